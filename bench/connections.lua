@@ -0,0 +1,106 @@
+#!/usr/bin/env tarantool
+
+-- Connection overhead benchmark: latency of a trivial query on one
+-- connection, throughput of many concurrent connections and
+-- memory held by a connection waiting for a reply.
+--
+-- Usage: MYSQL=host:port:user:password:db ./connections.lua [connections]
+--
+-- max_connections of the server should be above the count of
+-- connections, e.g. SET GLOBAL max_connections = 1100.
+
+package.path = "../?/init.lua;./?/init.lua"
+package.cpath = "../?.so;../?.dylib;./?.so;./?.dylib"
+
+local mysql = require('mysql')
+local fiber = require('fiber')
+local clock = require('clock')
+local ffi = require('ffi')
+
+ffi.cdef('int getpagesize(void);')
+
+local host, port, user, password, db = string.match(os.getenv('MYSQL') or '',
+    "([^:]*):([^:]*):([^:]*):([^:]*):([^:]*)")
+
+local CONNECTIONS = tonumber(arg[1]) or 1000
+local QUERIES = 10000
+
+-- Resident memory of the process in KB, nil if unknown.
+local function rss_kb()
+    local f = io.open('/proc/self/statm')
+    if f == nil then
+        return nil
+    end
+    local pages = tonumber(f:read('*a'):match('^%d+%s+(%d+)'))
+    f:close()
+    return pages * ffi.C.getpagesize() / 1024
+end
+
+local function connect()
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db})
+    if conn == nil then
+        error(err)
+    end
+    return conn
+end
+
+-- Latency of a round trip on one connection.
+local conn = connect()
+local started = clock.monotonic()
+for _ = 1, QUERIES do
+    conn:execute('SELECT 1')
+end
+local elapsed = clock.monotonic() - started
+print(('%-24s %8.2f us per query'):format('single connection',
+                                           elapsed / QUERIES * 1e6))
+conn:close()
+
+collectgarbage('collect')
+local rss_before = rss_kb()
+local conns = {}
+for i = 1, CONNECTIONS do
+    conns[i] = connect()
+end
+
+-- Throughput of concurrent connections, a fiber per connection.
+local done = fiber.channel(CONNECTIONS)
+local per_conn = math.max(math.floor(QUERIES / CONNECTIONS), 10)
+started = clock.monotonic()
+for i = 1, CONNECTIONS do
+    fiber.create(function()
+        for _ = 1, per_conn do
+            conns[i]:execute('SELECT 1')
+        end
+        done:put(true)
+    end)
+end
+for _ = 1, CONNECTIONS do
+    done:get()
+end
+elapsed = clock.monotonic() - started
+print(('%-24s %8.2f us per query %10.0f queries/s'):format(
+      ('%d connections'):format(CONNECTIONS),
+      elapsed / (per_conn * CONNECTIONS) * 1e6,
+      per_conn * CONNECTIONS / elapsed))
+
+-- Memory of connections parked in a network wait.
+for i = 1, CONNECTIONS do
+    fiber.create(function()
+        conns[i]:execute('SELECT SLEEP(1)')
+        done:put(true)
+    end)
+end
+fiber.sleep(0.5)
+local rss_waiting = rss_kb()
+for _ = 1, CONNECTIONS do
+    done:get()
+end
+if rss_before ~= nil then
+    print(('%-24s %8.1f KB per waiting connection'):format('memory',
+          (rss_waiting - rss_before) / CONNECTIONS))
+end
+
+for i = 1, CONNECTIONS do
+    conns[i]:close()
+end
@@ -0,0 +1,96 @@
+#!/usr/bin/env tarantool
+
+-- Result decoding benchmark: rows per second of narrow and wide
+-- result sets in named and numeric result modes and of the lazy
+-- result format reading two columns of each row.
+--
+-- Usage: MYSQL=host:port:user:password:db ./decode.lua [rows]
+
+package.path = "../?/init.lua;./?/init.lua"
+package.cpath = "../?.so;../?.dylib;./?.so;./?.dylib"
+
+local mysql = require('mysql')
+local clock = require('clock')
+
+local host, port, user, password, db = string.match(os.getenv('MYSQL') or '',
+    "([^:]*):([^:]*):([^:]*):([^:]*):([^:]*)")
+
+local ROWS = tonumber(arg[1]) or 100000
+local ITERATIONS = 5
+local WIDE_COLUMNS = 32
+
+local MODES = {
+    {name = 'named', opts = {}},
+    {name = 'numeric', opts = {use_numeric_result = true}},
+    {name = 'lazy', opts = {result_format = 'lazy'}},
+}
+
+local function connect(mode)
+    local opts = {host = host, port = port, user = user,
+        password = password, db = db, decode_budget_time = 0}
+    for k, v in pairs(mode.opts) do
+        opts[k] = v
+    end
+    return mysql.connect(opts)
+end
+
+-- Read two columns of each row of a lazy result set.
+local function touch(result)
+    for i = 1, #result do
+        local row = result[i]
+        local _, _ = row.c1, row.c2
+    end
+end
+
+local function create_table(conn, name, columns)
+    local defs = {}
+    local values = {}
+    for i = 1, columns do
+        local kind = i % 4
+        if kind == 1 then
+            table.insert(defs, ('c%d INT'):format(i))
+            table.insert(values, 'n')
+        elseif kind == 2 then
+            table.insert(defs, ('c%d BIGINT'):format(i))
+            table.insert(values, 'n * 1000003')
+        elseif kind == 3 then
+            table.insert(defs, ('c%d DOUBLE'):format(i))
+            table.insert(values, 'n / 7')
+        else
+            table.insert(defs, ('c%d VARCHAR(32)'):format(i))
+            table.insert(values, "CONCAT('value ', n)")
+        end
+    end
+    conn:execute(('CREATE TEMPORARY TABLE %s (%s)'):format(
+        name, table.concat(defs, ', ')))
+    conn:execute(('INSERT INTO %s WITH RECURSIVE s(n) AS (SELECT 1 ' ..
+                  'UNION ALL SELECT n + 1 FROM s WHERE n < %d) ' ..
+                  'SELECT %s FROM s'):format(name, ROWS,
+                                             table.concat(values, ', ')))
+end
+
+local function run(conn, mode, name)
+    local best = math.huge
+    for _ = 1, ITERATIONS do
+        local started = clock.monotonic()
+        local results = conn:execute(('SELECT * FROM %s'):format(name))
+        if mode.name == 'lazy' then
+            touch(results[1])
+        end
+        best = math.min(best, clock.monotonic() - started)
+        collectgarbage('collect')
+    end
+    return ROWS / best
+end
+
+for _, mode in ipairs(MODES) do
+    local conn = connect(mode)
+    conn:execute(('SET SESSION cte_max_recursion_depth = %d'):format(ROWS))
+    create_table(conn, 'narrow', 3)
+    create_table(conn, 'wide', WIDE_COLUMNS)
+    print(('%-8s narrow (3 columns): %10.0f rows/s'):format(
+        mode.name, run(conn, mode, 'narrow')))
+    print(('%-8s wide (%d columns): %10.0f rows/s'):format(
+        mode.name, WIDE_COLUMNS, run(conn, mode, 'wide')))
+    conn:close()
+end
@@ -0,0 +1,59 @@
+#!/usr/bin/env tarantool
+
+-- MsgPack encoding benchmark: results of conn:execute() encoded
+-- with msgpack.encode() against conn:execute_msgpack().
+--
+-- Usage: MYSQL=host:port:user:password:db ./msgpack.lua [rows]
+
+package.path = "../?/init.lua;./?/init.lua"
+package.cpath = "../?.so;../?.dylib;./?.so;./?.dylib"
+
+local mysql = require('mysql')
+local buffer = require('buffer')
+local msgpack = require('msgpack')
+local clock = require('clock')
+
+local host, port, user, password, db = string.match(os.getenv('MYSQL') or '',
+    "([^:]*):([^:]*):([^:]*):([^:]*):([^:]*)")
+
+local ROWS = tonumber(arg[1]) or 10000
+local ITERATIONS = 20
+
+local conn = mysql.connect({host = host, port = port, user = user,
+    password = password, db = db, decode_budget_time = 0})
+conn:execute(('SET SESSION cte_max_recursion_depth = %d'):format(ROWS))
+conn:execute('CREATE TEMPORARY TABLE bench (id INT, amount DOUBLE, ' ..
+             'name VARCHAR(32), created BIGINT)')
+conn:execute(('INSERT INTO bench WITH RECURSIVE s(n) AS (SELECT 1 ' ..
+              'UNION ALL SELECT n + 1 FROM s WHERE n < %d) ' ..
+              "SELECT n, n / 3, CONCAT('name ', n), n * 1000003 FROM s"):
+             format(ROWS))
+
+local SQL = 'SELECT * FROM bench'
+local ibuf = buffer.ibuf()
+
+local function measure(name, fn)
+    local best = math.huge
+    local gc_before = collectgarbage('count')
+    for _ = 1, ITERATIONS do
+        ibuf:reset()
+        local started = clock.monotonic()
+        fn()
+        best = math.min(best, clock.monotonic() - started)
+    end
+    local garbage = (collectgarbage('count') - gc_before) / ITERATIONS
+    collectgarbage('collect')
+    print(('%-16s %8.2f ms %10.0f rows/s %10.0f KB of lua heap per query'):
+          format(name, best * 1000, ROWS / best, math.max(garbage, 0)))
+end
+
+collectgarbage('stop')
+measure('execute+encode', function()
+    local data = conn:execute(SQL)
+    msgpack.encode(data, ibuf)
+end)
+measure('execute_msgpack', function()
+    conn:execute_msgpack(ibuf, SQL)
+end)
+collectgarbage('restart')
+conn:close()
@@ -31,16 +31,30 @@
 #include <stddef.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <strings.h>
+#include <time.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
 #include <mysql.h>
 #include <errmsg.h>
+#include <mariadb_rpl.h>
 
 #define TIMEOUT_INFINITY 365 * 86400 * 100.0
 static const char mysql_driver_label[] = "__tnt_mysql_driver";
+static const char mysql_stmt_label[] = "__tnt_mysql_stmt";
+static const char mysql_cursor_label[] = "__tnt_mysql_cursor";
+static const char mysql_result_label[] = "__tnt_mysql_result";
+static const char mysql_row_label[] = "__tnt_mysql_row";
+static const char mysql_columns_label[] = "__tnt_mysql_columns";
+static const char mysql_batch_label[] = "__tnt_mysql_batch";
+static const char mysql_binlog_label[] = "__tnt_mysql_binlog";
 
 static int luaL_nil_ref = LUA_REFNIL;
 
@@ -55,12 +69,213 @@ luaL_pushnull(struct lua_State *L)
 	lua_rawgeti(L, LUA_REGISTRYINDEX, luaL_nil_ref);
 }
 
+/*
+ * A buffer of a long column grown to fit its longest value.
+ */
+struct mysql_long_buffer {
+	char *data;
+	unsigned long size;
+};
+
+/*
+ * Memory of result binds reused across executions: binds, value
+ * lengths, NULL flags, cells and short buffers are laid out in
+ * one block. Long columns start with a short buffer too and get a
+ * buffer of their own on the first value which doesn't fit it,
+ * see mysql_prepared_fetch_long().
+ */
+struct mysql_arena {
+	char *data;
+	size_t capacity;
+	/* Buffers of long columns by column number. */
+	struct mysql_long_buffer *long_buffers;
+	unsigned long long_count;
+};
+
+/* A size of a short buffer of a long column. */
+#define RESULT_BUFFER_SIZE 4096
+/* Parameters longer than that are sent by chunks of this size. */
+#define LONG_DATA_SIZE 65536
+
+/*
+ * A prepared statement along with its bind buffers. Parameter
+ * buffers are kept between executions of the statement, result
+ * ones are in an arena of the connection or the cursor.
+ */
+struct mysql_prepared {
+	MYSQL_STMT *stmt;
+	unsigned long param_count;
+	MYSQL_BIND *param_binds;
+	/* Temporary buffer for input parameters. sizeof(uint64_t) should be
+	 * enough to store any number value, any other will be passed as
+	 * string from lua */
+	uint64_t *values;
+	unsigned long col_count;
+	MYSQL_BIND *result_binds;
+	/* Result value lengths and NULL flags bound to columns. */
+	unsigned long *lengths;
+	my_bool *is_null;
+	/* Values of the fetched row, NULL for a NULL value. */
+	char **cells;
+	struct mysql_arena *arena;
+	/*
+	 * Set when results are bound with their binary types
+	 * rather than as strings, see mysql_binary_type().
+	 */
+	bool binary;
+};
+
+/*
+ * An entry of the prepared statement cache.
+ */
+struct mysql_stmt_cache_entry {
+	struct mysql_stmt_cache_entry *prev;
+	struct mysql_stmt_cache_entry *next;
+	uint32_t hash;
+	size_t sql_len;
+	char *sql;
+	struct mysql_prepared prepared;
+};
+
+/*
+ * LRU cache of prepared statements keyed by SQL text. The first
+ * entry is the most recently used one.
+ *
+ * The server forgets all prepared statements of a session on
+ * COM_CHANGE_USER, so the cache is flushed on reset. A reconnect
+ * creates a new connection object with an empty cache.
+ */
+struct mysql_stmt_cache {
+	struct mysql_stmt_cache_entry *first;
+	struct mysql_stmt_cache_entry *last;
+	unsigned size;
+	unsigned capacity;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+/*
+ * A statement whose lua object was collected. The connection may
+ * be busy with another request at that moment, so the statement
+ * is closed on the next request.
+ */
+struct mysql_orphan_stmt {
+	struct mysql_orphan_stmt *next;
+	MYSQL_STMT *stmt;
+};
+
+struct mysql_cursor;
+struct mysql_mpbuf;
+
+/* A representation of result sets, see result_format option. */
+enum mysql_result_format {
+	/* Rows are lua tables. */
+	MYSQL_RESULT_TABLE,
+	/* Rows are decoded on access, see mysql_lazy_result. */
+	MYSQL_RESULT_LAZY,
+	/* Values are grouped by columns, see mysql_columns. */
+	MYSQL_RESULT_COLUMNAR,
+};
+
+/* Result sets of a request listed in its profile. */
+#define PROFILE_RESULT_MAX 16
+
+/* Reading of a result set of a profiled request. */
+struct mysql_profile_result {
+	/* Seconds of decoding, waits for the socket excluded. */
+	double decode;
+	uint64_t rows;
+	uint64_t bytes;
+};
+
+/*
+ * Phases of a request of a connection, see driver.profile().
+ * Waits for the socket are accounted by mysql_wait_for_io(),
+ * which finds the profile of a request by its socket.
+ */
+struct mysql_profile {
+	my_socket socket;
+	/* The request is running, the profile is in the list. */
+	bool active;
+	double start;
+	/* Seconds till the request is sent and the reply is awaited. */
+	double send;
+	/* Seconds of waits for the socket to be readable or writable. */
+	double io_read;
+	double io_write;
+	/* Seconds of decoding of all the result sets. */
+	double decode;
+	/* Seconds of the whole request. */
+	double total;
+	uint64_t rows;
+	uint64_t bytes;
+	unsigned result_count;
+	struct mysql_profile_result results[PROFILE_RESULT_MAX];
+	struct mysql_profile *next;
+};
+
 struct mysql_connection {
 	MYSQL *raw_conn;
 	int use_numeric_result;
 	int keep_null;
+	enum mysql_result_format result_format;
+	/* Set while results are encoded to MsgPack. */
+	struct mysql_mpbuf *mpbuf;
+	struct mysql_stmt_cache stmt_cache;
+	/*
+	 * Incremented when the server forgets prepared statements
+	 * of the session, see struct mysql_statement.
+	 */
+	unsigned generation;
+	struct mysql_orphan_stmt *orphans;
+	/*
+	 * A cursor reading a text protocol result set. Its rows
+	 * occupy the connection until they are read out.
+	 */
+	struct mysql_cursor *cursor;
+	/*
+	 * A text protocol result set of a collected cursor. It is
+	 * read out on the next request like orphan statements.
+	 */
+	MYSQL_RES *orphan_result;
+	/*
+	 * Rows and seconds of decoding after which the fiber
+	 * yields, 0 means no limit.
+	 */
+	int decode_budget_rows;
+	double decode_budget_time;
+	/*
+	 * Set when the server reports changes of the session
+	 * state, see mysql_conn_session_dirty().
+	 */
+	bool track_session;
+	bool session_dirty;
+	/* Set when the current database is changed. */
+	bool schema_changed;
+	/*
+	 * Seconds of a request before its query is killed, 0 means
+	 * no limit. next_timeout overrides it for the next request
+	 * unless it is negative.
+	 */
+	double query_timeout;
+	double next_timeout;
+	/* Result binds of statements executed at once. */
+	struct mysql_arena arena;
+	/*
+	 * Push DECIMAL and temporal values as decimal and datetime
+	 * objects and bind integral numbers as integers.
+	 */
+	bool native_types;
+	/* Rows sent by LOAD DATA LOCAL INFILE being executed. */
+	struct mysql_load_data *load_data;
+	/* Phases of the last profiled request. */
+	struct mysql_profile profile;
 };
 
+/* Seconds of decoding between yields by default. */
+#define DECODE_BUDGET_TIME_DEFAULT 0.01
+
 /*
  * A dumb hash for MySQL field type values.
  *
@@ -143,6 +358,34 @@ lua_check_mysqlconn(struct lua_State *L, int index)
 	return *conn_p;
 }
 
+/*
+ * Get an integer option from an optional table of options at
+ * index idx. Return def when the table or the option is absent.
+ */
+static int
+lua_mysql_opt_int(struct lua_State *L, int idx, const char *name, int def)
+{
+	if (!lua_istable(L, idx))
+		return def;
+	lua_getfield(L, idx, name);
+	int value = lua_isnil(L, -1) ? def : (int)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
+/* Get a number option, see lua_mysql_opt_int(). */
+static double
+lua_mysql_opt_number(struct lua_State *L, int idx, const char *name,
+		     double def)
+{
+	if (!lua_istable(L, idx))
+		return def;
+	lua_getfield(L, idx, name);
+	double value = lua_isnil(L, -1) ? def : lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
 /*
  * Push native lua error with code -3
  */
@@ -183,351 +426,5818 @@ lua_mysql_field_type_to_string(enum enum_field_types type)
 	return mysql_field_type_strs[hash];
 }
 
-/**
- * Push value retrieved from mysql field to lua stack.
- *
- * When `data` is NULL, `field` and len` parameters are
- * ignored and Lua nil or LuaJIT FFI NULL is pushed.
+/* Push prepared statement status and error message to lua stack. */
+static int
+lua_mysql_stmt_push_error(struct lua_State *L, MYSQL_STMT *stmt)
+{
+	int err = mysql_stmt_errno(stmt);
+	switch (err) {
+	case CR_SERVER_LOST:
+	case CR_SERVER_GONE_ERROR:
+		lua_pushnumber(L, -1);
+		break;
+	default:
+		lua_pushnumber(L, 1);
+	}
+	safe_pushstring(L, (char *) mysql_stmt_error(stmt));
+	return 2;
+}
+
+/*
+ * A decoder of text values of a result set column. Decoders are
+ * chosen once per result set by column types, so decoding of a
+ * cell is a single indirect call.
  */
-static void
-lua_mysql_push_value(struct lua_State *L, MYSQL_FIELD *field, void *data,
-		     unsigned long len, int keep_null)
+typedef void
+(*mysql_decode_f)(struct lua_State *L, const char *data, unsigned long len);
+
+/* Parse digits of an integer value, the server sends valid ones. */
+static inline uint64_t
+mysql_parse_digits(const char *data, const char *end)
 {
-	/*
-	 * Field type isn't MYSQL_TYPE_NULL actually in case of
-	 * Lua's nil passed as value.
-	 * Example: 'conn:execute('SELECT ? AS x', nil)'.
-	 */
-	if (data == NULL)
-		field->type = MYSQL_TYPE_NULL;
-	switch (field->type) {
-		case MYSQL_TYPE_TINY:
-		case MYSQL_TYPE_SHORT:
-		case MYSQL_TYPE_LONG:
-		case MYSQL_TYPE_FLOAT:
-		case MYSQL_TYPE_INT24:
-		case MYSQL_TYPE_DOUBLE: {
-			char *data_end = data + len;;
-			double v = strtod(data, &data_end);
-			lua_pushnumber(L, v);
-			break;
-		}
+	uint64_t v = 0;
+	for (; data < end; ++data)
+		v = v * 10 + (*data - '0');
+	return v;
+}
 
-		case MYSQL_TYPE_NULL:
-			if (keep_null == 1)
-				luaL_pushnull(L);
-			else
-				lua_pushnil(L);
-			break;
+static void
+lua_mysql_decode_int(struct lua_State *L, const char *data,
+		     unsigned long len)
+{
+	if (len > 0 && *data == '-')
+		lua_pushnumber(L, -(double)mysql_parse_digits(data + 1,
+							      data + len));
+	else
+		lua_pushnumber(L, (double)mysql_parse_digits(data, data + len));
+}
 
-		case MYSQL_TYPE_LONGLONG: {
-				long long v = atoll(data);
-				if (field->flags & UNSIGNED_FLAG) {
-					luaL_pushuint64(L, v);
-				} else {
-					luaL_pushint64(L, v);
-				}
-				break;
-		}
+static void
+lua_mysql_decode_double(struct lua_State *L, const char *data,
+			unsigned long len)
+{
+	(void)len;
+	lua_pushnumber(L, strtod(data, NULL));
+}
 
-		/* AS string */
-		case MYSQL_TYPE_NEWDECIMAL:
-		case MYSQL_TYPE_DECIMAL:
-		case MYSQL_TYPE_TIMESTAMP:
-		default:
-			lua_pushlstring(L, data, len);
-			break;
+static void
+lua_mysql_decode_longlong(struct lua_State *L, const char *data,
+			  unsigned long len)
+{
+	if (len > 0 && *data == '-') {
+		uint64_t v = mysql_parse_digits(data + 1, data + len);
+		luaL_pushint64(L, (int64_t)(0 - v));
+	} else {
+		luaL_pushint64(L, mysql_parse_digits(data, data + len));
 	}
 }
 
-/* Push mysql recordset to lua stack */
-static int
-lua_mysql_fetch_result(struct lua_State *L)
+static void
+lua_mysql_decode_ulonglong(struct lua_State *L, const char *data,
+			   unsigned long len)
 {
-	struct mysql_connection *conn =
-		(struct mysql_connection *) lua_topointer(L, 1);
-	MYSQL_RES *result = (MYSQL_RES *) lua_topointer(L, 2);
-	MYSQL_FIELD *fields = mysql_fetch_fields(result);
-	const unsigned num_fields = mysql_num_fields(result);
+	luaL_pushuint64(L, mysql_parse_digits(data, data + len));
+}
 
-	MYSQL_ROW row;
-	int row_idx = 1;
+static void
+lua_mysql_decode_string(struct lua_State *L, const char *data,
+			unsigned long len)
+{
+	lua_pushlstring(L, data, len);
+}
 
-	/*
-	 * When use_numeric_result is false the table is a result
-	 * set (a return value of this function). Otherwise it is
-	 * a value of "rows" field of the return value.
-	 */
-	lua_newtable(L);
-	do {
-		row = mysql_fetch_row(result);
-		if (!row)
-			break;
-		/* Create and fill a row table. */
-		lua_newtable(L);
-		unsigned long *len = mysql_fetch_lengths(result);
-		unsigned col_no;
-		for (col_no = 0; col_no < num_fields; ++col_no) {
-			lua_mysql_push_value(L, fields + col_no, row[col_no],
-					     len[col_no], conn->keep_null);
-			if (conn->use_numeric_result) {
-				/* Assign to a column number. */
-				lua_rawseti(L, -2, col_no + 1);
-			} else {
-				/* Assign to a column name. */
-				lua_setfield(L, -2, fields[col_no].name);
-			}
-		}
-		lua_rawseti(L, -2, row_idx);
-		++row_idx;
-	} while (true);
+/*
+ * decimal.new() and datetime.new() of Tarantool, they are loaded
+ * on the first connection with native_types option.
+ */
+static int luaL_decimal_new_ref = LUA_REFNIL;
+static int luaL_datetime_new_ref = LUA_REFNIL;
+static uint32_t datetime_ctypeid = 0;
+static uint32_t decimal_ctypeid = 0;
 
-	if (!conn->use_numeric_result)
-		return 1;
+/* Types of int64_t, uint64_t and box.NULL cdata, set on load. */
+static uint32_t int64_ctypeid = 0;
+static uint32_t uint64_ctypeid = 0;
+static uint32_t ptr_ctypeid = 0;
 
-	/*
-	 * Create a result set table (a return value of the
-	 * function), swap it with the rows table filled above and
-	 * set result_set.rows = rows.
-	 */
-	lua_newtable(L);
-	lua_insert(L, -2);
-	lua_setfield(L, -2, "rows");
+static void
+lua_mysql_load_native_types(struct lua_State *L);
 
-	/*
-	 * Create a metadata table and set
-	 * result_set.metadata = metadata.
-	 */
-	lua_newtable(L);
-	unsigned col_no;
-	for (col_no = 0; col_no < num_fields; ++col_no) {
-		/* A column metadata. */
-		lua_newtable(L);
-		lua_pushstring(L, fields[col_no].name);
-		lua_setfield(L, -2, "name");
-		lua_pushstring(L, lua_mysql_field_type_to_string(
-			fields[col_no].type));
-		lua_setfield(L, -2, "type");
-		lua_rawseti(L, -2, col_no + 1);
+/*
+ * Call a constructor of a native value with an argument on top
+ * of lua stack, push the string data instead when the value is
+ * out of range of the native type.
+ */
+static void
+lua_mysql_push_native(struct lua_State *L, int new_ref, const char *data,
+		      unsigned long len)
+{
+	lua_rawgeti(L, LUA_REGISTRYINDEX, new_ref);
+	lua_insert(L, -2);
+	if (lua_pcall(L, 1, 1, 0) != 0) {
+		lua_pop(L, 1);
+		lua_pushlstring(L, data, len);
 	}
-	lua_setfield(L, -2, "metadata");
+}
 
-	return 1;
+static void
+lua_mysql_decode_decimal(struct lua_State *L, const char *data,
+			 unsigned long len)
+{
+	lua_pushlstring(L, data, len);
+	lua_mysql_push_native(L, luaL_decimal_new_ref, data, len);
 }
 
-/**
- * Execute plain sql script without parameters substitution
+/*
+ * Push a datetime object of a DATE, DATETIME or TIMESTAMP value,
+ * zero dates are pushed as strings.
  */
-static int
-lua_mysql_execute(struct lua_State *L)
+static void
+lua_mysql_push_datetime(struct lua_State *L, MYSQL_TIME *time,
+			const char *data, unsigned long len)
 {
-	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
-	MYSQL *raw_conn = conn->raw_conn;
-	size_t len;
-	const char *sql = lua_tolstring(L, 2, &len);
-	int err;
-
-	err = mysql_real_query(raw_conn, sql, len);
-	if (err)
-		return lua_mysql_push_error(L, raw_conn);
-
-	lua_pushnumber(L, 0);
-	int ret_count = 2;
-	int result_no = 0;
-
-	lua_newtable(L);
-	while (true) {
-		MYSQL_RES *res = mysql_use_result(raw_conn);
-		if (res) {
-			lua_pushnumber(L, ++result_no);
-			int fail = 0;
-			lua_pushcfunction(L, lua_mysql_fetch_result);
-			lua_pushlightuserdata(L, conn);
-			lua_pushlightuserdata(L, res);
-			fail = lua_pcall(L, 2, 1, 0);
-			if (mysql_errno(raw_conn)) {
-				ret_count = lua_mysql_push_error(L, raw_conn);
-				mysql_free_result(res);
-				return ret_count;
-			}
-			mysql_free_result(res);
-			if (fiber_is_cancelled()) {
-				lua_pushnumber(L, -2);
-				safe_pushstring(L, "Fiber was cancelled");
-				return 2;
-			}
-			if (fail) {
-				return lua_push_error(L);
-			}
-			lua_settable(L, -3);
-		}
-		int next_res = mysql_next_result(raw_conn);
-		if (next_res < 0)
-			break;
+	if (time->month == 0 || time->day == 0) {
+		lua_pushlstring(L, data, len);
+		return;
 	}
-	return ret_count;
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, time->year);
+	lua_setfield(L, -2, "year");
+	lua_pushinteger(L, time->month);
+	lua_setfield(L, -2, "month");
+	lua_pushinteger(L, time->day);
+	lua_setfield(L, -2, "day");
+	lua_pushinteger(L, time->hour);
+	lua_setfield(L, -2, "hour");
+	lua_pushinteger(L, time->minute);
+	lua_setfield(L, -2, "min");
+	lua_pushinteger(L, time->second);
+	lua_setfield(L, -2, "sec");
+	lua_pushinteger(L, time->second_part * 1000);
+	lua_setfield(L, -2, "nsec");
+	lua_mysql_push_native(L, luaL_datetime_new_ref, data, len);
 }
 
 /*
- * Push row retrieved from prepared statement
+ * Parse 'YYYY-MM-DD[ hh:mm:ss[.ffffff]]' text of a temporal
+ * value. Return -1 on unexpected format.
  */
 static int
-lua_mysql_stmt_push_row(struct lua_State *L)
+mysql_parse_datetime(const char *data, unsigned long len, MYSQL_TIME *time)
+{
+	memset(time, 0, sizeof(*time));
+	if (len < 10 || data[4] != '-' || data[7] != '-')
+		return -1;
+	time->year = mysql_parse_digits(data, data + 4);
+	time->month = mysql_parse_digits(data + 5, data + 7);
+	time->day = mysql_parse_digits(data + 8, data + 10);
+	if (len == 10)
+		return 0;
+	if (len < 19 || data[13] != ':' || data[16] != ':')
+		return -1;
+	time->hour = mysql_parse_digits(data + 11, data + 13);
+	time->minute = mysql_parse_digits(data + 14, data + 16);
+	time->second = mysql_parse_digits(data + 17, data + 19);
+	if (len == 19)
+		return 0;
+	if (data[19] != '.' || len > 26)
+		return -1;
+	/* Scale a fraction of any precision to microseconds. */
+	unsigned long pos;
+	for (pos = 20; pos < 26; ++pos) {
+		time->second_part *= 10;
+		if (pos < len)
+			time->second_part += data[pos] - '0';
+	}
+	return 0;
+}
+
+static void
+lua_mysql_decode_datetime(struct lua_State *L, const char *data,
+			  unsigned long len)
 {
-	unsigned long col_count = lua_tonumber(L, 1);
-	MYSQL_BIND *results = (MYSQL_BIND *)lua_topointer(L, 2);
-	MYSQL_FIELD *fields = (MYSQL_FIELD *)lua_topointer(L, 3);
-	int keep_null = lua_tointeger(L, 4);
+	MYSQL_TIME time;
+	if (mysql_parse_datetime(data, len, &time) != 0)
+		lua_pushlstring(L, data, len);
+	else
+		lua_mysql_push_datetime(L, &time, data, len);
+}
 
-	lua_newtable(L);
-	unsigned col_no;
-	for (col_no = 0; col_no < col_count; ++col_no) {
-		void *data = *results[col_no].is_null ? NULL :
-			results[col_no].buffer;
-		lua_pushstring(L, fields[col_no].name);
-		lua_mysql_push_value(L, fields + col_no, data,
-				     *results[col_no].length, keep_null);
-		lua_settable(L, -3);
+/* Choose a decoder of a column. */
+static mysql_decode_f
+mysql_column_decoder(MYSQL_FIELD *field, bool native)
+{
+	switch (field->type) {
+	case MYSQL_TYPE_TINY:
+	case MYSQL_TYPE_SHORT:
+	case MYSQL_TYPE_LONG:
+	case MYSQL_TYPE_INT24:
+		return lua_mysql_decode_int;
+	case MYSQL_TYPE_FLOAT:
+	case MYSQL_TYPE_DOUBLE:
+		return lua_mysql_decode_double;
+	case MYSQL_TYPE_LONGLONG:
+		if (field->flags & UNSIGNED_FLAG)
+			return lua_mysql_decode_ulonglong;
+		return lua_mysql_decode_longlong;
+	case MYSQL_TYPE_NEWDECIMAL:
+	case MYSQL_TYPE_DECIMAL:
+		if (native)
+			return lua_mysql_decode_decimal;
+		return lua_mysql_decode_string;
+	case MYSQL_TYPE_DATE:
+	case MYSQL_TYPE_DATETIME:
+	case MYSQL_TYPE_TIMESTAMP:
+		if (native)
+			return lua_mysql_decode_datetime;
+		return lua_mysql_decode_string;
+	/* AS string */
+	default:
+		return lua_mysql_decode_string;
 	}
-	return 1;
 }
 
 /*
- * Execute sql statement as prepared statement with params
+ * Decoders of binary values of prepared statement results, see
+ * mysql_binary_type().
  */
-static int
-lua_mysql_execute_prepared(struct lua_State *L)
+static void
+lua_mysql_decode_bin_int(struct lua_State *L, const char *data,
+			 unsigned long len)
 {
-	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
-	size_t len;
-	const char *sql = lua_tolstring(L, 2, &len);
-	int ret_count = 0, fail = 0, error = 0;
+	(void)len;
+	lua_pushnumber(L, (double)*(const int64_t *)data);
+}
 
-	MYSQL_STMT *stmt = NULL;
-	MYSQL_RES *meta = NULL;
-	MYSQL_BIND *param_binds = NULL;
-	MYSQL_BIND *result_binds = NULL;
-	/* Temporary buffer for input parameters. sizeof(uint64_t) should be
-	 * enough to store any number value, any other will be passed as
-	 * string from lua */
-	uint64_t *values = NULL;
+static void
+lua_mysql_decode_bin_double(struct lua_State *L, const char *data,
+			    unsigned long len)
+{
+	(void)len;
+	lua_pushnumber(L, *(const double *)data);
+}
 
-	/* We hope that all should be fine and push 0 (OK) */
-	lua_pushnumber(L, 0);
-	lua_newtable(L);
-	ret_count = 2;
-	stmt = mysql_stmt_init(conn->raw_conn);
-	if ((error = !stmt))
-		goto done;
-	error = mysql_stmt_prepare(stmt, sql, len);
-	if (error)
-		goto done;
-	/* Alloc space for input parameters */
-	unsigned long paramCount = mysql_stmt_param_count(stmt);
-	param_binds = (MYSQL_BIND *)calloc(sizeof(*param_binds), paramCount);
-	values = (uint64_t *)calloc(sizeof(*values), paramCount);
-	/* Setup input bind buffer */
-	unsigned param_no;
-	for (param_no = 0; param_no < paramCount; ++param_no) {
-		if ((unsigned long)lua_gettop(L) <= param_no + 3) {
-			param_binds[param_no].buffer_type = MYSQL_TYPE_NULL;
+static void
+lua_mysql_decode_bin_longlong(struct lua_State *L, const char *data,
+			      unsigned long len)
+{
+	(void)len;
+	luaL_pushint64(L, *(const int64_t *)data);
+}
+
+static void
+lua_mysql_decode_bin_ulonglong(struct lua_State *L, const char *data,
+			       unsigned long len)
+{
+	(void)len;
+	luaL_pushuint64(L, *(const uint64_t *)data);
+}
+
+static void
+lua_mysql_decode_bin_datetime(struct lua_State *L, const char *data,
+			      unsigned long len)
+{
+	MYSQL_TIME *time = (MYSQL_TIME *)data;
+	char text[32];
+	(void)len;
+	int text_len = snprintf(text, sizeof(text),
+				"%04u-%02u-%02u %02u:%02u:%02u",
+				time->year, time->month, time->day,
+				time->hour, time->minute, time->second);
+	lua_mysql_push_datetime(L, time, text, text_len);
+}
+
+/*
+ * Choose a buffer type of a result column bound with its binary
+ * type. Integers are fetched as 64 bit ones, the client library
+ * converts them.
+ */
+static enum enum_field_types
+mysql_binary_type(MYSQL_FIELD *field)
+{
+	switch (field->type) {
+	case MYSQL_TYPE_TINY:
+	case MYSQL_TYPE_SHORT:
+	case MYSQL_TYPE_LONG:
+	case MYSQL_TYPE_INT24:
+	case MYSQL_TYPE_LONGLONG:
+		return MYSQL_TYPE_LONGLONG;
+	case MYSQL_TYPE_FLOAT:
+	case MYSQL_TYPE_DOUBLE:
+		return MYSQL_TYPE_DOUBLE;
+	case MYSQL_TYPE_DATE:
+	case MYSQL_TYPE_DATETIME:
+	case MYSQL_TYPE_TIMESTAMP:
+		return field->type;
+	default:
+		return MYSQL_TYPE_STRING;
+	}
+}
+
+/* Choose a decoder of a column bound with its binary type. */
+static mysql_decode_f
+mysql_binary_decoder(MYSQL_FIELD *field)
+{
+	switch (mysql_binary_type(field)) {
+	case MYSQL_TYPE_LONGLONG:
+		if (field->type != MYSQL_TYPE_LONGLONG)
+			return lua_mysql_decode_bin_int;
+		if (field->flags & UNSIGNED_FLAG)
+			return lua_mysql_decode_bin_ulonglong;
+		return lua_mysql_decode_bin_longlong;
+	case MYSQL_TYPE_DOUBLE:
+		return lua_mysql_decode_bin_double;
+	case MYSQL_TYPE_STRING:
+		return mysql_column_decoder(field, true);
+	default:
+		return lua_mysql_decode_bin_datetime;
+	}
+}
+
+/*
+ * Push a row as a table. The table holds values in the column
+ * order when names_idx is 0, otherwise it maps column names to
+ * values. The names are pushed to lua stack starting at
+ * names_idx once per result set to avoid interning of strings
+ * for each row.
+ */
+static void
+lua_mysql_push_row(struct lua_State *L, unsigned num_fields,
+		   mysql_decode_f *decoders, char **cells,
+		   unsigned long *lengths, int names_idx, int keep_null)
+{
+	if (names_idx == 0)
+		lua_createtable(L, num_fields, 0);
+	else
+		lua_createtable(L, 0, num_fields);
+	unsigned col_no;
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		if (names_idx != 0)
+			lua_pushvalue(L, names_idx + col_no);
+		/*
+		 * Field type isn't MYSQL_TYPE_NULL actually in case
+		 * of Lua's nil passed as value.
+		 * Example: 'conn:execute('SELECT ? AS x', nil)'.
+		 */
+		if (cells[col_no] == NULL) {
+			if (keep_null == 1)
+				luaL_pushnull(L);
+			else
+				lua_pushnil(L);
+		} else {
+			decoders[col_no](L, cells[col_no], lengths[col_no]);
+		}
+		if (names_idx == 0) {
+			/* Assign to a column number. */
+			lua_rawseti(L, -2, col_no + 1);
+		} else {
+			/* Assign to a column name. */
+			lua_rawset(L, -3);
+		}
+	}
+}
+
+/* Push a metadata table of result set columns. */
+static void
+lua_mysql_push_metadata(struct lua_State *L, MYSQL_FIELD *fields,
+			unsigned num_fields)
+{
+	lua_newtable(L);
+	unsigned col_no;
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		/* A column metadata. */
+		lua_newtable(L);
+		lua_pushstring(L, fields[col_no].name);
+		lua_setfield(L, -2, "name");
+		lua_pushstring(L, lua_mysql_field_type_to_string(
+			fields[col_no].type));
+		lua_setfield(L, -2, "type");
+		lua_rawseti(L, -2, col_no + 1);
+	}
+}
+
+#define HISTOGRAM_BUCKET_COUNT 15
+
+/*
+ * Upper bounds of latency histogram buckets in seconds. The last
+ * bucket of a histogram counts the rest of observations.
+ */
+static const double mysql_histogram_bounds[HISTOGRAM_BUCKET_COUNT - 1] = {
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+	0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+struct mysql_histogram {
+	/* Observations by bucket, not cumulative. */
+	uint64_t counts[HISTOGRAM_BUCKET_COUNT];
+	uint64_t count;
+	double sum;
+};
+
+/*
+ * Counters of requests of all connections. They are updated by
+ * the TX thread only, so an update is a couple of increments and
+ * a clock read, which is cheap enough to keep them always on.
+ */
+struct mysql_metrics {
+	uint64_t queries;
+	uint64_t query_errors;
+	uint64_t executes;
+	uint64_t execute_errors;
+	/* Rows read from result sets and bytes of their values. */
+	uint64_t rows;
+	uint64_t bytes;
+	/* Queries and executions waiting for the server now. */
+	uint64_t in_flight;
+	/* Seconds till the server replies to a query. */
+	struct mysql_histogram query_time;
+	/* Seconds till the server replies to a statement execution. */
+	struct mysql_histogram execute_time;
+	/* Seconds of reading and decoding of a result set. */
+	struct mysql_histogram fetch_time;
+};
+
+static struct mysql_metrics mysql_metrics;
+
+static void
+mysql_histogram_observe(struct mysql_histogram *histogram, double value)
+{
+	unsigned bucket = 0;
+	while (bucket < HISTOGRAM_BUCKET_COUNT - 1 &&
+	       value > mysql_histogram_bounds[bucket])
+		++bucket;
+	++histogram->counts[bucket];
+	++histogram->count;
+	histogram->sum += value;
+}
+
+/* mysql_real_query() accounted in metrics. */
+static int
+mysql_metrics_query(MYSQL *raw_conn, const char *sql, unsigned long len)
+{
+	double start = clock_monotonic();
+	++mysql_metrics.in_flight;
+	int rc = mysql_real_query(raw_conn, sql, len);
+	--mysql_metrics.in_flight;
+	mysql_histogram_observe(&mysql_metrics.query_time,
+				clock_monotonic() - start);
+	++mysql_metrics.queries;
+	if (rc != 0)
+		++mysql_metrics.query_errors;
+	return rc;
+}
+
+/* mysql_stmt_execute() accounted in metrics. */
+static int
+mysql_metrics_stmt_execute(MYSQL_STMT *stmt)
+{
+	double start = clock_monotonic();
+	++mysql_metrics.in_flight;
+	int rc = mysql_stmt_execute(stmt);
+	--mysql_metrics.in_flight;
+	mysql_histogram_observe(&mysql_metrics.execute_time,
+				clock_monotonic() - start);
+	++mysql_metrics.executes;
+	if (rc != 0)
+		++mysql_metrics.execute_errors;
+	return rc;
+}
+
+/*
+ * Push a histogram as {count = <n>, sum = <seconds>, buckets =
+ * {{le = <bound>, count = <n>}, ...}}. Counts of buckets are
+ * cumulative, the last bound is math.huge.
+ */
+static void
+lua_mysql_push_histogram(struct lua_State *L,
+			 const struct mysql_histogram *histogram)
+{
+	lua_createtable(L, 0, 3);
+	lua_pushnumber(L, histogram->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, histogram->sum);
+	lua_setfield(L, -2, "sum");
+	lua_createtable(L, HISTOGRAM_BUCKET_COUNT, 0);
+	uint64_t count = 0;
+	unsigned bucket;
+	for (bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; ++bucket) {
+		count += histogram->counts[bucket];
+		lua_createtable(L, 0, 2);
+		lua_pushnumber(L, bucket < HISTOGRAM_BUCKET_COUNT - 1 ?
+			       mysql_histogram_bounds[bucket] : HUGE_VAL);
+		lua_setfield(L, -2, "le");
+		lua_pushnumber(L, count);
+		lua_setfield(L, -2, "count");
+		lua_rawseti(L, -2, bucket + 1);
+	}
+	lua_setfield(L, -2, "buckets");
+}
+
+/**
+ * Return counters and latency histograms of all connections
+ */
+static int
+lua_mysql_stats(struct lua_State *L)
+{
+	const struct mysql_metrics *metrics = &mysql_metrics;
+	lua_createtable(L, 0, 10);
+	lua_pushnumber(L, metrics->queries);
+	lua_setfield(L, -2, "queries");
+	lua_pushnumber(L, metrics->query_errors);
+	lua_setfield(L, -2, "query_errors");
+	lua_pushnumber(L, metrics->executes);
+	lua_setfield(L, -2, "executes");
+	lua_pushnumber(L, metrics->execute_errors);
+	lua_setfield(L, -2, "execute_errors");
+	lua_pushnumber(L, metrics->rows);
+	lua_setfield(L, -2, "rows");
+	lua_pushnumber(L, metrics->bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, metrics->in_flight);
+	lua_setfield(L, -2, "in_flight");
+	lua_mysql_push_histogram(L, &metrics->query_time);
+	lua_setfield(L, -2, "query_time");
+	lua_mysql_push_histogram(L, &metrics->execute_time);
+	lua_setfield(L, -2, "execute_time");
+	lua_mysql_push_histogram(L, &metrics->fetch_time);
+	lua_setfield(L, -2, "fetch_time");
+	return 1;
+}
+
+/* Whether requests are profiled, see driver.profile(). */
+static bool mysql_profiling = false;
+
+/* Profiles of running requests. */
+static struct mysql_profile *mysql_profiles = NULL;
+
+static struct mysql_profile *
+mysql_profile_find(my_socket socket)
+{
+	struct mysql_profile *profile;
+	for (profile = mysql_profiles; profile != NULL;
+	     profile = profile->next) {
+		if (profile->socket == socket)
+			return profile;
+	}
+	return NULL;
+}
+
+/* Remember the moment the request is sent and its reply is awaited. */
+static inline void
+mysql_profile_sent(struct mysql_profile *profile)
+{
+	if (profile->send < 0)
+		profile->send = clock_monotonic() - profile->start;
+}
+
+static void
+mysql_profile_end(struct mysql_profile *profile)
+{
+	if (!profile->active)
+		return;
+	struct mysql_profile **prev = &mysql_profiles;
+	while (*prev != profile)
+		prev = &(*prev)->next;
+	*prev = profile->next;
+	profile->active = false;
+	profile->total = clock_monotonic() - profile->start;
+	/* The reply was ready at once. */
+	if (profile->send < 0)
+		profile->send = profile->total;
+}
+
+/*
+ * Start a profile of a request of a connection. A profile left
+ * active by a request failed with a lua error is started anew.
+ */
+static void
+mysql_profile_begin(struct mysql_profile *profile, MYSQL *raw_conn)
+{
+	mysql_profile_end(profile);
+	memset(profile, 0, sizeof(*profile));
+	profile->socket = mysql_get_socket(raw_conn);
+	profile->start = clock_monotonic();
+	profile->send = -1;
+	profile->active = true;
+	profile->next = mysql_profiles;
+	mysql_profiles = profile;
+}
+
+/* Account reading of a result set in a profile. */
+static void
+mysql_profile_add_result(struct mysql_profile *profile, double decode,
+			 uint64_t rows, uint64_t bytes)
+{
+	profile->decode += decode;
+	profile->rows += rows;
+	profile->bytes += bytes;
+	if (profile->result_count < PROFILE_RESULT_MAX) {
+		struct mysql_profile_result *result =
+			&profile->results[profile->result_count];
+		result->decode = decode;
+		result->rows = rows;
+		result->bytes = bytes;
+	}
+	++profile->result_count;
+}
+
+/**
+ * Turn profiling of requests on or off
+ */
+static int
+lua_mysql_profile(struct lua_State *L)
+{
+	mysql_profiling = lua_toboolean(L, 1);
+	while (!mysql_profiling && mysql_profiles != NULL)
+		mysql_profile_end(mysql_profiles);
+	return 0;
+}
+
+/*
+ * A source of rows of a result set: either a result of a text
+ * protocol query read with mysql_use_result() or a result of an
+ * executed prepared statement.
+ */
+struct mysql_rowset {
+	struct mysql_connection *conn;
+	MYSQL *raw_conn;
+	MYSQL_RES *res;
+	struct mysql_prepared *prepared;
+	MYSQL_FIELD *fields;
+	unsigned num_fields;
+	/* All rows are read. */
+	bool eof;
+	/* Reading of a row has failed. */
+	bool error;
+	/* The fiber was cancelled while decoding rows. */
+	bool cancelled;
+	/* Rows read and bytes of their values. */
+	uint64_t rows;
+	uint64_t bytes;
+};
+
+/*
+ * Decoding of a large result set must not stall other fibers:
+ * the fiber yields once it has spent its budget of rows or time.
+ */
+struct mysql_decode_budget {
+	int rows;
+	int rows_left;
+	double time;
+	double deadline;
+};
+
+static void
+mysql_decode_budget_create(struct mysql_decode_budget *budget,
+			   struct mysql_connection *conn)
+{
+	budget->rows = conn->decode_budget_rows;
+	budget->rows_left = budget->rows;
+	budget->time = conn->decode_budget_time;
+	budget->deadline = budget->time > 0 ?
+		clock_monotonic() + budget->time : 0;
+}
+
+/*
+ * Account a decoded row and yield if the budget is spent. Return
+ * -1 if the fiber was cancelled meanwhile.
+ */
+static int
+mysql_decode_budget_spend(struct mysql_decode_budget *budget)
+{
+	if (budget->rows > 0 && --budget->rows_left == 0)
+		goto yield;
+	if (budget->time > 0 && clock_monotonic() >= budget->deadline)
+		goto yield;
+	return 0;
+yield:
+	fiber_sleep(0);
+	if (fiber_is_cancelled())
+		return -1;
+	budget->rows_left = budget->rows;
+	if (budget->time > 0)
+		budget->deadline = clock_monotonic() + budget->time;
+	return 0;
+}
+
+static void
+mysql_rowset_create_from_result(struct mysql_rowset *rowset,
+				struct mysql_connection *conn, MYSQL_RES *res)
+{
+	memset(rowset, 0, sizeof(*rowset));
+	rowset->conn = conn;
+	rowset->raw_conn = conn->raw_conn;
+	rowset->res = res;
+	rowset->fields = mysql_fetch_fields(res);
+	rowset->num_fields = mysql_num_fields(res);
+}
+
+/*
+ * Create a rowset of an executed statement. Result binds of the
+ * statement should be bound to the fields.
+ */
+static void
+mysql_rowset_create_from_stmt(struct mysql_rowset *rowset,
+			      struct mysql_connection *conn,
+			      struct mysql_prepared *prepared,
+			      MYSQL_FIELD *fields, unsigned num_fields)
+{
+	memset(rowset, 0, sizeof(*rowset));
+	rowset->conn = conn;
+	rowset->raw_conn = conn->raw_conn;
+	rowset->prepared = prepared;
+	rowset->fields = fields;
+	rowset->num_fields = num_fields;
+}
+
+static void
+mysql_arena_destroy(struct mysql_arena *arena)
+{
+	unsigned long col_no;
+	for (col_no = 0; col_no < arena->long_count; ++col_no)
+		free(arena->long_buffers[col_no].data);
+	free(arena->long_buffers);
+	free(arena->data);
+	memset(arena, 0, sizeof(*arena));
+}
+
+/*
+ * Fetch the rest of values which don't fit buffers of their long
+ * columns, growing the buffers. Return -1 on error.
+ */
+static int
+mysql_prepared_fetch_long(struct mysql_prepared *prepared)
+{
+	struct mysql_arena *arena = prepared->arena;
+	bool rebind = false;
+	unsigned long col_no;
+	for (col_no = 0; col_no < prepared->col_count; ++col_no) {
+		MYSQL_BIND *bind = &prepared->result_binds[col_no];
+		unsigned long len = prepared->lengths[col_no];
+		if (bind->buffer_type != MYSQL_TYPE_STRING ||
+		    prepared->is_null[col_no] || len < bind->buffer_length)
 			continue;
+		if (col_no >= arena->long_count) {
+			struct mysql_long_buffer *long_buffers =
+				(struct mysql_long_buffer *)
+				realloc(arena->long_buffers,
+					prepared->col_count *
+					sizeof(*long_buffers));
+			if (long_buffers == NULL)
+				return -1;
+			memset(long_buffers + arena->long_count, 0,
+			       (prepared->col_count - arena->long_count) *
+			       sizeof(*long_buffers));
+			arena->long_buffers = long_buffers;
+			arena->long_count = prepared->col_count;
 		}
-		switch (lua_type(L, 3 + param_no)) {
-		case LUA_TNIL:
-			param_binds[param_no].buffer_type = MYSQL_TYPE_NULL;
+		struct mysql_long_buffer *long_buffer =
+			&arena->long_buffers[col_no];
+		/* The value is truncated to the size of the buffer. */
+		unsigned long offset = bind->buffer_length;
+		if (long_buffer->size < len + 1) {
+			char *data = (char *)realloc(long_buffer->data,
+						     len + 1);
+			if (data == NULL)
+				return -1;
+			long_buffer->data = data;
+			long_buffer->size = len + 1;
+		}
+		if (bind->buffer != long_buffer->data)
+			memcpy(long_buffer->data, bind->buffer, offset);
+		MYSQL_BIND piece;
+		unsigned long piece_len;
+		memset(&piece, 0, sizeof(piece));
+		piece.buffer_type = MYSQL_TYPE_STRING;
+		piece.buffer = long_buffer->data + offset;
+		piece.buffer_length = long_buffer->size - offset;
+		piece.length = &piece_len;
+		if (mysql_stmt_fetch_column(prepared->stmt, &piece, col_no,
+					    offset) != 0)
+			return -1;
+		long_buffer->data[len] = '\0';
+		bind->buffer = long_buffer->data;
+		bind->buffer_length = long_buffer->size;
+		rebind = true;
+	}
+	/* Fetch next rows to the grown buffers right away. */
+	if (rebind && mysql_stmt_bind_result(prepared->stmt,
+					     prepared->result_binds) != 0)
+		return -1;
+	return 0;
+}
+
+/* Account a fetched row in metrics. */
+static inline void
+mysql_rowset_account(struct mysql_rowset *rowset, char **cells,
+		     unsigned long *lengths)
+{
+	uint64_t bytes = 0;
+	unsigned col_no;
+	for (col_no = 0; col_no < rowset->num_fields; ++col_no) {
+		if (cells[col_no] != NULL)
+			bytes += lengths[col_no];
+	}
+	++rowset->rows;
+	rowset->bytes += bytes;
+	++mysql_metrics.rows;
+	mysql_metrics.bytes += bytes;
+}
+
+static void
+mysql_conn_track_session(struct mysql_connection *conn);
+
+/*
+ * Fetch the next row. Cells of a NULL value are NULL. Return 0
+ * on success and -1 at the end of rows or on error, see eof and
+ * error flags. Changes of the session state reported at the end
+ * of rows are tracked.
+ */
+static int
+mysql_rowset_fetch(struct mysql_rowset *rowset, char ***cells,
+		   unsigned long **lengths)
+{
+	if (rowset->eof || rowset->error)
+		return -1;
+	if (rowset->res != NULL) {
+		MYSQL_ROW row = mysql_fetch_row(rowset->res);
+		if (row == NULL) {
+			if (mysql_errno(rowset->raw_conn)) {
+				rowset->error = true;
+			} else {
+				rowset->eof = true;
+				mysql_conn_track_session(rowset->conn);
+			}
+			return -1;
+		}
+		*cells = row;
+		*lengths = mysql_fetch_lengths(rowset->res);
+		mysql_rowset_account(rowset, *cells, *lengths);
+		return 0;
+	}
+	struct mysql_prepared *prepared = rowset->prepared;
+	int rc = mysql_stmt_fetch(prepared->stmt);
+	if (rc == MYSQL_DATA_TRUNCATED)
+		rc = mysql_prepared_fetch_long(prepared) == 0 ? 0 : 1;
+	if (rc == 1) {
+		rowset->error = true;
+		return -1;
+	} else if (rc != 0) {
+		rowset->eof = true;
+		mysql_conn_track_session(rowset->conn);
+		return -1;
+	}
+	unsigned col_no;
+	for (col_no = 0; col_no < rowset->num_fields; ++col_no) {
+		prepared->cells[col_no] = prepared->is_null[col_no] ? NULL :
+			prepared->result_binds[col_no].buffer;
+	}
+	*cells = prepared->cells;
+	*lengths = prepared->lengths;
+	mysql_rowset_account(rowset, *cells, *lengths);
+	return 0;
+}
+
+/* Push an error of a rowset to lua stack. */
+static int
+lua_mysql_rowset_push_error(struct lua_State *L, struct mysql_rowset *rowset)
+{
+	if (rowset->prepared != NULL)
+		return lua_mysql_stmt_push_error(L, rowset->prepared->stmt);
+	return lua_mysql_push_error(L, rowset->raw_conn);
+}
+
+/*
+ * A result set with values kept in their text form and decoded
+ * only when a row field is indexed, see result_format = 'lazy'.
+ * Cells of all rows are copied to one buffer, so a result set
+ * costs a few allocations instead of a table per row.
+ *
+ * The userdata environment table holds a map of column names to
+ * column numbers, an array of column names and the result set
+ * userdata itself. Row objects share the table to keep the result
+ * set alive.
+ */
+struct mysql_lazy_result {
+	unsigned num_fields;
+	size_t num_rows;
+	int numeric;
+	int keep_null;
+	mysql_decode_f *decoders;
+	/* Cells of rows, num_rows * num_fields. */
+	struct mysql_lazy_cell *cells;
+	size_t cells_capacity;
+	/* Zero terminated values of cells. */
+	char *data;
+	size_t data_size;
+	size_t data_capacity;
+};
+
+struct mysql_lazy_cell {
+	size_t offset;
+	/* Length of the value, LAZY_CELL_NULL for NULL. */
+	unsigned long length;
+};
+
+#define LAZY_CELL_NULL ((unsigned long)-1)
+
+enum {
+	LAZY_ENV_COLUMNS = 1,
+	LAZY_ENV_NAMES = 2,
+	LAZY_ENV_RESULT = 3,
+};
+
+/* A row of a lazy result set. */
+struct mysql_lazy_row {
+	struct mysql_lazy_result *result;
+	size_t row_no;
+};
+
+/* Grow a buffer to fit size elements. Return -1 on no memory. */
+static int
+mysql_buffer_reserve(void **buf, size_t *capacity, size_t size,
+		     size_t elem_size)
+{
+	if (size <= *capacity)
+		return 0;
+	size_t new_capacity = *capacity > 0 ? *capacity : 64;
+	while (new_capacity < size)
+		new_capacity *= 2;
+	void *new_buf = realloc(*buf, new_capacity * elem_size);
+	if (new_buf == NULL)
+		return -1;
+	*buf = new_buf;
+	*capacity = new_capacity;
+	return 0;
+}
+
+/* Append a row to a lazy result set. Return -1 on no memory. */
+static int
+mysql_lazy_result_append(struct mysql_lazy_result *result, char **cells,
+			 unsigned long *lengths)
+{
+	unsigned num_fields = result->num_fields;
+	size_t first = result->num_rows * num_fields;
+	if (mysql_buffer_reserve((void **)&result->cells,
+				 &result->cells_capacity, first + num_fields,
+				 sizeof(*result->cells)) != 0)
+		return -1;
+	size_t row_size = 0;
+	unsigned col_no;
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		if (cells[col_no] != NULL)
+			row_size += lengths[col_no] + 1;
+	}
+	if (mysql_buffer_reserve((void **)&result->data,
+				 &result->data_capacity,
+				 result->data_size + row_size, 1) != 0)
+		return -1;
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		struct mysql_lazy_cell *cell = &result->cells[first + col_no];
+		if (cells[col_no] == NULL) {
+			cell->offset = 0;
+			cell->length = LAZY_CELL_NULL;
+			continue;
+		}
+		cell->offset = result->data_size;
+		cell->length = lengths[col_no];
+		memcpy(result->data + cell->offset, cells[col_no],
+		       lengths[col_no]);
+		result->data[cell->offset + lengths[col_no]] = '\0';
+		result->data_size += lengths[col_no] + 1;
+	}
+	++result->num_rows;
+	return 0;
+}
+
+/*
+ * Push rows of a rowset as a lazy result set, see
+ * lua_mysql_decode_rows() for arguments.
+ */
+static int
+lua_mysql_fetch_lazy(struct lua_State *L)
+{
+	struct mysql_connection *conn =
+		(struct mysql_connection *) lua_topointer(L, 1);
+	struct mysql_rowset *rowset =
+		(struct mysql_rowset *) lua_topointer(L, 2);
+	size_t limit = lua_tointeger(L, 3);
+	MYSQL_FIELD *fields = rowset->fields;
+	unsigned num_fields = rowset->num_fields;
+	char **cells;
+	unsigned long *lengths;
+	struct mysql_decode_budget budget;
+
+	struct mysql_lazy_result *result = (struct mysql_lazy_result *)
+		lua_newuserdata(L, sizeof(*result));
+	memset(result, 0, sizeof(*result));
+	luaL_getmetatable(L, mysql_result_label);
+	lua_setmetatable(L, -2);
+	result->num_fields = num_fields;
+	result->numeric = lua_toboolean(L, 4);
+	result->keep_null = conn->keep_null;
+	result->decoders = (mysql_decode_f *)
+		malloc(num_fields * sizeof(*result->decoders) + 1);
+	if (result->decoders == NULL)
+		luaL_error(L, "Can not allocate memory for result set");
+
+	lua_createtable(L, 3, 0);
+	lua_createtable(L, 0, num_fields);
+	lua_createtable(L, num_fields, 0);
+	unsigned col_no;
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		result->decoders[col_no] =
+			mysql_column_decoder(fields + col_no,
+					     conn->native_types);
+		lua_pushstring(L, fields[col_no].name);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, col_no + 1);
+		lua_pushinteger(L, col_no + 1);
+		lua_rawset(L, -4);
+	}
+	lua_rawseti(L, -3, LAZY_ENV_NAMES);
+	lua_rawseti(L, -2, LAZY_ENV_COLUMNS);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, LAZY_ENV_RESULT);
+	lua_setfenv(L, -2);
+
+	mysql_decode_budget_create(&budget, conn);
+	while ((limit == 0 || result->num_rows < limit) &&
+	       mysql_rowset_fetch(rowset, &cells, &lengths) == 0) {
+		if (mysql_lazy_result_append(result, cells, lengths) != 0)
+			luaL_error(L, "Can not allocate memory for result set");
+		if (mysql_decode_budget_spend(&budget) != 0) {
+			rowset->cancelled = true;
 			break;
-		case LUA_TBOOLEAN:
-			param_binds[param_no].buffer_type = MYSQL_TYPE_TINY;
-			param_binds[param_no].buffer = values + param_no;
-			*(bool *)(values + param_no) =
-				lua_toboolean(L, 3 + param_no);
-			param_binds[param_no].buffer_length = 1;
+		}
+	}
+	return 1;
+}
+
+/* Push a value of a lazy result set cell. */
+static void
+lua_mysql_lazy_push_value(struct lua_State *L,
+			  struct mysql_lazy_result *result, size_t row_no,
+			  unsigned col_no)
+{
+	struct mysql_lazy_cell *cell =
+		&result->cells[row_no * result->num_fields + col_no];
+	if (cell->length == LAZY_CELL_NULL) {
+		if (result->keep_null == 1)
+			luaL_pushnull(L);
+		else
+			lua_pushnil(L);
+		return;
+	}
+	result->decoders[col_no](L, result->data + cell->offset,
+				 cell->length);
+}
+
+/* Push a row of a lazy result set as a table. */
+static void
+lua_mysql_lazy_push_table(struct lua_State *L, int env_idx,
+			  struct mysql_lazy_result *result, size_t row_no)
+{
+	unsigned num_fields = result->num_fields;
+	unsigned col_no;
+	if (result->numeric) {
+		lua_createtable(L, num_fields, 0);
+		for (col_no = 0; col_no < num_fields; ++col_no) {
+			lua_mysql_lazy_push_value(L, result, row_no, col_no);
+			lua_rawseti(L, -2, col_no + 1);
+		}
+		return;
+	}
+	lua_rawgeti(L, env_idx, LAZY_ENV_NAMES);
+	lua_createtable(L, 0, num_fields);
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		lua_rawgeti(L, -2, col_no + 1);
+		lua_mysql_lazy_push_value(L, result, row_no, col_no);
+		lua_rawset(L, -3);
+	}
+	lua_remove(L, -2);
+}
+
+/**
+ * Get a row of a lazy result set by its number
+ */
+static int
+lua_mysql_result_index(struct lua_State *L)
+{
+	struct mysql_lazy_result *result = (struct mysql_lazy_result *)
+		luaL_checkudata(L, 1, mysql_result_label);
+	if (lua_type(L, 2) != LUA_TNUMBER)
+		return 0;
+	lua_Integer row_no = lua_tointeger(L, 2);
+	if (row_no < 1 || (size_t)row_no > result->num_rows)
+		return 0;
+	struct mysql_lazy_row *row = (struct mysql_lazy_row *)
+		lua_newuserdata(L, sizeof(*row));
+	row->result = result;
+	row->row_no = row_no - 1;
+	luaL_getmetatable(L, mysql_row_label);
+	lua_setmetatable(L, -2);
+	/* Keep the result set alive. */
+	lua_getfenv(L, 1);
+	lua_setfenv(L, -2);
+	return 1;
+}
+
+static int
+lua_mysql_result_len(struct lua_State *L)
+{
+	struct mysql_lazy_result *result = (struct mysql_lazy_result *)
+		luaL_checkudata(L, 1, mysql_result_label);
+	lua_pushinteger(L, result->num_rows);
+	return 1;
+}
+
+/**
+ * Decode a lazy result set as an array of row tables
+ */
+static int
+lua_mysql_result_serialize(struct lua_State *L)
+{
+	struct mysql_lazy_result *result = (struct mysql_lazy_result *)
+		luaL_checkudata(L, 1, mysql_result_label);
+	lua_getfenv(L, 1);
+	int env_idx = lua_gettop(L);
+	lua_createtable(L, result->num_rows, 0);
+	size_t row_no;
+	for (row_no = 0; row_no < result->num_rows; ++row_no) {
+		lua_mysql_lazy_push_table(L, env_idx, result, row_no);
+		lua_rawseti(L, -2, row_no + 1);
+	}
+	return 1;
+}
+
+static int
+lua_mysql_result_gc(struct lua_State *L)
+{
+	struct mysql_lazy_result *result = (struct mysql_lazy_result *)
+		luaL_checkudata(L, 1, mysql_result_label);
+	free(result->decoders);
+	free(result->cells);
+	free(result->data);
+	memset(result, 0, sizeof(*result));
+	return 0;
+}
+
+static int
+lua_mysql_result_tostring(struct lua_State *L)
+{
+	struct mysql_lazy_result *result = (struct mysql_lazy_result *)
+		luaL_checkudata(L, 1, mysql_result_label);
+	lua_pushfstring(L, "MYSQL_RESULT: %p", result);
+	return 1;
+}
+
+/**
+ * Decode a field of a lazy row indexed by a column number or name
+ */
+static int
+lua_mysql_row_index(struct lua_State *L)
+{
+	struct mysql_lazy_row *row = (struct mysql_lazy_row *)
+		luaL_checkudata(L, 1, mysql_row_label);
+	struct mysql_lazy_result *result = row->result;
+	lua_Integer col_no;
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		col_no = lua_tointeger(L, 2);
+	} else {
+		lua_getfenv(L, 1);
+		lua_rawgeti(L, -1, LAZY_ENV_COLUMNS);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		col_no = lua_tointeger(L, -1);
+	}
+	if (col_no < 1 || col_no > result->num_fields)
+		return 0;
+	lua_mysql_lazy_push_value(L, result, row->row_no, col_no - 1);
+	return 1;
+}
+
+static int
+lua_mysql_row_len(struct lua_State *L)
+{
+	struct mysql_lazy_row *row = (struct mysql_lazy_row *)
+		luaL_checkudata(L, 1, mysql_row_label);
+	lua_pushinteger(L, row->result->num_fields);
+	return 1;
+}
+
+/**
+ * Decode a lazy row as a table
+ */
+static int
+lua_mysql_row_serialize(struct lua_State *L)
+{
+	struct mysql_lazy_row *row = (struct mysql_lazy_row *)
+		luaL_checkudata(L, 1, mysql_row_label);
+	lua_getfenv(L, 1);
+	lua_mysql_lazy_push_table(L, lua_gettop(L), row->result,
+				  row->row_no);
+	return 1;
+}
+
+static int
+lua_mysql_row_tostring(struct lua_State *L)
+{
+	struct mysql_lazy_row *row = (struct mysql_lazy_row *)
+		luaL_checkudata(L, 1, mysql_row_label);
+	lua_pushfstring(L, "MYSQL_ROW: %p", row);
+	return 1;
+}
+
+/*
+ * Columnar result sets, see result_format = 'columnar'. Numeric
+ * columns are FFI arrays of int64_t, uint64_t or double with a
+ * bitmap of NULL values, other columns are lua tables. Arrays
+ * have count + 1 elements to be indexed from 1 like tables.
+ */
+enum mysql_column_kind {
+	COLUMN_TABLE,
+	COLUMN_INT64,
+	COLUMN_UINT64,
+	COLUMN_DOUBLE,
+	COLUMN_KIND_MAX,
+};
+
+/* FFI array types of numeric column kinds. */
+static const char *mysql_column_ctypes[COLUMN_KIND_MAX] = {
+	[COLUMN_INT64] = "int64_t[?]",
+	[COLUMN_UINT64] = "uint64_t[?]",
+	[COLUMN_DOUBLE] = "double[?]",
+};
+static int luaL_column_ctype_refs[COLUMN_KIND_MAX];
+static int luaL_bitmap_ctype_ref = LUA_REFNIL;
+static int luaL_ffi_new_ref = LUA_REFNIL;
+
+/*
+ * Values of a numeric column are collected to a C array and
+ * copied to an FFI array when the row count is known.
+ */
+struct mysql_column_builder {
+	enum mysql_column_kind kind;
+	mysql_decode_f decode;
+	union {
+		int64_t *i64;
+		uint64_t *u64;
+		double *f64;
+		void *ptr;
+	} values;
+	size_t capacity;
+	/* NULL bitmap, a bit per value. */
+	uint8_t *nulls;
+	size_t nulls_size;
+};
+
+struct mysql_columns {
+	unsigned num_fields;
+	struct mysql_column_builder builders[];
+};
+
+static enum mysql_column_kind
+mysql_column_kind(MYSQL_FIELD *field)
+{
+	switch (field->type) {
+	case MYSQL_TYPE_TINY:
+	case MYSQL_TYPE_SHORT:
+	case MYSQL_TYPE_LONG:
+	case MYSQL_TYPE_INT24:
+		return COLUMN_INT64;
+	case MYSQL_TYPE_LONGLONG:
+		if (field->flags & UNSIGNED_FLAG)
+			return COLUMN_UINT64;
+		return COLUMN_INT64;
+	case MYSQL_TYPE_FLOAT:
+	case MYSQL_TYPE_DOUBLE:
+		return COLUMN_DOUBLE;
+	default:
+		return COLUMN_TABLE;
+	}
+}
+
+/* Make room for a value with index row_no. */
+static int
+mysql_column_builder_reserve(struct mysql_column_builder *builder,
+			     size_t row_no)
+{
+	if (row_no < builder->capacity)
+		return 0;
+	if (mysql_buffer_reserve(&builder->values.ptr, &builder->capacity,
+				 row_no + 1, sizeof(uint64_t)) != 0)
+		return -1;
+	size_t nulls_size = builder->capacity / 8 + 1;
+	void *nulls = realloc(builder->nulls, nulls_size);
+	if (nulls == NULL)
+		return -1;
+	builder->nulls = (uint8_t *)nulls;
+	memset(builder->nulls + builder->nulls_size, 0,
+	       nulls_size - builder->nulls_size);
+	builder->nulls_size = nulls_size;
+	return 0;
+}
+
+static void
+mysql_column_builder_add(struct mysql_column_builder *builder,
+			 size_t row_no, const char *data, unsigned long len)
+{
+	if (data == NULL) {
+		builder->nulls[row_no / 8] |= 1 << (row_no % 8);
+		builder->values.u64[row_no] = 0;
+		return;
+	}
+	switch (builder->kind) {
+	case COLUMN_INT64:
+		if (len > 0 && *data == '-')
+			builder->values.i64[row_no] = (int64_t)
+				(0 - mysql_parse_digits(data + 1, data + len));
+		else
+			builder->values.i64[row_no] =
+				mysql_parse_digits(data, data + len);
+		break;
+	case COLUMN_UINT64:
+		builder->values.u64[row_no] =
+			mysql_parse_digits(data, data + len);
+		break;
+	default:
+		builder->values.f64[row_no] = strtod(data, NULL);
+		break;
+	}
+}
+
+static int
+lua_mysql_columns_gc(struct lua_State *L)
+{
+	struct mysql_columns *columns = (struct mysql_columns *)
+		luaL_checkudata(L, 1, mysql_columns_label);
+	unsigned col_no;
+	for (col_no = 0; col_no < columns->num_fields; ++col_no) {
+		free(columns->builders[col_no].values.ptr);
+		free(columns->builders[col_no].nulls);
+	}
+	columns->num_fields = 0;
+	return 0;
+}
+
+/*
+ * Push a new zero filled FFI array of a type referenced by
+ * ctype_ref and return its data.
+ */
+static void *
+lua_mysql_push_array(struct lua_State *L, int ctype_ref, size_t count)
+{
+	uint32_t ctypeid;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, luaL_ffi_new_ref);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ctype_ref);
+	lua_pushnumber(L, count);
+	lua_call(L, 2, 1);
+	return luaL_checkcdata(L, -1, &ctypeid);
+}
+
+/*
+ * Push rows of a rowset as a columnar result set, see
+ * lua_mysql_decode_rows() for arguments.
+ */
+static int
+lua_mysql_fetch_columnar(struct lua_State *L)
+{
+	struct mysql_connection *conn =
+		(struct mysql_connection *) lua_topointer(L, 1);
+	struct mysql_rowset *rowset =
+		(struct mysql_rowset *) lua_topointer(L, 2);
+	size_t limit = lua_tointeger(L, 3);
+	MYSQL_FIELD *fields = rowset->fields;
+	unsigned num_fields = rowset->num_fields;
+	char **cells;
+	unsigned long *lengths;
+	size_t row_no = 0;
+	unsigned col_no;
+	struct mysql_decode_budget budget;
+
+	luaL_checkstack(L, num_fields + LUA_MINSTACK, "too many columns");
+	struct mysql_columns *columns = (struct mysql_columns *)
+		lua_newuserdata(L, sizeof(*columns) + num_fields *
+				sizeof(struct mysql_column_builder));
+	memset(columns, 0, sizeof(*columns) + num_fields *
+	       sizeof(struct mysql_column_builder));
+	luaL_getmetatable(L, mysql_columns_label);
+	lua_setmetatable(L, -2);
+	columns->num_fields = num_fields;
+	/* Tables of non-numeric columns, nil for numeric ones. */
+	int tables_idx = lua_gettop(L) + 1;
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		struct mysql_column_builder *builder =
+			&columns->builders[col_no];
+		builder->kind = mysql_column_kind(fields + col_no);
+		builder->decode = mysql_column_decoder(fields + col_no,
+						       conn->native_types);
+		if (builder->kind == COLUMN_TABLE)
+			lua_newtable(L);
+		else
+			lua_pushnil(L);
+	}
+
+	mysql_decode_budget_create(&budget, conn);
+	while ((limit == 0 || row_no < limit) &&
+	       mysql_rowset_fetch(rowset, &cells, &lengths) == 0) {
+		++row_no;
+		for (col_no = 0; col_no < num_fields; ++col_no) {
+			struct mysql_column_builder *builder =
+				&columns->builders[col_no];
+			if (builder->kind != COLUMN_TABLE) {
+				if (mysql_column_builder_reserve(builder,
+								 row_no) != 0)
+					luaL_error(L, "Can not allocate memory "
+						   "for result set");
+				mysql_column_builder_add(builder, row_no,
+							 cells[col_no],
+							 lengths[col_no]);
+				continue;
+			}
+			if (cells[col_no] == NULL) {
+				if (conn->keep_null != 1)
+					continue;
+				luaL_pushnull(L);
+			} else {
+				builder->decode(L, cells[col_no],
+						lengths[col_no]);
+			}
+			lua_rawseti(L, tables_idx + col_no, row_no);
+		}
+		if (mysql_decode_budget_spend(&budget) != 0) {
+			rowset->cancelled = true;
+			break;
+		}
+	}
+
+	lua_createtable(L, 0, 4);
+	lua_createtable(L, 0, num_fields);
+	lua_createtable(L, 0, num_fields);
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		struct mysql_column_builder *builder =
+			&columns->builders[col_no];
+		if (builder->kind == COLUMN_TABLE) {
+			lua_pushvalue(L, tables_idx + col_no);
+			lua_setfield(L, -3, fields[col_no].name);
+			continue;
+		}
+		uint64_t *values = (uint64_t *)lua_mysql_push_array(L,
+			luaL_column_ctype_refs[builder->kind], row_no + 1);
+		if (row_no > 0)
+			memcpy(values + 1, builder->values.u64 + 1,
+			       row_no * sizeof(uint64_t));
+		lua_setfield(L, -3, fields[col_no].name);
+		uint8_t *nulls = (uint8_t *)lua_mysql_push_array(L,
+			luaL_bitmap_ctype_ref, row_no / 8 + 1);
+		if (row_no > 0)
+			memcpy(nulls, builder->nulls, row_no / 8 + 1);
+		lua_setfield(L, -2, fields[col_no].name);
+	}
+	lua_setfield(L, -3, "nulls");
+	lua_setfield(L, -2, "columns");
+	lua_pushinteger(L, row_no);
+	lua_setfield(L, -2, "count");
+	lua_mysql_push_metadata(L, fields, num_fields);
+	lua_setfield(L, -2, "metadata");
+	return 1;
+}
+
+/*
+ * Encoding of result sets to MsgPack, see execute_msgpack. Rows
+ * are written to an ibuf right from the row buffers of the
+ * connector, no lua values are created.
+ */
+struct mysql_mpbuf {
+	box_ibuf_t *ibuf;
+	char **rpos;
+	char **wpos;
+};
+
+/* Reserve size bytes at the write position. */
+static char *
+mysql_mpbuf_reserve(struct mysql_mpbuf *buf, size_t size)
+{
+	return (char *)box_ibuf_reserve(buf->ibuf, size);
+}
+
+/* Offset of the write position from the read position. */
+static size_t
+mysql_mpbuf_used(struct mysql_mpbuf *buf)
+{
+	return *buf->wpos - *buf->rpos;
+}
+
+static inline char *
+mysql_mp_store_u16(char *data, uint16_t v)
+{
+	*data++ = v >> 8;
+	*data++ = v;
+	return data;
+}
+
+static inline char *
+mysql_mp_store_u32(char *data, uint32_t v)
+{
+	data = mysql_mp_store_u16(data, v >> 16);
+	return mysql_mp_store_u16(data, v);
+}
+
+static inline char *
+mysql_mp_store_u64(char *data, uint64_t v)
+{
+	data = mysql_mp_store_u32(data, v >> 32);
+	return mysql_mp_store_u32(data, v);
+}
+
+static char *
+mysql_mp_encode_uint(char *data, uint64_t v)
+{
+	if (v <= 0x7f) {
+		*data++ = v;
+	} else if (v <= UINT8_MAX) {
+		*data++ = 0xcc;
+		*data++ = v;
+	} else if (v <= UINT16_MAX) {
+		*data++ = 0xcd;
+		data = mysql_mp_store_u16(data, v);
+	} else if (v <= UINT32_MAX) {
+		*data++ = 0xce;
+		data = mysql_mp_store_u32(data, v);
+	} else {
+		*data++ = 0xcf;
+		data = mysql_mp_store_u64(data, v);
+	}
+	return data;
+}
+
+/* Encode a negative integer. */
+static char *
+mysql_mp_encode_int(char *data, int64_t v)
+{
+	if (v >= -32) {
+		*data++ = v;
+	} else if (v >= INT8_MIN) {
+		*data++ = 0xd0;
+		*data++ = v;
+	} else if (v >= INT16_MIN) {
+		*data++ = 0xd1;
+		data = mysql_mp_store_u16(data, v);
+	} else if (v >= INT32_MIN) {
+		*data++ = 0xd2;
+		data = mysql_mp_store_u32(data, v);
+	} else {
+		*data++ = 0xd3;
+		data = mysql_mp_store_u64(data, v);
+	}
+	return data;
+}
+
+static char *
+mysql_mp_encode_strl(char *data, uint32_t len)
+{
+	if (len <= 31) {
+		*data++ = 0xa0 | len;
+	} else if (len <= UINT8_MAX) {
+		*data++ = 0xd9;
+		*data++ = len;
+	} else if (len <= UINT16_MAX) {
+		*data++ = 0xda;
+		data = mysql_mp_store_u16(data, len);
+	} else {
+		*data++ = 0xdb;
+		data = mysql_mp_store_u32(data, len);
+	}
+	return data;
+}
+
+static char *
+mysql_mp_encode_array(char *data, uint32_t size)
+{
+	if (size <= 15) {
+		*data++ = 0x90 | size;
+	} else if (size <= UINT16_MAX) {
+		*data++ = 0xdc;
+		data = mysql_mp_store_u16(data, size);
+	} else {
+		*data++ = 0xdd;
+		data = mysql_mp_store_u32(data, size);
+	}
+	return data;
+}
+
+static char *
+mysql_mp_encode_map(char *data, uint32_t size)
+{
+	if (size <= 15) {
+		*data++ = 0x80 | size;
+	} else if (size <= UINT16_MAX) {
+		*data++ = 0xde;
+		data = mysql_mp_store_u16(data, size);
+	} else {
+		*data++ = 0xdf;
+		data = mysql_mp_store_u32(data, size);
+	}
+	return data;
+}
+
+/*
+ * An array header of a yet unknown size is written as array32 and
+ * filled when the size is known.
+ */
+#define MP_ARRAY32_SIZE 5
+
+static size_t
+mysql_mpbuf_begin_array(struct mysql_mpbuf *buf)
+{
+	char *data = mysql_mpbuf_reserve(buf, MP_ARRAY32_SIZE);
+	if (data == NULL)
+		return SIZE_MAX;
+	size_t offset = mysql_mpbuf_used(buf);
+	*data = 0xdd;
+	*buf->wpos = data + MP_ARRAY32_SIZE;
+	return offset;
+}
+
+static void
+mysql_mpbuf_end_array(struct mysql_mpbuf *buf, size_t offset, uint32_t size)
+{
+	mysql_mp_store_u32(*buf->rpos + offset + 1, size);
+}
+
+/*
+ * An encoder of text values of a result set column, a MsgPack
+ * counterpart of mysql_decode_f. The value takes at most
+ * len + MP_VALUE_SIZE_MAX bytes.
+ */
+typedef char *
+(*mysql_encode_f)(char *dst, const char *data, unsigned long len);
+
+#define MP_VALUE_SIZE_MAX 9
+
+static char *
+mysql_mp_encode_integer(char *dst, const char *data, unsigned long len)
+{
+	if (len > 0 && *data == '-') {
+		uint64_t v = mysql_parse_digits(data + 1, data + len);
+		if (v != 0)
+			return mysql_mp_encode_int(dst, (int64_t)(0 - v));
+		return mysql_mp_encode_uint(dst, 0);
+	}
+	return mysql_mp_encode_uint(dst, mysql_parse_digits(data, data + len));
+}
+
+static char *
+mysql_mp_encode_double(char *dst, const char *data, unsigned long len)
+{
+	union {
+		double d;
+		uint64_t u;
+	} v;
+	(void)len;
+	v.d = strtod(data, NULL);
+	*dst++ = 0xcb;
+	return mysql_mp_store_u64(dst, v.u);
+}
+
+static char *
+mysql_mp_encode_string(char *dst, const char *data, unsigned long len)
+{
+	dst = mysql_mp_encode_strl(dst, len);
+	memcpy(dst, data, len);
+	return dst + len;
+}
+
+/* Choose an encoder of a column, see mysql_column_decoder(). */
+static mysql_encode_f
+mysql_column_encoder(MYSQL_FIELD *field)
+{
+	switch (field->type) {
+	case MYSQL_TYPE_TINY:
+	case MYSQL_TYPE_SHORT:
+	case MYSQL_TYPE_LONG:
+	case MYSQL_TYPE_INT24:
+	case MYSQL_TYPE_LONGLONG:
+		return mysql_mp_encode_integer;
+	case MYSQL_TYPE_FLOAT:
+	case MYSQL_TYPE_DOUBLE:
+		return mysql_mp_encode_double;
+	default:
+		return mysql_mp_encode_string;
+	}
+}
+
+/*
+ * Encode rows of a rowset to the MsgPack buffer of the connection
+ * as an array of rows, see lua_mysql_decode_rows() for arguments.
+ * Rows are maps of column names to values or arrays of values
+ * when use_numeric_result is set. Push the count of rows.
+ */
+static int
+lua_mysql_fetch_msgpack(struct lua_State *L)
+{
+	struct mysql_connection *conn =
+		(struct mysql_connection *) lua_topointer(L, 1);
+	struct mysql_rowset *rowset =
+		(struct mysql_rowset *) lua_topointer(L, 2);
+	size_t limit = lua_tointeger(L, 3);
+	struct mysql_mpbuf *buf = conn->mpbuf;
+	MYSQL_FIELD *fields = rowset->fields;
+	unsigned num_fields = rowset->num_fields;
+	int numeric = conn->use_numeric_result;
+	int keep_null = conn->keep_null;
+	char **cells;
+	unsigned long *lengths;
+	size_t row_count = 0;
+	unsigned col_no;
+	struct mysql_decode_budget budget;
+
+	/* Encode column names once. */
+	size_t keys_size = 0;
+	if (!numeric) {
+		for (col_no = 0; col_no < num_fields; ++col_no)
+			keys_size += strlen(fields[col_no].name) +
+				     MP_VALUE_SIZE_MAX;
+	}
+	mysql_encode_f *encoders = (mysql_encode_f *)lua_newuserdata(L,
+		num_fields * (sizeof(mysql_encode_f) + 2 * sizeof(size_t)) +
+		keys_size);
+	size_t *key_offsets = (size_t *)(encoders + num_fields);
+	size_t *key_sizes = key_offsets + num_fields;
+	char *keys = (char *)(key_sizes + num_fields);
+	char *key_end = keys;
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		encoders[col_no] = mysql_column_encoder(fields + col_no);
+		if (numeric)
+			continue;
+		const char *name = fields[col_no].name;
+		key_offsets[col_no] = key_end - keys;
+		key_end = mysql_mp_encode_string(key_end, name, strlen(name));
+		key_sizes[col_no] = key_end - keys - key_offsets[col_no];
+	}
+
+	size_t header = mysql_mpbuf_begin_array(buf);
+	if (header == SIZE_MAX)
+		luaL_error(L, "Can not allocate memory for MsgPack buffer");
+	mysql_decode_budget_create(&budget, conn);
+	while ((limit == 0 || row_count < limit) &&
+	       mysql_rowset_fetch(rowset, &cells, &lengths) == 0) {
+		size_t row_size = MP_VALUE_SIZE_MAX + keys_size;
+		uint32_t value_count = 0;
+		for (col_no = 0; col_no < num_fields; ++col_no) {
+			row_size += MP_VALUE_SIZE_MAX;
+			if (cells[col_no] != NULL) {
+				row_size += lengths[col_no];
+				++value_count;
+			}
+		}
+		char *data = mysql_mpbuf_reserve(buf, row_size);
+		if (data == NULL)
+			luaL_error(L, "Can not allocate memory for MsgPack "
+				   "buffer");
+		if (numeric)
+			data = mysql_mp_encode_array(data, num_fields);
+		else
+			data = mysql_mp_encode_map(data, keep_null == 1 ?
+						   num_fields : value_count);
+		for (col_no = 0; col_no < num_fields; ++col_no) {
+			if (cells[col_no] == NULL && !numeric &&
+			    keep_null != 1)
+				continue;
+			if (!numeric) {
+				memcpy(data, keys + key_offsets[col_no],
+				       key_sizes[col_no]);
+				data += key_sizes[col_no];
+			}
+			if (cells[col_no] == NULL)
+				*data++ = 0xc0;
+			else
+				data = encoders[col_no](data, cells[col_no],
+							lengths[col_no]);
+		}
+		*buf->wpos = data;
+		++row_count;
+		if (mysql_decode_budget_spend(&budget) != 0) {
+			rowset->cancelled = true;
+			break;
+		}
+	}
+	mysql_mpbuf_end_array(buf, header, row_count);
+	lua_pushnumber(L, row_count);
+	return 1;
+}
+
+/*
+ * Push rows of a rowset as a table of rows. Arguments: a
+ * connection, a rowset, a maximum count of rows (0 means all the
+ * rows) and whether rows are arrays of values.
+ */
+static int
+lua_mysql_decode_rows(struct lua_State *L)
+{
+	struct mysql_connection *conn =
+		(struct mysql_connection *) lua_topointer(L, 1);
+	struct mysql_rowset *rowset =
+		(struct mysql_rowset *) lua_topointer(L, 2);
+	int limit = lua_tointeger(L, 3);
+	int numeric = lua_toboolean(L, 4);
+	MYSQL_FIELD *fields = rowset->fields;
+	unsigned num_fields = rowset->num_fields;
+	char **cells;
+	unsigned long *lengths;
+	int row_idx = 1;
+	int names_idx = 0;
+	struct mysql_decode_budget budget;
+
+	if (conn->mpbuf != NULL)
+		return lua_mysql_fetch_msgpack(L);
+	if (conn->result_format == MYSQL_RESULT_LAZY)
+		return lua_mysql_fetch_lazy(L);
+	if (conn->result_format == MYSQL_RESULT_COLUMNAR)
+		return lua_mysql_fetch_columnar(L);
+
+	/* Build a decoding plan of the result set. */
+	luaL_checkstack(L, num_fields + LUA_MINSTACK, "too many columns");
+	mysql_decode_f *decoders = (mysql_decode_f *)
+		lua_newuserdata(L, num_fields * sizeof(*decoders));
+	unsigned col_no;
+	bool binary = rowset->prepared != NULL && rowset->prepared->binary;
+	for (col_no = 0; col_no < num_fields; ++col_no) {
+		decoders[col_no] = binary ?
+			mysql_binary_decoder(fields + col_no) :
+			mysql_column_decoder(fields + col_no,
+					     conn->native_types);
+	}
+	if (!numeric) {
+		names_idx = lua_gettop(L) + 1;
+		for (col_no = 0; col_no < num_fields; ++col_no)
+			lua_pushstring(L, fields[col_no].name);
+	}
+
+	mysql_decode_budget_create(&budget, conn);
+	lua_newtable(L);
+	while ((limit == 0 || row_idx <= limit) &&
+	       mysql_rowset_fetch(rowset, &cells, &lengths) == 0) {
+		lua_mysql_push_row(L, num_fields, decoders, cells, lengths,
+				   names_idx, conn->keep_null);
+		lua_rawseti(L, -2, row_idx);
+		++row_idx;
+		if (mysql_decode_budget_spend(&budget) != 0) {
+			rowset->cancelled = true;
+			break;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Push rows of a rowset, see lua_mysql_decode_rows(). The time of
+ * reading and decoding is accounted in metrics.
+ */
+static int
+lua_mysql_fetch_rows(struct lua_State *L)
+{
+	struct mysql_connection *conn =
+		(struct mysql_connection *) lua_topointer(L, 1);
+	struct mysql_rowset *rowset =
+		(struct mysql_rowset *) lua_topointer(L, 2);
+	struct mysql_profile *profile = conn->profile.active ?
+		&conn->profile : NULL;
+	uint64_t rows = rowset->rows;
+	uint64_t bytes = rowset->bytes;
+	double io = 0;
+	if (profile != NULL) {
+		mysql_profile_sent(profile);
+		io = profile->io_read + profile->io_write;
+	}
+	double start = clock_monotonic();
+	int ret_count = lua_mysql_decode_rows(L);
+	double time = clock_monotonic() - start;
+	mysql_histogram_observe(&mysql_metrics.fetch_time, time);
+	if (profile != NULL) {
+		io = profile->io_read + profile->io_write - io;
+		mysql_profile_add_result(profile, time - io,
+					 rowset->rows - rows,
+					 rowset->bytes - bytes);
+	}
+	return ret_count;
+}
+
+/* Push mysql recordset to lua stack */
+static int
+lua_mysql_fetch_result(struct lua_State *L)
+{
+	struct mysql_connection *conn =
+		(struct mysql_connection *) lua_topointer(L, 1);
+	struct mysql_rowset *rowset =
+		(struct mysql_rowset *) lua_topointer(L, 2);
+
+	/*
+	 * When use_numeric_result is false the table is a result
+	 * set (a return value of this function). Otherwise it is
+	 * a value of "rows" field of the return value. The fetch
+	 * time is accounted by lua_mysql_fetch_rows().
+	 */
+	lua_pushcfunction(L, lua_mysql_fetch_rows);
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_pushinteger(L, 0);
+	lua_pushboolean(L, conn->use_numeric_result);
+	lua_call(L, 4, 1);
+
+	if (!conn->use_numeric_result || conn->mpbuf != NULL ||
+	    conn->result_format == MYSQL_RESULT_COLUMNAR)
+		return 1;
+
+	/*
+	 * Create a result set table (a return value of the
+	 * function), swap it with the rows table filled above and
+	 * set result_set.rows = rows.
+	 */
+	lua_newtable(L);
+	lua_insert(L, -2);
+	lua_setfield(L, -2, "rows");
+
+	/*
+	 * Create a metadata table and set
+	 * result_set.metadata = metadata.
+	 */
+	lua_mysql_push_metadata(L, rowset->fields, rowset->num_fields);
+	lua_setfield(L, -2, "metadata");
+
+	return 1;
+}
+
+/*
+ * Remember whether the last reply has changed the session state:
+ * variables, the current database, temporary tables and so on.
+ * It is reported with the reply to each statement and at the end
+ * of its result set. A change of the current database is tracked
+ * with any reset strategy, the server reports it by default.
+ */
+static void
+mysql_conn_track_session(struct mysql_connection *conn)
+{
+	const char *data;
+	size_t len;
+	if (mysql_session_track_get_first(conn->raw_conn,
+					  SESSION_TRACK_SCHEMA,
+					  &data, &len) == 0)
+		conn->schema_changed = true;
+	if (!conn->track_session)
+		return;
+	if (mysql_session_track_get_first(conn->raw_conn,
+					  SESSION_TRACK_STATE_CHANGE,
+					  &data, &len) == 0)
+		conn->session_dirty = true;
+}
+
+/*
+ * Ask the server to report changes of the session state. It is
+ * done again after each reset, which restores session variables.
+ */
+static void
+mysql_conn_start_tracking(struct mysql_connection *conn)
+{
+	static const char sql[] = "SET SESSION session_track_state_change = ON";
+	conn->session_dirty = false;
+	conn->schema_changed = false;
+	if (!conn->track_session)
+		return;
+	if (mysql_real_query(conn->raw_conn, sql, sizeof(sql) - 1) != 0) {
+		/* The server can't track the session state. */
+		conn->track_session = false;
+	}
+}
+
+/*
+ * Check whether the session may differ from a fresh one: either
+ * its state has changed or a transaction is left open. Without
+ * tracking any session is considered dirty.
+ */
+static bool
+mysql_conn_session_dirty(struct mysql_connection *conn)
+{
+	unsigned int server_status = SERVER_STATUS_IN_TRANS;
+	if (!conn->track_session || conn->session_dirty)
+		return true;
+	mariadb_get_infov(conn->raw_conn, MARIADB_CONNECTION_SERVER_STATUS,
+			  &server_status);
+	return (server_status & SERVER_STATUS_IN_TRANS) != 0;
+}
+
+/*
+ * Read and free the rest of results of a multi statement query.
+ * Return 0 on success and -1 on error.
+ */
+static int
+mysql_skip_results(struct mysql_connection *conn)
+{
+	MYSQL *raw_conn = conn->raw_conn;
+	int rc;
+	while ((rc = mysql_next_result(raw_conn)) == 0) {
+		mysql_conn_track_session(conn);
+		MYSQL_RES *res = mysql_use_result(raw_conn);
+		if (res != NULL)
+			mysql_free_result(res);
+	}
+	return rc > 0 ? -1 : 0;
+}
+
+/*
+ * Defer closing of a statement of a collected lua object until
+ * the next request. Return -1 when the connection is closed or
+ * there is no memory, so the statement should be closed now.
+ */
+static int
+mysql_conn_add_orphan(struct mysql_connection *conn, MYSQL_STMT *stmt)
+{
+	if (conn->raw_conn == NULL)
+		return -1;
+	struct mysql_orphan_stmt *orphan =
+		(struct mysql_orphan_stmt *)malloc(sizeof(*orphan));
+	if (orphan == NULL)
+		return -1;
+	orphan->stmt = stmt;
+	orphan->next = conn->orphans;
+	conn->orphans = orphan;
+	return 0;
+}
+
+/*
+ * Read out a result set and close statements of collected lua
+ * objects.
+ */
+static void
+mysql_conn_close_orphans(struct mysql_connection *conn)
+{
+	if (conn->orphan_result != NULL) {
+		mysql_free_result(conn->orphan_result);
+		conn->orphan_result = NULL;
+		mysql_skip_results(conn);
+	}
+	while (conn->orphans != NULL) {
+		struct mysql_orphan_stmt *orphan = conn->orphans;
+		conn->orphans = orphan->next;
+		mysql_stmt_close(orphan->stmt);
+		free(orphan);
+	}
+}
+
+/**
+ * Execute plain sql script without parameters substitution
+ */
+static int
+lua_mysql_execute(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	MYSQL *raw_conn = conn->raw_conn;
+	size_t len;
+	const char *sql = lua_tolstring(L, 2, &len);
+	int err;
+
+	mysql_conn_close_orphans(conn);
+	err = mysql_metrics_query(raw_conn, sql, len);
+	if (err)
+		return lua_mysql_push_error(L, raw_conn);
+	mysql_conn_track_session(conn);
+
+	lua_pushnumber(L, 0);
+	int ret_count = 2;
+	int result_no = 0;
+
+	lua_newtable(L);
+	while (true) {
+		MYSQL_RES *res = mysql_use_result(raw_conn);
+		if (res) {
+			struct mysql_rowset rowset;
+			mysql_rowset_create_from_result(&rowset, conn, res);
+			lua_pushnumber(L, ++result_no);
+			int fail = 0;
+			lua_pushcfunction(L, lua_mysql_fetch_result);
+			lua_pushlightuserdata(L, conn);
+			lua_pushlightuserdata(L, &rowset);
+			fail = lua_pcall(L, 2, 1, 0);
+			if (mysql_errno(raw_conn)) {
+				ret_count = lua_mysql_push_error(L, raw_conn);
+				mysql_free_result(res);
+				return ret_count;
+			}
+			/*
+			 * The connection is considered broken after
+			 * cancellation, don't read the rest of rows.
+			 */
+			if (rowset.cancelled)
+				res->handle = NULL;
+			mysql_free_result(res);
+			if (fiber_is_cancelled()) {
+				lua_pushnumber(L, -2);
+				safe_pushstring(L, "Fiber was cancelled");
+				return 2;
+			}
+			if (fail) {
+				return lua_push_error(L);
+			}
+			lua_settable(L, -3);
+		}
+		int next_res = mysql_next_result(raw_conn);
+		if (next_res < 0)
+			break;
+		if (next_res > 0)
+			return lua_mysql_push_error(L, raw_conn);
+		mysql_conn_track_session(conn);
+	}
+	return ret_count;
+}
+
+static void
+mysql_prepared_destroy(struct mysql_prepared *prepared)
+{
+	free(prepared->values);
+	free(prepared->param_binds);
+	if (prepared->stmt)
+		mysql_stmt_close(prepared->stmt);
+	memset(prepared, 0, sizeof(*prepared));
+}
+
+/*
+ * Prepare a statement and allocate its parameter binds. On
+ * failure push status and error message to lua stack and return
+ * the number of pushed values, otherwise return 0.
+ */
+static int
+lua_mysql_prepare_stmt(struct lua_State *L, struct mysql_connection *conn,
+		       const char *sql, size_t len,
+		       struct mysql_prepared *prepared)
+{
+	int ret_count = 0;
+	memset(prepared, 0, sizeof(*prepared));
+	prepared->stmt = mysql_stmt_init(conn->raw_conn);
+	if (prepared->stmt == NULL)
+		return lua_mysql_push_error(L, conn->raw_conn);
+	if (mysql_stmt_prepare(prepared->stmt, sql, len) != 0) {
+		ret_count = lua_mysql_stmt_push_error(L, prepared->stmt);
+		mysql_prepared_destroy(prepared);
+		return ret_count;
+	}
+	prepared->param_count = mysql_stmt_param_count(prepared->stmt);
+	if (prepared->param_count == 0)
+		return 0;
+	prepared->param_binds = (MYSQL_BIND *)calloc(
+		sizeof(*prepared->param_binds), prepared->param_count);
+	prepared->values = (uint64_t *)calloc(
+		sizeof(*prepared->values), prepared->param_count);
+	if (prepared->param_binds == NULL || prepared->values == NULL) {
+		mysql_prepared_destroy(prepared);
+		lua_pushnumber(L, 1);
+		int fail = safe_pushstring(L,
+			"Can not allocate memory for statement parameters");
+		return fail ? lua_push_error(L) : 2;
+	}
+	return 0;
+}
+
+/* A buffer type of a result column, see mysql_binary_type(). */
+static inline enum enum_field_types
+mysql_prepared_result_type(MYSQL_FIELD *field, bool binary)
+{
+	return binary ? mysql_binary_type(field) : MYSQL_TYPE_STRING;
+}
+
+/*
+ * A size of a result buffer of a column, long columns get a
+ * short buffer, see struct mysql_arena.
+ */
+static inline unsigned long
+mysql_prepared_result_size(MYSQL_FIELD *field, bool binary)
+{
+	switch (mysql_prepared_result_type(field, binary)) {
+	case MYSQL_TYPE_LONGLONG:
+		return sizeof(int64_t);
+	case MYSQL_TYPE_DOUBLE:
+		return sizeof(double);
+	case MYSQL_TYPE_STRING:
+		/* Reserve a byte for the terminating zero. */
+		return field->length < RESULT_BUFFER_SIZE ?
+		       field->length + 1 : RESULT_BUFFER_SIZE;
+	default:
+		return sizeof(MYSQL_TIME);
+	}
+}
+
+/* Round a size up to alignment of any bound value. */
+static inline size_t
+mysql_arena_align(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+/*
+ * Lay out result binds for the columns of the current result set
+ * in an arena, with their binary types when binary is set,
+ * otherwise as strings. Grown buffers of long columns are reused.
+ */
+static int
+mysql_prepared_bind_results(struct mysql_prepared *prepared,
+			    struct mysql_arena *arena, MYSQL_FIELD *fields,
+			    unsigned long col_count, bool binary)
+{
+	size_t binds_size = mysql_arena_align(col_count * sizeof(MYSQL_BIND));
+	size_t lengths_size = mysql_arena_align(col_count *
+						sizeof(unsigned long));
+	size_t is_null_size = mysql_arena_align(col_count * sizeof(my_bool));
+	size_t cells_size = mysql_arena_align(col_count * sizeof(char *));
+	size_t size = binds_size + lengths_size + is_null_size + cells_size;
+	unsigned long col_no;
+	for (col_no = 0; col_no < col_count; ++col_no) {
+		size += mysql_arena_align(
+			mysql_prepared_result_size(fields + col_no, binary));
+	}
+	if (size > arena->capacity) {
+		/* Nothing is kept, so don't copy by realloc(). */
+		free(arena->data);
+		arena->capacity = 0;
+		arena->data = (char *)malloc(size);
+		if (arena->data == NULL)
+			return -1;
+		arena->capacity = size;
+	}
+	char *data = arena->data;
+	memset(data, 0, binds_size + lengths_size + is_null_size);
+	prepared->result_binds = (MYSQL_BIND *)data;
+	data += binds_size;
+	prepared->lengths = (unsigned long *)data;
+	data += lengths_size;
+	prepared->is_null = (my_bool *)data;
+	data += is_null_size;
+	prepared->cells = (char **)data;
+	data += cells_size;
+	prepared->col_count = col_count;
+	prepared->arena = arena;
+	prepared->binary = binary;
+	for (col_no = 0; col_no < col_count; ++col_no) {
+		MYSQL_BIND *bind = &prepared->result_binds[col_no];
+		unsigned long col_size =
+			mysql_prepared_result_size(fields + col_no, binary);
+		bind->buffer_type = mysql_prepared_result_type(fields + col_no,
+							       binary);
+		bind->is_unsigned = (fields[col_no].flags & UNSIGNED_FLAG) != 0;
+		bind->buffer = data;
+		bind->buffer_length = col_size;
+		bind->length = &prepared->lengths[col_no];
+		bind->is_null = &prepared->is_null[col_no];
+		data += mysql_arena_align(col_size);
+		if (bind->buffer_type == MYSQL_TYPE_STRING &&
+		    col_no < arena->long_count &&
+		    arena->long_buffers[col_no].size > col_size) {
+			bind->buffer = arena->long_buffers[col_no].data;
+			bind->buffer_length = arena->long_buffers[col_no].size;
+		}
+	}
+	return mysql_stmt_bind_result(prepared->stmt,
+				      prepared->result_binds) ? -1 : 0;
+}
+
+enum mysql_cdata_kind {
+	MYSQL_CDATA_OTHER,
+	MYSQL_CDATA_INT64,
+	MYSQL_CDATA_UINT64,
+	MYSQL_CDATA_NULL,
+};
+
+/*
+ * Classify a value at index idx of lua stack as an int64_t, a
+ * uint64_t, box.NULL or anything else, and set *cdata to the data
+ * of a cdata value.
+ */
+static enum mysql_cdata_kind
+mysql_classify_cdata(struct lua_State *L, int idx, void **cdata)
+{
+	if (!luaL_iscdata(L, idx))
+		return MYSQL_CDATA_OTHER;
+	uint32_t ctypeid;
+	*cdata = luaL_checkcdata(L, idx, &ctypeid);
+	if (ctypeid == int64_ctypeid)
+		return MYSQL_CDATA_INT64;
+	if (ctypeid == uint64_ctypeid)
+		return MYSQL_CDATA_UINT64;
+	if (ctypeid == ptr_ctypeid && *(void **)*cdata == NULL)
+		return MYSQL_CDATA_NULL;
+	return MYSQL_CDATA_OTHER;
+}
+
+/*
+ * Bind an int64_t, uint64_t or box.NULL value at index idx of
+ * lua stack. Return -1 for values of other types.
+ */
+static int
+lua_mysql_bind_cdata(struct lua_State *L, int idx, MYSQL_BIND *bind,
+		     uint64_t *value)
+{
+	void *cdata;
+	enum mysql_cdata_kind kind = mysql_classify_cdata(L, idx, &cdata);
+	switch (kind) {
+	case MYSQL_CDATA_INT64:
+	case MYSQL_CDATA_UINT64:
+		bind->buffer_type = MYSQL_TYPE_LONGLONG;
+		bind->is_unsigned = kind == MYSQL_CDATA_UINT64;
+		bind->buffer = value;
+		bind->buffer_length = 8;
+		*value = *(uint64_t *)cdata;
+		return 0;
+	case MYSQL_CDATA_NULL:
+		bind->buffer_type = MYSQL_TYPE_NULL;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Replace a value at index idx of lua stack with its text
+ * suitable for MySQL. Datetime objects are formatted without a
+ * time zone, other values are converted by tostring().
+ */
+static void
+lua_mysql_param_to_string(struct lua_State *L, int idx)
+{
+	uint32_t ctypeid = 0;
+	if (datetime_ctypeid != 0 && luaL_iscdata(L, idx))
+		luaL_checkcdata(L, idx, &ctypeid);
+	if (ctypeid != 0 && ctypeid == datetime_ctypeid) {
+		lua_getfield(L, idx, "format");
+		lua_pushvalue(L, idx);
+		lua_pushstring(L, "%Y-%m-%d %H:%M:%S.%6f");
+		lua_call(L, 2, 1);
+	} else {
+		lua_getglobal(L, "tostring");
+		lua_pushvalue(L, idx);
+		lua_call(L, 1, 1);
+	}
+	lua_replace(L, idx);
+}
+
+/* Whether a value is a decimal or a datetime object. */
+static bool
+lua_mysql_is_native(struct lua_State *L, int idx)
+{
+	if (!luaL_iscdata(L, idx))
+		return false;
+	lua_mysql_load_native_types(L);
+	uint32_t ctypeid;
+	luaL_checkcdata(L, idx, &ctypeid);
+	return ctypeid == decimal_ctypeid || ctypeid == datetime_ctypeid;
+}
+
+/*
+ * Fill parameter binds of a prepared statement with values
+ * taken from lua stack starting at index idx. Missing values are
+ * bound as NULL. int64_t and uint64_t values are bound as
+ * integers, so are integral numbers when native is set. Decimal
+ * and datetime values are bound as strings. Return an error
+ * message for a value of another type or NULL.
+ */
+static const char *
+lua_mysql_bind_params(struct lua_State *L, int idx, int nargs,
+		      struct mysql_prepared *prepared, bool native)
+{
+	MYSQL_BIND *param_binds = prepared->param_binds;
+	uint64_t *values = prepared->values;
+	size_t len;
+	double number;
+	unsigned param_no;
+	for (param_no = 0; param_no < prepared->param_count; ++param_no) {
+		memset(&param_binds[param_no], 0, sizeof(MYSQL_BIND));
+		if (param_no >= (unsigned)nargs) {
+			param_binds[param_no].buffer_type = MYSQL_TYPE_NULL;
+			continue;
+		}
+		int value_idx = idx + param_no;
+		switch (lua_type(L, value_idx)) {
+		case LUA_TNIL:
+			param_binds[param_no].buffer_type = MYSQL_TYPE_NULL;
+			break;
+		case LUA_TBOOLEAN:
+			param_binds[param_no].buffer_type = MYSQL_TYPE_TINY;
+			param_binds[param_no].buffer = values + param_no;
+			*(bool *)(values + param_no) =
+				lua_toboolean(L, value_idx);
+			param_binds[param_no].buffer_length = 1;
+			break;
+		case LUA_TNUMBER:
+			number = lua_tonumber(L, value_idx);
+			param_binds[param_no].buffer = values + param_no;
+			param_binds[param_no].buffer_length = 8;
+			/*
+			 * Integers up to 2^53 are exact in doubles, the
+			 * range is checked first to keep the cast
+			 * defined.
+			 */
+			if (native && number >= -9007199254740992.0 &&
+			    number <= 9007199254740992.0 &&
+			    number == (double)(int64_t)number) {
+				param_binds[param_no].buffer_type =
+					MYSQL_TYPE_LONGLONG;
+				*(int64_t *)(values + param_no) =
+					(int64_t)number;
+				break;
+			}
+			param_binds[param_no].buffer_type = MYSQL_TYPE_DOUBLE;
+			*(double *)(values + param_no) = number;
+			break;
+		default:
+			if (luaL_iscdata(L, value_idx) &&
+			    lua_mysql_bind_cdata(L, value_idx,
+						 &param_binds[param_no],
+						 values + param_no) == 0)
+				break;
+			if (!lua_mysql_is_native(L, value_idx))
+				return "Unsupported type of a parameter";
+			lua_mysql_param_to_string(L, value_idx);
+			/* Fall through. */
+		case LUA_TSTRING:
+			param_binds[param_no].buffer_type = MYSQL_TYPE_STRING;
+			param_binds[param_no].buffer =
+				(char *)lua_tolstring(L, value_idx, &len);
+			param_binds[param_no].buffer_length = len;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Send string parameters longer than LONG_DATA_SIZE by chunks
+ * instead of within the execute packet, which would hold a copy
+ * of all of them. Should be called after mysql_stmt_bind_param().
+ * Return -1 on error.
+ */
+static int
+mysql_prepared_send_long_data(struct mysql_prepared *prepared)
+{
+	unsigned long param_no;
+	for (param_no = 0; param_no < prepared->param_count; ++param_no) {
+		MYSQL_BIND *bind = &prepared->param_binds[param_no];
+		if (bind->buffer_type != MYSQL_TYPE_STRING ||
+		    bind->buffer_length <= LONG_DATA_SIZE)
+			continue;
+		const char *data = (const char *)bind->buffer;
+		unsigned long offset;
+		for (offset = 0; offset < bind->buffer_length;
+		     offset += LONG_DATA_SIZE) {
+			unsigned long len = bind->buffer_length - offset;
+			if (len > LONG_DATA_SIZE)
+				len = LONG_DATA_SIZE;
+			if (mysql_stmt_send_long_data(prepared->stmt, param_no,
+						      data + offset, len))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A dumb FNV-1a hash of SQL text for the statement cache.
+ */
+static uint32_t
+mysql_sql_hash(const char *sql, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		hash ^= (unsigned char)sql[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void
+mysql_stmt_cache_unlink(struct mysql_stmt_cache *cache,
+			struct mysql_stmt_cache_entry *entry)
+{
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		cache->first = entry->next;
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache->last = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void
+mysql_stmt_cache_link_first(struct mysql_stmt_cache *cache,
+			    struct mysql_stmt_cache_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->first;
+	if (cache->first != NULL)
+		cache->first->prev = entry;
+	else
+		cache->last = entry;
+	cache->first = entry;
+}
+
+/* Drop an entry from the cache and close its statement. */
+static void
+mysql_stmt_cache_remove(struct mysql_stmt_cache *cache,
+			struct mysql_stmt_cache_entry *entry)
+{
+	mysql_stmt_cache_unlink(cache, entry);
+	--cache->size;
+	mysql_prepared_destroy(&entry->prepared);
+	free(entry->sql);
+	free(entry);
+}
+
+/* Drop all cached statements. Counters are kept. */
+static void
+mysql_stmt_cache_flush(struct mysql_stmt_cache *cache)
+{
+	while (cache->first != NULL)
+		mysql_stmt_cache_remove(cache, cache->first);
+}
+
+/*
+ * Find a prepared statement for the SQL text in the cache or
+ * prepare a new one and put it to the cache evicting the least
+ * recently used entry if the cache is full. On failure push
+ * status and error message to lua stack and return NULL.
+ */
+static struct mysql_stmt_cache_entry *
+lua_mysql_stmt_cache_get(struct lua_State *L, struct mysql_connection *conn,
+			 const char *sql, size_t len)
+{
+	struct mysql_stmt_cache *cache = &conn->stmt_cache;
+	uint32_t hash = mysql_sql_hash(sql, len);
+	struct mysql_stmt_cache_entry *entry;
+	for (entry = cache->first; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && entry->sql_len == len &&
+		    memcmp(entry->sql, sql, len) == 0)
+			break;
+	}
+	if (entry != NULL) {
+		++cache->hits;
+		if (entry != cache->first) {
+			mysql_stmt_cache_unlink(cache, entry);
+			mysql_stmt_cache_link_first(cache, entry);
+		}
+		return entry;
+	}
+	++cache->misses;
+	entry = (struct mysql_stmt_cache_entry *)calloc(1, sizeof(*entry));
+	if (entry != NULL)
+		entry->sql = (char *)malloc(len);
+	if (entry == NULL || entry->sql == NULL) {
+		free(entry);
+		lua_pushnumber(L, 1);
+		safe_pushstring(L, "Can not allocate memory for statement "
+				"cache entry");
+		return NULL;
+	}
+	if (lua_mysql_prepare_stmt(L, conn, sql, len,
+				   &entry->prepared) != 0) {
+		free(entry->sql);
+		free(entry);
+		return NULL;
+	}
+	memcpy(entry->sql, sql, len);
+	entry->sql_len = len;
+	entry->hash = hash;
+	if (cache->size >= cache->capacity) {
+		mysql_stmt_cache_remove(cache, cache->last);
+		++cache->evictions;
+	}
+	mysql_stmt_cache_link_first(cache, entry);
+	++cache->size;
+	return entry;
+}
+
+/*
+ * Execute a prepared statement with params taken from lua stack
+ * starting at index idx and push status and results. Set *failed
+ * when the statement has failed, so it should not be reused.
+ */
+static int
+lua_mysql_prepared_execute(struct lua_State *L, struct mysql_connection *conn,
+			   struct mysql_prepared *prepared, int idx,
+			   int nargs, bool *failed)
+{
+	int ret_count = 0, fail = 0, error = 0;
+	MYSQL_STMT *stmt = prepared->stmt;
+	MYSQL_RES *meta = NULL;
+
+	/* We hope that all should be fine and push 0 (OK) */
+	lua_pushnumber(L, 0);
+	lua_newtable(L);
+	ret_count = 2;
+	const char *msg = lua_mysql_bind_params(L, idx, nargs, prepared,
+						conn->native_types);
+	if (msg != NULL) {
+		*failed = false;
+		lua_pop(L, 2);
+		lua_pushnumber(L, 1);
+		fail = safe_pushstring(L, (char *)msg);
+		return fail ? lua_push_error(L) : 2;
+	}
+	error = mysql_stmt_bind_param(stmt, prepared->param_binds) ||
+		mysql_prepared_send_long_data(prepared) != 0;
+	if (error)
+		goto done;
+	error = mysql_metrics_stmt_execute(stmt);
+	if (error)
+		goto done;
+	mysql_conn_track_session(conn);
+
+	meta = mysql_stmt_result_metadata(stmt);
+	if (!meta)
+		goto done;
+	/* Bind space for output */
+	unsigned long col_count = mysql_num_fields(meta);
+	MYSQL_FIELD *fields = mysql_fetch_fields(meta);
+	/*
+	 * Binary values are decoded by lua_mysql_decode_rows() only,
+	 * other result formats take text values.
+	 */
+	bool binary = conn->native_types && conn->mpbuf == NULL &&
+		      conn->result_format == MYSQL_RESULT_TABLE;
+	error = mysql_prepared_bind_results(prepared, &conn->arena, fields,
+					    col_count, binary);
+	if (error)
+		goto done;
+	struct mysql_rowset rowset;
+	mysql_rowset_create_from_stmt(&rowset, conn, prepared, fields,
+				      col_count);
+	lua_pushnumber(L, 1);
+	lua_pushcfunction(L, lua_mysql_fetch_rows);
+	lua_pushlightuserdata(L, conn);
+	lua_pushlightuserdata(L, &rowset);
+	lua_pushinteger(L, 0);
+	lua_pushboolean(L, 0);
+	if ((fail = lua_pcall(L, 4, 1, 0)))
+		goto done;
+	lua_settable(L, -3);
+	error = rowset.error;
+
+done:
+	if (error)
+		ret_count = lua_mysql_stmt_push_error(L, stmt);
+	if (meta) {
+		mysql_stmt_free_result(stmt);
+		mysql_free_result(meta);
+	}
+	*failed = error || fail;
+	if (fiber_is_cancelled()) {
+		lua_pushnumber(L, -2);
+		safe_pushstring(L, "Fiber was cancelled");
+		return 2;
+	}
+	return fail ? lua_push_error(L) : ret_count;
+}
+
+/*
+ * Execute sql statement as prepared statement with params
+ */
+static int
+lua_mysql_execute_prepared(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	size_t len;
+	const char *sql = lua_tolstring(L, 2, &len);
+	int nargs = lua_gettop(L) - 2;
+	int ret_count;
+	bool failed;
+
+	struct mysql_stmt_cache_entry *entry = NULL;
+	struct mysql_prepared uncached;
+	struct mysql_prepared *prepared = &uncached;
+
+	mysql_conn_close_orphans(conn);
+	if (conn->stmt_cache.capacity > 0) {
+		entry = lua_mysql_stmt_cache_get(L, conn, sql, len);
+		if (entry == NULL)
+			return 2;
+		prepared = &entry->prepared;
+	} else if ((ret_count = lua_mysql_prepare_stmt(L, conn, sql, len,
+							prepared)) != 0) {
+		return ret_count;
+	}
+	ret_count = lua_mysql_prepared_execute(L, conn, prepared, 3, nargs,
+					       &failed);
+	if (entry == NULL)
+		mysql_prepared_destroy(prepared);
+	else if (failed)
+		mysql_stmt_cache_remove(&conn->stmt_cache, entry);
+	return ret_count;
+}
+
+/*
+ * Get an ibuf from a struct ibuf or struct ibuf * cdata at index
+ * idx. Return NULL if the value is not an ibuf.
+ */
+static box_ibuf_t *
+lua_mysql_check_ibuf(struct lua_State *L, int idx)
+{
+	static uint32_t ibuf_ctypeid = 0;
+	static uint32_t ibuf_ptr_ctypeid = 0;
+	if (ibuf_ctypeid == 0) {
+		ibuf_ctypeid = luaL_ctypeid(L, "struct ibuf");
+		ibuf_ptr_ctypeid = luaL_ctypeid(L, "struct ibuf *");
+	}
+	uint32_t ctypeid;
+	void *data = luaL_checkcdata(L, idx, &ctypeid);
+	if (ctypeid == ibuf_ctypeid)
+		return (box_ibuf_t *)data;
+	if (ctypeid == ibuf_ptr_ctypeid)
+		return *(box_ibuf_t **)data;
+	return NULL;
+}
+
+/**
+ * Execute sql statement and encode its results to an ibuf as a
+ * MsgPack array of result sets, each of them is an array of rows.
+ * Return status and the count of written bytes.
+ */
+static int
+lua_mysql_execute_msgpack(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	struct mysql_mpbuf buf;
+	buf.ibuf = lua_mysql_check_ibuf(L, 2);
+	if (buf.ibuf == NULL) {
+		lua_pushnumber(L, 1);
+		int fail = safe_pushstring(L, "Usage: "
+			"conn:execute_msgpack(ibuf, sql, ...)");
+		return fail ? lua_push_error(L) : 2;
+	}
+	box_ibuf_read_range(buf.ibuf, &buf.rpos, &buf.wpos);
+	/* Arguments are the same as of execute() now. */
+	lua_remove(L, 2);
+	int nargs = lua_gettop(L) - 2;
+
+	size_t start = mysql_mpbuf_used(&buf);
+	size_t header = mysql_mpbuf_begin_array(&buf);
+	if (header == SIZE_MAX) {
+		lua_pushnumber(L, 1);
+		int fail = safe_pushstring(L, "Can not allocate memory for "
+					   "MsgPack buffer");
+		return fail ? lua_push_error(L) : 2;
+	}
+	/*
+	 * The buffer lives on this stack frame, so a lua error must
+	 * not leave it referenced by the connection.
+	 */
+	lua_pushcfunction(L, nargs > 0 ? lua_mysql_execute_prepared :
+					 lua_mysql_execute);
+	lua_insert(L, 1);
+	conn->mpbuf = &buf;
+	int rc = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+	conn->mpbuf = NULL;
+	int ret_count = lua_gettop(L);
+	if (rc != 0 || ret_count != 2 || lua_tointeger(L, -2) != 0) {
+		/* Drop partially written results. */
+		*buf.wpos = *buf.rpos + start;
+		return rc != 0 ? lua_error(L) : ret_count;
+	}
+	mysql_mpbuf_end_array(&buf, header, lua_objlen(L, -1));
+	lua_pop(L, 1);
+	lua_pushnumber(L, mysql_mpbuf_used(&buf) - start);
+	return 2;
+}
+
+/**
+ * Return statistics of the prepared statement cache
+ */
+static int
+lua_mysql_stmt_cache_stats(struct lua_State *L)
+{
+	struct mysql_stmt_cache *cache =
+		&lua_check_mysqlconn(L, 1)->stmt_cache;
+	lua_createtable(L, 0, 5);
+	lua_pushnumber(L, cache->size);
+	lua_setfield(L, -2, "size");
+	lua_pushnumber(L, cache->capacity);
+	lua_setfield(L, -2, "capacity");
+	luaL_pushuint64(L, cache->hits);
+	lua_setfield(L, -2, "hits");
+	luaL_pushuint64(L, cache->misses);
+	lua_setfield(L, -2, "misses");
+	luaL_pushuint64(L, cache->evictions);
+	lua_setfield(L, -2, "evictions");
+	return 1;
+}
+
+/*
+ * A prepared statement exposed to lua. The environment of the
+ * userdata refers to the connection userdata, so the connection
+ * object outlives the statement.
+ */
+struct mysql_statement {
+	struct mysql_connection *conn;
+	/* Value of conn->generation at the moment of prepare. */
+	unsigned generation;
+	struct mysql_prepared prepared;
+};
+
+static inline struct mysql_statement *
+lua_check_mysqlstmt(struct lua_State *L, int index)
+{
+	struct mysql_statement *statement = (struct mysql_statement *)
+		luaL_checkudata(L, index, mysql_stmt_label);
+	if (statement->prepared.stmt == NULL ||
+	    statement->conn->raw_conn == NULL)
+		luaL_error(L, "Driver fatal error (closed statement "
+			      "or connection)");
+	return statement;
+}
+
+/*
+ * Push an error if the server has forgotten the statement due
+ * to a connection reset. Return the number of pushed values.
+ */
+static int
+lua_mysql_stmt_check_generation(struct lua_State *L,
+				struct mysql_statement *statement)
+{
+	if (statement->generation == statement->conn->generation)
+		return 0;
+	lua_pushnumber(L, 1);
+	int fail = safe_pushstring(L, "Statement is invalidated by "
+				   "connection reset");
+	return fail ? lua_push_error(L) : 2;
+}
+
+/**
+ * Prepare a statement object
+ */
+static int
+lua_mysql_prepare(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	size_t len;
+	const char *sql = luaL_checklstring(L, 2, &len);
+	struct mysql_prepared prepared;
+	int ret_count;
+
+	mysql_conn_close_orphans(conn);
+	if ((ret_count = lua_mysql_prepare_stmt(L, conn, sql, len,
+						&prepared)) != 0)
+		return ret_count;
+	lua_pushnumber(L, 0);
+	struct mysql_statement *statement = (struct mysql_statement *)
+		lua_newuserdata(L, sizeof(*statement));
+	statement->conn = conn;
+	statement->generation = conn->generation;
+	statement->prepared = prepared;
+	luaL_getmetatable(L, mysql_stmt_label);
+	lua_setmetatable(L, -2);
+	/* Keep the connection object alive. */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+	return 2;
+}
+
+/**
+ * Execute a statement object with params
+ */
+static int
+lua_mysql_stmt_execute(struct lua_State *L)
+{
+	struct mysql_statement *statement = lua_check_mysqlstmt(L, 1);
+	int nargs = lua_gettop(L) - 1;
+	int ret_count;
+	bool failed;
+
+	if ((ret_count = lua_mysql_stmt_check_generation(L, statement)) != 0)
+		return ret_count;
+	struct mysql_connection *conn = statement->conn;
+	mysql_conn_close_orphans(conn);
+	if (mysql_profiling)
+		mysql_profile_begin(&conn->profile, conn->raw_conn);
+	ret_count = lua_mysql_prepared_execute(L, conn, &statement->prepared,
+					       2, nargs, &failed);
+	mysql_profile_end(&conn->profile);
+	return ret_count;
+}
+
+/* Rows sent in one bulk execution by default. */
+#define BULK_BATCH_SIZE_DEFAULT 1000
+
+enum mysql_bulk_kind {
+	MYSQL_BULK_NULL,
+	MYSQL_BULK_BOOL,
+	MYSQL_BULK_INT64,
+	MYSQL_BULK_UINT64,
+	MYSQL_BULK_DOUBLE,
+	MYSQL_BULK_STRING,
+	/* A value which can't be a parameter. */
+	MYSQL_BULK_INVALID,
+};
+
+/*
+ * Column-wise parameter arrays of a bulk execution. Every
+ * parameter has batch_size slots of each array.
+ */
+struct mysql_bulk {
+	unsigned long param_count;
+	unsigned batch_size;
+	MYSQL_BIND *binds;
+	/* An array of double, int64_t or char * of a parameter. */
+	uint64_t *values;
+	unsigned long *lengths;
+	char *indicators;
+};
+
+/*
+ * Whether the server accepts several parameter sets in one
+ * COM_STMT_BULK_EXECUTE. It is a MariaDB extension.
+ */
+static bool
+mysql_bulk_supported(MYSQL *raw_conn)
+{
+	unsigned long ext_caps = 0;
+	if (mariadb_get_infov(raw_conn,
+			      MARIADB_CONNECTION_EXTENDED_SERVER_CAPABILITIES,
+			      &ext_caps) != 0)
+		return false;
+	return (ext_caps & (MARIADB_CLIENT_STMT_BULK_OPERATIONS >> 32)) != 0;
+}
+
+static int
+mysql_bulk_create(struct mysql_bulk *bulk, unsigned long param_count,
+		  unsigned batch_size)
+{
+	size_t count = (size_t)param_count * batch_size;
+	bulk->param_count = param_count;
+	bulk->batch_size = batch_size;
+	bulk->binds = (MYSQL_BIND *)calloc(param_count, sizeof(MYSQL_BIND));
+	bulk->values = (uint64_t *)calloc(count, sizeof(uint64_t));
+	bulk->lengths = (unsigned long *)calloc(count, sizeof(unsigned long));
+	bulk->indicators = (char *)calloc(count, 1);
+	if (bulk->binds == NULL || bulk->values == NULL ||
+	    bulk->lengths == NULL || bulk->indicators == NULL)
+		return -1;
+	return 0;
+}
+
+static void
+mysql_bulk_destroy(struct mysql_bulk *bulk)
+{
+	free(bulk->binds);
+	free(bulk->values);
+	free(bulk->lengths);
+	free(bulk->indicators);
+}
+
+/*
+ * Format a finite number in the shortest form which reads back the
+ * same. Integral values are written without an exponent, otherwise
+ * the server would take 1e+15 for a DOUBLE rather than an integer.
+ * Return the length of the text.
+ */
+static int
+mysql_format_number(char *buf, size_t size, double value)
+{
+	if (value == floor(value) && fabs(value) < 1e18)
+		return snprintf(buf, size, "%.0f", value);
+	int precision, len = 0;
+	for (precision = 15; precision <= 17; ++precision) {
+		len = snprintf(buf, size, "%.*g", precision, value);
+		if (strtod(buf, NULL) == value)
+			break;
+	}
+	return len;
+}
+
+/* The kind of a parameter value at index idx of lua stack. */
+static enum mysql_bulk_kind
+lua_mysql_bulk_value_kind(struct lua_State *L, int idx)
+{
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL:
+		return MYSQL_BULK_NULL;
+	case LUA_TBOOLEAN:
+		return MYSQL_BULK_BOOL;
+	case LUA_TNUMBER:
+		return MYSQL_BULK_DOUBLE;
+	case LUA_TSTRING:
+		return MYSQL_BULK_STRING;
+	}
+	void *cdata;
+	switch (mysql_classify_cdata(L, idx, &cdata)) {
+	case MYSQL_CDATA_INT64:
+		return MYSQL_BULK_INT64;
+	case MYSQL_CDATA_UINT64:
+		return MYSQL_BULK_UINT64;
+	case MYSQL_CDATA_NULL:
+		return MYSQL_BULK_NULL;
+	default:
+		return MYSQL_BULK_INVALID;
+	}
+}
+
+/*
+ * The kind of a parameter fitting values of both kinds. Integers
+ * and doubles are sent as strings when mixed, so that no digits
+ * are lost.
+ */
+static enum mysql_bulk_kind
+mysql_bulk_kind_merge(enum mysql_bulk_kind a, enum mysql_bulk_kind b)
+{
+	if (a == b || b == MYSQL_BULK_NULL)
+		return a;
+	if (a == MYSQL_BULK_NULL)
+		return b;
+	if (a == MYSQL_BULK_BOOL && b != MYSQL_BULK_STRING)
+		return b;
+	if (b == MYSQL_BULK_BOOL && a != MYSQL_BULK_STRING)
+		return a;
+	return MYSQL_BULK_STRING;
+}
+
+/*
+ * Fill column-wise binds with rows first..first + count - 1 of
+ * the rows table at index rows_idx. The type of a parameter is
+ * chosen to fit all its values in the batch, see
+ * mysql_bulk_kind_merge(). Converted values are anchored in the
+ * table at index anchor_idx. Return the error message or NULL.
+ */
+static const char *
+lua_mysql_bulk_fill(struct lua_State *L, struct mysql_bulk *bulk,
+		    int rows_idx, int anchor_idx, int first, unsigned count)
+{
+	unsigned long param_count = bulk->param_count;
+	unsigned long param_no;
+	unsigned row_no;
+	int anchored = lua_objlen(L, anchor_idx);
+	for (param_no = 0; param_no < param_count; ++param_no) {
+		enum mysql_bulk_kind kind = MYSQL_BULK_NULL;
+		for (row_no = 0; row_no < count; ++row_no) {
+			lua_rawgeti(L, rows_idx, first + row_no);
+			if (!lua_istable(L, -1)) {
+				lua_pop(L, 1);
+				return "execute_many: a row must be a table";
+			}
+			lua_rawgeti(L, -1, param_no + 1);
+			enum mysql_bulk_kind value_kind =
+				lua_mysql_bulk_value_kind(L, -1);
+			lua_pop(L, 2);
+			if (value_kind == MYSQL_BULK_INVALID)
+				return "execute_many: unsupported parameter "
+				       "type";
+			kind = mysql_bulk_kind_merge(kind, value_kind);
+		}
+
+		MYSQL_BIND *bind = &bulk->binds[param_no];
+		uint64_t *values = bulk->values +
+			param_no * bulk->batch_size;
+		unsigned long *lengths = bulk->lengths +
+			param_no * bulk->batch_size;
+		char *indicators = bulk->indicators +
+			param_no * bulk->batch_size;
+		memset(bind, 0, sizeof(*bind));
+		bind->buffer = values;
+		bind->u.indicator = indicators;
+		switch (kind) {
+		case MYSQL_BULK_BOOL:
+		case MYSQL_BULK_INT64:
+			bind->buffer_type = MYSQL_TYPE_LONGLONG;
+			break;
+		case MYSQL_BULK_UINT64:
+			bind->buffer_type = MYSQL_TYPE_LONGLONG;
+			bind->is_unsigned = true;
+			break;
+		case MYSQL_BULK_DOUBLE:
+			bind->buffer_type = MYSQL_TYPE_DOUBLE;
+			break;
+		default:
+			bind->buffer_type = MYSQL_TYPE_STRING;
+			bind->length = lengths;
+		}
+
+		for (row_no = 0; row_no < count; ++row_no) {
+			lua_rawgeti(L, rows_idx, first + row_no);
+			lua_rawgeti(L, -1, param_no + 1);
+			enum mysql_bulk_kind value_kind =
+				lua_mysql_bulk_value_kind(L, -1);
+			indicators[row_no] = value_kind == MYSQL_BULK_NULL ?
+				STMT_INDICATOR_NULL : STMT_INDICATOR_NONE;
+			if (value_kind == MYSQL_BULK_NULL) {
+				lua_pop(L, 2);
+				continue;
+			}
+			bool is_int = value_kind == MYSQL_BULK_INT64 ||
+				      value_kind == MYSQL_BULK_UINT64;
+			uint32_t ctypeid;
+			uint64_t int_value = is_int ?
+				*(uint64_t *)luaL_checkcdata(L, -1, &ctypeid) :
+				(uint64_t)lua_toboolean(L, -1);
+			switch (kind) {
+			case MYSQL_BULK_BOOL:
+			case MYSQL_BULK_INT64:
+			case MYSQL_BULK_UINT64:
+				values[row_no] = int_value;
+				break;
+			case MYSQL_BULK_DOUBLE:
+				((double *)values)[row_no] =
+					value_kind == MYSQL_BULK_BOOL ?
+					lua_toboolean(L, -1) :
+					lua_tonumber(L, -1);
+				break;
+			default:
+				if (value_kind == MYSQL_BULK_BOOL) {
+					((const char **)values)[row_no] =
+						int_value ? "1" : "0";
+					lengths[row_no] = 1;
+					break;
+				}
+				/*
+				 * Numbers are written exactly, unlike
+				 * by lua_tolstring().
+				 */
+				if (value_kind != MYSQL_BULK_STRING) {
+					char buf[32];
+					int len;
+					if (value_kind == MYSQL_BULK_INT64)
+						len = snprintf(buf, sizeof(buf),
+							"%lld",
+							(long long)int_value);
+					else if (value_kind ==
+						 MYSQL_BULK_UINT64)
+						len = snprintf(buf, sizeof(buf),
+							"%llu",
+							(unsigned long long)
+							int_value);
+					else
+						len = mysql_format_number(buf,
+							sizeof(buf),
+							lua_tonumber(L, -1));
+					lua_pushlstring(L, buf, len);
+					lua_pushvalue(L, -1);
+					lua_rawseti(L, anchor_idx, ++anchored);
+					lua_replace(L, -2);
+				}
+				size_t len;
+				((const char **)values)[row_no] =
+					lua_tolstring(L, -1, &len);
+				lengths[row_no] = len;
+			}
+			lua_pop(L, 2);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Execute a statement once per row of the table at index
+ * rows_idx. It is used when the server does not support bulk
+ * execution or results of each row are needed: unless results_idx
+ * is 0, {affected_rows = ..., insert_id = ...} of each row is set
+ * to the table at results_idx. The first insert id generated by
+ * the rows is set to *insert_id. Return 0 or -1 on a statement
+ * error, or on an invalid parameter setting *msg.
+ */
+static int
+lua_mysql_stmt_execute_rows(struct lua_State *L,
+			    struct mysql_prepared *prepared, int rows_idx,
+			    int row_count, bool native,
+			    uint64_t *affected_rows, uint64_t *insert_id,
+			    int results_idx, const char **msg)
+{
+	MYSQL_STMT *stmt = prepared->stmt;
+	int param_count = prepared->param_count;
+	int row_no, param_no;
+	for (row_no = 1; row_no <= row_count; ++row_no) {
+		lua_rawgeti(L, rows_idx, row_no);
+		int row_idx = lua_gettop(L);
+		for (param_no = 1; param_no <= param_count; ++param_no)
+			lua_rawgeti(L, row_idx, param_no);
+		*msg = lua_mysql_bind_params(L, row_idx + 1, param_count,
+					     prepared, native);
+		if (*msg != NULL) {
+			lua_settop(L, row_idx - 1);
+			return -1;
+		}
+		int error = mysql_stmt_bind_param(stmt,
+						  prepared->param_binds) ||
+			    mysql_prepared_send_long_data(prepared) != 0 ||
+			    mysql_metrics_stmt_execute(stmt);
+		lua_settop(L, row_idx - 1);
+		if (error)
+			return -1;
+		*affected_rows += mysql_stmt_affected_rows(stmt);
+		if (*insert_id == 0)
+			*insert_id = mysql_stmt_insert_id(stmt);
+		if (results_idx != 0) {
+			lua_createtable(L, 0, 2);
+			lua_pushnumber(L, mysql_stmt_affected_rows(stmt));
+			lua_setfield(L, -2, "affected_rows");
+			lua_pushnumber(L, mysql_stmt_insert_id(stmt));
+			lua_setfield(L, -2, "insert_id");
+			lua_rawseti(L, results_idx, row_no);
+		}
+		if (mysql_stmt_field_count(stmt) > 0)
+			mysql_stmt_free_result(stmt);
+		if (fiber_is_cancelled())
+			return 0;
+	}
+	return 0;
+}
+
+/**
+ * Execute a statement object with many sets of params
+ */
+static int
+lua_mysql_stmt_execute_many(struct lua_State *L)
+{
+	struct mysql_statement *statement = lua_check_mysqlstmt(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int batch_size = luaL_optinteger(L, 3, BULK_BATCH_SIZE_DEFAULT);
+	if (batch_size <= 0)
+		luaL_error(L, "execute_many: batch_size must be positive");
+	bool row_results = lua_toboolean(L, 4);
+	lua_settop(L, 3);
+	struct mysql_prepared *prepared = &statement->prepared;
+	MYSQL_STMT *stmt = prepared->stmt;
+	int row_count = lua_objlen(L, 2);
+	uint64_t affected_rows = 0;
+	uint64_t insert_id = 0;
+	int ret_count;
+
+	if ((ret_count = lua_mysql_stmt_check_generation(L, statement)) != 0)
+		return ret_count;
+	int row_no;
+	for (row_no = 1; row_no <= row_count; ++row_no) {
+		lua_rawgeti(L, 2, row_no);
+		bool is_table = lua_istable(L, -1);
+		lua_pop(L, 1);
+		if (!is_table) {
+			lua_pushnumber(L, 1);
+			int fail = safe_pushstring(L, "execute_many: a row must "
+						   "be a table");
+			return fail ? lua_push_error(L) : 2;
+		}
+	}
+	mysql_conn_close_orphans(statement->conn);
+	/* Results of rows are at index 4 when requested. */
+	if (row_results)
+		lua_createtable(L, row_count, 0);
+	if (row_count == 0)
+		goto done;
+	/* A bulk execution reports only the totals of all rows. */
+	if (row_results || prepared->param_count == 0 ||
+	    !mysql_bulk_supported(statement->conn->raw_conn)) {
+		const char *msg = NULL;
+		if (lua_mysql_stmt_execute_rows(L, prepared, 2, row_count,
+				statement->conn->native_types,
+				&affected_rows, &insert_id,
+				row_results ? 4 : 0, &msg) == 0)
+			goto done;
+		if (msg == NULL)
+			return lua_mysql_stmt_push_error(L, stmt);
+		lua_pushnumber(L, 1);
+		int fail = safe_pushstring(L, (char *)msg);
+		return fail ? lua_push_error(L) : 2;
+	}
+
+	if (batch_size > row_count)
+		batch_size = row_count;
+	struct mysql_bulk bulk;
+	if (mysql_bulk_create(&bulk, prepared->param_count,
+			      batch_size) != 0) {
+		mysql_bulk_destroy(&bulk);
+		lua_pushnumber(L, 1);
+		int fail = safe_pushstring(L, "Can not allocate memory for "
+					   "bulk parameters");
+		return fail ? lua_push_error(L) : 2;
+	}
+	/* Strings converted from numbers are kept here. */
+	lua_newtable(L);
+	int anchor_idx = lua_gettop(L);
+	int first;
+	for (first = 1; first <= row_count; first += batch_size) {
+		unsigned int count = row_count - first + 1;
+		if (count > (unsigned)batch_size)
+			count = batch_size;
+		const char *msg = lua_mysql_bulk_fill(L, &bulk, 2,
+						      anchor_idx, first,
+						      count);
+		if (msg != NULL) {
+			mysql_bulk_destroy(&bulk);
+			lua_pushnumber(L, 1);
+			int fail = safe_pushstring(L, (char *)msg);
+			return fail ? lua_push_error(L) : 2;
+		}
+		if (mysql_stmt_attr_set(stmt, STMT_ATTR_ARRAY_SIZE, &count) ||
+		    mysql_stmt_bind_param(stmt, bulk.binds) ||
+		    mysql_metrics_stmt_execute(stmt)) {
+			ret_count = lua_mysql_stmt_push_error(L, stmt);
+			count = 0;
+			mysql_stmt_attr_set(stmt, STMT_ATTR_ARRAY_SIZE, &count);
+			mysql_bulk_destroy(&bulk);
+			return ret_count;
+		}
+		affected_rows += mysql_stmt_affected_rows(stmt);
+		/* The first id generated by a bulk request. */
+		if (insert_id == 0)
+			insert_id = mysql_stmt_insert_id(stmt);
+		/* Strings of the batch are not needed anymore. */
+		lua_newtable(L);
+		lua_replace(L, anchor_idx);
+		if (fiber_is_cancelled())
+			break;
+	}
+	unsigned int array_size = 0;
+	mysql_stmt_attr_set(stmt, STMT_ATTR_ARRAY_SIZE, &array_size);
+	mysql_bulk_destroy(&bulk);
+
+done:
+	mysql_conn_track_session(statement->conn);
+	if (fiber_is_cancelled()) {
+		lua_pushnumber(L, -2);
+		safe_pushstring(L, "Fiber was cancelled");
+		return 2;
+	}
+	lua_pushnumber(L, 0);
+	lua_pushnumber(L, affected_rows);
+	lua_pushnumber(L, insert_id);
+	if (!row_results)
+		return 3;
+	lua_pushvalue(L, 4);
+	return 4;
+}
+
+/**
+ * Close a statement object
+ */
+static int
+lua_mysql_stmt_close(struct lua_State *L)
+{
+	struct mysql_statement *statement = (struct mysql_statement *)
+		luaL_checkudata(L, 1, mysql_stmt_label);
+	if (statement->prepared.stmt == NULL) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	mysql_prepared_destroy(&statement->prepared);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/**
+ * Collect a statement object
+ */
+static int
+lua_mysql_stmt_gc(struct lua_State *L)
+{
+	struct mysql_statement *statement = (struct mysql_statement *)
+		luaL_checkudata(L, 1, mysql_stmt_label);
+	struct mysql_connection *conn = statement->conn;
+	MYSQL_STMT *stmt = statement->prepared.stmt;
+	if (stmt == NULL)
+		return 0;
+	/*
+	 * Sending COM_STMT_CLOSE could interleave with a request
+	 * of another fiber, so defer it until the next request.
+	 */
+	if (mysql_conn_add_orphan(conn, stmt) == 0)
+		statement->prepared.stmt = NULL;
+	mysql_prepared_destroy(&statement->prepared);
+	return 0;
+}
+
+static int
+lua_mysql_stmt_tostring(struct lua_State *L)
+{
+	struct mysql_statement *statement = (struct mysql_statement *)
+		luaL_checkudata(L, 1, mysql_stmt_label);
+	lua_pushfstring(L, "MYSQL_STMT: %p", statement->prepared.stmt);
+	return 1;
+}
+
+/*
+ * A cursor reads rows of a result set on demand. A query without
+ * parameters is read with mysql_use_result(): unread rows stay in
+ * the socket, so the connection can't serve other requests until
+ * the cursor is read out or closed. A query with parameters opens
+ * a read only server side cursor of a prepared statement.
+ *
+ * Like a statement object the cursor userdata refers to the
+ * connection userdata.
+ */
+struct mysql_cursor {
+	struct mysql_connection *conn;
+	/* A result set of a query without parameters. */
+	MYSQL_RES *res;
+	/* A statement and its metadata for a query with parameters. */
+	struct mysql_prepared prepared;
+	MYSQL_RES *meta;
+	struct mysql_arena arena;
+	struct mysql_rowset rowset;
+};
+
+static inline struct mysql_cursor *
+lua_check_mysqlcursor(struct lua_State *L, int index)
+{
+	struct mysql_cursor *cursor = (struct mysql_cursor *)
+		luaL_checkudata(L, index, mysql_cursor_label);
+	if (cursor->conn->raw_conn == NULL)
+		luaL_error(L, "Driver fatal error (closed connection)");
+	return cursor;
+}
+
+/*
+ * Free the result set of a cursor. When drain is set, unread
+ * rows and the rest of results of a multi statement query are
+ * read out, so the connection can serve the next request. Return
+ * 0 on success and -1 on error.
+ */
+static int
+mysql_cursor_release(struct mysql_cursor *cursor, bool drain)
+{
+	struct mysql_connection *conn = cursor->conn;
+	int rc = 0;
+	if (cursor->res != NULL) {
+		conn->cursor = NULL;
+		/*
+		 * The connection is going away: don't touch it
+		 * when freeing the result set.
+		 */
+		if (!drain)
+			cursor->res->handle = NULL;
+		mysql_free_result(cursor->res);
+		cursor->res = NULL;
+		if (drain)
+			rc = mysql_skip_results(conn);
+	}
+	if (cursor->meta != NULL) {
+		mysql_free_result(cursor->meta);
+		cursor->meta = NULL;
+	}
+	mysql_prepared_destroy(&cursor->prepared);
+	mysql_arena_destroy(&cursor->arena);
+	cursor->rowset.fields = NULL;
+	cursor->rowset.num_fields = 0;
+	cursor->rowset.eof = true;
+	return rc;
+}
+
+/*
+ * Forget result sets before the connection is closed: nobody is
+ * going to read them anymore.
+ */
+static void
+mysql_conn_detach_results(struct mysql_connection *conn)
+{
+	if (conn->cursor != NULL)
+		mysql_cursor_release(conn->cursor, false);
+	if (conn->orphan_result != NULL) {
+		conn->orphan_result->handle = NULL;
+		mysql_free_result(conn->orphan_result);
+		conn->orphan_result = NULL;
+	}
+}
+
+/*
+ * Execute a query with parameters, on a read only server side
+ * cursor if server_cursor is set. On failure push status and
+ * error message to lua stack and return the number of pushed
+ * values, otherwise return 0.
+ */
+static int
+lua_mysql_cursor_open_stmt(struct lua_State *L, struct mysql_cursor *cursor,
+			   const char *sql, size_t len, int idx, int nargs,
+			   bool server_cursor)
+{
+	struct mysql_connection *conn = cursor->conn;
+	struct mysql_prepared *prepared = &cursor->prepared;
+	int ret_count;
+	if ((ret_count = lua_mysql_prepare_stmt(L, conn, sql, len,
+						prepared)) != 0)
+		return ret_count;
+	MYSQL_STMT *stmt = prepared->stmt;
+	unsigned long cursor_type = server_cursor ? CURSOR_TYPE_READ_ONLY :
+						    CURSOR_TYPE_NO_CURSOR;
+	const char *msg = lua_mysql_bind_params(L, idx, nargs, prepared,
+						conn->native_types);
+	if (msg != NULL) {
+		mysql_cursor_release(cursor, true);
+		lua_pushnumber(L, 1);
+		int fail = safe_pushstring(L, (char *)msg);
+		return fail ? lua_push_error(L) : 2;
+	}
+	if (mysql_stmt_attr_set(stmt, STMT_ATTR_CURSOR_TYPE, &cursor_type) ||
+	    mysql_stmt_bind_param(stmt, prepared->param_binds) ||
+	    mysql_prepared_send_long_data(prepared) != 0 ||
+	    mysql_metrics_stmt_execute(stmt))
+		goto error;
+	mysql_conn_track_session(conn);
+	cursor->meta = mysql_stmt_result_metadata(stmt);
+	if (cursor->meta == NULL) {
+		/* The query returns no rows. */
+		cursor->rowset.eof = true;
+		return 0;
+	}
+	MYSQL_FIELD *fields = mysql_fetch_fields(cursor->meta);
+	unsigned num_fields = mysql_num_fields(cursor->meta);
+	if (mysql_prepared_bind_results(prepared, &cursor->arena, fields,
+					num_fields, false))
+		goto error;
+	mysql_rowset_create_from_stmt(&cursor->rowset, conn, prepared,
+				      fields, num_fields);
+	return 0;
+error:
+	ret_count = lua_mysql_stmt_push_error(L, stmt);
+	mysql_cursor_release(cursor, true);
+	return ret_count;
+}
+
+/*
+ * Execute a query without parameters and start reading its first
+ * result set. On failure push status and error message to lua
+ * stack and return the number of pushed values, otherwise
+ * return 0.
+ */
+static int
+lua_mysql_cursor_open_query(struct lua_State *L, struct mysql_cursor *cursor,
+			    const char *sql, size_t len)
+{
+	struct mysql_connection *conn = cursor->conn;
+	MYSQL *raw_conn = conn->raw_conn;
+	if (mysql_metrics_query(raw_conn, sql, len))
+		return lua_mysql_push_error(L, raw_conn);
+	mysql_conn_track_session(conn);
+	while (true) {
+		MYSQL_RES *res = mysql_use_result(raw_conn);
+		if (res != NULL) {
+			cursor->res = res;
+			conn->cursor = cursor;
+			mysql_rowset_create_from_result(&cursor->rowset,
+							conn, res);
+			return 0;
+		}
+		if (mysql_errno(raw_conn))
+			return lua_mysql_push_error(L, raw_conn);
+		int next_res = mysql_next_result(raw_conn);
+		if (next_res < 0)
+			break;
+		if (next_res > 0)
+			return lua_mysql_push_error(L, raw_conn);
+		mysql_conn_track_session(conn);
+	}
+	/* No statement of the query returns rows. */
+	cursor->rowset.eof = true;
+	return 0;
+}
+
+/*
+ * Push a new cursor over a result set of a query with parameters
+ * taken from lua stack starting at index idx. A query with
+ * parameters uses a server side cursor if server_cursor is set,
+ * otherwise its rows are read as they arrive. On failure push
+ * status and error message to lua stack and return the number of
+ * pushed values, otherwise return 0.
+ */
+static int
+lua_mysql_cursor_open(struct lua_State *L, int conn_idx, const char *sql,
+		      size_t len, int idx, int nargs, bool server_cursor)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, conn_idx);
+	struct mysql_cursor *cursor = (struct mysql_cursor *)
+		lua_newuserdata(L, sizeof(*cursor));
+	memset(cursor, 0, sizeof(*cursor));
+	cursor->conn = conn;
+	luaL_getmetatable(L, mysql_cursor_label);
+	lua_setmetatable(L, -2);
+	/* Keep the connection object alive. */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, conn_idx);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+
+	if (nargs > 0)
+		return lua_mysql_cursor_open_stmt(L, cursor, sql, len, idx,
+						  nargs, server_cursor);
+	return lua_mysql_cursor_open_query(L, cursor, sql, len);
+}
+
+/**
+ * Open a cursor over a result set of a query
+ */
+static int
+lua_mysql_cursor(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	size_t len;
+	const char *sql = luaL_checklstring(L, 2, &len);
+	int nargs = lua_gettop(L) - 2;
+	int ret_count;
+
+	mysql_conn_close_orphans(conn);
+	if ((ret_count = lua_mysql_cursor_open(L, 1, sql, len, 3, nargs,
+					       true)) != 0)
+		return ret_count;
+	lua_pushnumber(L, 0);
+	lua_insert(L, -2);
+	return 2;
+}
+
+/**
+ * Fetch up to n rows. Return status, rows and whether all the rows
+ * are read. The cursor is released when it is read out.
+ */
+static int
+lua_mysql_cursor_fetch(struct lua_State *L)
+{
+	struct mysql_cursor *cursor = lua_check_mysqlcursor(L, 1);
+	int limit = lua_tointeger(L, 2);
+	struct mysql_rowset *rowset = &cursor->rowset;
+	MYSQL *raw_conn = cursor->conn->raw_conn;
+	int ret_count;
+
+	if (rowset->eof) {
+		lua_pushnumber(L, 0);
+		lua_newtable(L);
+		lua_pushboolean(L, 1);
+		return 3;
+	}
+	if (cursor->prepared.stmt != NULL) {
+		/* Ask the server for the whole chunk at once. */
+		unsigned long prefetch_rows = limit;
+		mysql_stmt_attr_set(cursor->prepared.stmt,
+				    STMT_ATTR_PREFETCH_ROWS, &prefetch_rows);
+	}
+	lua_pushnumber(L, 0);
+	lua_pushcfunction(L, lua_mysql_fetch_rows);
+	lua_pushlightuserdata(L, cursor->conn);
+	lua_pushlightuserdata(L, rowset);
+	lua_pushinteger(L, limit);
+	lua_pushboolean(L, cursor->conn->use_numeric_result);
+	int fail = lua_pcall(L, 4, 1, 0);
+	if (rowset->error) {
+		ret_count = lua_mysql_rowset_push_error(L, rowset);
+		mysql_cursor_release(cursor, true);
+		return ret_count;
+	}
+	if (fiber_is_cancelled()) {
+		lua_pushnumber(L, -2);
+		safe_pushstring(L, "Fiber was cancelled");
+		return 2;
+	}
+	if (fail)
+		return lua_push_error(L);
+	if (!rowset->eof) {
+		lua_pushboolean(L, 0);
+		return 3;
+	}
+	if (mysql_cursor_release(cursor, true) != 0)
+		return lua_mysql_push_error(L, raw_conn);
+	lua_pushboolean(L, 1);
+	return 3;
+}
+
+/**
+ * Push metadata of the result set of a cursor
+ */
+static int
+lua_mysql_cursor_metadata(struct lua_State *L)
+{
+	struct mysql_cursor *cursor = lua_check_mysqlcursor(L, 1);
+	lua_mysql_push_metadata(L, cursor->rowset.fields,
+				cursor->rowset.num_fields);
+	return 1;
+}
+
+/**
+ * Close a cursor reading out the rest of its rows
+ */
+static int
+lua_mysql_cursor_close(struct lua_State *L)
+{
+	struct mysql_cursor *cursor = (struct mysql_cursor *)
+		luaL_checkudata(L, 1, mysql_cursor_label);
+	MYSQL *raw_conn = cursor->conn->raw_conn;
+	if (raw_conn == NULL) {
+		mysql_cursor_release(cursor, false);
+	} else if (mysql_cursor_release(cursor, true) != 0) {
+		return lua_mysql_push_error(L, raw_conn);
+	}
+	lua_pushnumber(L, 0);
+	return 1;
+}
+
+/**
+ * Collect a cursor
+ */
+static int
+lua_mysql_cursor_gc(struct lua_State *L)
+{
+	struct mysql_cursor *cursor = (struct mysql_cursor *)
+		luaL_checkudata(L, 1, mysql_cursor_label);
+	struct mysql_connection *conn = cursor->conn;
+	/*
+	 * Reading the rest of rows could interleave with a request
+	 * of another fiber, so defer it until the next request.
+	 */
+	if (cursor->res != NULL && conn->raw_conn != NULL) {
+		conn->orphan_result = cursor->res;
+		conn->cursor = NULL;
+		cursor->res = NULL;
+	}
+	MYSQL_STMT *stmt = cursor->prepared.stmt;
+	if (stmt != NULL && mysql_conn_add_orphan(conn, stmt) == 0)
+		cursor->prepared.stmt = NULL;
+	mysql_cursor_release(cursor, false);
+	return 0;
+}
+
+static int
+lua_mysql_cursor_tostring(struct lua_State *L)
+{
+	struct mysql_cursor *cursor = (struct mysql_cursor *)
+		luaL_checkudata(L, 1, mysql_cursor_label);
+	lua_pushfstring(L, "MYSQL_CURSOR: %p", cursor);
+	return 1;
+}
+
+/* Rows loaded into a space in one transaction by default. */
+#define LOAD_BATCH_SIZE_DEFAULT 1000
+
+/*
+ * Items of a batch encoded back to back: tuples of load_into() or
+ * statements of execute_batch(). Tuples are encoded outside of a
+ * transaction, since reading of rows yields, and then replaced in
+ * one transaction.
+ */
+struct mysql_batch {
+	char *data;
+	size_t size;
+	size_t capacity;
+	/* End offsets of items. */
+	size_t *ends;
+	size_t count;
+	size_t ends_capacity;
+};
+
+/* A field of tuples made by load_into(). */
+struct mysql_load_field {
+	unsigned col_no;
+	/*
+	 * Encodes a value or returns NULL if the value does not fit
+	 * the type given by opts.types.
+	 */
+	mysql_encode_f encode;
+	/* The type given by opts.types or NULL. */
+	const char *type;
+};
+
+static int
+lua_mysql_batch_gc(struct lua_State *L)
+{
+	struct mysql_batch *batch = (struct mysql_batch *)
+		luaL_checkudata(L, 1, mysql_batch_label);
+	free(batch->data);
+	free(batch->ends);
+	memset(batch, 0, sizeof(*batch));
+	return 0;
+}
+
+/*
+ * Encode a value of a field of the 'integer' type. Return NULL if
+ * the value is not an integer in the range of int64_t or uint64_t.
+ */
+static char *
+mysql_load_encode_integer(char *dst, const char *data, unsigned long len)
+{
+	static const char uint64_max[] = "18446744073709551615";
+	static const char int64_min[] = "9223372036854775808";
+	bool negative = len > 0 && *data == '-';
+	const char *digits = data + negative;
+	unsigned long digit_count = len - negative;
+	const char *limit = negative ? int64_min : uint64_max;
+	unsigned long limit_len = negative ? sizeof(int64_min) - 1 :
+					     sizeof(uint64_max) - 1;
+	if (digit_count == 0 || digit_count > limit_len)
+		return NULL;
+	unsigned long pos;
+	for (pos = 0; pos < digit_count; ++pos) {
+		if (digits[pos] < '0' || digits[pos] > '9')
+			return NULL;
+	}
+	/* Digit strings of the same length compare as numbers. */
+	if (digit_count == limit_len && memcmp(digits, limit, limit_len) > 0)
+		return NULL;
+	return mysql_mp_encode_integer(dst, data, len);
+}
+
+/*
+ * Encode a value of a field of the 'number' type. Return NULL if
+ * the value is not a number.
+ */
+static char *
+mysql_load_encode_number(char *dst, const char *data, unsigned long len)
+{
+	char *end;
+	if (len == 0)
+		return NULL;
+	strtod(data, &end);
+	if (end != data + len)
+		return NULL;
+	return mysql_mp_encode_double(dst, data, len);
+}
+
+/*
+ * Resolve fields of tuples: the field i is the column named or
+ * numbered fields[i] of opts.fields, all the columns by default.
+ * opts.types[i] overrides a type of the field: 'string',
+ * 'integer' or 'number'. Push a new array of fields or an error
+ * message and return -1.
+ */
+static int
+lua_mysql_load_fields(struct lua_State *L, int opts_idx,
+		      struct mysql_rowset *rowset, unsigned *field_count)
+{
+	MYSQL_FIELD *fields = rowset->fields;
+	unsigned num_fields = rowset->num_fields;
+	unsigned count = num_fields;
+	lua_getfield(L, opts_idx, "fields");
+	if (lua_istable(L, -1))
+		count = lua_objlen(L, -1);
+	lua_getfield(L, opts_idx, "types");
+	struct mysql_load_field *load_fields = (struct mysql_load_field *)
+		lua_newuserdata(L, count * sizeof(*load_fields) + 1);
+	unsigned field_no;
+	for (field_no = 0; field_no < count; ++field_no) {
+		struct mysql_load_field *field = &load_fields[field_no];
+		field->col_no = field_no;
+		if (lua_istable(L, -3)) {
+			lua_rawgeti(L, -3, field_no + 1);
+			if (lua_type(L, -1) == LUA_TNUMBER) {
+				field->col_no = lua_tointeger(L, -1) - 1;
+			} else if (lua_type(L, -1) == LUA_TSTRING) {
+				const char *name = lua_tostring(L, -1);
+				for (field->col_no = 0;
+				     field->col_no < num_fields &&
+				     strcmp(fields[field->col_no].name,
+					    name) != 0;
+				     ++field->col_no);
+			} else {
+				field->col_no = num_fields;
+			}
+			lua_pop(L, 1);
+		}
+		if (field->col_no >= num_fields) {
+			lua_pushfstring(L, "Unknown column for field %d",
+					field_no + 1);
+			return -1;
+		}
+		field->encode = mysql_column_encoder(
+			fields + field->col_no);
+		field->type = NULL;
+		if (!lua_istable(L, -2))
+			continue;
+		lua_rawgeti(L, -2, field_no + 1);
+		const char *type = lua_tostring(L, -1);
+		if (type == NULL) {
+			/* Coerced by the column type. */
+		} else if (strcmp(type, "string") == 0) {
+			field->encode = mysql_mp_encode_string;
+			field->type = "string";
+		} else if (strcmp(type, "integer") == 0) {
+			field->encode = mysql_load_encode_integer;
+			field->type = "integer";
+		} else if (strcmp(type, "number") == 0) {
+			field->encode = mysql_load_encode_number;
+			field->type = "number";
+		} else {
+			lua_pushfstring(L, "Unknown type '%s' of field %d",
+					type, field_no + 1);
+			return -1;
+		}
+		lua_pop(L, 1);
+	}
+	*field_count = count;
+	return 0;
+}
+
+/*
+ * Encode a row as a tuple and append it to a batch. Return -1 on
+ * memory error or the number of a field whose value does not fit
+ * its type.
+ */
+static int
+mysql_load_batch_add(struct mysql_batch *batch,
+		     struct mysql_load_field *fields, unsigned field_count,
+		     char **cells, unsigned long *lengths)
+{
+	size_t tuple_size = MP_VALUE_SIZE_MAX;
+	unsigned field_no;
+	for (field_no = 0; field_no < field_count; ++field_no) {
+		unsigned col_no = fields[field_no].col_no;
+		tuple_size += MP_VALUE_SIZE_MAX;
+		if (cells[col_no] != NULL)
+			tuple_size += lengths[col_no];
+	}
+	if (mysql_buffer_reserve((void **)&batch->data, &batch->capacity,
+				 batch->size + tuple_size, 1) != 0 ||
+	    mysql_buffer_reserve((void **)&batch->ends,
+				 &batch->ends_capacity, batch->count + 1,
+				 sizeof(*batch->ends)) != 0)
+		return -1;
+	char *data = batch->data + batch->size;
+	data = mysql_mp_encode_array(data, field_count);
+	for (field_no = 0; field_no < field_count; ++field_no) {
+		unsigned col_no = fields[field_no].col_no;
+		if (cells[col_no] == NULL)
+			*data++ = 0xc0;
+		else
+			data = fields[field_no].encode(data, cells[col_no],
+						       lengths[col_no]);
+		if (data == NULL)
+			return field_no + 1;
+	}
+	batch->size = data - batch->data;
+	batch->ends[batch->count++] = batch->size;
+	return 0;
+}
+
+/* Replace tuples of a batch in one transaction. */
+static int
+mysql_load_batch_commit(struct mysql_batch *batch, uint32_t space_id)
+{
+	if (box_txn_begin() != 0)
+		return -1;
+	size_t tuple_no;
+	const char *begin = batch->data;
+	for (tuple_no = 0; tuple_no < batch->count; ++tuple_no) {
+		const char *end = batch->data + batch->ends[tuple_no];
+		if (box_replace(space_id, begin, end, NULL) != 0) {
+			box_txn_rollback();
+			return -1;
+		}
+		begin = end;
+	}
+	return box_txn_commit();
+}
+
+/**
+ * Load rows of a query into a space. Arguments: a connection, a
+ * space id, a query, a table of options (fields, types and
+ * batch_size) and parameters of the query. Return status and the
+ * count of loaded rows.
+ */
+static int
+lua_mysql_load_into(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	uint32_t space_id = luaL_checkinteger(L, 2);
+	size_t len;
+	const char *sql = luaL_checklstring(L, 3, &len);
+	luaL_checktype(L, 4, LUA_TTABLE);
+	int nargs = lua_gettop(L) - 4;
+	int batch_size = lua_mysql_opt_int(L, 4, "batch_size",
+					   LOAD_BATCH_SIZE_DEFAULT);
+	struct mysql_load_field *fields;
+	unsigned field_count;
+	uint64_t loaded = 0;
+	char **cells;
+	unsigned long *lengths;
+	int ret_count;
+
+	if (batch_size <= 0)
+		luaL_error(L, "batch_size must be positive");
+	if (box_txn()) {
+		lua_pushnumber(L, 1);
+		int fail = safe_pushstring(L, "load_into can not be called "
+					   "in a transaction");
+		return fail ? lua_push_error(L) : 2;
+	}
+	mysql_conn_close_orphans(conn);
+	if ((ret_count = lua_mysql_cursor_open(L, 1, sql, len, 5, nargs,
+					       false)) != 0)
+		return ret_count;
+	struct mysql_cursor *cursor =
+		(struct mysql_cursor *) lua_touserdata(L, -1);
+	struct mysql_rowset *rowset = &cursor->rowset;
+
+	if (lua_mysql_load_fields(L, 4, rowset, &field_count) != 0) {
+		mysql_cursor_release(cursor, true);
+		lua_pushnumber(L, 1);
+		lua_insert(L, -2);
+		return 2;
+	}
+	fields = (struct mysql_load_field *) lua_touserdata(L, -1);
+	struct mysql_batch *batch = (struct mysql_batch *)
+		lua_newuserdata(L, sizeof(*batch));
+	memset(batch, 0, sizeof(*batch));
+	luaL_getmetatable(L, mysql_batch_label);
+	lua_setmetatable(L, -2);
+
+	while (!rowset->eof) {
+		batch->size = 0;
+		batch->count = 0;
+		while ((int)batch->count < batch_size &&
+		       mysql_rowset_fetch(rowset, &cells, &lengths) == 0) {
+			int rc = mysql_load_batch_add(batch, fields,
+						      field_count, cells,
+						      lengths);
+			if (rc > 0) {
+				mysql_cursor_release(cursor, true);
+				lua_pushnumber(L, 1);
+				lua_pushfstring(L, "A value of field %d does "
+						"not fit type '%s'", rc,
+						fields[rc - 1].type);
+				return 2;
+			}
+			if (rc != 0) {
+				mysql_cursor_release(cursor, true);
+				lua_pushnumber(L, 1);
+				int fail = safe_pushstring(L, "Can not "
+					"allocate memory for loaded rows");
+				return fail ? lua_push_error(L) : 2;
+			}
+		}
+		if (rowset->error) {
+			ret_count = lua_mysql_rowset_push_error(L, rowset);
+			mysql_cursor_release(cursor, true);
+			return ret_count;
+		}
+		if (fiber_is_cancelled())
+			goto cancelled;
+		if (batch->count == 0)
+			break;
+		if (mysql_load_batch_commit(batch, space_id) != 0) {
+			mysql_cursor_release(cursor, true);
+			lua_pushnumber(L, 1);
+			safe_pushstring(L, (char *)
+				box_error_message(box_error_last()));
+			return 2;
+		}
+		loaded += batch->count;
+		/* Let other fibers run between transactions. */
+		fiber_sleep(0);
+		if (fiber_is_cancelled())
+			goto cancelled;
+	}
+	if (mysql_cursor_release(cursor, true) != 0)
+		return lua_mysql_push_error(L, conn->raw_conn);
+	lua_pushnumber(L, 0);
+	luaL_pushuint64(L, loaded);
+	return 2;
+cancelled:
+	mysql_cursor_release(cursor, false);
+	lua_pushnumber(L, -2);
+	safe_pushstring(L, "Fiber was cancelled");
+	return 2;
+}
+
+/* Append a string to a batch. Return -1 on no memory. */
+static int
+mysql_batch_append(struct mysql_batch *batch, const char *data, size_t len)
+{
+	if (mysql_buffer_reserve((void **)&batch->data, &batch->capacity,
+				 batch->size + len, 1) != 0)
+		return -1;
+	memcpy(batch->data + batch->size, data, len);
+	batch->size += len;
+	return 0;
+}
+
+/*
+ * Append a lua value to a batch as an SQL literal. Return -1 on
+ * no memory or if the value has no literal, setting an error
+ * message.
+ */
+static int
+mysql_batch_append_value(struct lua_State *L, MYSQL *raw_conn,
+			 struct mysql_batch *batch, int idx,
+			 const char **error)
+{
+	char literal[32];
+	size_t len;
+	const char *str;
+	*error = "Can not allocate memory for a batch";
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL:
+		return mysql_batch_append(batch, "NULL", 4);
+	case LUA_TBOOLEAN:
+		return mysql_batch_append(batch,
+					  lua_toboolean(L, idx) ? "1" : "0", 1);
+	case LUA_TNUMBER: {
+		double value = lua_tonumber(L, idx);
+		if (value != value || value - value != 0) {
+			*error = "Can not represent a number in SQL";
+			return -1;
+		}
+		len = mysql_format_number(literal, sizeof(literal), value);
+		return mysql_batch_append(batch, literal, len);
+	}
+	case LUA_TSTRING:
+		str = lua_tolstring(L, idx, &len);
+		if (mysql_buffer_reserve((void **)&batch->data,
+					 &batch->capacity,
+					 batch->size + len * 2 + 3, 1) != 0)
+			return -1;
+		batch->data[batch->size++] = '\'';
+		batch->size += mysql_real_escape_string(raw_conn,
+			batch->data + batch->size, str, len);
+		batch->data[batch->size++] = '\'';
+		return 0;
+	default: {
+		void *cdata;
+		switch (mysql_classify_cdata(L, idx, &cdata)) {
+		case MYSQL_CDATA_INT64:
+			len = snprintf(literal, sizeof(literal), "%lld",
+				       (long long)*(int64_t *)cdata);
+			break;
+		case MYSQL_CDATA_UINT64:
+			len = snprintf(literal, sizeof(literal), "%llu",
+				       (unsigned long long)*(uint64_t *)cdata);
+			break;
+		case MYSQL_CDATA_NULL:
+			return mysql_batch_append(batch, "NULL", 4);
+		default:
+			*error = "Unsupported type of a parameter";
+			return -1;
+		}
+		return mysql_batch_append(batch, literal, len);
+	}
+	}
+}
+
+/*
+ * Skip spaces and comments at the start of a statement. Return the
+ * position of the first token.
+ */
+static size_t
+mysql_sql_skip_space(const char *sql, size_t len)
+{
+	size_t pos = 0;
+	while (pos < len) {
+		if (isspace((unsigned char)sql[pos])) {
+			++pos;
+		} else if (sql[pos] == '#' ||
+			   (sql[pos] == '-' && pos + 2 < len &&
+			    sql[pos + 1] == '-' &&
+			    isspace((unsigned char)sql[pos + 2]))) {
+			while (pos < len && sql[pos] != '\n')
+				++pos;
+		} else if (sql[pos] == '/' && pos + 1 < len &&
+			   sql[pos + 1] == '*') {
+			for (pos += 2; pos + 1 < len; ++pos) {
+				if (sql[pos] == '*' && sql[pos + 1] == '/')
+					break;
+			}
+			pos += 2;
+		} else {
+			break;
+		}
+	}
+	return pos < len ? pos : len;
+}
+
+/* Whether a statement starts with a keyword. */
+static bool
+mysql_sql_starts_with(const char *sql, size_t len, const char *keyword)
+{
+	size_t pos = mysql_sql_skip_space(sql, len);
+	size_t keyword_len = strlen(keyword);
+	if (len - pos < keyword_len ||
+	    strncasecmp(sql + pos, keyword, keyword_len) != 0)
+		return false;
+	pos += keyword_len;
+	return pos == len || !(isalnum((unsigned char)sql[pos]) ||
+			       sql[pos] == '_' || sql[pos] == '$');
+}
+
+/*
+ * Append a statement to a batch replacing ? placeholders outside
+ * of quotes and comments with parameters from the array at index
+ * idx, starting with its second item. Backslashes escape quotes
+ * unless the session has NO_BACKSLASH_ESCAPES. Return -1 and set
+ * an error message on failure.
+ *
+ * Results are matched to statements by their order, so a statement
+ * must give exactly one result: several statements in one item and
+ * CALL are rejected.
+ */
+static int
+mysql_batch_append_stmt(struct lua_State *L, MYSQL *raw_conn,
+			struct mysql_batch *batch, int idx,
+			bool backslash_escapes, const char **error)
+{
+	size_t len;
+	lua_rawgeti(L, idx, 1);
+	const char *sql = lua_tolstring(L, -1, &len);
+	lua_pop(L, 1);
+	if (sql == NULL) {
+		*error = "A statement of a batch must be a string";
+		return -1;
+	}
+	/* A separator after the statement would make an empty one. */
+	while (len > 0 && (sql[len - 1] == ';' ||
+			   isspace((unsigned char)sql[len - 1])))
+		--len;
+	if (mysql_sql_starts_with(sql, len, "CALL")) {
+		*error = "CALL can't be a statement of a batch, it may "
+			 "return several results";
+		return -1;
+	}
+	int nargs = lua_objlen(L, idx) - 1;
+	int param_no = 0;
+	size_t begin = 0, pos;
+	char quote = 0;
+	for (pos = 0; pos < len; ++pos) {
+		char c = sql[pos];
+		if (quote != 0) {
+			if (c == '\\' && quote != '`' && backslash_escapes)
+				++pos;
+			else if (c == quote)
+				quote = 0;
+		} else if (c == '\'' || c == '"' || c == '`') {
+			quote = c;
+		} else if (c == ';') {
+			*error = "A statement of a batch must be a single "
+				 "statement";
+			return -1;
+		} else if (c == '#' || (c == '-' && pos + 2 < len &&
+					sql[pos + 1] == '-' &&
+					isspace((unsigned char)sql[pos + 2]))) {
+			while (pos < len && sql[pos] != '\n')
+				++pos;
+		} else if (c == '/' && pos + 1 < len && sql[pos + 1] == '*') {
+			for (pos += 2; pos + 1 < len; ++pos) {
+				if (sql[pos] == '*' && sql[pos + 1] == '/')
+					break;
+			}
+			++pos;
+		} else if (c == '?') {
+			if (param_no == nargs) {
+				*error = "Too few parameters of a statement";
+				return -1;
+			}
+			if (mysql_batch_append(batch, sql + begin,
+					       pos - begin) != 0) {
+				*error = "Can not allocate memory for a batch";
+				return -1;
+			}
+			lua_rawgeti(L, idx, ++param_no + 1);
+			int rc = mysql_batch_append_value(L, raw_conn, batch,
+							  lua_gettop(L), error);
+			lua_pop(L, 1);
+			if (rc != 0)
+				return -1;
+			begin = pos + 1;
+		}
+	}
+	if (param_no < nargs) {
+		*error = "Too many parameters of a statement";
+		return -1;
+	}
+	if (mysql_batch_append(batch, sql + begin, len - begin) != 0 ||
+	    mysql_buffer_reserve((void **)&batch->ends,
+				 &batch->ends_capacity, batch->count + 1,
+				 sizeof(*batch->ends)) != 0) {
+		*error = "Can not allocate memory for a batch";
+		return -1;
+	}
+	batch->ends[batch->count++] = batch->size;
+	return 0;
+}
+
+/**
+ * Execute a batch of statements with parameters in one round
+ * trip. Arguments: a connection, an array of {sql, params...}
+ * arrays and whether to stop on the first failed statement.
+ * Parameters are interpolated on the client side. Return status,
+ * a table of results and a table of error messages, both keyed by
+ * numbers of statements. A result is a result set or the count of
+ * affected rows. More or fewer results than statements fail the
+ * batch, since the results can't be matched to the statements
+ * then.
+ */
+static int
+lua_mysql_execute_batch(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	MYSQL *raw_conn = conn->raw_conn;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	bool stop_on_error = lua_toboolean(L, 3);
+	int count = lua_objlen(L, 2);
+	int stmt_no, ret_count;
+	const char *error;
+	unsigned int server_status = 0;
+	mariadb_get_infov(raw_conn, MARIADB_CONNECTION_SERVER_STATUS,
+			  &server_status);
+	bool backslash_escapes =
+		(server_status & SERVER_STATUS_NO_BACKSLASH_ESCAPES) == 0;
+	const char *mismatch = NULL;
+
+	struct mysql_batch *batch = (struct mysql_batch *)
+		lua_newuserdata(L, sizeof(*batch));
+	memset(batch, 0, sizeof(*batch));
+	luaL_getmetatable(L, mysql_batch_label);
+	lua_setmetatable(L, -2);
+	for (stmt_no = 1; stmt_no <= count; ++stmt_no) {
+		lua_rawgeti(L, 2, stmt_no);
+		int rc = lua_istable(L, -1) ?
+			mysql_batch_append_stmt(L, raw_conn, batch,
+						lua_gettop(L),
+						backslash_escapes,
+						&error) : -1;
+		if (!lua_istable(L, -1))
+			error = "A statement of a batch must be a table";
+		lua_pop(L, 1);
+		if (rc != 0) {
+			lua_pushnumber(L, 1);
+			lua_pushfstring(L, "Statement %d: %s", stmt_no, error);
+			return 2;
+		}
+		/*
+		 * Statements are separated by ';' on a line of its own,
+		 * so that a trailing comment does not swallow it.
+		 */
+		if (stmt_no < count && mysql_batch_append(batch, "\n;", 2)) {
+			lua_pushnumber(L, 1);
+			int fail = safe_pushstring(L, "Can not allocate memory "
+						   "for a batch");
+			return fail ? lua_push_error(L) : 2;
+		}
+	}
+
+	mysql_conn_close_orphans(conn);
+	lua_newtable(L);
+	int results_idx = lua_gettop(L);
+	lua_newtable(L);
+	int errors_idx = lua_gettop(L);
+	int next = 0;
+	while (next < count) {
+		size_t begin = next == 0 ? 0 : batch->ends[next - 1] + 2;
+		int rc = mysql_metrics_query(raw_conn, batch->data + begin,
+					     batch->ends[count - 1] - begin);
+		stmt_no = next;
+		while (rc == 0) {
+			mysql_conn_track_session(conn);
+			MYSQL_RES *res = mysql_use_result(raw_conn);
+			if (res != NULL) {
+				struct mysql_rowset rowset;
+				mysql_rowset_create_from_result(&rowset,
+								conn, res);
+				lua_pushcfunction(L, lua_mysql_fetch_result);
+				lua_pushlightuserdata(L, conn);
+				lua_pushlightuserdata(L, &rowset);
+				int fail = lua_pcall(L, 2, 1, 0);
+				if (mysql_errno(raw_conn)) {
+					ret_count = lua_mysql_push_error(L,
+								raw_conn);
+					mysql_free_result(res);
+					return ret_count;
+				}
+				if (rowset.cancelled)
+					res->handle = NULL;
+				mysql_free_result(res);
+				if (fiber_is_cancelled()) {
+					lua_pushnumber(L, -2);
+					safe_pushstring(L, "Fiber was cancelled");
+					return 2;
+				}
+				if (fail)
+					return lua_push_error(L);
+			} else if (mysql_field_count(raw_conn) == 0) {
+				lua_pushnumber(L,
+					mysql_affected_rows(raw_conn));
+			} else {
+				rc = 1;
+				break;
+			}
+			/* Drain the rest to keep the connection usable. */
+			if (stmt_no < count) {
+				lua_rawseti(L, results_idx, ++stmt_no);
+			} else {
+				mismatch = "A statement of a batch returned "
+					   "several results";
+				lua_pop(L, 1);
+			}
+			rc = mysql_next_result(raw_conn);
+			if (rc < 0) {
+				if (stmt_no < count && mismatch == NULL)
+					mismatch = "A batch returned fewer "
+						   "results than statements";
+				next = count;
+				break;
+			}
+		}
+		if (rc <= 0)
+			break;
+		/* A lost connection fails the whole batch. */
+		lua_mysql_push_error(L, raw_conn);
+		if (lua_tointeger(L, -2) < 0)
+			return 2;
+		lua_rawseti(L, errors_idx, stmt_no + 1);
+		lua_pop(L, 1);
+		next = stmt_no + 1;
+		if (stop_on_error)
+			break;
+	}
+	if (mismatch != NULL) {
+		lua_pushnumber(L, 1);
+		int fail = safe_pushstring(L, (char *)mismatch);
+		return fail ? lua_push_error(L) : 2;
+	}
+	lua_pushnumber(L, 0);
+	lua_insert(L, results_idx);
+	return 3;
+}
+
+/* Bytes of rows of LOAD DATA encoded at once. */
+#define LOAD_DATA_CHUNK_SIZE 65536
+
+/*
+ * Rows of LOAD DATA LOCAL INFILE sent by conn:load_data(). Rows
+ * are taken from a lua function on the stack of the calling fiber
+ * and encoded as tab separated values in chunks, or the data is
+ * taken from an ibuf as is.
+ */
+struct mysql_load_data {
+	struct lua_State *L;
+	int source_idx;
+	/* Values of a row, 0 means all the values of an array. */
+	int column_count;
+	box_ibuf_t *ibuf;
+	/* The chunk being sent. */
+	struct mysql_batch chunk;
+	size_t sent;
+	size_t rows;
+	bool eof;
+	char error[MYSQL_ERRMSG_SIZE];
+};
+
+/* Append a string escaped for LOAD DATA to a chunk. */
+static int
+mysql_load_data_append_string(struct mysql_batch *chunk, const char *s,
+			      size_t len)
+{
+	if (mysql_buffer_reserve((void **)&chunk->data, &chunk->capacity,
+				 chunk->size + len * 2, 1) != 0)
+		return -1;
+	char *p = chunk->data + chunk->size;
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		char c = s[i];
+		switch (c) {
+		case '\\': *p++ = '\\'; *p++ = '\\'; break;
+		case '\t': *p++ = '\\'; *p++ = 't'; break;
+		case '\n': *p++ = '\\'; *p++ = 'n'; break;
+		case '\r': *p++ = '\\'; *p++ = 'r'; break;
+		case '\0': *p++ = '\\'; *p++ = '0'; break;
+		default: *p++ = c;
+		}
+	}
+	chunk->size = p - chunk->data;
+	return 0;
+}
+
+/*
+ * Append a value at index idx of lua stack to a chunk. Raise an
+ * error on no memory or a value of an unknown type.
+ */
+static void
+lua_mysql_load_data_append_value(struct lua_State *L,
+				 struct mysql_batch *chunk, int idx)
+{
+	char buf[32];
+	int len = -1;
+	const char *s;
+	size_t size;
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL:
+		len = snprintf(buf, sizeof(buf), "\\N");
+		break;
+	case LUA_TBOOLEAN:
+		len = snprintf(buf, sizeof(buf), "%d", lua_toboolean(L, idx));
+		break;
+	case LUA_TNUMBER: {
+		double d = lua_tonumber(L, idx);
+		if (d != d || d - d != 0)
+			luaL_error(L, "Can not represent a number in SQL");
+		len = mysql_format_number(buf, sizeof(buf), d);
+		break;
+	}
+	case LUA_TSTRING:
+		s = lua_tolstring(L, idx, &size);
+		if (mysql_load_data_append_string(chunk, s, size) != 0)
+			luaL_error(L, "Can not allocate memory for a chunk");
+		return;
+	default:
+		if (!luaL_iscdata(L, idx))
+			luaL_error(L, "Unsupported value of type %s",
+				   luaL_typename(L, idx));
+		void *cdata;
+		enum mysql_cdata_kind kind =
+			mysql_classify_cdata(L, idx, &cdata);
+		if (kind == MYSQL_CDATA_INT64) {
+			len = snprintf(buf, sizeof(buf), "%lld",
+				       (long long) *(int64_t *)cdata);
+		} else if (kind == MYSQL_CDATA_UINT64) {
+			len = snprintf(buf, sizeof(buf), "%llu",
+				       (unsigned long long)
+				       *(uint64_t *)cdata);
+		} else if (kind == MYSQL_CDATA_NULL) {
+			len = snprintf(buf, sizeof(buf), "\\N");
+		} else {
+			/* Decimals, datetimes. */
+			lua_pushvalue(L, idx);
+			lua_mysql_param_to_string(L, lua_gettop(L));
+			s = lua_tolstring(L, -1, &size);
+			int rc = mysql_load_data_append_string(chunk, s,
+							       size);
+			lua_pop(L, 1);
+			if (rc != 0)
+				luaL_error(L, "Can not allocate memory for "
+					   "a chunk");
+			return;
+		}
+	}
+	if (mysql_batch_append(chunk, buf, len) != 0)
+		luaL_error(L, "Can not allocate memory for a chunk");
+}
+
+/*
+ * Encode rows of a source function to the chunk of a load until
+ * it is full or the source ends. Protected: arguments are the
+ * source function and the load.
+ */
+static int
+lua_mysql_load_data_fill(struct lua_State *L)
+{
+	struct mysql_load_data *load = (struct mysql_load_data *)
+		lua_touserdata(L, 2);
+	struct mysql_batch *chunk = &load->chunk;
+	while (chunk->size < LOAD_DATA_CHUNK_SIZE) {
+		lua_pushvalue(L, 1);
+		lua_call(L, 0, 1);
+		if (lua_isnil(L, -1)) {
+			load->eof = true;
+			return 0;
+		}
+		if (!lua_istable(L, -1))
+			luaL_error(L, "A row must be a table");
+		int row_idx = lua_gettop(L);
+		int count = load->column_count > 0 ? load->column_count :
+			    (int) lua_objlen(L, row_idx);
+		int i;
+		for (i = 1; i <= count; ++i) {
+			if (i > 1 && mysql_batch_append(chunk, "\t", 1) != 0)
+				luaL_error(L, "Can not allocate memory for "
+					   "a chunk");
+			lua_rawgeti(L, row_idx, i);
+			lua_mysql_load_data_append_value(L, chunk,
+							 lua_gettop(L));
+			lua_pop(L, 1);
+		}
+		if (mysql_batch_append(chunk, "\n", 1) != 0)
+			luaL_error(L, "Can not allocate memory for a chunk");
+		lua_pop(L, 1);
+		++load->rows;
+	}
+	return 0;
+}
+
+/*
+ * Handlers of LOAD DATA LOCAL INFILE requests of the server. They
+ * are installed for every connection, so the server gets no local
+ * files except the data of conn:load_data().
+ */
+static int
+mysql_local_infile_init(void **ptr, const char *filename, void *userdata)
+{
+	struct mysql_connection *conn = (struct mysql_connection *) userdata;
+	(void)filename;
+	*ptr = conn;
+	return conn->load_data == NULL ? 1 : 0;
+}
+
+static int
+mysql_local_infile_read(void *ptr, char *buf, unsigned int buf_len)
+{
+	struct mysql_connection *conn = (struct mysql_connection *) ptr;
+	struct mysql_load_data *load = conn->load_data;
+	struct mysql_batch *chunk = &load->chunk;
+	if (load->ibuf != NULL) {
+		char **rpos, **wpos;
+		box_ibuf_read_range(load->ibuf, &rpos, &wpos);
+		size_t len = *wpos - *rpos;
+		if (len > buf_len)
+			len = buf_len;
+		memcpy(buf, *rpos, len);
+		*rpos += len;
+		return len;
+	}
+	if (load->sent == chunk->size) {
+		if (load->eof)
+			return 0;
+		/* Let other fibers run between chunks. */
+		if (load->rows > 0)
+			fiber_sleep(0);
+		chunk->size = 0;
+		load->sent = 0;
+		struct lua_State *L = load->L;
+		lua_pushcfunction(L, lua_mysql_load_data_fill);
+		lua_pushvalue(L, load->source_idx);
+		lua_pushlightuserdata(L, load);
+		if (lua_pcall(L, 2, 0, 0) != 0) {
+			snprintf(load->error, sizeof(load->error), "%s",
+				 lua_tostring(L, -1));
+			lua_pop(L, 1);
+			return -1;
+		}
+		if (fiber_is_cancelled()) {
+			snprintf(load->error, sizeof(load->error),
+				 "Fiber was cancelled");
+			return -1;
+		}
+	}
+	size_t len = chunk->size - load->sent;
+	if (len > buf_len)
+		len = buf_len;
+	memcpy(buf, chunk->data + load->sent, len);
+	load->sent += len;
+	return len;
+}
+
+static void
+mysql_local_infile_end(void *ptr)
+{
+	(void)ptr;
+}
+
+static int
+mysql_local_infile_error(void *ptr, char *error_msg, unsigned int error_len)
+{
+	struct mysql_connection *conn = (struct mysql_connection *) ptr;
+	const char *error = conn->load_data == NULL ?
+		"Local files are sent by conn:load_data() only" :
+		conn->load_data->error;
+	snprintf(error_msg, error_len, "%s", error);
+	return CR_UNKNOWN_ERROR;
+}
+
+/**
+ * Execute a LOAD DATA LOCAL INFILE statement sending rows of a
+ * source: a function returning an array of values of the next row
+ * or nil at the end, or an ibuf with the data. Arguments: a
+ * connection, the statement, the source and the number of values
+ * of a row. Return status and the count of loaded rows.
+ */
+static int
+lua_mysql_load_data(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	MYSQL *raw_conn = conn->raw_conn;
+	size_t len;
+	const char *sql = luaL_checklstring(L, 2, &len);
+	struct mysql_load_data load;
+	memset(&load, 0, sizeof(load));
+	load.L = L;
+	load.source_idx = 3;
+	load.column_count = lua_tointeger(L, 4);
+	if (luaL_iscdata(L, 3)) {
+		load.ibuf = lua_mysql_check_ibuf(L, 3);
+		if (load.ibuf == NULL)
+			luaL_error(L, "The source must be a function or "
+				   "an ibuf");
+	} else {
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+	}
+
+	mysql_conn_close_orphans(conn);
+	conn->load_data = &load;
+	int rc = mysql_metrics_query(raw_conn, sql, len);
+	conn->load_data = NULL;
+	free(load.chunk.data);
+	if (rc != 0) {
+		if (fiber_is_cancelled()) {
+			lua_pushnumber(L, -2);
+			safe_pushstring(L, "Fiber was cancelled");
+			return 2;
+		}
+		return lua_mysql_push_error(L, raw_conn);
+	}
+	mysql_conn_track_session(conn);
+	lua_pushnumber(L, 0);
+	lua_pushnumber(L, mysql_affected_rows(raw_conn));
+	return 2;
+}
+
+/* Row events of a binlog fetched at once by default. */
+#define BINLOG_BATCH_SIZE_DEFAULT 1000
+/* Longest binlog file name. */
+#define BINLOG_FILE_MAX 512
+/* MariaDB GTID event with no BEGIN and COMMIT around it. */
+#define BINLOG_GTID_STANDALONE 1
+/* Nesting of JSON values decoded. */
+#define BINLOG_JSON_DEPTH_MAX 100
+
+/*
+ * A table announced by a table map event. Row events refer to
+ * tables by ids, which are valid up to the end of a transaction.
+ */
+struct mysql_binlog_table {
+	uint64_t id;
+	char *schema;
+	char *name;
+	unsigned column_count;
+	unsigned char *types;
+	/* Metadata bytes of columns in little endian order. */
+	uint16_t *meta;
+	/* Rows of the table are not wanted. */
+	bool skip;
+};
+
+/*
+ * A position in binlog: a file, an offset of the next event and
+ * the GTID of the last transaction. The GTID is known for
+ * MariaDB servers only.
+ */
+struct mysql_binlog_position {
+	char file[BINLOG_FILE_MAX];
+	unsigned long long offset;
+	char gtid[64];
+};
+
+/*
+ * A stream of binlog events of a connection registered as a
+ * replica. Row events are decoded to change records. The
+ * connection serves the stream only until it is closed.
+ *
+ * Like a cursor the stream userdata refers to the connection
+ * userdata.
+ */
+struct mysql_binlog {
+	struct mysql_connection *conn;
+	MARIADB_RPL *rpl;
+	MARIADB_RPL_EVENT *event;
+	struct mysql_binlog_table *tables;
+	unsigned table_count;
+	unsigned table_capacity;
+	/* A transaction is read partially. */
+	bool in_transaction;
+	/* The position of the last read event. */
+	struct mysql_binlog_position current;
+	/* The position after the last transaction read out. */
+	struct mysql_binlog_position committed;
+};
+
+static inline struct mysql_binlog *
+lua_check_mysqlbinlog(struct lua_State *L, int index)
+{
+	struct mysql_binlog *binlog = (struct mysql_binlog *)
+		luaL_checkudata(L, index, mysql_binlog_label);
+	if (binlog->rpl == NULL || binlog->conn->raw_conn == NULL)
+		luaL_error(L, "Driver fatal error (closed binlog stream)");
+	return binlog;
+}
+
+static void
+mysql_binlog_forget_tables(struct mysql_binlog *binlog)
+{
+	unsigned i;
+	for (i = 0; i < binlog->table_count; ++i) {
+		struct mysql_binlog_table *table = &binlog->tables[i];
+		free(table->schema);
+		free(table->name);
+		free(table->types);
+		free(table->meta);
+	}
+	binlog->table_count = 0;
+}
+
+static void
+mysql_binlog_release(struct mysql_binlog *binlog)
+{
+	mysql_binlog_forget_tables(binlog);
+	free(binlog->tables);
+	binlog->tables = NULL;
+	binlog->table_capacity = 0;
+	if (binlog->event != NULL) {
+		mariadb_free_rpl_event(binlog->event);
+		binlog->event = NULL;
+	}
+	if (binlog->rpl != NULL) {
+		mariadb_rpl_close(binlog->rpl);
+		binlog->rpl = NULL;
+	}
+}
+
+static struct mysql_binlog_table *
+mysql_binlog_find_table(struct mysql_binlog *binlog, uint64_t id)
+{
+	unsigned i;
+	for (i = 0; i < binlog->table_count; ++i) {
+		if (binlog->tables[i].id == id)
+			return &binlog->tables[i];
+	}
+	return NULL;
+}
+
+static char *
+mysql_binlog_strdup(const MARIADB_STRING *str)
+{
+	char *copy = (char *) malloc(str->length + 1);
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy, str->str, str->length);
+	copy[str->length] = '\0';
+	return copy;
+}
+
+/* Bytes of metadata of a column of a table map event. */
+static unsigned
+mysql_binlog_meta_size(unsigned char type)
+{
+	switch (type) {
+	case MYSQL_TYPE_FLOAT:
+	case MYSQL_TYPE_DOUBLE:
+	case MYSQL_TYPE_BLOB:
+	case MYSQL_TYPE_GEOMETRY:
+	case MYSQL_TYPE_JSON:
+	case MYSQL_TYPE_TIMESTAMP2:
+	case MYSQL_TYPE_DATETIME2:
+	case MYSQL_TYPE_TIME2:
+		return 1;
+	case MYSQL_TYPE_VARCHAR:
+	case MYSQL_TYPE_VAR_STRING:
+	case MYSQL_TYPE_STRING:
+	case MYSQL_TYPE_BIT:
+	case MYSQL_TYPE_NEWDECIMAL:
+	case MYSQL_TYPE_ENUM:
+	case MYSQL_TYPE_SET:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Remember a table of a table map event. Rows of the table are
+ * skipped unless its "schema.name" is a key of the table at index
+ * filter_idx, when there is one. Return 0 on success and -1 on
+ * memory error.
+ */
+static int
+lua_mysql_binlog_map_table(struct lua_State *L, struct mysql_binlog *binlog,
+			   const struct st_mariadb_rpl_table_map_event *map,
+			   int filter_idx)
+{
+	struct mysql_binlog_table *table =
+		mysql_binlog_find_table(binlog, map->table_id);
+	if (table != NULL)
+		return 0;
+	if (binlog->table_count == binlog->table_capacity) {
+		unsigned capacity = binlog->table_capacity * 2 + 4;
+		struct mysql_binlog_table *tables =
+			(struct mysql_binlog_table *) realloc(binlog->tables,
+				capacity * sizeof(*tables));
+		if (tables == NULL)
+			return -1;
+		binlog->tables = tables;
+		binlog->table_capacity = capacity;
+	}
+	table = &binlog->tables[binlog->table_count];
+	memset(table, 0, sizeof(*table));
+	table->id = map->table_id;
+	table->column_count = map->column_count;
+	table->schema = mysql_binlog_strdup(&map->database);
+	table->name = mysql_binlog_strdup(&map->table);
+	table->types = (unsigned char *) malloc(map->column_count + 1);
+	table->meta = (uint16_t *) calloc(map->column_count + 1,
+					  sizeof(uint16_t));
+	if (table->schema == NULL || table->name == NULL ||
+	    table->types == NULL || table->meta == NULL) {
+		free(table->schema);
+		free(table->name);
+		free(table->types);
+		free(table->meta);
+		return -1;
+	}
+	++binlog->table_count;
+	if (map->column_types.length < map->column_count) {
+		/* Nothing is known about columns. */
+		table->skip = true;
+		return 0;
+	}
+	memcpy(table->types, map->column_types.str, map->column_count);
+	const unsigned char *meta = (const unsigned char *) map->metadata.str;
+	const unsigned char *meta_end = meta + map->metadata.length;
+	unsigned i;
+	for (i = 0; i < table->column_count; ++i) {
+		unsigned size = mysql_binlog_meta_size(table->types[i]);
+		if (meta + size > meta_end) {
+			table->skip = true;
+			return 0;
+		}
+		if (size > 0)
+			table->meta[i] = meta[0];
+		if (size > 1)
+			table->meta[i] |= meta[1] << 8;
+		meta += size;
+	}
+	if (lua_istable(L, filter_idx)) {
+		lua_pushfstring(L, "%s.%s", table->schema, table->name);
+		lua_rawget(L, filter_idx);
+		table->skip = lua_isnil(L, -1);
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+static inline uint64_t
+mysql_binlog_le(const unsigned char *p, unsigned size)
+{
+	uint64_t v = 0;
+	while (size-- > 0)
+		v = (v << 8) | p[size];
+	return v;
+}
+
+static inline uint64_t
+mysql_binlog_be(const unsigned char *p, unsigned size)
+{
+	uint64_t v = 0;
+	unsigned i;
+	for (i = 0; i < size; ++i)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/* Microseconds of a fraction of a temporal value of precision fsp. */
+static unsigned long
+mysql_binlog_usec(const unsigned char *p, unsigned fsp)
+{
+	switch (fsp) {
+	case 1:
+	case 2:
+		return p[0] * 10000;
+	case 3:
+	case 4:
+		return mysql_binlog_be(p, 2) * 100;
+	case 5:
+	case 6:
+		return mysql_binlog_be(p, 3);
+	default:
+		return 0;
+	}
+}
+
+/* Append the fraction of seconds to a formatted temporal value. */
+static int
+mysql_binlog_format_usec(char *buf, int len, unsigned long usec,
+			 unsigned fsp)
+{
+	static const unsigned long scale[] = {
+		1000000, 100000, 10000, 1000, 100, 10, 1
+	};
+	if (fsp == 0 || fsp > 6)
+		return len;
+	return len + snprintf(buf + len, 32, ".%0*lu", (int) fsp,
+			      usec / scale[fsp]);
+}
+
+/*
+ * Push a packed binary DECIMAL as a string, or nil when the value
+ * is malformed or does not fit before end. Return the size of the
+ * value.
+ */
+static unsigned
+lua_mysql_binlog_push_decimal(struct lua_State *L, const unsigned char *p,
+			      const unsigned char *end, unsigned precision,
+			      unsigned scale)
+{
+	static const unsigned dig2bytes[] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
+	unsigned intg = precision > scale ? precision - scale : 0;
+	unsigned intg0 = intg / 9, intg0x = intg % 9;
+	unsigned frac0 = scale / 9, frac0x = scale % 9;
+	unsigned size = intg0 * 4 + dig2bytes[intg0x] +
+			frac0 * 4 + dig2bytes[frac0x];
+	/* Digits, a sign, a point and a leading zero. */
+	char buf[100];
+	unsigned char bytes[64];
+	if (size == 0 || size > sizeof(bytes) || precision > 90 ||
+	    size > (size_t) (end - p)) {
+		lua_pushnil(L);
+		return size;
+	}
+	memcpy(bytes, p, size);
+	bool negative = (bytes[0] & 0x80) == 0;
+	uint64_t mask = negative ? 0xffffffff : 0;
+	bytes[0] ^= 0x80;
+	const unsigned char *b = bytes;
+	int len = 0;
+	if (negative)
+		buf[len++] = '-';
+	int start = len;
+	if (intg0x > 0) {
+		uint64_t v = mysql_binlog_be(b, dig2bytes[intg0x]) ^
+			(mask >> (32 - dig2bytes[intg0x] * 8));
+		b += dig2bytes[intg0x];
+		if (v != 0)
+			len += sprintf(buf + len, "%u", (unsigned) v);
+	}
+	unsigned i;
+	for (i = 0; i < intg0; ++i, b += 4) {
+		uint32_t v = (uint32_t) (mysql_binlog_be(b, 4) ^ mask);
+		if (len > start)
+			len += sprintf(buf + len, "%09u", v);
+		else if (v != 0)
+			len += sprintf(buf + len, "%u", v);
+	}
+	if (len == start)
+		buf[len++] = '0';
+	if (scale > 0)
+		buf[len++] = '.';
+	for (i = 0; i < frac0; ++i, b += 4) {
+		uint32_t v = (uint32_t) (mysql_binlog_be(b, 4) ^ mask);
+		len += sprintf(buf + len, "%09u", v);
+	}
+	if (frac0x > 0) {
+		uint64_t v = mysql_binlog_be(b, dig2bytes[frac0x]) ^
+			(mask >> (32 - dig2bytes[frac0x] * 8));
+		len += sprintf(buf + len, "%0*u", (int) frac0x, (unsigned) v);
+	}
+	lua_pushlstring(L, buf, len);
+	return size;
+}
+
+/*
+ * Size of the length of a value of a JSON document: 7 bits per
+ * byte, the high bit is set when more bytes follow. Return 0 on
+ * malformed data.
+ */
+static unsigned
+mysql_json_varlen(const unsigned char *p, const unsigned char *end,
+		  unsigned long *len)
+{
+	unsigned i;
+	*len = 0;
+	for (i = 0; i < 5 && p + i < end; ++i) {
+		*len |= (unsigned long) (p[i] & 0x7f) << (7 * i);
+		if ((p[i] & 0x80) == 0)
+			return i + 1;
+	}
+	return 0;
+}
+
+static int
+lua_mysql_push_json(struct lua_State *L, unsigned char type,
+		    const unsigned char *p, const unsigned char *end,
+		    int depth);
+
+/*
+ * Push a value of a JSON object or array, which is inlined in its
+ * entry or stored at an offset from the start of the container.
+ */
+static int
+lua_mysql_push_json_entry(struct lua_State *L, const unsigned char *entry,
+			  const unsigned char *start,
+			  const unsigned char *end, bool large, int depth)
+{
+	unsigned char type = entry[0];
+	unsigned offset_size = large ? 4 : 2;
+	bool inlined = type == 0x04 || type == 0x05 || type == 0x06 ||
+		       (large && (type == 0x07 || type == 0x08));
+	if (inlined)
+		return lua_mysql_push_json(L, type, entry + 1,
+					   entry + 1 + offset_size, depth);
+	uint64_t offset = mysql_binlog_le(entry + 1, offset_size);
+	if (start + offset >= end)
+		return -1;
+	return lua_mysql_push_json(L, type, start + offset, end, depth);
+}
+
+/*
+ * Push a value of a JSON document in the binary format of MySQL:
+ * objects and arrays as tables, opaque values as strings. Return 0
+ * on success and -1 on malformed data.
+ */
+static int
+lua_mysql_push_json(struct lua_State *L, unsigned char type,
+		    const unsigned char *p, const unsigned char *end,
+		    int depth)
+{
+	static const unsigned scalar_size[] = {
+		[0x04] = 1, [0x05] = 2, [0x06] = 2, [0x07] = 4,
+		[0x08] = 4, [0x09] = 8, [0x0a] = 8, [0x0b] = 8,
+	};
+	if (type <= 0x0b && type >= 0x04 && p + scalar_size[type] > end)
+		return -1;
+	unsigned long len;
+	unsigned n;
+	switch (type) {
+	case 0x00: case 0x01: case 0x02: case 0x03: {
+		bool large = (type & 1) != 0;
+		bool object = type < 0x02;
+		unsigned offset_size = large ? 4 : 2;
+		if (depth > BINLOG_JSON_DEPTH_MAX ||
+		    p + 2 * offset_size > end)
+			return -1;
+		uint64_t count = mysql_binlog_le(p, offset_size);
+		const unsigned char *entry = p + 2 * offset_size;
+		const unsigned char *values = entry +
+			(object ? count * (offset_size + 2) : 0);
+		if (values + count * (offset_size + 1) > end)
+			return -1;
+		lua_createtable(L, object ? 0 : count, object ? count : 0);
+		uint64_t i;
+		for (i = 0; i < count; ++i) {
+			if (object) {
+				uint64_t key = mysql_binlog_le(entry,
+							       offset_size);
+				unsigned key_len = mysql_binlog_le(entry +
+					offset_size, 2);
+				entry += offset_size + 2;
+				if (p + key + key_len > end)
+					return -1;
+				lua_pushlstring(L, (const char *) p + key,
+						key_len);
+			}
+			if (lua_mysql_push_json_entry(L, values, p, end,
+						      large, depth + 1) != 0)
+				return -1;
+			values += offset_size + 1;
+			if (object)
+				lua_rawset(L, -3);
+			else
+				lua_rawseti(L, -2, i + 1);
+		}
+		return 0;
+	}
+	case 0x04:
+		if (p[0] == 0x00)
+			luaL_pushnull(L);
+		else
+			lua_pushboolean(L, p[0] == 0x01);
+		return 0;
+	case 0x05:
+		lua_pushnumber(L, (int16_t) mysql_binlog_le(p, 2));
+		return 0;
+	case 0x06:
+		lua_pushnumber(L, (uint16_t) mysql_binlog_le(p, 2));
+		return 0;
+	case 0x07:
+		lua_pushnumber(L, (int32_t) mysql_binlog_le(p, 4));
+		return 0;
+	case 0x08:
+		lua_pushnumber(L, (uint32_t) mysql_binlog_le(p, 4));
+		return 0;
+	case 0x09:
+		luaL_pushint64(L, (int64_t) mysql_binlog_le(p, 8));
+		return 0;
+	case 0x0a:
+		luaL_pushuint64(L, mysql_binlog_le(p, 8));
+		return 0;
+	case 0x0b: {
+		double d;
+		memcpy(&d, p, sizeof(d));
+		lua_pushnumber(L, d);
+		return 0;
+	}
+	case 0x0c:
+		n = mysql_json_varlen(p, end, &len);
+		if (n == 0 || p + n + len > end)
+			return -1;
+		lua_pushlstring(L, (const char *) p + n, len);
+		return 0;
+	case 0x0f:
+		/* Opaque values start with a column type. */
+		if (p >= end)
+			return -1;
+		n = mysql_json_varlen(p + 1, end, &len);
+		if (n == 0 || p + 1 + n + len > end)
+			return -1;
+		lua_pushlstring(L, (const char *) p + 1 + n, len);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Push a value of a column of a row image. Return the pointer
+ * past the value or NULL on malformed data or an unknown type.
+ */
+static const unsigned char *
+lua_mysql_binlog_push_value(struct lua_State *L, unsigned char type,
+			    unsigned meta, const unsigned char *p,
+			    const unsigned char *end)
+{
+	char buf[64];
+	int len;
+	uint64_t v;
+	unsigned size, fsp;
+	switch (type) {
+	case MYSQL_TYPE_TINY:
+		if (p + 1 > end)
+			return NULL;
+		lua_pushnumber(L, (int8_t) p[0]);
+		return p + 1;
+	case MYSQL_TYPE_SHORT:
+		if (p + 2 > end)
+			return NULL;
+		lua_pushnumber(L, (int16_t) mysql_binlog_le(p, 2));
+		return p + 2;
+	case MYSQL_TYPE_INT24:
+		if (p + 3 > end)
+			return NULL;
+		v = mysql_binlog_le(p, 3);
+		lua_pushnumber(L, (v & 0x800000) ? (int32_t) v - 0x1000000 :
+						    (int32_t) v);
+		return p + 3;
+	case MYSQL_TYPE_LONG:
+		if (p + 4 > end)
+			return NULL;
+		lua_pushnumber(L, (int32_t) mysql_binlog_le(p, 4));
+		return p + 4;
+	case MYSQL_TYPE_LONGLONG:
+		if (p + 8 > end)
+			return NULL;
+		luaL_pushint64(L, (int64_t) mysql_binlog_le(p, 8));
+		return p + 8;
+	case MYSQL_TYPE_FLOAT: {
+		float f;
+		if (p + 4 > end)
+			return NULL;
+		memcpy(&f, p, sizeof(f));
+		lua_pushnumber(L, f);
+		return p + 4;
+	}
+	case MYSQL_TYPE_DOUBLE: {
+		double d;
+		if (p + 8 > end)
+			return NULL;
+		memcpy(&d, p, sizeof(d));
+		lua_pushnumber(L, d);
+		return p + 8;
+	}
+	case MYSQL_TYPE_YEAR:
+		if (p + 1 > end)
+			return NULL;
+		lua_pushnumber(L, p[0] == 0 ? 0 : 1900 + p[0]);
+		return p + 1;
+	case MYSQL_TYPE_DATE:
+	case MYSQL_TYPE_NEWDATE:
+		if (p + 3 > end)
+			return NULL;
+		v = mysql_binlog_le(p, 3);
+		len = snprintf(buf, sizeof(buf), "%04u-%02u-%02u",
+			       (unsigned) (v >> 9), (unsigned) (v >> 5) & 15,
+			       (unsigned) v & 31);
+		lua_pushlstring(L, buf, len);
+		return p + 3;
+	case MYSQL_TYPE_TIME:
+		if (p + 3 > end)
+			return NULL;
+		v = mysql_binlog_le(p, 3);
+		len = snprintf(buf, sizeof(buf), "%02u:%02u:%02u",
+			       (unsigned) (v / 10000),
+			       (unsigned) (v / 100 % 100),
+			       (unsigned) (v % 100));
+		lua_pushlstring(L, buf, len);
+		return p + 3;
+	case MYSQL_TYPE_DATETIME:
+		if (p + 8 > end)
+			return NULL;
+		v = mysql_binlog_le(p, 8);
+		len = snprintf(buf, sizeof(buf),
+			       "%04u-%02u-%02u %02u:%02u:%02u",
+			       (unsigned) (v / 10000000000ULL),
+			       (unsigned) (v / 100000000 % 100),
+			       (unsigned) (v / 1000000 % 100),
+			       (unsigned) (v / 10000 % 100),
+			       (unsigned) (v / 100 % 100),
+			       (unsigned) (v % 100));
+		lua_pushlstring(L, buf, len);
+		return p + 8;
+	case MYSQL_TYPE_TIMESTAMP:
+	case MYSQL_TYPE_TIMESTAMP2: {
+		fsp = type == MYSQL_TYPE_TIMESTAMP2 ? meta : 0;
+		size = 4 + (fsp + 1) / 2;
+		if (p + size > end)
+			return NULL;
+		time_t t = type == MYSQL_TYPE_TIMESTAMP2 ?
+			(time_t) mysql_binlog_be(p, 4) :
+			(time_t) mysql_binlog_le(p, 4);
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		len = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+		len = mysql_binlog_format_usec(buf, len,
+			mysql_binlog_usec(p + 4, fsp), fsp);
+		lua_pushlstring(L, buf, len);
+		return p + size;
+	}
+	case MYSQL_TYPE_DATETIME2: {
+		fsp = meta;
+		size = 5 + (fsp + 1) / 2;
+		if (p + size > end)
+			return NULL;
+		v = mysql_binlog_be(p, 5) - 0x8000000000ULL;
+		uint64_t ymd = v >> 17, ym = ymd >> 5, hms = v & 0x1ffff;
+		len = snprintf(buf, sizeof(buf),
+			       "%04u-%02u-%02u %02u:%02u:%02u",
+			       (unsigned) (ym / 13), (unsigned) (ym % 13),
+			       (unsigned) (ymd & 31), (unsigned) (hms >> 12),
+			       (unsigned) (hms >> 6) & 63,
+			       (unsigned) hms & 63);
+		len = mysql_binlog_format_usec(buf, len,
+			mysql_binlog_usec(p + 5, fsp), fsp);
+		lua_pushlstring(L, buf, len);
+		return p + size;
+	}
+	case MYSQL_TYPE_TIME2: {
+		fsp = meta;
+		size = 3 + (fsp + 1) / 2;
+		if (p + size > end)
+			return NULL;
+		/* Negative times are stored as complements. */
+		int64_t packed = (int64_t) mysql_binlog_be(p, size) -
+			((int64_t) 0x800000 << (8 * (size - 3)));
+		bool negative = packed < 0;
+		if (negative)
+			packed = -packed;
+		uint64_t frac = packed & ((1ULL << (8 * (size - 3))) - 1);
+		uint64_t hms = (uint64_t) packed >> (8 * (size - 3));
+		unsigned long usec = fsp <= 2 ? frac * 10000 :
+				     fsp <= 4 ? frac * 100 : frac;
+		len = snprintf(buf, sizeof(buf), "%s%02u:%02u:%02u",
+			       negative ? "-" : "",
+			       (unsigned) (hms >> 12) & 1023,
+			       (unsigned) (hms >> 6) & 63,
+			       (unsigned) hms & 63);
+		len = mysql_binlog_format_usec(buf, len, usec, fsp);
+		lua_pushlstring(L, buf, len);
+		return p + size;
+	}
+	case MYSQL_TYPE_NEWDECIMAL:
+		size = lua_mysql_binlog_push_decimal(L, p, end, meta & 0xff,
+						     meta >> 8);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			return NULL;
+		}
+		return p + size;
+	case MYSQL_TYPE_BIT:
+		size = (meta >> 8) + ((meta & 0xff) + 7) / 8;
+		if (p + size > end || size > 8)
+			return NULL;
+		luaL_pushuint64(L, mysql_binlog_be(p, size));
+		return p + size;
+	case MYSQL_TYPE_ENUM:
+	case MYSQL_TYPE_SET:
+		size = meta >> 8;
+		if (p + size > end || size > 8)
+			return NULL;
+		lua_pushnumber(L, mysql_binlog_le(p, size));
+		return p + size;
+	case MYSQL_TYPE_STRING: {
+		/* The real type and the length share the metadata. */
+		unsigned real_type = meta & 0xff;
+		unsigned max_len = meta >> 8;
+		if ((real_type & 0x30) != 0x30) {
+			max_len |= ((real_type & 0x30) ^ 0x30) << 4;
+			real_type |= 0x30;
+		}
+		if (real_type == MYSQL_TYPE_ENUM ||
+		    real_type == MYSQL_TYPE_SET)
+			return lua_mysql_binlog_push_value(L, real_type,
+				max_len << 8, p, end);
+		size = max_len > 255 ? 2 : 1;
+		goto string;
+	}
+	case MYSQL_TYPE_VARCHAR:
+	case MYSQL_TYPE_VAR_STRING:
+		size = meta > 255 ? 2 : 1;
+		goto string;
+	case MYSQL_TYPE_BLOB:
+	case MYSQL_TYPE_GEOMETRY:
+	case MYSQL_TYPE_JSON:
+		size = meta;
+		if (size < 1 || size > 4)
+			return NULL;
+string:
+		if (p + size > end)
+			return NULL;
+		v = mysql_binlog_le(p, size);
+		p += size;
+		if (v > (uint64_t) (end - p))
+			return NULL;
+		if (type == MYSQL_TYPE_JSON && v > 0) {
+			if (lua_mysql_push_json(L, p[0], p + 1, p + v, 0)) {
+				return NULL;
+			}
+		} else if (type == MYSQL_TYPE_JSON) {
+			luaL_pushnull(L);
+		} else {
+			lua_pushlstring(L, (const char *) p, v);
+		}
+		return p + v;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Push a row image as an array of values of columns of a table.
+ * Columns missing in the image are nil, NULL values are nil or
+ * box.NULL depending on keep_null. Return the pointer past the
+ * image or NULL on malformed data.
+ */
+static const unsigned char *
+lua_mysql_binlog_push_row(struct lua_State *L,
+			  const struct mysql_binlog_table *table,
+			  const unsigned char *columns,
+			  const unsigned char *p, const unsigned char *end,
+			  bool keep_null)
+{
+	unsigned i, present = 0;
+	for (i = 0; i < table->column_count; ++i)
+		present += (columns[i / 8] >> (i % 8)) & 1;
+	const unsigned char *nulls = p;
+	p += (present + 7) / 8;
+	if (p > end)
+		return NULL;
+	lua_createtable(L, table->column_count, 0);
+	unsigned n = 0;
+	for (i = 0; i < table->column_count; ++i) {
+		if (((columns[i / 8] >> (i % 8)) & 1) == 0)
+			continue;
+		bool is_null = (nulls[n / 8] >> (n % 8)) & 1;
+		++n;
+		if (is_null) {
+			if (keep_null) {
+				luaL_pushnull(L);
+				lua_rawseti(L, -2, i + 1);
+			}
+			continue;
+		}
+		p = lua_mysql_binlog_push_value(L, table->types[i],
+						table->meta[i], p, end);
+		if (p == NULL)
+			return NULL;
+		lua_rawseti(L, -2, i + 1);
+	}
+	return p;
+}
+
+/*
+ * Append change records of a row event to the table at index
+ * records_idx. Return the new count of records or -1 on
+ * malformed data.
+ */
+static int
+lua_mysql_binlog_push_rows(struct lua_State *L, struct mysql_binlog *binlog,
+			   const MARIADB_RPL_EVENT *event, int records_idx,
+			   int count)
+{
+	const struct st_mariadb_rpl_rows_event *rows = &event->event.rows;
+	struct mysql_binlog_table *table =
+		mysql_binlog_find_table(binlog, rows->table_id);
+	if (table == NULL || table->skip)
+		return count;
+	if (rows->column_count != table->column_count)
+		return -1;
+	const char *op;
+	switch (event->event_type) {
+	case WRITE_ROWS_EVENT_V1:
+	case WRITE_ROWS_EVENT:
+		op = "insert";
+		break;
+	case UPDATE_ROWS_EVENT_V1:
+	case UPDATE_ROWS_EVENT:
+		op = "update";
+		break;
+	default:
+		op = "delete";
+	}
+	bool keep_null = binlog->conn->keep_null;
+	const unsigned char *columns =
+		(const unsigned char *) rows->column_bitmap;
+	const unsigned char *updated =
+		(const unsigned char *) rows->column_update_bitmap;
+	const unsigned char *p = (const unsigned char *) rows->row_data;
+	const unsigned char *end = p + rows->row_data_size;
+	while (p < end) {
+		lua_createtable(L, 0, 5);
+		lua_pushstring(L, op);
+		lua_setfield(L, -2, "op");
+		lua_pushstring(L, table->schema);
+		lua_setfield(L, -2, "schema");
+		lua_pushstring(L, table->name);
+		lua_setfield(L, -2, "table");
+		/* Updates carry images before and after a change. */
+		if (*op != 'i') {
+			p = lua_mysql_binlog_push_row(L, table, columns, p,
+						      end, keep_null);
+			if (p == NULL)
+				return -1;
+			lua_setfield(L, -2, "old");
+		}
+		if (*op != 'd') {
+			p = lua_mysql_binlog_push_row(L, table,
+				*op == 'u' ? updated : columns, p, end,
+				keep_null);
+			if (p == NULL)
+				return -1;
+			lua_setfield(L, -2, "new");
+		}
+		lua_rawseti(L, records_idx, ++count);
+	}
+	return count;
+}
+
+static void
+lua_mysql_binlog_push_position(struct lua_State *L,
+			       const struct mysql_binlog_position *position)
+{
+	lua_createtable(L, 0, 3);
+	lua_pushstring(L, position->file);
+	lua_setfield(L, -2, "file");
+	lua_pushnumber(L, position->offset);
+	lua_setfield(L, -2, "position");
+	if (position->gtid[0] != '\0') {
+		lua_pushstring(L, position->gtid);
+		lua_setfield(L, -2, "gtid");
+	}
+}
+
+/*
+ * A transaction is read out: it is safe to resume the stream
+ * from the current position.
+ */
+static void
+mysql_binlog_commit(struct mysql_binlog *binlog)
+{
+	binlog->in_transaction = false;
+	binlog->committed = binlog->current;
+	mysql_binlog_forget_tables(binlog);
+}
+
+static bool
+mysql_binlog_query_is(const MARIADB_STRING *query, const char *word)
+{
+	size_t len = strlen(word);
+	return query->length >= len &&
+	       strncasecmp(query->str, word, len) == 0 &&
+	       (query->length == len || isspace((unsigned char)query->str[len]));
+}
+
+/*
+ * Account an event in the position of the stream. Return true
+ * when the event ends a transaction.
+ */
+static bool
+mysql_binlog_advance(struct mysql_binlog *binlog,
+		     const MARIADB_RPL_EVENT *event)
+{
+	struct mysql_binlog_position *current = &binlog->current;
+	const MARIADB_STRING *query = &event->event.query.statement;
+	switch (event->event_type) {
+	case ROTATE_EVENT: {
+		const MARIADB_STRING *file = &event->event.rotate.filename;
+		size_t len = file->length < BINLOG_FILE_MAX ?
+			     file->length : BINLOG_FILE_MAX - 1;
+		memcpy(current->file, file->str, len);
+		current->file[len] = '\0';
+		current->offset = event->event.rotate.position;
+		if (!binlog->in_transaction)
+			binlog->committed = *current;
+		return false;
+	}
+	case HEARTBEAT_LOG_EVENT:
+		return false;
+	default:
+		break;
+	}
+	/* Artificial events have no position. */
+	if (event->next_event_pos != 0)
+		current->offset = event->next_event_pos;
+	switch (event->event_type) {
+	case GTID_EVENT:
+		snprintf(current->gtid, sizeof(current->gtid),
+			 "%u-%u-%llu", event->event.gtid.domain_id,
+			 event->server_id,
+			 (unsigned long long) event->event.gtid.sequence_nr);
+		/* The event stands for BEGIN. */
+		if ((event->event.gtid.flags & BINLOG_GTID_STANDALONE) == 0)
+			binlog->in_transaction = true;
+		return false;
+	case XID_EVENT:
+		return true;
+	case QUERY_EVENT:
+		if (mysql_binlog_query_is(query, "BEGIN")) {
+			binlog->in_transaction = true;
+			return false;
+		}
+		/* Other statements out of a transaction commit at once. */
+		return !binlog->in_transaction ||
+		       mysql_binlog_query_is(query, "COMMIT") ||
+		       mysql_binlog_query_is(query, "ROLLBACK");
+	default:
+		return false;
+	}
+}
+
+/**
+ * Start streaming binlog events on a connection. Arguments: a
+ * connection, a server id of the replica, a binlog file, a
+ * position in it and an optional table of wanted tables keyed by
+ * "schema.name". An empty file name means the position given by
+ * @slave_connect_state set on the connection. Return status and
+ * a binlog stream.
+ */
+static int
+lua_mysql_binlog_open(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	unsigned int server_id = luaL_checkinteger(L, 2);
+	size_t file_len;
+	const char *file = luaL_optlstring(L, 3, "", &file_len);
+	unsigned long offset = luaL_optnumber(L, 4, 4);
+	if (file_len >= BINLOG_FILE_MAX)
+		luaL_error(L, "Binlog file name is too long");
+
+	mysql_conn_close_orphans(conn);
+	struct mysql_binlog *binlog = (struct mysql_binlog *)
+		lua_newuserdata(L, sizeof(*binlog));
+	memset(binlog, 0, sizeof(*binlog));
+	binlog->conn = conn;
+	luaL_getmetatable(L, mysql_binlog_label);
+	lua_setmetatable(L, -2);
+	/* Keep the connection object and the table filter. */
+	lua_createtable(L, 2, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	if (lua_istable(L, 5)) {
+		lua_pushvalue(L, 5);
+		lua_rawseti(L, -2, 2);
+	}
+	lua_setfenv(L, -2);
+
+	memcpy(binlog->current.file, file, file_len);
+	binlog->current.offset = offset;
+	binlog->committed = binlog->current;
+	binlog->rpl = mariadb_rpl_init(conn->raw_conn);
+	if (binlog->rpl == NULL) {
+		lua_pushnumber(L, 1);
+		int fail = safe_pushstring(L,
+			"Can not allocate memory for binlog stream");
+		return fail ? lua_push_error(L) : 2;
+	}
+	if (mariadb_rpl_optionsv(binlog->rpl, MARIADB_RPL_SERVER_ID,
+				 server_id) ||
+	    mariadb_rpl_optionsv(binlog->rpl, MARIADB_RPL_FILENAME,
+				 file, file_len) ||
+	    mariadb_rpl_optionsv(binlog->rpl, MARIADB_RPL_START, offset) ||
+	    mariadb_rpl_open(binlog->rpl)) {
+		int ret_count = lua_mysql_push_error(L, conn->raw_conn);
+		mysql_binlog_release(binlog);
+		return ret_count;
+	}
+	lua_pushnumber(L, 0);
+	lua_insert(L, -2);
+	return 2;
+}
+
+/**
+ * Read events of a binlog stream until up to limit change records
+ * of row events are collected. Records are returned at the end of
+ * a transaction or on a heartbeat of an idle server, unless a
+ * transaction alone has more records than the limit. Return
+ * status, an array of records and the position after the last
+ * transaction read out. Records of a transaction returned in
+ * parts are read again when the stream is resumed from the
+ * position.
+ */
+static int
+lua_mysql_binlog_fetch(struct lua_State *L)
+{
+	struct mysql_binlog *binlog = lua_check_mysqlbinlog(L, 1);
+	int limit = luaL_optinteger(L, 2, BINLOG_BATCH_SIZE_DEFAULT);
+	MYSQL *raw_conn = binlog->conn->raw_conn;
+	int count = 0;
+
+	lua_getfenv(L, 1);
+	lua_rawgeti(L, -1, 2);
+	int filter_idx = lua_gettop(L);
+	lua_newtable(L);
+	int records_idx = lua_gettop(L);
+	while (true) {
+		MARIADB_RPL_EVENT *event = mariadb_rpl_fetch(binlog->rpl,
+							     binlog->event);
+		if (event == NULL) {
+			binlog->event = NULL;
+			if (fiber_is_cancelled()) {
+				lua_pushnumber(L, -2);
+				safe_pushstring(L, "Fiber was cancelled");
+				return 2;
+			}
+			/* The server doesn't stream events anymore. */
+			lua_mysql_push_error(L, raw_conn);
+			lua_pushnumber(L, -1);
+			lua_replace(L, -3);
+			return 2;
+		}
+		binlog->event = event;
+		switch (event->event_type) {
+		case TABLE_MAP_EVENT:
+			if (lua_mysql_binlog_map_table(L, binlog,
+						       &event->event.table_map,
+						       filter_idx) != 0) {
+				lua_pushnumber(L, -1);
+				int fail = safe_pushstring(L, "Can not "
+					"allocate memory for binlog tables");
+				return fail ? lua_push_error(L) : 2;
+			}
 			break;
-		case LUA_TNUMBER:
-			param_binds[param_no].buffer_type = MYSQL_TYPE_DOUBLE;
-			param_binds[param_no].buffer = values + param_no;
-			*(double *)(values + param_no) =
-				lua_tonumber(L, 3 + param_no);
-			param_binds[param_no].buffer_length = 8;
+		case WRITE_ROWS_EVENT_V1:
+		case UPDATE_ROWS_EVENT_V1:
+		case DELETE_ROWS_EVENT_V1:
+		case WRITE_ROWS_EVENT:
+		case UPDATE_ROWS_EVENT:
+		case DELETE_ROWS_EVENT:
+			count = lua_mysql_binlog_push_rows(L, binlog, event,
+							   records_idx, count);
+			if (count < 0) {
+				lua_pushnumber(L, -1);
+				lua_pushfstring(L, "Malformed row event at "
+						"%s:%d", binlog->current.file,
+						(int) event->next_event_pos);
+				return 2;
+			}
 			break;
 		default:
-			param_binds[param_no].buffer_type = MYSQL_TYPE_STRING;
-			param_binds[param_no].buffer =
-				(char *)lua_tolstring(L, 3 + param_no, &len);
-			param_binds[param_no].buffer_length = len;
+			break;
 		}
-	}
-	mysql_stmt_bind_param(stmt, param_binds);
-	error = mysql_stmt_execute(stmt);
-	if (error)
-		goto done;
-
-	meta = mysql_stmt_result_metadata(stmt);
-	if (!meta)
-		goto done;
-	/* Alloc space for output */
-	unsigned long col_count = mysql_num_fields(meta);
-	result_binds = (MYSQL_BIND *)calloc(sizeof(MYSQL_BIND), col_count);
-	MYSQL_FIELD *fields = mysql_fetch_fields(meta);
-	unsigned long col_no;
-	for (col_no = 0; col_no < col_count; ++col_no) {
-		result_binds[col_no].buffer_type = MYSQL_TYPE_STRING;
-		result_binds[col_no].buffer =
-			(char *) malloc(fields[col_no].length);
-		result_binds[col_no].buffer_length = fields[col_no].length;
-		result_binds[col_no].length = (unsigned long *) malloc(
-			sizeof(unsigned long));
-		result_binds[col_no].is_null = (my_bool *) malloc(
-			sizeof(my_bool));
-	}
-	mysql_stmt_bind_result(stmt, result_binds);
-	lua_pushnumber(L, 1);
-	lua_newtable(L);
-	unsigned int row_idx = 1;
-	while (true) {
-		int has_no_row = mysql_stmt_fetch(stmt);
-		if (has_no_row)
+		bool commit = mysql_binlog_advance(binlog, event);
+		if (commit)
+			mysql_binlog_commit(binlog);
+		bool idle = event->event_type == HEARTBEAT_LOG_EVENT;
+		if (count > 0 && (commit || idle || count >= limit))
 			break;
-		lua_pushnumber(L, row_idx);
-		lua_pushcfunction(L, lua_mysql_stmt_push_row);
-		lua_pushnumber(L, col_count);
-		lua_pushlightuserdata(L, result_binds);
-		lua_pushlightuserdata(L, fields);
-		lua_pushinteger(L, conn->keep_null);
-		if ((fail = lua_pcall(L, 4, 1, 0)))
-			goto done;
-		lua_settable(L, -3);
-		++row_idx;
+		if (fiber_is_cancelled()) {
+			lua_pushnumber(L, -2);
+			safe_pushstring(L, "Fiber was cancelled");
+			return 2;
+		}
 	}
-	lua_settable(L, -3);
+	lua_pushnumber(L, 0);
+	lua_insert(L, records_idx);
+	lua_mysql_binlog_push_position(L, &binlog->committed);
+	return 3;
+}
 
-done:
-	if (error)
-		ret_count = lua_mysql_push_error(L, conn->raw_conn);
-	if (values)
-		free(values);
-	if (param_binds)
-		free(param_binds);
-	if (result_binds) {
-		unsigned long col_no;
-		for (col_no = 0; col_no < col_count; ++col_no) {
-			free(result_binds[col_no].buffer);
-			free(result_binds[col_no].length);
-			free(result_binds[col_no].is_null);
-		}
-		free(result_binds);
-	}
-	if (meta)
-		mysql_stmt_free_result(stmt);
-	if (stmt)
-		mysql_stmt_close(stmt);
-	if (fiber_is_cancelled()) {
-		lua_pushnumber(L, -2);
-		safe_pushstring(L, "Fiber was cancelled");
-		return 2;
-	}
-	return fail ? lua_push_error(L) : ret_count;
+/**
+ * Return the position after the last transaction read out
+ */
+static int
+lua_mysql_binlog_position(struct lua_State *L)
+{
+	struct mysql_binlog *binlog = (struct mysql_binlog *)
+		luaL_checkudata(L, 1, mysql_binlog_label);
+	lua_mysql_binlog_push_position(L, &binlog->committed);
+	return 1;
+}
+
+/**
+ * Stop a binlog stream. The connection is unusable afterwards.
+ */
+static int
+lua_mysql_binlog_close(struct lua_State *L)
+{
+	struct mysql_binlog *binlog = (struct mysql_binlog *)
+		luaL_checkudata(L, 1, mysql_binlog_label);
+	mysql_binlog_release(binlog);
+	lua_pushnumber(L, 0);
+	return 1;
+}
+
+static int
+lua_mysql_binlog_gc(struct lua_State *L)
+{
+	struct mysql_binlog *binlog = (struct mysql_binlog *)
+		luaL_checkudata(L, 1, mysql_binlog_label);
+	mysql_binlog_release(binlog);
+	return 0;
+}
+
+static int
+lua_mysql_binlog_tostring(struct lua_State *L)
+{
+	struct mysql_binlog *binlog = (struct mysql_binlog *)
+		luaL_checkudata(L, 1, mysql_binlog_label);
+	lua_pushfstring(L, "MYSQL_BINLOG: %p", binlog);
+	return 1;
 }
 
 /**
@@ -542,10 +6252,17 @@ lua_mysql_close(struct lua_State *L)
 		lua_pushboolean(L, 0);
 		return 1;
 	}
+	/*
+	 * The connection structure is freed on gc only, since
+	 * statement objects may refer to it.
+	 */
+	mysql_conn_detach_results(*conn_p);
+	mysql_profile_end(&(*conn_p)->profile);
 	mysql_close((*conn_p)->raw_conn);
 	(*conn_p)->raw_conn = NULL;
-	free(*conn_p);
-	*conn_p = NULL;
+	++(*conn_p)->generation;
+	mysql_stmt_cache_flush(&(*conn_p)->stmt_cache);
+	mysql_conn_close_orphans(*conn_p);
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -559,10 +6276,19 @@ lua_mysql_gc(struct lua_State *L)
 	struct mysql_connection **conn_p = (struct mysql_connection **)
 		luaL_checkudata(L, 1, mysql_driver_label);
 	if (conn_p != NULL && *conn_p != NULL && (*conn_p)->raw_conn != NULL) {
+		mysql_conn_detach_results(*conn_p);
 		mysql_close((*conn_p)->raw_conn);
 		(*conn_p)->raw_conn = NULL;
 	}
 	if (conn_p != NULL && *conn_p != NULL) {
+		mysql_profile_end(&(*conn_p)->profile);
+		/*
+		 * The statements are already invalidated by
+		 * mysql_close(), so no packets are sent here.
+		 */
+		mysql_stmt_cache_flush(&(*conn_p)->stmt_cache);
+		mysql_conn_close_orphans(*conn_p);
+		mysql_arena_destroy(&(*conn_p)->arena);
 		free(*conn_p);
 		*conn_p = NULL;
 	}
@@ -602,18 +6328,382 @@ lua_mysql_quote(struct lua_State *L)
 	return 1;
 }
 
+/**
+ * Check a connection by a COM_PING round trip, return true if it
+ * is alive.
+ */
 static int
-mysql_wait_for_io(my_socket socket, my_bool is_read, int timeout)
+lua_mysql_ping(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	mysql_conn_close_orphans(conn);
+	lua_pushboolean(L, mysql_ping(conn->raw_conn) == 0);
+	return 1;
+}
+
+/**
+ * Return true if a transaction is open on a connection, as of
+ * the last reply of the server. No packets are sent.
+ */
+static int
+lua_mysql_in_transaction(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	unsigned int server_status = SERVER_STATUS_IN_TRANS;
+	mariadb_get_infov(conn->raw_conn, MARIADB_CONNECTION_SERVER_STATUS,
+			  &server_status);
+	lua_pushboolean(L, (server_status & SERVER_STATUS_IN_TRANS) != 0);
+	return 1;
+}
+
+/*
+ * The current database. The connector follows changes of it by
+ * session_track_schema, which the server enables by default.
+ */
+static int
+lua_mysql_current_db(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	if (conn->raw_conn->db == NULL)
+		lua_pushnil(L);
+	else
+		lua_pushstring(L, conn->raw_conn->db);
+	return 1;
+}
+
+/* Seconds to wait for a reply after KILL QUERY is sent. */
+#define KILL_GRACE_TIME 1.0
+/* Seconds of connecting and sending KILL QUERY. */
+#define KILL_TIMEOUT 1
+
+/*
+ * A request with a deadline. Waits for IO of its socket are cut
+ * at the deadline, then the query is killed from a side
+ * connection and the reply is waited for a grace time. When there
+ * is no reply still, the connector gets a timeout and drops the
+ * connection.
+ */
+struct mysql_deadline {
+	MYSQL *raw_conn;
+	my_socket socket;
+	double time;
+	/* KILL QUERY has been sent. */
+	bool killed;
+	struct mysql_deadline *next;
+};
+
+/* Requests with a deadline waiting for the server. */
+static struct mysql_deadline *mysql_deadlines = NULL;
+
+static int
+mysql_wait_for_io(my_socket socket, my_bool is_read, int timeout);
+
+static struct mysql_deadline *
+mysql_deadline_find(my_socket socket)
+{
+	struct mysql_deadline *deadline;
+	for (deadline = mysql_deadlines; deadline != NULL;
+	     deadline = deadline->next) {
+		if (deadline->socket == socket)
+			return deadline;
+	}
+	return NULL;
+}
+
+static void
+mysql_deadline_start(struct mysql_deadline *deadline, MYSQL *raw_conn,
+		     double timeout)
+{
+	deadline->raw_conn = raw_conn;
+	deadline->socket = mysql_get_socket(raw_conn);
+	deadline->time = fiber_clock() + timeout;
+	deadline->killed = false;
+	deadline->next = mysql_deadlines;
+	mysql_deadlines = deadline;
+}
+
+static void
+mysql_deadline_stop(struct mysql_deadline *deadline)
+{
+	struct mysql_deadline **prev = &mysql_deadlines;
+	while (*prev != deadline)
+		prev = &(*prev)->next;
+	*prev = deadline->next;
+}
+
+/* TLS options the side connection takes from the killed one. */
+static const enum mysql_option mysql_tls_str_options[] = {
+	MYSQL_OPT_SSL_KEY, MYSQL_OPT_SSL_CERT, MYSQL_OPT_SSL_CA,
+	MYSQL_OPT_SSL_CAPATH, MYSQL_OPT_SSL_CIPHER, MYSQL_OPT_SSL_CRL,
+	MYSQL_OPT_SSL_CRLPATH, MARIADB_OPT_SSL_FP, MARIADB_OPT_SSL_FP_LIST,
+	MARIADB_OPT_TLS_PASSPHRASE, MARIADB_OPT_TLS_VERSION,
+};
+
+static const enum mysql_option mysql_tls_bool_options[] = {
+	MYSQL_OPT_SSL_ENFORCE, MYSQL_OPT_SSL_VERIFY_SERVER_CERT,
+};
+
+static void
+mysql_copy_tls_options(MYSQL *dst, MYSQL *src)
+{
+	size_t i;
+	for (i = 0; i < sizeof(mysql_tls_str_options) /
+		    sizeof(mysql_tls_str_options[0]); i++) {
+		const char *value = NULL;
+		if (mysql_get_optionv(src, mysql_tls_str_options[i],
+				      &value) == 0 && value != NULL)
+			mysql_options(dst, mysql_tls_str_options[i], value);
+	}
+	for (i = 0; i < sizeof(mysql_tls_bool_options) /
+		    sizeof(mysql_tls_bool_options[0]); i++) {
+		my_bool value = 0;
+		if (mysql_get_optionv(src, mysql_tls_bool_options[i],
+				      &value) == 0)
+			mysql_options(dst, mysql_tls_bool_options[i], &value);
+	}
+}
+
+/*
+ * Kill the query of an expired request from a side connection
+ * with the same credentials and TLS options and give the server
+ * a grace time to reply with an error. The grace time starts when
+ * KILL QUERY is done, however long connecting takes.
+ */
+static void
+mysql_deadline_kill(struct mysql_deadline *deadline)
+{
+	MYSQL *raw_conn = deadline->raw_conn;
+	unsigned int kill_timeout = KILL_TIMEOUT;
+	char sql[64];
+	deadline->killed = true;
+	MYSQL *killer = mysql_init(NULL);
+	if (killer == NULL) {
+		deadline->time = fiber_clock() + KILL_GRACE_TIME;
+		return;
+	}
+	mysql_copy_tls_options(killer, raw_conn);
+	mysql_options(killer, MYSQL_OPT_IO_WAIT, mysql_wait_for_io);
+	mysql_options(killer, MYSQL_OPT_CONNECT_TIMEOUT, &kill_timeout);
+	mysql_options(killer, MYSQL_OPT_READ_TIMEOUT, &kill_timeout);
+	mysql_options(killer, MYSQL_OPT_WRITE_TIMEOUT, &kill_timeout);
+	snprintf(sql, sizeof(sql), "KILL QUERY %lu",
+		 mysql_thread_id(raw_conn));
+	if (mysql_real_connect(killer, raw_conn->host, raw_conn->user,
+			       raw_conn->passwd, NULL, raw_conn->port,
+			       raw_conn->unix_socket, 0) != NULL)
+		mysql_real_query(killer, sql, strlen(sql));
+	mysql_close(killer);
+	deadline->time = fiber_clock() + KILL_GRACE_TIME;
+}
+
+/* Wait for a socket within the deadline of its request. */
+static int
+mysql_wait_for_socket(my_socket socket, my_bool is_read, int timeout)
 {
 	int coio_event = is_read ? COIO_READ : COIO_WRITE;
-	int wait_res;
-	wait_res = coio_wait(socket, coio_event,
-			     timeout >= 0? timeout / 1000.0: TIMEOUT_INFINITY);
-	if (wait_res == 0)
-		return 0;
+	double end = fiber_clock() +
+		(timeout >= 0 ? timeout / 1000.0 : TIMEOUT_INFINITY);
+	struct mysql_deadline *deadline = mysql_deadline_find(socket);
+	while (deadline != NULL && deadline->time < end) {
+		double left = deadline->time - fiber_clock();
+		if (left > 0 && coio_wait(socket, coio_event, left) != 0)
+			return 1;
+		if (fiber_is_cancelled() || fiber_clock() < deadline->time)
+			return 0;
+		/* The server ignores KILL QUERY, give up the connection. */
+		if (deadline->killed)
+			return 0;
+		mysql_deadline_kill(deadline);
+	}
+	if (coio_wait(socket, coio_event, end - fiber_clock()) != 0)
+		return 1;
+	return 0;
+}
+
+/*
+ * Called by the connector instead of a blocking poll(). The wait
+ * runs right on the stack of the calling fiber, so unlike the
+ * connector's non-blocking API it needs neither a coroutine stack
+ * per connection nor a context switch per wait.
+ */
+static int
+mysql_wait_for_io(my_socket socket, my_bool is_read, int timeout)
+{
+	struct mysql_profile *profile = mysql_profile_find(socket);
+	if (profile == NULL)
+		return mysql_wait_for_socket(socket, is_read, timeout);
+	if (is_read)
+		mysql_profile_sent(profile);
+	double start = clock_monotonic();
+	int rc = mysql_wait_for_socket(socket, is_read, timeout);
+	if (is_read)
+		profile->io_read += clock_monotonic() - start;
+	else
+		profile->io_write += clock_monotonic() - start;
+	return rc;
+}
+
+/*
+ * Call a request function with arguments on the lua stack within
+ * the timeout of the connection. A request reaching the deadline
+ * returns status 2 if the query is killed and the connection can
+ * be used further, or -4 if the connection is lost.
+ */
+static int
+lua_mysql_call_with_deadline(struct lua_State *L, lua_CFunction request)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	double timeout = conn->next_timeout >= 0 ? conn->next_timeout :
+						   conn->query_timeout;
+	conn->next_timeout = -1;
+	if (timeout <= 0)
+		return request(L);
+
+	int nargs = lua_gettop(L);
+	lua_pushcfunction(L, request);
+	lua_insert(L, 1);
+	struct mysql_deadline deadline;
+	mysql_deadline_start(&deadline, conn->raw_conn, timeout);
+	int rc = lua_pcall(L, nargs, LUA_MULTRET, 0);
+	mysql_deadline_stop(&deadline);
+	if (rc != 0)
+		return lua_error(L);
+	int ret_count = lua_gettop(L);
+	int status = lua_tointeger(L, 1);
+	if (!deadline.killed || status == -2)
+		return ret_count;
+	/* Results of a killed query may be cut, drop them. */
+	lua_settop(L, 0);
+	lua_pushnumber(L, status >= 0 ? 2 : -4);
+	int fail = safe_pushstring(L, status >= 0 ? "Query timeout" :
+				   "Query timeout, connection is lost");
+	return fail ? lua_push_error(L) : 2;
+}
+
+/*
+ * Call a request function within the timeout of the connection,
+ * see lua_mysql_call_with_deadline(), and profile it when
+ * profiling is on.
+ */
+static int
+lua_mysql_call_profiled(struct lua_State *L, lua_CFunction request)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	if (mysql_profiling)
+		mysql_profile_begin(&conn->profile, conn->raw_conn);
+	int ret_count = lua_mysql_call_with_deadline(L, request);
+	mysql_profile_end(&conn->profile);
+	return ret_count;
+}
+
+static int
+lua_mysql_execute_timed(struct lua_State *L)
+{
+	return lua_mysql_call_profiled(L, lua_mysql_execute);
+}
+
+static int
+lua_mysql_execute_prepared_timed(struct lua_State *L)
+{
+	return lua_mysql_call_profiled(L, lua_mysql_execute_prepared);
+}
+
+static int
+lua_mysql_execute_msgpack_timed(struct lua_State *L)
+{
+	return lua_mysql_call_profiled(L, lua_mysql_execute_msgpack);
+}
+
+/**
+ * Return phases of the last profiled request of a connection or
+ * nil when there is none
+ */
+static int
+lua_mysql_conn_profile(struct lua_State *L)
+{
+	const struct mysql_profile *profile =
+		&lua_check_mysqlconn(L, 1)->profile;
+	if (profile->start == 0 || profile->active) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_createtable(L, 0, 9);
+	lua_pushnumber(L, profile->total);
+	lua_setfield(L, -2, "total");
+	lua_pushnumber(L, profile->send);
+	lua_setfield(L, -2, "send");
+	lua_pushnumber(L, profile->io_read);
+	lua_setfield(L, -2, "io_read");
+	lua_pushnumber(L, profile->io_write);
+	lua_setfield(L, -2, "io_write");
+	lua_pushnumber(L, profile->decode);
+	lua_setfield(L, -2, "decode");
+	lua_pushnumber(L, profile->rows);
+	lua_setfield(L, -2, "rows");
+	lua_pushnumber(L, profile->bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, profile->result_count);
+	lua_setfield(L, -2, "result_count");
+	unsigned count = profile->result_count < PROFILE_RESULT_MAX ?
+		profile->result_count : PROFILE_RESULT_MAX;
+	lua_createtable(L, count, 0);
+	unsigned result_no;
+	for (result_no = 0; result_no < count; ++result_no) {
+		const struct mysql_profile_result *result =
+			&profile->results[result_no];
+		lua_createtable(L, 0, 3);
+		lua_pushnumber(L, result->decode);
+		lua_setfield(L, -2, "decode");
+		lua_pushnumber(L, result->rows);
+		lua_setfield(L, -2, "rows");
+		lua_pushnumber(L, result->bytes);
+		lua_setfield(L, -2, "bytes");
+		lua_rawseti(L, -2, result_no + 1);
+	}
+	lua_setfield(L, -2, "results");
 	return 1;
 }
 
+/**
+ * Set the timeout of the next request of a connection in seconds,
+ * 0 means no timeout.
+ */
+static int
+lua_mysql_set_timeout(struct lua_State *L)
+{
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	double timeout = luaL_checknumber(L, 2);
+	if (timeout < 0)
+		luaL_error(L, "timeout must be non-negative");
+	conn->next_timeout = timeout;
+	return 0;
+}
+
+/*
+ * Load decimal.new() and datetime.new() for connections with
+ * native_types option.
+ */
+static void
+lua_mysql_load_native_types(struct lua_State *L)
+{
+	if (luaL_datetime_new_ref != LUA_REFNIL)
+		return;
+	lua_getglobal(L, "require");
+	lua_pushstring(L, "decimal");
+	lua_call(L, 1, 1);
+	lua_getfield(L, -1, "new");
+	luaL_decimal_new_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pop(L, 1);
+	lua_getglobal(L, "require");
+	lua_pushstring(L, "datetime");
+	lua_call(L, 1, 1);
+	lua_getfield(L, -1, "new");
+	luaL_datetime_new_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pop(L, 1);
+	datetime_ctypeid = luaL_ctypeid(L, "struct datetime");
+	decimal_ctypeid = luaL_ctypeid(L, "decimal_t");
+}
+
 /**
  * connect to MySQL
  */
@@ -622,7 +6712,8 @@ lua_mysql_connect(struct lua_State *L)
 {
 	if (lua_gettop(L) < 7) {
 		luaL_error(L, "Usage: mysql.connect(host, port, user, "
-			   "password, db, use_numeric_result, keep_null)");
+			   "password, db, use_numeric_result, keep_null"
+			   "[, opts])");
 	}
 
 	const char *host = lua_tostring(L, 1);
@@ -632,6 +6723,44 @@ lua_mysql_connect(struct lua_State *L)
 	const char *db = lua_tostring(L, 5);
 	const int use_numeric_result = lua_toboolean(L, 6);
 	const int keep_null = lua_toboolean(L, 7);
+	const int stmt_cache_size = lua_mysql_opt_int(L, 8, "stmt_cache_size",
+						      0);
+	if (stmt_cache_size < 0)
+		luaL_error(L, "stmt_cache_size must be non-negative");
+	const int decode_budget_rows = lua_mysql_opt_int(L, 8,
+		"decode_budget_rows", 0);
+	const double decode_budget_time = lua_mysql_opt_number(L, 8,
+		"decode_budget_time", DECODE_BUDGET_TIME_DEFAULT);
+	if (decode_budget_rows < 0 || decode_budget_time < 0)
+		luaL_error(L, "decode budget must be non-negative");
+	const double query_timeout = lua_mysql_opt_number(L, 8,
+		"query_timeout", 0);
+	if (query_timeout < 0)
+		luaL_error(L, "query_timeout must be non-negative");
+	enum mysql_result_format result_format = MYSQL_RESULT_TABLE;
+	bool track_session = false;
+	bool native_types = false;
+	if (lua_istable(L, 8)) {
+		lua_getfield(L, 8, "track_session");
+		track_session = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 8, "native_types");
+		native_types = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		lua_getfield(L, 8, "result_format");
+		const char *format = lua_tostring(L, -1);
+		if (format == NULL || strcmp(format, "table") == 0)
+			result_format = MYSQL_RESULT_TABLE;
+		else if (strcmp(format, "lazy") == 0)
+			result_format = MYSQL_RESULT_LAZY;
+		else if (strcmp(format, "columnar") == 0)
+			result_format = MYSQL_RESULT_COLUMNAR;
+		else
+			luaL_error(L, "Unknown result_format '%s'", format);
+		lua_pop(L, 1);
+	}
+	if (native_types)
+		lua_mysql_load_native_types(L);
 
 	MYSQL *raw_conn, *tmp_raw_conn = mysql_init(NULL);
 	if (!tmp_raw_conn) {
@@ -652,10 +6781,14 @@ lua_mysql_connect(struct lua_State *L)
 	}
 
 	mysql_options(tmp_raw_conn, MYSQL_OPT_IO_WAIT, mysql_wait_for_io);
+	/* Only data of conn:load_data() is sent, see the handlers. */
+	unsigned int local_infile = 1;
+	mysql_options(tmp_raw_conn, MYSQL_OPT_LOCAL_INFILE, &local_infile);
 
 	raw_conn = mysql_real_connect(tmp_raw_conn, host, user, pass,
 		db, iport, usocket,
-		CLIENT_MULTI_STATEMENTS | CLIENT_MULTI_RESULTS);
+		CLIENT_MULTI_STATEMENTS | CLIENT_MULTI_RESULTS |
+		(track_session ? CLIENT_SESSION_TRACKING : 0));
 
 	if (!raw_conn) {
 		lua_pushinteger(L, -1);
@@ -680,21 +6813,79 @@ lua_mysql_connect(struct lua_State *L)
 	(*conn_p)->raw_conn = raw_conn;
 	(*conn_p)->use_numeric_result = use_numeric_result;
 	(*conn_p)->keep_null = keep_null;
+	(*conn_p)->stmt_cache.capacity = stmt_cache_size;
+	(*conn_p)->decode_budget_rows = decode_budget_rows;
+	(*conn_p)->decode_budget_time = decode_budget_time;
+	(*conn_p)->result_format = result_format;
+	(*conn_p)->track_session = track_session;
+	(*conn_p)->query_timeout = query_timeout;
+	(*conn_p)->next_timeout = -1;
+	(*conn_p)->native_types = native_types;
+	mysql_set_local_infile_handler(raw_conn, mysql_local_infile_init,
+				       mysql_local_infile_read,
+				       mysql_local_infile_end,
+				       mysql_local_infile_error, conn);
+	mysql_conn_start_tracking(*conn_p);
 	luaL_getmetatable(L, mysql_driver_label);
 	lua_setmetatable(L, -2);
 
 	return 2;
 }
 
+/**
+ * Reset the session of a connection. Arguments: a connection,
+ * user, password, database and a strategy:
+ *  - 'change_user' authenticates anew (the default);
+ *  - 'reset_connection' resets the session keeping the user and
+ *    selects the database again if it has changed;
+ *  - 'tracked' resets the session like 'reset_connection' only
+ *    when its state has changed or a transaction is left open,
+ *    or like 'change_user' when the database has changed;
+ *  - 'none' keeps the session as is.
+ */
 static int
 lua_mysql_reset(lua_State *L)
 {
-	MYSQL *raw_conn = lua_check_mysqlconn(L, 1)->raw_conn;
+	struct mysql_connection *conn = lua_check_mysqlconn(L, 1);
+	MYSQL *raw_conn = conn->raw_conn;
 	const char *user = lua_tostring(L, 2);
 	const char *pass = lua_tostring(L, 3);
 	const char *db = lua_tostring(L, 4);
+	const char *strategy = luaL_optstring(L, 5, "change_user");
+	int rc;
 
-	if (mysql_change_user(raw_conn, user, pass, db) == 0) {
+	mysql_conn_close_orphans(conn);
+	/* The reply to the last request may report a change too. */
+	mysql_conn_track_session(conn);
+	if (strcmp(strategy, "change_user") == 0) {
+		rc = mysql_change_user(raw_conn, user, pass, db);
+	} else if (strcmp(strategy, "reset_connection") == 0) {
+		rc = mysql_reset_connection(raw_conn);
+		/* A reset keeps the current database. */
+		if (rc == 0 && conn->schema_changed)
+			rc = db != NULL ? mysql_select_db(raw_conn, db) :
+			     mysql_change_user(raw_conn, user, pass, db);
+	} else if (strcmp(strategy, "tracked") == 0) {
+		if (!mysql_conn_session_dirty(conn)) {
+			lua_pushboolean(L, 1);
+			return 1;
+		}
+		/* A reset keeps the current database. */
+		if (conn->schema_changed)
+			rc = mysql_change_user(raw_conn, user, pass, db);
+		else
+			rc = mysql_reset_connection(raw_conn);
+	} else if (strcmp(strategy, "none") == 0) {
+		lua_pushboolean(L, 1);
+		return 1;
+	} else {
+		return luaL_error(L, "Unknown reset strategy '%s'", strategy);
+	}
+	/* The server has dropped all prepared statements. */
+	++conn->generation;
+	mysql_stmt_cache_flush(&conn->stmt_cache);
+	if (rc == 0) {
+		mysql_conn_start_tracking(conn);
 		lua_pushboolean(L, 1);
 	} else {
 		lua_pushboolean(L, 0);
@@ -709,16 +6900,55 @@ luaopen_mysql_driver(lua_State *L)
 	if (mysql_library_init(0, NULL, NULL))
 		luaL_error(L, "Failed to initialize mysql library");
 
+	int64_ctypeid = luaL_ctypeid(L, "int64_t");
+	uint64_ctypeid = luaL_ctypeid(L, "uint64_t");
+	ptr_ctypeid = luaL_ctypeid(L, "void *");
+
 	/* Create NULL constant. */
-	*(void **) luaL_pushcdata(L, luaL_ctypeid(L, "void *")) = NULL;
+	*(void **) luaL_pushcdata(L, ptr_ctypeid) = NULL;
 	luaL_nil_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
+	/* Keep ffi.new() and array types of columnar results. */
+	lua_getglobal(L, "require");
+	lua_pushstring(L, "ffi");
+	lua_call(L, 1, 1);
+	lua_getfield(L, -1, "new");
+	luaL_ffi_new_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	int kind;
+	for (kind = 0; kind < COLUMN_KIND_MAX; ++kind) {
+		if (mysql_column_ctypes[kind] == NULL)
+			continue;
+		lua_getfield(L, -1, "typeof");
+		lua_pushstring(L, mysql_column_ctypes[kind]);
+		lua_call(L, 1, 1);
+		luaL_column_ctype_refs[kind] =
+			luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_getfield(L, -1, "typeof");
+	lua_pushstring(L, "uint8_t[?]");
+	lua_call(L, 1, 1);
+	luaL_bitmap_ctype_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pop(L, 1);
+
 	static const struct luaL_Reg methods [] = {
-		{"execute_prepared", lua_mysql_execute_prepared},
-		{"execute",	lua_mysql_execute},
+		{"execute_prepared", lua_mysql_execute_prepared_timed},
+		{"execute",	lua_mysql_execute_timed},
 		{"quote",	lua_mysql_quote},
+		{"ping",	lua_mysql_ping},
+		{"in_transaction",	lua_mysql_in_transaction},
+		{"current_db",	lua_mysql_current_db},
 		{"close",	lua_mysql_close},
 		{"reset",	lua_mysql_reset},
+		{"stmt_cache_stats",	lua_mysql_stmt_cache_stats},
+		{"prepare",	lua_mysql_prepare},
+		{"cursor",	lua_mysql_cursor},
+		{"execute_msgpack",	lua_mysql_execute_msgpack_timed},
+		{"set_timeout",	lua_mysql_set_timeout},
+		{"load_into",	lua_mysql_load_into},
+		{"execute_batch",	lua_mysql_execute_batch},
+		{"load_data",	lua_mysql_load_data},
+		{"binlog_open",	lua_mysql_binlog_open},
+		{"profile",	lua_mysql_conn_profile},
 		{"__tostring",	lua_mysql_tostring},
 		{"__gc",	lua_mysql_gc},
 		{NULL, NULL}
@@ -732,9 +6962,101 @@ luaopen_mysql_driver(lua_State *L)
 	lua_setfield(L, -2, "__metatable");
 	lua_pop(L, 1);
 
+	static const struct luaL_Reg stmt_methods [] = {
+		{"execute",	lua_mysql_stmt_execute},
+		{"execute_many",	lua_mysql_stmt_execute_many},
+		{"close",	lua_mysql_stmt_close},
+		{"__tostring",	lua_mysql_stmt_tostring},
+		{"__gc",	lua_mysql_stmt_gc},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable(L, mysql_stmt_label);
+	lua_pushvalue(L, -1);
+	luaL_register(L, NULL, stmt_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pushstring(L, mysql_stmt_label);
+	lua_setfield(L, -2, "__metatable");
+	lua_pop(L, 1);
+
+	static const struct luaL_Reg cursor_methods [] = {
+		{"fetch",	lua_mysql_cursor_fetch},
+		{"metadata",	lua_mysql_cursor_metadata},
+		{"close",	lua_mysql_cursor_close},
+		{"__tostring",	lua_mysql_cursor_tostring},
+		{"__gc",	lua_mysql_cursor_gc},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable(L, mysql_cursor_label);
+	lua_pushvalue(L, -1);
+	luaL_register(L, NULL, cursor_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pushstring(L, mysql_cursor_label);
+	lua_setfield(L, -2, "__metatable");
+	lua_pop(L, 1);
+
+	static const struct luaL_Reg binlog_methods [] = {
+		{"fetch",	lua_mysql_binlog_fetch},
+		{"position",	lua_mysql_binlog_position},
+		{"close",	lua_mysql_binlog_close},
+		{"__tostring",	lua_mysql_binlog_tostring},
+		{"__gc",	lua_mysql_binlog_gc},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable(L, mysql_binlog_label);
+	lua_pushvalue(L, -1);
+	luaL_register(L, NULL, binlog_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pushstring(L, mysql_binlog_label);
+	lua_setfield(L, -2, "__metatable");
+	lua_pop(L, 1);
+
+	static const struct luaL_Reg result_meta [] = {
+		{"__index",	lua_mysql_result_index},
+		{"__len",	lua_mysql_result_len},
+		{"__serialize",	lua_mysql_result_serialize},
+		{"__tostring",	lua_mysql_result_tostring},
+		{"__gc",	lua_mysql_result_gc},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable(L, mysql_result_label);
+	luaL_register(L, NULL, result_meta);
+	lua_pushstring(L, mysql_result_label);
+	lua_setfield(L, -2, "__metatable");
+	lua_pop(L, 1);
+
+	static const struct luaL_Reg row_meta [] = {
+		{"__index",	lua_mysql_row_index},
+		{"__len",	lua_mysql_row_len},
+		{"__serialize",	lua_mysql_row_serialize},
+		{"__tostring",	lua_mysql_row_tostring},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable(L, mysql_row_label);
+	luaL_register(L, NULL, row_meta);
+	lua_pushstring(L, mysql_row_label);
+	lua_setfield(L, -2, "__metatable");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, mysql_columns_label);
+	lua_pushcfunction(L, lua_mysql_columns_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, mysql_batch_label);
+	lua_pushcfunction(L, lua_mysql_batch_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
 	lua_newtable(L);
 	static const struct luaL_Reg meta [] = {
 		{"connect", lua_mysql_connect},
+		{"stats", lua_mysql_stats},
+		{"profile", lua_mysql_profile},
 		{NULL, NULL}
 	};
 	luaL_register(L, NULL, meta);
@@ -1,27 +1,699 @@
 -- init.lua (internal file)
 
+local bit = require('bit')
 local fiber = require('fiber')
+local clock = require('clock')
+-- Declares struct ibuf used by execute_msgpack.
+require('buffer')
 local driver = require('mysql.driver')
 local ffi = require('ffi')
 local log = require('log')
 
 local pool_mt
 local conn_mt
+local stmt_mt
+local cursor_mt
+local cursor_create
 
--- The marker for empty slots in a connection pool.
+-- The marker for free slots in a connection pool. A fiber takes a
+-- slot from pool.queue to use a connection: an idle one from
+-- pool.idle or a new one.
 --
--- Note: It should not be equal to `nil`, because fiber channel's
--- `get` method returns `nil` when a timeout is reached.
+-- Note: It should not be equal to `nil`, because the queue's `get`
+-- method returns `nil` when a timeout is reached.
 local POOL_EMPTY_SLOT = true
 
+-- Delays between failed reconnects of a pool in seconds.
+local RECONNECT_DELAY_MIN = 0.1
+local RECONNECT_DELAY_MAX = 30
+
+-- Open connection pools reported by mysql.stats().
+local pools = setmetatable({}, {__mode = 'k'})
+
+-- Requests taking longer than threshold seconds are written to a ring
+-- buffer of the last size ones when the profiler is on, see
+-- mysql.profiler_start().
+local SLOW_QUERY_THRESHOLD = 0.1
+local SLOW_LOG_SIZE = 100
+local profiler = {
+    enabled = false,
+    threshold = SLOW_QUERY_THRESHOLD,
+    size = SLOW_LOG_SIZE,
+    log = {},
+    -- Count of entries written since the start.
+    count = 0,
+}
+
+-- Coalescing of writes: rows of the same statement given by
+-- different fibers within coalesce_window seconds are written by one
+-- connection in one transaction.
+local COALESCE_WINDOW = 0.005
+local COALESCE_MAX_ROWS = 1000
+
+-- Free slots of a connection pool with an ordered list of fibers
+-- waiting for them. It is used like a fiber channel of slots, but
+-- a freed slot is given to the waiter with the highest priority,
+-- then with the earliest deadline, then to the one waiting longest.
+local slot_queue_mt
+
+local function slot_queue_create(size, max_waiters)
+    return setmetatable({
+        size = size,
+        free = 0,
+        max_waiters = max_waiters,
+        waiters = {},
+        seq = 0,
+        -- Statistics.
+        granted = 0,
+        rejected = 0,
+        timeouts = 0,
+        wait_time = 0,
+        max_wait_time = 0,
+    }, slot_queue_mt)
+end
+
+-- Whether waiter a should get a slot before waiter b.
+local function waiter_precedes(a, b)
+    if a.priority ~= b.priority then
+        return a.priority > b.priority
+    end
+    if a.deadline ~= b.deadline then
+        return a.deadline < b.deadline
+    end
+    return a.seq < b.seq
+end
+
+local function slot_queue_remove_waiter(self, waiter)
+    for i, w in ipairs(self.waiters) do
+        if w == waiter then
+            table.remove(self.waiters, i)
+            return
+        end
+    end
+end
+
+-- Take a slot. Return nil when the timeout is reached and throw
+-- an error when there are max_waiters fibers waiting already.
+local function slot_queue_get(self, timeout, priority)
+    if self.free > 0 then
+        self.free = self.free - 1
+        self.granted = self.granted + 1
+        return POOL_EMPTY_SLOT
+    end
+    if timeout ~= nil and timeout <= 0 then
+        return nil
+    end
+    if self.max_waiters ~= nil and #self.waiters >= self.max_waiters then
+        self.rejected = self.rejected + 1
+        error('Too many fibers are waiting for a connection')
+    end
+    local started = fiber.clock()
+    self.seq = self.seq + 1
+    local waiter = {
+        cond = fiber.cond(),
+        priority = priority or 0,
+        deadline = timeout and started + timeout or math.huge,
+        seq = self.seq,
+        slot = nil,
+    }
+    local pos = #self.waiters + 1
+    while pos > 1 and waiter_precedes(waiter, self.waiters[pos - 1]) do
+        pos = pos - 1
+    end
+    table.insert(self.waiters, pos, waiter)
+    while waiter.slot == nil do
+        local now = fiber.clock()
+        if now >= waiter.deadline then
+            break
+        end
+        local ok, err = pcall(waiter.cond.wait, waiter.cond,
+                              timeout and waiter.deadline - now)
+        if not ok then
+            -- The fiber is cancelled, give a slot away if any.
+            slot_queue_remove_waiter(self, waiter)
+            if waiter.slot ~= nil then
+                self:put(waiter.slot)
+            end
+            error(err)
+        end
+    end
+    local waited = fiber.clock() - started
+    if waiter.slot == nil then
+        slot_queue_remove_waiter(self, waiter)
+        self.timeouts = self.timeouts + 1
+        return nil
+    end
+    self.granted = self.granted + 1
+    self.wait_time = self.wait_time + waited
+    self.max_wait_time = math.max(self.max_wait_time, waited)
+    return waiter.slot
+end
+
+-- Give a slot back. Return false if all the slots are free.
+local function slot_queue_put(self, slot)
+    local waiter = table.remove(self.waiters, 1)
+    if waiter ~= nil then
+        waiter.slot = slot
+        waiter.cond:signal()
+        return true
+    end
+    if self.free >= self.size then
+        return false
+    end
+    self.free = self.free + 1
+    return true
+end
+
+slot_queue_mt = {
+    __index = {
+        get = slot_queue_get,
+        put = slot_queue_put,
+        count = function(self)
+            return self.free
+        end,
+        is_full = function(self)
+            return self.free == self.size
+        end,
+        is_empty = function(self)
+            return self.free == 0
+        end,
+    }
+}
+
+-- Cache of results of read queries keyed by SQL and parameters.
+-- Entries are kept in LRU order within a memory limit and expire
+-- after their TTL. A write through the connector drops entries of
+-- the tables it changes, other writers are seen after the TTL.
+local CACHE_SIZE = 16 * 1024 * 1024
+local CACHE_TTL = 1
+-- Analyzed statements kept by a cache or a cluster, see sql_memo().
+local SQL_PLANS_MAX = 1000
+-- Estimated memory of an entry besides its results.
+local CACHE_ENTRY_SIZE = 200
+
+local function cache_create(opts)
+    if type(opts) ~= 'table' then
+        opts = {}
+    end
+    local size = opts.size or CACHE_SIZE
+    local ttl = opts.ttl or CACHE_TTL
+    if type(size) ~= 'number' or size <= 0 then
+        error('cache size must be a positive number')
+    end
+    if type(ttl) ~= 'number' or ttl <= 0 then
+        error('cache ttl must be a positive number')
+    end
+    return {
+        size = size,
+        ttl = ttl,
+        entries = {},
+        -- Sets of entries by names of tables they read.
+        tables = {},
+        plans = {},
+        plan_count = 0,
+        -- The most and the least recently used entries.
+        head = nil,
+        tail = nil,
+        memory = 0,
+        count = 0,
+        -- Incremented on each invalidation, so results of a query
+        -- which ran meanwhile aren't stored.
+        epoch = 0,
+        -- Statistics.
+        hits = 0,
+        misses = 0,
+        evictions = 0,
+        expirations = 0,
+        invalidations = 0,
+    }
+end
+
+local function cache_unlink(cache, entry)
+    if entry.prev ~= nil then
+        entry.prev.next = entry.next
+    else
+        cache.head = entry.next
+    end
+    if entry.next ~= nil then
+        entry.next.prev = entry.prev
+    else
+        cache.tail = entry.prev
+    end
+    entry.prev = nil
+    entry.next = nil
+end
+
+local function cache_link(cache, entry)
+    entry.next = cache.head
+    if cache.head ~= nil then
+        cache.head.prev = entry
+    else
+        cache.tail = entry
+    end
+    cache.head = entry
+end
+
+local function cache_remove(cache, entry)
+    cache_unlink(cache, entry)
+    cache.entries[entry.key] = nil
+    for _, name in ipairs(entry.tables) do
+        local set = cache.tables[name]
+        set[entry] = nil
+        if next(set) == nil then
+            cache.tables[name] = nil
+        end
+    end
+    cache.memory = cache.memory - entry.size
+    cache.count = cache.count - 1
+end
+
+-- Estimate memory of results, nil for lazy ones.
+local function cache_value_size(value)
+    local t = type(value)
+    if t == 'string' then
+        return 24 + #value
+    elseif t == 'table' then
+        local size = 56
+        for _, v in pairs(value) do
+            local v_size = cache_value_size(v)
+            if v_size == nil then
+                return nil
+            end
+            size = size + 16 + v_size
+        end
+        return size
+    elseif t == 'cdata' then
+        return 16 + (ffi.sizeof(value) or 0)
+    elseif t == 'userdata' then
+        return nil
+    end
+    return 16
+end
+
+-- Build a key of a query in the current database db, nil if a
+-- parameter can't be a part of it. Unqualified table names of the
+-- same statement refer to different tables in other databases.
+local function cache_key(db, sql, ...)
+    local n = select('#', ...)
+    local parts = {db or '', sql}
+    for i = 1, n do
+        local v = select(i, ...)
+        local t = type(v)
+        if v == nil then
+            parts[i + 2] = 'n'
+        elseif t == 'number' then
+            parts[i + 2] = ('d%.17g'):format(v)
+        elseif t == 'string' then
+            parts[i + 2] = 's' .. #v .. ':' .. v
+        elseif t == 'boolean' then
+            parts[i + 2] = v and 'b1' or 'b0'
+        elseif ffi.istype('int64_t', v) or ffi.istype('uint64_t', v) then
+            -- An integer number and an int64_t of the same value
+            -- give the same key.
+            parts[i + 2] = 'd' .. tostring(v):gsub('U?LL$', '')
+        elseif t == 'cdata' then
+            parts[i + 2] = 'c' .. tostring(v)
+        else
+            return nil
+        end
+    end
+    return table.concat(parts, '\0')
+end
+
+-- Copy cached results, so that a caller changing its results
+-- doesn't change them for the others. FFI arrays of columnar
+-- results are copied too, box.NULL is kept.
+local function cache_copy(value)
+    local t = type(value)
+    if t == 'table' then
+        local copy = {}
+        for k, v in pairs(value) do
+            copy[k] = cache_copy(v)
+        end
+        return setmetatable(copy, getmetatable(value))
+    elseif t == 'cdata' and not ffi.istype('void *', value) then
+        local ctype = ffi.typeof(value)
+        local size = ffi.sizeof(value)
+        local copy
+        if ffi.sizeof(ctype) == nil then
+            -- A variable length array.
+            copy = ffi.new(ctype, size / ffi.sizeof(ctype, 1))
+        else
+            copy = ffi.new(ctype)
+        end
+        ffi.copy(copy, value, size)
+        return copy
+    end
+    return value
+end
+
+local function cache_get(cache, key)
+    local entry = cache.entries[key]
+    if entry == nil then
+        cache.misses = cache.misses + 1
+        return nil
+    end
+    if entry.expires <= fiber.clock() then
+        cache_remove(cache, entry)
+        cache.expirations = cache.expirations + 1
+        cache.misses = cache.misses + 1
+        return nil
+    end
+    cache.hits = cache.hits + 1
+    cache_unlink(cache, entry)
+    cache_link(cache, entry)
+    return cache_copy(entry.results)
+end
+
+local function cache_put(cache, key, results, tables, ttl)
+    local size = cache_value_size(results)
+    if size == nil then
+        return
+    end
+    size = size + #key + CACHE_ENTRY_SIZE
+    if size > cache.size then
+        return
+    end
+    local old = cache.entries[key]
+    if old ~= nil then
+        cache_remove(cache, old)
+    end
+    while cache.memory + size > cache.size do
+        cache_remove(cache, cache.tail)
+        cache.evictions = cache.evictions + 1
+    end
+    local entry = {
+        key = key,
+        results = cache_copy(results),
+        size = size,
+        expires = fiber.clock() + (ttl or cache.ttl),
+        tables = tables,
+    }
+    cache.entries[key] = entry
+    cache_link(cache, entry)
+    for _, name in ipairs(tables) do
+        local set = cache.tables[name]
+        if set == nil then
+            set = {}
+            cache.tables[name] = set
+        end
+        set[entry] = true
+    end
+    cache.memory = cache.memory + size
+    cache.count = cache.count + 1
+end
+
+-- Drop entries reading the given tables, all of them when tables
+-- is true.
+local function cache_invalidate(cache, tables)
+    cache.epoch = cache.epoch + 1
+    if tables == true then
+        cache.invalidations = cache.invalidations + cache.count
+        cache.entries = {}
+        cache.tables = {}
+        cache.head = nil
+        cache.tail = nil
+        cache.memory = 0
+        cache.count = 0
+        return
+    end
+    for _, name in ipairs(tables) do
+        local set = cache.tables[name]
+        if set ~= nil then
+            local dropped = {}
+            for entry in pairs(set) do
+                table.insert(dropped, entry)
+            end
+            for _, entry in ipairs(dropped) do
+                cache_remove(cache, entry)
+            end
+            cache.invalidations = cache.invalidations + #dropped
+        end
+    end
+end
+
+local function cache_stats(cache)
+    local lookups = cache.hits + cache.misses
+    return {
+        size = cache.size,
+        memory = cache.memory,
+        entries = cache.count,
+        hits = cache.hits,
+        misses = cache.misses,
+        hit_rate = lookups > 0 and cache.hits / lookups or 0,
+        evictions = cache.evictions,
+        expirations = cache.expirations,
+        invalidations = cache.invalidations,
+    }
+end
+
+-- Drop cached results of the given tables, all of them when no
+-- tables are given.
+local function cache_invalidate_tables(cache, tables)
+    if cache == nil then
+        return
+    end
+    if tables == nil then
+        return cache_invalidate(cache, true)
+    end
+    local names = {}
+    for i, name in ipairs(tables) do
+        names[i] = name:lower()
+    end
+    cache_invalidate(cache, names)
+end
+
+-- Words which end a list of tables, so they aren't taken for
+-- aliases.
+local SQL_CLAUSE_WORDS = {
+    where = true, group = true, order = true, limit = true, having = true,
+    from = true, union = true, join = true, inner = true, left = true,
+    right = true, cross = true, natural = true, straight_join = true,
+    on = true, using = true, set = true, values = true, value = true,
+    select = true, partition = true, window = true, into = true,
+    ['for'] = true, lock = true, use = true, force = true, ignore = true,
+}
+
+-- Functions and words which make results of a SELECT depend on
+-- something besides the tables it reads.
+local SQL_VOLATILE_WORDS = {
+    into = true, update = true, share = true, sql_no_cache = true,
+    rand = true, uuid = true, uuid_short = true, now = true,
+    sysdate = true, curdate = true, curtime = true, current_date = true,
+    current_time = true, current_timestamp = true, localtime = true,
+    localtimestamp = true, unix_timestamp = true, utc_date = true,
+    utc_time = true, utc_timestamp = true, connection_id = true,
+    last_insert_id = true, found_rows = true, row_count = true,
+    get_lock = true, release_lock = true, is_free_lock = true,
+    is_used_lock = true, sleep = true, benchmark = true, user = true,
+    current_user = true, session_user = true, system_user = true,
+    database = true, schema = true, nextval = true, lastval = true,
+}
+
+-- Statements which change tables after WITH.
+local SQL_WRITE_WORDS = {
+    insert = true, replace = true, update = true, delete = true,
+}
+
+-- Statements which change no tables.
+local SQL_READ_WORDS = {
+    select = true, show = true, describe = true, desc = true,
+    explain = true, set = true, begin = true, start = true, commit = true,
+    rollback = true, savepoint = true, release = true, use = true,
+    ['do'] = true, help = true,
+}
+
+-- Replace string literals of a statement with empty ones. A quote
+-- is escaped by a backslash or by doubling it.
+local function sql_strip_strings(sql)
+    local parts = {}
+    local pos = 1
+    while true do
+        local start, _, quote = sql:find('([\'"])', pos)
+        if start == nil then
+            break
+        end
+        table.insert(parts, sql:sub(pos, start - 1))
+        table.insert(parts, quote .. quote)
+        local i = start + 1
+        while i <= #sql do
+            i = sql:find('[\\' .. quote .. ']', i)
+            if i == nil then
+                i = #sql + 1
+            elseif sql:byte(i) == 92 then
+                -- A backslash.
+                i = i + 2
+            elseif sql:sub(i + 1, i + 1) == quote then
+                i = i + 2
+            else
+                break
+            end
+        end
+        pos = i + 1
+    end
+    table.insert(parts, sql:sub(pos))
+    return table.concat(parts)
+end
+
+-- Lowercase words and punctuation of a statement without string
+-- literals and comments.
+local function sql_tokens(sql)
+    sql = sql_strip_strings(sql:lower())
+    sql = sql:gsub('/%*.-%*/', ' ')
+    sql = sql:gsub('%-%-%s[^\n]*', ' ')
+    sql = sql:gsub('#[^\n]*', ' ')
+    sql = sql:gsub('([,;%(%)=<>])', ' %1 ')
+    local tokens = {}
+    for token in sql:gmatch('%S+') do
+        table.insert(tokens, token)
+    end
+    -- A trailing semicolon ends the only statement.
+    if tokens[#tokens] == ';' then
+        tokens[#tokens] = nil
+    end
+    return tokens
+end
+
+-- Add names of tables listed like "db.a AS x, `b` y" starting at
+-- token i to a set.
+local function sql_collect_tables(tokens, i, tables)
+    while true do
+        local token = tokens[i]
+        if token == nil or not token:match('^[%w_`$]') or
+           SQL_CLAUSE_WORDS[token] then
+            return
+        end
+        tables[token:gsub('`', ''):match('([^%.]*)$')] = true
+        i = i + 1
+        if tokens[i] == 'as' then
+            i = i + 2
+        elseif tokens[i] ~= nil and tokens[i]:match('^[%w_`]') and
+               not SQL_CLAUSE_WORDS[tokens[i]] then
+            i = i + 1
+        end
+        if tokens[i] ~= ',' then
+            return
+        end
+        i = i + 1
+    end
+end
+
+-- Skip words from a set starting at token i.
+local function sql_skip(tokens, i, words)
+    while words[tokens[i]] do
+        i = i + 1
+    end
+    return i
+end
+
+local function set_to_list(set)
+    local list = {}
+    for name in pairs(set) do
+        table.insert(list, name)
+    end
+    return list
+end
+
+local SQL_INSERT_MODIFIERS = {
+    low_priority = true, delayed = true, high_priority = true,
+    ignore = true, into = true,
+}
+local SQL_UPDATE_MODIFIERS = {low_priority = true, ignore = true}
+local SQL_DELETE_MODIFIERS = {low_priority = true, quick = true,
+                              ignore = true}
+
+-- Analyze a statement: whether its results can be cached, which
+-- tables it reads and which ones it changes (true when it isn't
+-- known).
+local function sql_plan(sql)
+    local tokens = sql_tokens(sql)
+    local read = {}
+    for i, token in ipairs(tokens) do
+        if token == 'from' or token == 'join' or token == 'straight_join' then
+            sql_collect_tables(tokens, i + 1, read)
+        end
+    end
+    local plan = {write = false}
+    for _, token in ipairs(tokens) do
+        if token == ';' then
+            -- Several statements.
+            plan.write = true
+            return plan
+        end
+    end
+    local first = tokens[1]
+    if first == 'select' or first == 'with' or first == '(' then
+        for _, token in ipairs(tokens) do
+            if first == 'with' and SQL_WRITE_WORDS[token] then
+                -- WITH ... DELETE and so on.
+                plan.write = true
+                return plan
+            end
+            if SQL_VOLATILE_WORDS[token] or token:match('^@') then
+                return plan
+            end
+        end
+        plan.read = set_to_list(read)
+        return plan
+    end
+    if SQL_READ_WORDS[first] then
+        return plan
+    end
+    local write = {}
+    if first == 'insert' or first == 'replace' then
+        sql_collect_tables(tokens, sql_skip(tokens, 2, SQL_INSERT_MODIFIERS),
+                           write)
+    elseif first == 'update' or first == 'delete' then
+        local modifiers = first == 'update' and SQL_UPDATE_MODIFIERS or
+                          SQL_DELETE_MODIFIERS
+        sql_collect_tables(tokens, sql_skip(tokens, 2, modifiers), write)
+        -- Joined tables may be changed as well.
+        for name in pairs(read) do
+            write[name] = true
+        end
+    elseif first == 'truncate' then
+        sql_collect_tables(tokens, sql_skip(tokens, 2, {table = true}),
+                           write)
+    else
+        plan.write = true
+        return plan
+    end
+    plan.write = set_to_list(write)
+    if #plan.write == 0 then
+        plan.write = true
+    end
+    return plan
+end
+
+-- An analysis of a statement remembered by its owner in plans,
+-- they are forgotten all at once when there are too many of them.
+local function sql_memo(owner, sql, analyze)
+    local plan = owner.plans[sql]
+    if plan == nil then
+        if owner.plan_count >= SQL_PLANS_MAX then
+            owner.plans = {}
+            owner.plan_count = 0
+        end
+        plan = analyze(sql)
+        owner.plans[sql] = plan
+        owner.plan_count = owner.plan_count + 1
+    end
+    return plan
+end
+
+local function cache_plan(cache, sql)
+    return sql_memo(cache, sql, sql_plan)
+end
+
 --create a new connection
-local function conn_create(mysql_conn)
+local function conn_create(mysql_conn, cache)
     local queue = fiber.channel(1)
     queue:put(true)
     local conn = setmetatable({
         usable = true,
         conn = mysql_conn,
         queue = queue,
+        cache = cache,
    }, conn_mt)
     return conn
 end
@@ -31,6 +703,8 @@ end
 local CONN_GC_HOOK_TIMEOUT = 0
 
 local function conn_gc_hook(pool, conn_id)
+    pool.live = pool.live - 1
+    pool.gc_recovered = pool.gc_recovered + 1
     local success = pool.queue:put(POOL_EMPTY_SLOT, CONN_GC_HOOK_TIMEOUT)
     if not success then
         log.error('mysql pool %s internal queue unexpected state: there are no ' ..
@@ -43,25 +717,104 @@ local function conn_gc_hook(pool, conn_id)
     end
 end
 
--- get connection from pool
-local function conn_get(pool, timeout)
-    local mysql_conn = pool.queue:get(timeout)
+-- Extra connection options passed to the driver.
+local function driver_opts(opts)
+    return {
+        stmt_cache_size = opts.stmt_cache_size,
+        decode_budget_rows = opts.decode_budget_rows,
+        decode_budget_time = opts.decode_budget_time,
+        result_format = opts.result_format,
+        track_session = opts.reset_strategy == 'tracked',
+        query_timeout = opts.query_timeout,
+        native_types = opts.native_types,
+    }
+end
+
+-- Split a query of conn:execute() to a statement, a timeout and
+-- a cache TTL (false to bypass the cache).
+local function query_parse(query)
+    if type(query) ~= 'table' then
+        return query
+    end
+    local timeout = query.timeout
+    if timeout ~= nil and (type(timeout) ~= 'number' or timeout < 0) then
+        error('timeout must be a non-negative number')
+    end
+    local cache = query.cache
+    if cache ~= nil and cache ~= false and
+       (type(cache) ~= 'number' or cache <= 0) then
+        error('cache must be false or a positive number')
+    end
+    return query.sql, timeout, cache
+end
+
+-- Ways to reset a session of a connection taken from a pool.
+local RESET_STRATEGIES = {
+    change_user = true,
+    reset_connection = true,
+    tracked = true,
+    none = true,
+}
+
+-- Open a new connection of a pool. Failed attempts make next
+-- ones wait for a growing delay with jitter, so that a restart of
+-- the server doesn't cause a storm of reconnects.
+local function pool_connect(pool)
+    if fiber.clock() < pool.reconnect_at then
+        return nil, pool.reconnect_error
+    end
+    local ok, status, mysql_conn = pcall(driver.connect, pool.host,
+                                         pool.port or 0, pool.user,
+                                         pool.pass, pool.db,
+                                         pool.use_numeric_result,
+                                         pool.keep_null, pool.driver_opts)
+    if not ok or status < 0 then
+        local err = ok and mysql_conn or status
+        pool.reconnect_delay = math.min(math.max(pool.reconnect_delay * 2,
+                                                 RECONNECT_DELAY_MIN),
+                                        RECONNECT_DELAY_MAX)
+        pool.reconnect_at = fiber.clock() +
+                            pool.reconnect_delay * (0.5 + math.random())
+        pool.reconnect_error = err
+        pool.connect_errors = pool.connect_errors + 1
+        return nil, err
+    end
+    pool.reconnect_delay = 0
+    pool.reconnect_at = 0
+    pool.live = pool.live + 1
+    pool.connects = pool.connects + 1
+    return mysql_conn
+end
+
+-- Put an idle connection to a pool.
+local function pool_add_idle(pool, mysql_conn)
+    local now = fiber.clock()
+    table.insert(pool.idle, {conn = mysql_conn, since = now, checked = now})
+end
 
+-- get connection from pool
+local function conn_get(pool, timeout, priority)
+    local start = profiler.enabled and clock.monotonic()
     -- A timeout was reached.
-    if mysql_conn == nil then return nil end
+    if pool.queue:get(timeout, priority) == nil then return nil end
+    local pool_wait = start and clock.monotonic() - start or nil
 
-    if mysql_conn == POOL_EMPTY_SLOT then
-        local status
-        status, mysql_conn = driver.connect(pool.host, pool.port or 0,
-                                            pool.user, pool.pass,
-                                            pool.db, pool.use_numeric_result,
-                                            pool.keep_null)
-        if status < 0 then
-            error(mysql_conn)
+    -- The most recently used connection is taken, so that the rest
+    -- stay idle and can be closed.
+    local idle = table.remove(pool.idle)
+    local mysql_conn = idle and idle.conn
+    if mysql_conn == nil then
+        local err
+        mysql_conn, err = pool_connect(pool)
+        if mysql_conn == nil then
+            pool.queue:put(POOL_EMPTY_SLOT)
+            error(err)
         end
     end
 
-    local conn = conn_create(mysql_conn)
+    local conn = conn_create(mysql_conn, pool.cache)
+    -- Reported by the profiler with the first request.
+    conn.pool_wait = pool_wait
     local conn_id = tostring(conn)
     -- we can use ffi gc to return mysql connection to pool
     conn.__gc_hook = ffi.gc(ffi.new('void *'),
@@ -114,23 +867,292 @@ local function conn_acquire_lock(conn)
     end
 end
 
+-- Take the lock of a connection for a request. When the profiler is
+-- on, returns the start time of the request and seconds of waiting
+-- for the lock.
+local function conn_acquire_profiled(conn)
+    if not profiler.enabled then
+        conn_acquire_lock(conn)
+        return nil
+    end
+    local start = clock.monotonic()
+    conn_acquire_lock(conn)
+    return start, clock.monotonic() - start
+end
+
+local function slow_log_add(entry)
+    profiler.log[profiler.count % profiler.size + 1] = entry
+    profiler.count = profiler.count + 1
+end
+
+-- Write a request started at start to the slow log if it took longer
+-- than the threshold, along with phases profiled by the driver unless
+-- its results are cached. It is called before the lock of the
+-- connection is released.
+local function conn_profile_finish(conn, sql, start, lock, cached)
+    local pool_wait = conn.pool_wait or 0
+    conn.pool_wait = nil
+    if start == nil then
+        return
+    end
+    local duration = pool_wait + clock.monotonic() - start
+    if not profiler.enabled or duration < profiler.threshold then
+        return
+    end
+    -- The driver keeps the profile of the previous request then.
+    local entry = not cached and conn.conn:profile() or {cached = true}
+    entry.time = fiber.time()
+    entry.sql = sql
+    entry.duration = duration
+    entry.pool_wait = pool_wait
+    entry.lock = lock
+    slow_log_add(entry)
+end
+
+-- Merge lists of changed tables, true means all the tables.
+local function cache_merge(tables, write)
+    if tables == true or write == true then
+        return true
+    end
+    local merged = {}
+    for _, name in ipairs(tables or {}) do
+        table.insert(merged, name)
+    end
+    for _, name in ipairs(write) do
+        table.insert(merged, name)
+    end
+    return merged
+end
+
+-- Drop cache entries of tables changed by a statement with the
+-- given status. Tables changed in a transaction are dropped again
+-- when it ends: other connections could cache the old rows
+-- meanwhile.
+local function conn_cache_written(conn, write, status)
+    local cache = conn.cache
+    if write then
+        cache_invalidate(cache, write)
+    end
+    if status >= 0 and conn.conn:in_transaction() then
+        if write then
+            conn.cache_pending = cache_merge(conn.cache_pending, write)
+        end
+    elseif conn.cache_pending ~= nil then
+        cache_invalidate(cache, conn.cache_pending)
+        conn.cache_pending = nil
+    end
+end
+
+local function quote_name(name)
+    return '`' .. name:gsub('`', '``') .. '`'
+end
+
+-- A LOAD DATA statement reading tab separated values of columns of
+-- a table.
+local function load_data_sql(table_name, columns, opts)
+    local parts = {}
+    for part in table_name:gsub('`', ''):gmatch('[^%.]+') do
+        table.insert(parts, quote_name(part))
+    end
+    local names = {}
+    for i, column in ipairs(columns or {}) do
+        names[i] = quote_name(column)
+    end
+    local duplicates = ''
+    if opts.on_duplicate == 'replace' then
+        duplicates = ' REPLACE'
+    elseif opts.on_duplicate == 'ignore' then
+        duplicates = ' IGNORE'
+    elseif opts.on_duplicate ~= nil then
+        error("on_duplicate must be 'replace' or 'ignore'")
+    end
+    local sql = ("LOAD DATA LOCAL INFILE 'tarantool'%s INTO TABLE %s " ..
+                 "CHARACTER SET utf8mb4"):format(duplicates,
+                                                  table.concat(parts, '.'))
+    if #names > 0 then
+        sql = sql .. ' (' .. table.concat(names, ', ') .. ')'
+    end
+    return sql, names
+end
+
+-- A function returning rows of a source of conn:load_data() one by
+-- one: a function, an iterator of luafun, a space or an index. An
+-- ibuf is returned as is.
+local function load_data_source(source, opts)
+    if type(source) == 'cdata' or type(source) == 'function' then
+        return source
+    end
+    local gen, param, state
+    if type(source) == 'table' and source.gen ~= nil then
+        gen, param, state = source.gen, source.param, source.state
+    elseif type(source) == 'table' and source.pairs ~= nil then
+        gen, param, state = source:pairs(opts.key,
+                                         {iterator = opts.iterator})
+    else
+        error('The source must be a function, an iterator, a space, ' ..
+              'an index or an ibuf')
+    end
+    return function()
+        local row
+        state, row = gen(param, state)
+        if state == nil then
+            return nil
+        end
+        if box.tuple.is(row) then
+            return row:totable()
+        end
+        return row
+    end
+end
+
 conn_mt = {
     __index = {
-        execute = function(self, sql, ...)
-            conn_acquire_lock(self)
+        execute = function(self, query, ...)
+            local sql, timeout, ttl = query_parse(query)
+            local cache = self.cache
+            local plan = cache ~= nil and type(sql) == 'string' and
+                         cache_plan(cache, sql) or nil
+            local start, lock = conn_acquire_profiled(self)
+            local key, epoch
+            if plan ~= nil and plan.read ~= nil and ttl ~= false and
+               not self.conn:in_transaction() then
+                key = cache_key(self.conn:current_db(), sql, ...)
+                if key ~= nil then
+                    local results = cache_get(cache, key)
+                    if results ~= nil then
+                        conn_profile_finish(self, sql, start, lock, true)
+                        self.queue:put(true)
+                        return results, true
+                    end
+                    epoch = cache.epoch
+                end
+            end
+            if timeout ~= nil then
+                self.conn:set_timeout(timeout)
+            end
             local status, datas
             if select('#', ...) > 0 then
                 status, datas = self.conn:execute_prepared(sql, ...)
             else
                 status, datas = self.conn:execute(sql)
             end
+            conn_profile_finish(self, sql, start, lock)
+            if plan ~= nil then
+                conn_cache_written(self, plan.write, status)
+            end
             if status ~= 0 then
+                -- Callers tell a lost connection from a failed
+                -- statement or a timeout by it.
+                self.failed_status = status
                 self.queue:put(status > 0)
                 error(datas)
             end
+            if key ~= nil and cache.epoch == epoch then
+                cache_put(cache, key, datas, plan.read, ttl)
+            end
             self.queue:put(true)
             return datas, true
         end,
+        execute_msgpack = function(self, ibuf, query, ...)
+            if type(ibuf) ~= 'cdata' then
+                error('Usage: conn:execute_msgpack(ibuf, sql, ...)')
+            end
+            local sql, timeout = query_parse(query)
+            local start, lock = conn_acquire_profiled(self)
+            if timeout ~= nil then
+                self.conn:set_timeout(timeout)
+            end
+            local status, size = self.conn:execute_msgpack(ibuf, sql, ...)
+            conn_profile_finish(self, sql, start, lock)
+            if self.cache ~= nil and type(sql) == 'string' then
+                conn_cache_written(self, cache_plan(self.cache, sql).write,
+                                   status)
+            end
+            if status ~= 0 then
+                self.queue:put(status > 0)
+                error(size)
+            end
+            self.queue:put(true)
+            return size, true
+        end,
+        execute_batch = function(self, batch, opts)
+            opts = opts or {}
+            if type(batch) ~= 'table' then
+                error('Usage: conn:execute_batch({{sql, ...}, ...}, opts)')
+            end
+            conn_acquire_lock(self)
+            local status, results, errors = self.conn:execute_batch(batch,
+                opts.stop_on_error ~= false)
+            if self.cache ~= nil then
+                local write
+                for _, statement in ipairs(batch) do
+                    local sql = type(statement) == 'table' and statement[1]
+                    if type(sql) == 'string' then
+                        local plan = cache_plan(self.cache, sql)
+                        if plan.write then
+                            write = cache_merge(write, plan.write)
+                        end
+                    end
+                end
+                conn_cache_written(self, write, status)
+            end
+            if status ~= 0 then
+                self.queue:put(status > 0)
+                error(results)
+            end
+            self.queue:put(true)
+            if next(errors) == nil then
+                errors = nil
+            end
+            return results, errors
+        end,
+        load_into = function(self, space, query, ...)
+            if type(space) ~= 'table' then
+                space = box.space[space]
+            end
+            if space == nil or (type(query) ~= 'string' and
+                                type(query) ~= 'table') then
+                error('Usage: conn:load_into(space, query, ...)')
+            end
+            local sql, opts = query, {}
+            if type(query) == 'table' then
+                sql = query.sql
+                opts = {
+                    fields = query.fields,
+                    types = query.types,
+                    batch_size = query.batch_size,
+                }
+            end
+            conn_acquire_lock(self)
+            local status, count = self.conn:load_into(space.id, sql, opts,
+                                                      ...)
+            if status ~= 0 then
+                self.queue:put(status > 0)
+                error(count)
+            end
+            self.queue:put(true)
+            return count, true
+        end,
+        load_data = function(self, table_name, columns, source, opts)
+            opts = opts or {}
+            if type(table_name) ~= 'string' or source == nil then
+                error('Usage: conn:load_data(table, columns, source, opts)')
+            end
+            local sql, names = load_data_sql(table_name, columns, opts)
+            local rows = load_data_source(source, opts)
+            conn_acquire_lock(self)
+            local status, count = self.conn:load_data(sql, rows, #names)
+            if self.cache ~= nil then
+                local name = table_name:gsub('`', ''):match('([^%.]*)$')
+                conn_cache_written(self, {name:lower()}, status)
+            end
+            if status ~= 0 then
+                self.queue:put(status > 0)
+                error(count)
+            end
+            self.queue:put(true)
+            return count, true
+        end,
         begin = function(self)
             return self:execute('BEGIN') ~= nil
         end,
@@ -151,11 +1173,11 @@ conn_mt = {
             self.queue:put(false)
             return true
         end,
-        reset = function(self, user, pass, db)
+        reset = function(self, user, pass, db, strategy)
             conn_acquire_lock(self)
             -- If the update of the connection settings fails, we must set
             -- the connection to a "broken" state and throw an error.
-            local status = self.conn:reset(user, pass, db)
+            local status = self.conn:reset(user, pass, db, strategy)
             if not status then
                 self.queue:put(false)
                 error('Сonnection settings update failed.')
@@ -167,58 +1189,419 @@ conn_mt = {
             local ret = self.conn:quote(value)
             self.queue:put(true)
             return ret
-        end
-    }
-}
-
--- Create connection pool. Accepts mysql connection params (host, port, user,
--- password, dbname), size.
-local function pool_create(opts)
+        end,
+        prepare = function(self, sql)
+            conn_acquire_lock(self)
+            local status, stmt = self.conn:prepare(sql)
+            if status ~= 0 then
+                self.queue:put(status > 0)
+                error(stmt)
+            end
+            self.queue:put(true)
+            return setmetatable({
+                conn = self,
+                stmt = stmt,
+                sql = sql,
+                usable = true,
+                -- Tables changed by the statement for the cache.
+                write = self.cache ~= nil and
+                        cache_plan(self.cache, sql).write,
+            }, stmt_mt)
+        end,
+        cursor = function(self, sql, ...)
+            conn_acquire_lock(self)
+            local status, cursor = self.conn:cursor(sql, ...)
+            if status ~= 0 then
+                self.queue:put(status > 0)
+                error(cursor)
+            end
+            return cursor_create(self, cursor)
+        end,
+        stmt_cache_stats = function(self)
+            if not self.usable then
+                error('Connection is not usable')
+            end
+            return self.conn:stmt_cache_stats()
+        end,
+        cache_stats = function(self)
+            if self.cache == nil then
+                return nil
+            end
+            return cache_stats(self.cache)
+        end,
+        cache_invalidate = function(self, tables)
+            cache_invalidate_tables(self.cache, tables)
+        end,
+    }
+}
+
+-- Rows fetched by a cursor at once by default.
+local CURSOR_CHUNK_SIZE = 1000
+
+-- A cursor holds the connection lock until it is read out or
+-- closed. A forgotten cursor releases it when it is collected.
+local function cursor_gc_hook(conn, cursor)
+    local status = cursor:close()
+    conn.queue:put(status >= 0)
+end
+
+cursor_create = function(conn, cursor)
+    return setmetatable({
+        conn = conn,
+        cursor = cursor,
+        usable = true,
+        exhausted = false,
+        meta = cursor:metadata(),
+        __gc_hook = ffi.gc(ffi.new('void *'),
+            function(self)
+                -- Fiber yields are prohibited in gc.
+                fiber.new(cursor_gc_hook, conn, cursor)
+            end),
+    }, cursor_mt)
+end
+
+local function cursor_release(cursor, ok)
+    cursor.usable = false
+    ffi.gc(cursor.__gc_hook, nil)
+    cursor.conn.queue:put(ok)
+end
+
+local function check_chunk_size(n)
+    if n == nil then
+        return CURSOR_CHUNK_SIZE
+    end
+    if type(n) ~= 'number' or n < 1 then
+        error('Chunk size should be a positive number')
+    end
+    return n
+end
+
+-- Row i of a columnar result set, a table keyed like its columns.
+local function columnar_row(result, i)
+    local row = {}
+    for name, values in pairs(result.columns) do
+        local nulls = result.nulls[name]
+        if nulls == nil or bit.band(nulls[bit.rshift(i, 3)],
+                                    bit.lshift(1, i % 8)) == 0 then
+            row[name] = values[i]
+        end
+    end
+    return row
+end
+
+cursor_mt = {
+    __index = {
+        fetch = function(self, n)
+            n = check_chunk_size(n)
+            if self.exhausted then
+                return nil
+            end
+            if not self.usable then
+                error('Cursor is not usable')
+            end
+            local status, rows, eof = self.cursor:fetch(n)
+            if status ~= 0 then
+                cursor_release(self, status > 0)
+                error(rows)
+            end
+            if eof then
+                self.exhausted = true
+                cursor_release(self, true)
+                -- A columnar result set has no length.
+                if (rows.count or #rows) == 0 then
+                    return nil
+                end
+            end
+            return rows
+        end,
+        rows = function(self, n)
+            n = check_chunk_size(n)
+            local rows
+            local i = 0
+            return function()
+                -- A columnar result set has no length.
+                if rows == nil or i == (rows.count or #rows) then
+                    rows = self:fetch(n)
+                    i = 0
+                    if rows == nil then
+                        return nil
+                    end
+                end
+                i = i + 1
+                if rows.count ~= nil then
+                    return columnar_row(rows, i)
+                end
+                return rows[i]
+            end
+        end,
+        chunks = function(self, n)
+            n = check_chunk_size(n)
+            return function()
+                return self:fetch(n)
+            end
+        end,
+        metadata = function(self)
+            return self.meta
+        end,
+        close = function(self)
+            if self.exhausted then
+                return true
+            end
+            if not self.usable then
+                error('Cursor is not usable')
+            end
+            local status, err = self.cursor:close()
+            cursor_release(self, status >= 0)
+            if status ~= 0 then
+                error(err)
+            end
+            return true
+        end
+    }
+}
+
+local function stmt_acquire_lock(stmt)
+    if not stmt.usable then
+        error('Statement is not usable')
+    end
+    return conn_acquire_profiled(stmt.conn)
+end
+
+-- Execute a statement for each of rows, return affected rows, the
+-- first generated insert id and results of rows with row_results.
+local function stmt_execute_many(self, rows, opts)
     opts = opts or {}
-    opts.size = opts.size or 1
-    local queue = fiber.channel(opts.size)
-
-    for i = 1, opts.size do
-        local status, conn = driver.connect(opts.host, opts.port or 0,
-                                            opts.user, opts.password,
-                                            opts.db, opts.use_numeric_result,
-                                            opts.keep_null)
-        if status < 0 then
-            while queue:count() > 0 do
-                local mysql_conn = queue:get()
-                mysql_conn:close()
+    stmt_acquire_lock(self)
+    local status, datas, insert_id, results = self.stmt:execute_many(rows,
+        opts.batch_size, opts.row_results)
+    if self.conn.cache ~= nil then
+        conn_cache_written(self.conn, self.write, status)
+    end
+    if status ~= 0 then
+        self.conn.queue:put(status > 0)
+        error(datas)
+    end
+    self.conn.queue:put(true)
+    return datas, insert_id, results
+end
+
+stmt_mt = {
+    __index = {
+        execute = function(self, ...)
+            local start, lock = stmt_acquire_lock(self)
+            local status, datas = self.stmt:execute(...)
+            conn_profile_finish(self.conn, self.sql, start, lock)
+            if self.conn.cache ~= nil then
+                conn_cache_written(self.conn, self.write, status)
+            end
+            if status ~= 0 then
+                self.conn.queue:put(status > 0)
+                error(datas)
+            end
+            self.conn.queue:put(true)
+            return datas, true
+        end,
+        execute_many = function(self, rows, opts)
+            local affected_rows, _, results = stmt_execute_many(self, rows,
+                                                                opts)
+            if results ~= nil then
+                return affected_rows, true, results
             end
-            error(conn)
+            return affected_rows, true
+        end,
+        close = function(self)
+            stmt_acquire_lock(self)
+            self.usable = false
+            self.stmt:close()
+            self.conn.queue:put(true)
+            return true
+        end
+    }
+}
+
+-- Remove an idle connection from a pool, return false if it is
+-- not idle anymore.
+local function pool_remove_idle(pool, idle)
+    for i = #pool.idle, 1, -1 do
+        if pool.idle[i] == idle then
+            table.remove(pool.idle, i)
+            return true
         end
-        queue:put(conn)
     end
+    return false
+end
 
-    return setmetatable({
+-- Close connections idle for longer than idle_timeout, ping the
+-- ones not checked for health_check_interval and open new ones
+-- until there are min_size connections.
+local function pool_check(pool)
+    local now = fiber.clock()
+    if pool.idle_timeout ~= nil then
+        for i = #pool.idle, 1, -1 do
+            local idle = pool.idle[i]
+            if pool.live > pool.min_size and
+               now - idle.since > pool.idle_timeout then
+                table.remove(pool.idle, i)
+                pool.live = pool.live - 1
+                idle.conn:close()
+            end
+        end
+    end
+    if pool.health_check_interval ~= nil then
+        local checked = {}
+        for _, idle in ipairs(pool.idle) do
+            if now - idle.checked >= pool.health_check_interval then
+                table.insert(checked, idle)
+            end
+        end
+        -- A connection is pinged in a slot, so it can't be taken.
+        for _, idle in ipairs(checked) do
+            if not pool.usable or not pool.queue:get(0) then
+                break
+            end
+            if pool_remove_idle(pool, idle) then
+                if idle.conn:ping() then
+                    idle.checked = fiber.clock()
+                    table.insert(pool.idle, 1, idle)
+                else
+                    pool.live = pool.live - 1
+                    idle.conn:close()
+                end
+            end
+            pool.queue:put(POOL_EMPTY_SLOT)
+        end
+    end
+    while pool.usable and pool.live < pool.min_size and
+          pool.queue:get(0) do
+        local mysql_conn = pool_connect(pool)
+        if mysql_conn ~= nil then
+            pool_add_idle(pool, mysql_conn)
+        end
+        pool.queue:put(POOL_EMPTY_SLOT)
+        if mysql_conn == nil then
+            break
+        end
+    end
+end
+
+-- The background fiber of a pool.
+local function pool_maintain(pool)
+    while pool.usable do
+        pool.maintain_cond:wait(pool.check_interval)
+        if pool.usable then
+            local ok, err = pcall(pool_check, pool)
+            if not ok then
+                log.error('mysql pool %s health check failed: %s', pool, err)
+            end
+        end
+    end
+end
+
+-- Create connection pool. Accepts mysql connection params (host, port, user,
+-- password, dbname), size.
+local function pool_create(opts)
+    opts = opts or {}
+    opts.max_size = opts.max_size or opts.size or 1
+    opts.min_size = opts.min_size or opts.max_size
+    if opts.min_size > opts.max_size then
+        error('min_size must not be greater than max_size')
+    end
+    opts.reset_strategy = opts.reset_strategy or 'change_user'
+    if not RESET_STRATEGIES[opts.reset_strategy] then
+        error(('Unknown reset strategy %s'):format(opts.reset_strategy))
+    end
+    local queue = slot_queue_create(opts.max_size, opts.max_waiters)
+
+    local pool = setmetatable({
+        name        = opts.name or ('%s:%s/%s'):format(opts.host or '',
+                                                      opts.port or '',
+                                                      opts.db or ''),
         -- connection variables
         host        = opts.host,
         port        = opts.port,
         user        = opts.user,
         pass        = opts.password,
         db          = opts.db,
-        size        = opts.size,
+        size        = opts.max_size,
+        min_size    = opts.min_size,
         use_numeric_result = opts.use_numeric_result,
         keep_null   = opts.keep_null,
+        driver_opts = driver_opts(opts),
+        reset_strategy = opts.reset_strategy,
+        idle_timeout = opts.idle_timeout,
+        health_check_interval = opts.health_check_interval,
+        coalesce_window = opts.coalesce_window or COALESCE_WINDOW,
+        coalesce_max_rows = opts.coalesce_max_rows or COALESCE_MAX_ROWS,
+        coalesce_row_results = opts.coalesce_row_results,
+        cache       = opts.cache and cache_create(opts.cache) or nil,
 
         -- private variables
         queue       = queue,
-        usable      = true
+        idle        = {},
+        live        = 0,
+        coalesce_batches = {},
+        reconnect_delay = 0,
+        reconnect_at = 0,
+        usable      = true,
+        -- Statistics.
+        connects    = 0,
+        connect_errors = 0,
+        gc_recovered = 0,
     }, pool_mt)
+
+    -- Open min_size connections in parallel.
+    local opened = fiber.channel(opts.min_size)
+    for _ = 1, opts.min_size do
+        fiber.create(function()
+            opened:put({pool_connect(pool)})
+        end)
+    end
+    local err
+    for _ = 1, opts.min_size do
+        local res = opened:get()
+        if res[1] ~= nil then
+            pool_add_idle(pool, res[1])
+        else
+            err = err or res[2]
+        end
+    end
+    if err ~= nil then
+        for _, idle in ipairs(pool.idle) do
+            idle.conn:close()
+        end
+        error(err)
+    end
+    for _ = 1, opts.max_size do
+        queue:put(POOL_EMPTY_SLOT)
+    end
+
+    pool.check_interval = opts.health_check_interval or
+                          (opts.idle_timeout and opts.idle_timeout / 2)
+    if pool.check_interval ~= nil then
+        pool.maintain_cond = fiber.cond()
+        fiber.create(pool_maintain, pool)
+    end
+    -- Connections opened later replace closed or lost ones.
+    pool.initial_connects = pool.connects
+    pools[pool] = true
+    return pool
 end
 
 -- Close pool
 local function pool_close(self)
     self.usable = false
-    for i = 1, self.size do
-        local mysql_conn = self.queue:get()
-        if mysql_conn ~= POOL_EMPTY_SLOT then
-            mysql_conn:close()
-        end
+    pools[self] = nil
+    if self.maintain_cond ~= nil then
+        self.maintain_cond:signal()
+    end
+    for _ = 1, self.size do
+        self.queue:get()
     end
+    for _, idle in ipairs(self.idle) do
+        idle.conn:close()
+    end
+    self.idle = {}
+    self.live = 0
     return true
 end
 
@@ -229,12 +1612,12 @@ local function pool_get(self, opts)
     if not self.usable then
         error('Pool is not usable')
     end
-    local conn = conn_get(self, opts.timeout)
+    local conn = conn_get(self, opts.timeout, opts.priority)
 
     -- A timeout was reached.
     if conn == nil then return nil end
 
-    conn:reset(self.user, self.pass, self.db)
+    conn:reset(self.user, self.pass, self.db, self.reset_strategy)
     return conn
 end
 
@@ -247,36 +1630,1495 @@ local function pool_put(self, conn)
             error(msg)
         end
 
-        self.queue:put(conn_put(conn))
+        local mysql_conn = conn_put(conn)
+        if mysql_conn ~= POOL_EMPTY_SLOT then
+            pool_add_idle(self, mysql_conn)
+        else
+            self.live = self.live - 1
+        end
+        self.queue:put(POOL_EMPTY_SLOT)
     else
         error('Connection is not usable')
     end
 end
 
+-- Results of rows written by one bulk request: the request reports
+-- only totals, so a row is told apart only when every row affected
+-- one row, and then insert ids are consecutive from the first one.
+local function coalesce_results(rows, affected_rows, insert_id)
+    local results = {}
+    if affected_rows ~= #rows then
+        for i = 1, #rows do
+            results[i] = {}
+        end
+        return results
+    end
+    for i = 1, #rows do
+        results[i] = {
+            affected_rows = 1,
+            insert_id = insert_id ~= 0 and insert_id + i - 1 or 0,
+        }
+    end
+    return results
+end
+
+-- Write rows of a batch and set batch.results and batch.errors.
+-- The rows are written in bulk, or one by one when results of each
+-- row are requested. When the transaction fails, rows are written
+-- one by one to find the failed ones.
+local function coalesce_write(pool, batch)
+    local conn = pool:get()
+    local ok, err = pcall(function()
+        local stmt = conn:prepare(batch.sql)
+        local opts = {row_results = pool.coalesce_row_results}
+        conn:begin()
+        local written, affected_rows, insert_id, results = pcall(
+            stmt_execute_many, stmt, batch.rows, opts)
+        if written then
+            written = pcall(conn.commit, conn)
+        end
+        if written then
+            batch.results = results or
+                coalesce_results(batch.rows, affected_rows, insert_id)
+        else
+            pcall(conn.rollback, conn)
+            for i, row in ipairs(batch.rows) do
+                local row_ok, row_affected, row_id = pcall(
+                    stmt_execute_many, stmt, {row})
+                if row_ok then
+                    batch.results[i] = {affected_rows = row_affected,
+                                        insert_id = row_id}
+                else
+                    batch.errors[i] = row_affected
+                end
+            end
+        end
+        stmt:close()
+    end)
+    if not ok then
+        for i = 1, #batch.rows do
+            batch.errors[i] = batch.errors[i] or err
+        end
+    end
+    pool:put(conn)
+end
+
+local function coalesce_flush(pool, batch)
+    if batch.flushed then
+        return
+    end
+    batch.flushed = true
+    if pool.coalesce_batches[batch.sql] == batch then
+        pool.coalesce_batches[batch.sql] = nil
+    end
+    local ok, err = pcall(coalesce_write, pool, batch)
+    if not ok then
+        for i = 1, #batch.rows do
+            batch.errors[i] = batch.errors[i] or err
+        end
+    end
+    batch.done = true
+    batch.cond:broadcast()
+end
+
+local function coalesce_timer(pool, batch)
+    fiber.sleep(pool.coalesce_window)
+    coalesce_flush(pool, batch)
+end
+
+-- Execute a statement with arguments coalesced with executions of the
+-- same statement by other fibers
+local function pool_execute_coalesced(self, sql, ...)
+    if not self.usable then
+        error('Pool is not usable')
+    end
+    local batch = self.coalesce_batches[sql]
+    if batch == nil then
+        batch = {
+            sql = sql,
+            rows = {},
+            results = {},
+            errors = {},
+            cond = fiber.cond(),
+        }
+        self.coalesce_batches[sql] = batch
+        fiber.create(coalesce_timer, self, batch)
+    end
+    table.insert(batch.rows, {n = select('#', ...), ...})
+    local row_no = #batch.rows
+    if row_no >= self.coalesce_max_rows then
+        self.coalesce_batches[sql] = nil
+        fiber.create(coalesce_flush, self, batch)
+    end
+    while not batch.done do
+        batch.cond:wait()
+    end
+    if batch.errors[row_no] ~= nil then
+        error(batch.errors[row_no])
+    end
+    local result = batch.results[row_no]
+    return result.affected_rows, result.insert_id
+end
+
+-- Returns statistics of the pool
+local function pool_stats(self)
+    local queue = self.queue
+    return {
+        name = self.name,
+        size = self.size,
+        live = self.live,
+        idle = #self.idle,
+        busy = self.live - #self.idle,
+        free = queue.free,
+        waiters = #queue.waiters,
+        granted = queue.granted,
+        rejected = queue.rejected,
+        timeouts = queue.timeouts,
+        wait_time = queue.wait_time,
+        max_wait_time = queue.max_wait_time,
+        connects = self.connects,
+        reconnects = self.connects - (self.initial_connects or 0),
+        connect_errors = self.connect_errors,
+        gc_recovered = self.gc_recovered,
+        cache = self.cache and cache_stats(self.cache),
+    }
+end
+
+local function pool_cache_invalidate(self, tables)
+    cache_invalidate_tables(self.cache, tables)
+end
+
 pool_mt = {
     __index = {
         get = pool_get;
         put = pool_put;
         close = pool_close;
+        stats = pool_stats;
+        execute_coalesced = pool_execute_coalesced;
+        cache_invalidate = pool_cache_invalidate;
     }
 }
 
--- Create connection. Accepts mysql connection params (host, port, user,
--- password, dbname)
-local function connect(opts)
+-- A cluster of a primary and replicas: a pool per server. Reads
+-- go to the healthy replica with the least load, writes and
+-- transactions go to the primary.
+local cluster_mt
+local routed_conn_mt
+
+-- Seconds between checks of replicas.
+local CLUSTER_CHECK_INTERVAL = 1
+-- Seconds to wait for a replica to catch up to a GTID.
+local GTID_WAIT_TIMEOUT = 1
+
+-- Queries of GTIDs executed by the primary and of a wait for a
+-- replica to execute them. Both wait functions return 0 when the
+-- GTIDs are executed.
+local GTID_QUERIES = {
+    mysql = {
+        executed = 'SELECT @@GLOBAL.gtid_executed AS gtid',
+        wait = 'SELECT WAIT_FOR_EXECUTED_GTID_SET(?, ?) AS r',
+    },
+    mariadb = {
+        executed = 'SELECT @@GLOBAL.gtid_binlog_pos AS gtid',
+        wait = 'SELECT MASTER_GTID_WAIT(?, ?) AS r',
+    },
+}
+
+-- Statements which may run on a replica.
+local SQL_REPLICA_WORDS = {
+    select = true, show = true, describe = true, desc = true,
+    explain = true, with = true, ['('] = true,
+}
+
+-- Words of statements which must run on the primary: locking
+-- reads, functions depending on the session and functions of
+-- sequences, which change them.
+local SQL_PRIMARY_WORDS = {
+    into = true, update = true, share = true, insert = true,
+    replace = true, delete = true, last_insert_id = true,
+    found_rows = true, row_count = true, get_lock = true,
+    release_lock = true, is_free_lock = true, is_used_lock = true,
+    connection_id = true, nextval = true, lastval = true, setval = true,
+}
+
+-- Route a statement: 'read' goes to a replica, 'write' to the
+-- primary, 'begin' and 'end' start and end a transaction.
+local function sql_route(sql)
+    local tokens = sql_tokens(sql)
+    local first = tokens[1]
+    if first == 'begin' or
+       (first == 'start' and tokens[2] == 'transaction') then
+        return 'begin'
+    end
+    if first == 'commit' or first == 'rollback' then
+        return 'end'
+    end
+    if not SQL_REPLICA_WORDS[first] then
+        return 'write'
+    end
+    for i, token in ipairs(tokens) do
+        if token == ';' or SQL_PRIMARY_WORDS[token] or token:match('^@') then
+            return 'write'
+        end
+        -- NEXT VALUE FOR and PREVIOUS VALUE FOR of sequences.
+        if (token == 'next' or token == 'previous') and
+           tokens[i + 1] == 'value' and tokens[i + 2] == 'for' then
+            return 'write'
+        end
+    end
+    return 'read'
+end
+
+local function cluster_route(cluster, query)
+    if type(query) == 'table' and query.mode ~= nil then
+        if query.mode ~= 'read' and query.mode ~= 'write' then
+            error("mode must be 'read' or 'write'")
+        end
+        return query.mode
+    end
+    local sql = type(query) == 'table' and query.sql or query
+    if type(sql) ~= 'string' then
+        return 'write'
+    end
+    return sql_memo(cluster, sql, sql_route)
+end
+
+local function pack(...)
+    return {n = select('#', ...), ...}
+end
+
+-- Call fn with a connection of a pool and put it back.
+local function pool_call(pool, fn, ...)
+    local conn = pool:get()
+    local res = pack(pcall(fn, conn, ...))
+    pool:put(conn)
+    if not res[1] then
+        error(res[2], 0)
+    end
+    return unpack(res, 2, res.n)
+end
+
+-- The first row of results by column names.
+local function first_row(results)
+    local result_set = results[1]
+    if result_set == nil then
+        return nil
+    end
+    if result_set.metadata == nil then
+        return result_set[1]
+    end
+    local values = result_set.rows[1]
+    if values == nil then
+        return nil
+    end
+    local row = {}
+    for i, column in ipairs(result_set.metadata) do
+        row[column.name] = values[i]
+    end
+    return row
+end
+
+-- GTIDs executed by the primary, called on its connection.
+local function conn_gtid(conn, cluster)
+    local row = first_row(conn:execute(GTID_QUERIES[cluster.flavor].executed))
+    return row and row.gtid
+end
+
+-- Seconds a replica lags behind, nil if it doesn't replicate.
+local function conn_replica_lag(conn)
+    local ok, results = pcall(conn.execute, conn, 'SHOW REPLICA STATUS')
+    if not ok then
+        results = conn:execute('SHOW SLAVE STATUS')
+    end
+    local row = first_row(results)
+    if row == nil then
+        return nil
+    end
+    return row.Seconds_Behind_Source or row.Seconds_Behind_Master
+end
+
+-- Update health and lag of replicas. A replica is healthy if it
+-- answers and lags behind for no more than max_lag seconds.
+local function replica_check(cluster, replica)
+    local ok, conn = pcall(replica.pool.get, replica.pool,
+                           {timeout = cluster.check_interval})
+    if ok and conn == nil then
+        -- All the connections are busy, so the replica is up.
+        return
+    end
+    local lag = conn
+    if ok then
+        ok, lag = pcall(function()
+            if cluster.max_lag == nil then
+                conn:execute('SELECT 1')
+                return 0
+            end
+            return conn_replica_lag(conn)
+        end)
+        replica.pool:put(conn)
+    end
+    if not ok then
+        replica.error = lag
+        lag = nil
+    elseif lag == nil then
+        replica.error = 'Replication is not running'
+    else
+        replica.error = nil
+    end
+    replica.lag = lag
+    replica.healthy = lag ~= nil and
+                      (cluster.max_lag == nil or lag <= cluster.max_lag)
+end
+
+local function cluster_check(cluster)
+    for _, replica in ipairs(cluster.replicas) do
+        replica_check(cluster, replica)
+    end
+end
+
+local function cluster_maintain(cluster)
+    while cluster.usable do
+        cluster.maintain_cond:wait(cluster.check_interval)
+        if cluster.usable then
+            local ok, err = pcall(cluster_check, cluster)
+            if not ok then
+                log.error('mysql cluster %s check failed: %s', cluster, err)
+            end
+        end
+    end
+end
+
+-- A healthy replica with the least busy connections per weight,
+-- the least lagging one of equal ones.
+local function cluster_pick_replica(cluster)
+    local best, best_load
+    for _, replica in ipairs(cluster.replicas) do
+        if replica.healthy then
+            local pool = replica.pool
+            local load = (pool.size - pool.queue.free + 1) / replica.weight
+            if best == nil or load < best_load or
+               (load == best_load and replica.lag < best.lag) then
+                best = replica
+                best_load = load
+            end
+        end
+    end
+    return best
+end
+
+-- Execute a read on a replica, which executed the given GTIDs if
+-- any. Fall back to the primary when no replica is healthy, the
+-- replica doesn't catch up in time or its connection is lost; a
+-- replica which doesn't answer is skipped until it is checked
+-- again. Statement errors, timeouts and cancellation are raised
+-- to the caller, the primary would not do better.
+local function cluster_read(cluster, query, gtid, ...)
+    local replica = cluster_pick_replica(cluster)
+    if replica ~= nil then
+        local ok, conn = pcall(replica.pool.get, replica.pool)
+        if not ok or conn == nil then
+            replica.healthy = false
+            replica.error = conn
+        else
+            local res = pack(pcall(function(...)
+                if gtid ~= nil and gtid ~= '' then
+                    local row = first_row(conn:execute({
+                        sql = GTID_QUERIES[cluster.flavor].wait,
+                        cache = false,
+                    }, gtid, cluster.gtid_wait_timeout))
+                    if row == nil or row.r ~= 0 then
+                        return nil
+                    end
+                end
+                return conn:execute(query, ...)
+            end, ...))
+            -- Only a lost connection (-1) falls back.
+            local lost = not res[1] and conn.failed_status == -1
+            if lost then
+                replica.healthy = false
+                replica.error = res[2]
+            end
+            replica.pool:put(conn)
+            if not res[1] and not lost then
+                error(res[2])
+            end
+            if res[1] and res[2] ~= nil then
+                return unpack(res, 2, res.n)
+            end
+        end
+    end
+    return pool_call(cluster.primary, function(primary_conn, ...)
+        return primary_conn:execute(query, ...)
+    end, ...)
+end
+
+-- Execute a write on the primary. Return the results and GTIDs
+-- executed by the primary after it when read_your_writes is set.
+local function cluster_write(cluster, query, ...)
+    return pool_call(cluster.primary, function(conn, ...)
+        local results = conn:execute(query, ...)
+        local gtid
+        if cluster.read_your_writes then
+            gtid = conn_gtid(conn, cluster)
+        end
+        return results, gtid
+    end, ...)
+end
+
+local function cluster_check_usable(cluster)
+    if not cluster.usable then
+        error('Cluster is not usable')
+    end
+end
+
+-- Create a cluster. Accepts options of mysql.pool_create() for
+-- all the servers, primary and replicas tables of host, port and
+-- other options of a server.
+local function cluster_create(opts)
     opts = opts or {}
+    local flavor = opts.flavor or 'mysql'
+    if GTID_QUERIES[flavor] == nil then
+        error(('Unknown flavor %s'):format(flavor))
+    end
+    -- The result cache is shared by the servers, so that writes to
+    -- the primary drop results read from replicas.
+    local function server_opts(server, defaults)
+        local merged = {}
+        for k, v in pairs(opts) do
+            if k ~= 'primary' and k ~= 'replicas' and k ~= 'cache' then
+                merged[k] = v
+            end
+        end
+        for k, v in pairs(defaults) do
+            merged[k] = v
+        end
+        for k, v in pairs(server) do
+            if k ~= 'cache' then
+                merged[k] = v
+            end
+        end
+        return merged
+    end
+    local cache = opts.cache and cache_create(opts.cache) or nil
 
-    local status, mysql_conn = driver.connect(opts.host, opts.port or 0,
-                                              opts.user, opts.password,
-                                              opts.db, opts.use_numeric_result,
-                                              opts.keep_null)
-    if status < 0 then
-        error(mysql_conn)
+    local cluster = setmetatable({
+        primary = pool_create(server_opts(opts.primary or {}, {})),
+        replicas = {},
+        max_lag = opts.max_lag,
+        check_interval = opts.check_interval or CLUSTER_CHECK_INTERVAL,
+        read_your_writes = opts.read_your_writes,
+        gtid_wait_timeout = opts.gtid_wait_timeout or GTID_WAIT_TIMEOUT,
+        flavor = flavor,
+        cache = cache,
+        plans = {},
+        plan_count = 0,
+        usable = true,
+    }, cluster_mt)
+    cluster.primary.cache = cache
+    for _, server in ipairs(opts.replicas or {}) do
+        -- A replica may be down, it is connected to on demand.
+        local ok, pool = pcall(pool_create, server_opts(server,
+                                                        {min_size = 0}))
+        if not ok then
+            cluster:close()
+            error(pool)
+        end
+        pool.cache = cache
+        table.insert(cluster.replicas, {
+            pool = pool,
+            host = server.host,
+            port = server.port,
+            weight = server.weight or 1,
+            healthy = true,
+            lag = 0,
+        })
+    end
+    if #cluster.replicas > 0 then
+        cluster.maintain_cond = fiber.cond()
+        fiber.create(cluster_maintain, cluster)
     end
-    return conn_create(mysql_conn)
+    return cluster
 end
 
+local function cluster_close(self)
+    self.usable = false
+    if self.maintain_cond ~= nil then
+        self.maintain_cond:signal()
+    end
+    self.primary:close()
+    for _, replica in ipairs(self.replicas) do
+        replica.pool:close()
+    end
+    return true
+end
+
+-- Execute a statement on a replica or the primary, see
+-- cluster_route().
+local function cluster_execute(self, query, ...)
+    cluster_check_usable(self)
+    local route = cluster_route(self, query)
+    if route == 'read' then
+        return cluster_read(self, query, type(query) == 'table' and
+                            query.gtid or nil, ...)
+    end
+    if route == 'begin' or route == 'end' then
+        error('Use cluster:get() for transactions')
+    end
+    local results = cluster_write(self, query, ...)
+    return results, true
+end
+
+local function cluster_get(self)
+    cluster_check_usable(self)
+    return setmetatable({
+        cluster = self,
+        -- A connection of the primary held by a transaction.
+        conn = nil,
+        gtid = nil,
+        usable = true,
+    }, routed_conn_mt)
+end
+
+local function cluster_stats(self)
+    local replicas = {}
+    for i, replica in ipairs(self.replicas) do
+        replicas[i] = {
+            host = replica.host,
+            port = replica.port,
+            healthy = replica.healthy,
+            lag = replica.lag,
+            error = replica.error,
+            pool = replica.pool:stats(),
+        }
+    end
+    return {
+        primary = self.primary:stats(),
+        replicas = replicas,
+        cache = self.cache and cache_stats(self.cache),
+    }
+end
+
+cluster_mt = {
+    __index = {
+        get = cluster_get;
+        put = function(self, conn)
+            return conn:close()
+        end;
+        execute = cluster_execute;
+        close = cluster_close;
+        stats = cluster_stats;
+    }
+}
+
+local function routed_conn_check_usable(self)
+    if not self.usable then
+        error('Connection is not usable')
+    end
+end
+
+-- End a transaction of a routed connection.
+local function routed_conn_end(self, query)
+    local conn = self.conn
+    if conn == nil then
+        return true
+    end
+    self.conn = nil
+    local res = pack(pcall(function()
+        local results = conn:execute(query)
+        if self.cluster.read_your_writes then
+            self.gtid = conn_gtid(conn, self.cluster)
+        end
+        return results
+    end))
+    self.cluster.primary:put(conn)
+    if not res[1] then
+        error(res[2], 0)
+    end
+    return res[2] ~= nil
+end
+
+routed_conn_mt = {
+    __index = {
+        execute = function(self, query, ...)
+            routed_conn_check_usable(self)
+            local route = cluster_route(self.cluster, query)
+            if route == 'begin' then
+                self:begin()
+                return {}, true
+            elseif route == 'end' then
+                routed_conn_end(self, query)
+                return {}, true
+            elseif self.conn ~= nil then
+                return self.conn:execute(query, ...)
+            elseif route == 'read' then
+                local gtid = type(query) == 'table' and query.gtid or
+                             self.gtid
+                return cluster_read(self.cluster, query, gtid, ...)
+            end
+            local results, gtid = cluster_write(self.cluster, query, ...)
+            self.gtid = gtid or self.gtid
+            return results, true
+        end,
+        begin = function(self)
+            routed_conn_check_usable(self)
+            if self.conn ~= nil then
+                error('A transaction is already started')
+            end
+            local conn = self.cluster.primary:get()
+            local ok, err = pcall(conn.begin, conn)
+            if not ok then
+                self.cluster.primary:put(conn)
+                error(err, 0)
+            end
+            self.conn = conn
+            return true
+        end,
+        commit = function(self)
+            routed_conn_check_usable(self)
+            return routed_conn_end(self, 'COMMIT')
+        end,
+        rollback = function(self)
+            routed_conn_check_usable(self)
+            return routed_conn_end(self, 'ROLLBACK')
+        end,
+        -- GTIDs of the last write, see read_your_writes.
+        gtid = function(self)
+            return self.gtid
+        end,
+        close = function(self)
+            routed_conn_check_usable(self)
+            self.usable = false
+            if self.conn ~= nil then
+                pcall(self.conn.rollback, self.conn)
+                self.cluster.primary:put(self.conn)
+                self.conn = nil
+            end
+            return true
+        end,
+    }
+}
+
+--
+-- Scatter-gather: a query is run on every shard, a pool of each
+-- server, at once.
+--
+
+-- Ways to handle failed shards: fail the query or return results
+-- of the others.
+local MULTI_POOL_ON_ERROR = {fail = true, partial = true}
+
+local multi_pool_mt
+local merge_mt
+
+-- Call fn(shard_no, pool) for every shard in a fiber of its own.
+-- Return results and errors keyed by numbers of shards.
+local function multi_pool_scatter(self, fn)
+    local results, errors = {}, {}
+    local left = #self.pools
+    local done = fiber.cond()
+    for i, pool in ipairs(self.pools) do
+        fiber.create(function()
+            local ok, res = pcall(fn, i, pool)
+            if ok then
+                results[i] = res
+            else
+                errors[i] = res
+            end
+            left = left - 1
+            if left == 0 then
+                done:signal()
+            end
+        end)
+    end
+    while left > 0 do
+        done:wait()
+    end
+    return results, errors
+end
+
+-- Apply the failure policy to errors of shards. Return the errors
+-- or nil when there are none.
+local function multi_pool_check(self, errors)
+    local failed, first
+    for i in pairs(errors) do
+        failed = (failed or 0) + 1
+        first = math.min(first or i, i)
+    end
+    if failed == nil then
+        return nil
+    end
+    if self.on_error == 'fail' or
+       #self.pools - failed < self.min_shards then
+        error(('Shard %d: %s'):format(first, errors[first]), 0)
+    end
+    return errors
+end
+
+local function deadline_left(deadline)
+    if deadline == nil then
+        return nil
+    end
+    local left = deadline - fiber.clock()
+    if left <= 0 then
+        error('Timeout exceeded', 0)
+    end
+    return left
+end
+
+local function multi_pool_get(pool, deadline)
+    local conn = pool:get({timeout = deadline_left(deadline)})
+    if conn == nil then
+        error('Timeout exceeded', 0)
+    end
+    return conn
+end
+
+local function multi_pool_deadline(self, query)
+    local timeout = type(query) == 'table' and query.timeout or
+                    self.timeout
+    return timeout and fiber.clock() + timeout
+end
+
+-- Execute a query on every shard. The query may be a table like
+-- the one of conn:execute(), its timeout is shared by the shards.
+local function multi_pool_execute_all(self, query, ...)
+    local deadline = multi_pool_deadline(self, query)
+    local args = pack(...)
+    local results, errors = multi_pool_scatter(self, function(_, pool)
+        local conn = multi_pool_get(pool, deadline)
+        local shard_query = type(query) == 'table' and
+                            table.copy(query) or {sql = query}
+        shard_query.timeout = deadline_left(deadline)
+        local res = pack(pcall(conn.execute, conn, shard_query,
+                               unpack(args, 1, args.n)))
+        pool:put(conn)
+        if not res[1] then
+            error(res[2], 0)
+        end
+        return res[2]
+    end)
+    return results, multi_pool_check(self, errors)
+end
+
+-- A shard of a merge: a cursor and its current chunk of rows.
+local function merge_shard_release(shard)
+    if shard.conn == nil then
+        return
+    end
+    if shard.cursor ~= nil then
+        pcall(shard.cursor.close, shard.cursor)
+    end
+    shard.pool:put(shard.conn)
+    shard.conn = nil
+end
+
+-- Release connections of all shards of a merge.
+local function merge_release(shards)
+    for _, shard in pairs(shards) do
+        merge_shard_release(shard)
+    end
+end
+
+-- Move a shard to its next row, fetching the next chunk when the
+-- current one is read out. Return false at the end of rows.
+local function merge_shard_advance(merge, shard)
+    shard.pos = shard.pos + 1
+    if shard.pos <= #shard.chunk then
+        return true
+    end
+    local ok, rows = pcall(shard.cursor.fetch, shard.cursor,
+                           merge.chunk_size)
+    if not ok then
+        merge.errors[shard.no] = rows
+        merge_shard_release(shard)
+        local multi = merge.multi_pool
+        local check_ok, err = pcall(multi_pool_check, multi, merge.errors)
+        if not check_ok then
+            merge:close()
+            error(err, 0)
+        end
+        return false
+    end
+    if rows == nil then
+        merge_shard_release(shard)
+        return false
+    end
+    shard.chunk = rows
+    shard.pos = 1
+    return true
+end
+
+local function merge_key(merge, shard)
+    return shard.chunk[shard.pos][merge.order_by]
+end
+
+-- Whether the current row of shard a goes before the one of b.
+-- NULL values go first like in ascending ORDER BY of MySQL.
+local function merge_precedes(merge, a, b)
+    local x, y = merge_key(merge, a), merge_key(merge, b)
+    if x == nil or y == nil then
+        if merge.desc then
+            return y == nil and x ~= nil
+        end
+        return x == nil and y ~= nil
+    end
+    if merge.desc then
+        return y < x
+    end
+    return x < y
+end
+
+local function merge_sift_down(merge, i)
+    local heap = merge.heap
+    while true do
+        local least = i
+        for child = 2 * i, 2 * i + 1 do
+            if heap[child] ~= nil and
+               merge_precedes(merge, heap[child], heap[least]) then
+                least = child
+            end
+        end
+        if least == i then
+            return
+        end
+        heap[i], heap[least] = heap[least], heap[i]
+        i = least
+    end
+end
+
+-- Return the next row of a merge or nil at the end.
+local function merge_next(merge)
+    if merge.limit ~= nil and merge.count >= merge.limit then
+        merge:close()
+        return nil
+    end
+    local heap = merge.heap
+    local shard = heap[1]
+    if shard == nil then
+        return nil
+    end
+    local row = shard.chunk[shard.pos]
+    if merge.order_by == nil then
+        -- Concatenation: read out shards one by one.
+        if not merge_shard_advance(merge, shard) then
+            table.remove(heap, 1)
+        end
+    elseif merge_shard_advance(merge, shard) then
+        merge_sift_down(merge, 1)
+    else
+        heap[1] = heap[#heap]
+        heap[#heap] = nil
+        merge_sift_down(merge, 1)
+    end
+    merge.count = merge.count + 1
+    return row
+end
+
+-- What prevents appending LIMIT to a statement, nil if nothing.
+local function sql_limit_conflict(sql)
+    if sql:match(';%s*$') then
+        return 'a trailing semicolon'
+    end
+    local tokens = sql_tokens(sql)
+    for i, token in ipairs(tokens) do
+        local next_token = tokens[i + 1]
+        if token == 'limit' then
+            return 'a LIMIT clause'
+        elseif (token == 'for' and (next_token == 'update' or
+                                    next_token == 'share')) or
+               (token == 'lock' and next_token == 'in') then
+            return 'a locking clause'
+        elseif token == 'into' then
+            return 'an INTO clause'
+        end
+    end
+    return nil
+end
+
+-- Stream rows of a query run on every shard: concatenated in the
+-- order of shards or merged by order_by. A limit is appended to
+-- the query of each shard and ends the stream early.
+local function multi_pool_rows(self, query, opts, ...)
+    opts = opts or {}
+    local sql = type(query) == 'table' and query.sql or query
+    if type(sql) ~= 'string' then
+        error('Usage: multi_pool:rows(query, opts, ...)')
+    end
+    if opts.limit ~= nil and opts.pushdown ~= false then
+        local conflict = sql_limit_conflict(sql)
+        if conflict ~= nil then
+            error(('Can not push LIMIT down to a statement with %s, ' ..
+                   'use pushdown = false'):format(conflict))
+        end
+        -- A new line ends a trailing comment.
+        sql = ('%s\nLIMIT %d'):format(sql, opts.limit)
+    end
+    local shards = {}
+    local merge = setmetatable({
+        multi_pool = self,
+        order_by = opts.order_by,
+        desc = opts.desc == true,
+        limit = opts.limit,
+        chunk_size = opts.chunk_size or CURSOR_CHUNK_SIZE,
+        count = 0,
+        shards = shards,
+        heap = {},
+        errors = {},
+        -- An abandoned merge returns connections of its shards, the
+        -- hook refers to the shards only to let the merge be freed.
+        __gc_hook = ffi.gc(ffi.new('void *'),
+            function()
+                -- Fiber yields are prohibited in gc.
+                fiber.new(merge_release, shards)
+            end),
+    }, merge_mt)
+    local deadline = multi_pool_deadline(self, query)
+    local args = pack(...)
+    local _, errors = multi_pool_scatter(self, function(i, pool)
+        local shard = {no = i, pool = pool, pos = 1}
+        merge.shards[i] = shard
+        shard.conn = multi_pool_get(pool, deadline)
+        local ok, err = pcall(function()
+            shard.cursor = shard.conn:cursor(sql, unpack(args, 1, args.n))
+            shard.chunk = shard.cursor:fetch(merge.chunk_size)
+        end)
+        if not ok or shard.chunk == nil then
+            merge_shard_release(shard)
+        end
+        if not ok then
+            error(err, 0)
+        end
+    end)
+    merge.errors = errors
+    local ok, err = pcall(multi_pool_check, self, errors)
+    if not ok then
+        merge:close()
+        error(err, 0)
+    end
+    for i = 1, #self.pools do
+        local shard = merge.shards[i]
+        if shard ~= nil and shard.conn ~= nil then
+            table.insert(merge.heap, shard)
+        end
+    end
+    if merge.order_by ~= nil then
+        for i = math.floor(#merge.heap / 2), 1, -1 do
+            merge_sift_down(merge, i)
+        end
+    end
+    return merge
+end
+
+merge_mt = {
+    __call = merge_next,
+    __index = {
+        next = merge_next,
+        -- Release connections of shards before the rows are read out.
+        close = function(self)
+            ffi.gc(self.__gc_hook, nil)
+            merge_release(self.shards)
+            self.heap = {}
+            return true
+        end,
+        collect = function(self)
+            local rows = {}
+            for row in self do
+                table.insert(rows, row)
+            end
+            return rows
+        end,
+    }
+}
+
+local function multi_pool_create(pools, opts)
+    opts = opts or {}
+    if type(pools) ~= 'table' or #pools == 0 then
+        error('Usage: mysql.multi_pool({pool, ...}, opts)')
+    end
+    local on_error = opts.on_error or 'fail'
+    if not MULTI_POOL_ON_ERROR[on_error] then
+        error("on_error must be 'fail' or 'partial'")
+    end
+    return setmetatable({
+        pools = pools,
+        timeout = opts.timeout,
+        on_error = on_error,
+        min_shards = opts.min_shards or 1,
+    }, multi_pool_mt)
+end
+
+multi_pool_mt = {
+    __index = {
+        execute_all = multi_pool_execute_all,
+        rows = multi_pool_rows,
+    }
+}
+
+-- Returns counters and latency histograms of all connections along
+-- with statistics of open pools by name
+local function stats()
+    local result = driver.stats()
+    result.pools = {}
+    for pool in pairs(pools) do
+        result.pools[pool.name] = pool:stats()
+    end
+    return result
+end
+
+-- Turn the profiler of requests on and clear the slow log
+local function profiler_start(opts)
+    opts = opts or {}
+    local threshold = opts.threshold or SLOW_QUERY_THRESHOLD
+    if type(threshold) ~= 'number' or threshold < 0 then
+        error('threshold must be a non-negative number')
+    end
+    local size = opts.size or SLOW_LOG_SIZE
+    if type(size) ~= 'number' or size < 1 then
+        error('size must be a positive number')
+    end
+    profiler.threshold = threshold
+    profiler.size = math.floor(size)
+    profiler.log = {}
+    profiler.count = 0
+    profiler.enabled = true
+    driver.profile(true)
+end
+
+-- Turn the profiler of requests off, the slow log is kept
+local function profiler_stop()
+    profiler.enabled = false
+    driver.profile(false)
+end
+
+-- Returns entries of the slow log from the oldest one
+local function slow_log()
+    local entries = {}
+    for i = math.max(profiler.count - profiler.size, 0),
+            profiler.count - 1 do
+        table.insert(entries, profiler.log[i % profiler.size + 1])
+    end
+    return entries
+end
+
+-- Counters of mysql.stats() exported as mysql_<name>_total.
+local METRICS_COUNTERS = {
+    'queries', 'query_errors', 'executes', 'execute_errors', 'rows', 'bytes',
+}
+-- Histograms of mysql.stats() by metric names.
+local METRICS_HISTOGRAMS = {
+    mysql_query_duration_seconds = 'query_time',
+    mysql_execute_duration_seconds = 'execute_time',
+    mysql_fetch_duration_seconds = 'fetch_time',
+}
+-- Gauges of mysql.stats() exported as mysql_<name>.
+local METRICS_GAUGES = {'in_flight'}
+-- Gauges of pool:stats() exported as mysql_pool_<name>.
+local METRICS_POOL_GAUGES = {
+    'size', 'live', 'idle', 'busy', 'free', 'waiters',
+}
+-- Counters of pool:stats() exported as mysql_pool_<name>_total.
+local METRICS_POOL_COUNTERS = {
+    'granted', 'rejected', 'timeouts', 'connects', 'reconnects',
+    'connect_errors', 'gc_recovered',
+}
+
+-- Observations of mysql.stats() in the form of the metrics module.
+local function metrics_collect()
+    local observations = {}
+    local timestamp = fiber.time64()
+    local function observe(name, value, label_pairs)
+        table.insert(observations, {
+            metric_name = name,
+            label_pairs = label_pairs or {},
+            value = value,
+            timestamp = timestamp,
+        })
+    end
+    local current = stats()
+    for _, name in ipairs(METRICS_COUNTERS) do
+        observe(('mysql_%s_total'):format(name), current[name])
+    end
+    for _, name in ipairs(METRICS_GAUGES) do
+        observe('mysql_' .. name, current[name])
+    end
+    for name, key in pairs(METRICS_HISTOGRAMS) do
+        local histogram = current[key]
+        for _, bucket in ipairs(histogram.buckets) do
+            observe(name .. '_bucket', bucket.count, {le = bucket.le})
+        end
+        observe(name .. '_sum', histogram.sum)
+        observe(name .. '_count', histogram.count)
+    end
+    for pool_name, pool in pairs(current.pools) do
+        local label_pairs = {pool = pool_name}
+        for _, name in ipairs(METRICS_POOL_GAUGES) do
+            observe('mysql_pool_' .. name, pool[name], label_pairs)
+        end
+        for _, name in ipairs(METRICS_POOL_COUNTERS) do
+            observe(('mysql_pool_%s_total'):format(name), pool[name],
+                    label_pairs)
+        end
+    end
+    return observations
+end
+
+-- Returns a collector to register in the metrics module:
+-- metrics.registry:register(mysql.metrics_collector())
+local function metrics_collector()
+    return {
+        name = 'mysql',
+        kind = 'untyped',
+        help = 'MySQL connector metrics',
+        metainfo = {},
+        collect = metrics_collect,
+    }
+end
+
+-- Create connection. Accepts mysql connection params (host, port, user,
+-- password, dbname)
+local function connect(opts)
+    opts = opts or {}
+    local cache = opts.cache and cache_create(opts.cache) or nil
+
+    local status, mysql_conn = driver.connect(opts.host, opts.port or 0,
+                                              opts.user, opts.password,
+                                              opts.db, opts.use_numeric_result,
+                                              opts.keep_null, driver_opts(opts))
+    if status < 0 then
+        error(mysql_conn)
+    end
+    return conn_create(mysql_conn, cache)
+end
+
+--
+-- Binlog streams: change data capture of a server by a connection
+-- registered as its replica.
+--
+
+-- Change records delivered at once.
+local BINLOG_BATCH_SIZE = 1000
+-- Seconds of silence of the server after which it sends a
+-- heartbeat: a partial batch is delivered no later than that.
+local BINLOG_HEARTBEAT = 0.1
+-- Seconds between restarts of a broken stream.
+local BINLOG_RECONNECT_DELAY = 1
+
+-- Values past the top of the signed range of integer columns, which
+-- binlog doesn't tell from signed ones.
+local UNSIGNED_RANGES = {
+    tinyint = 2^8, smallint = 2^16, mediumint = 2^24, int = 2^32,
+}
+
+local binlog_stream_mt
+
+-- Columns of a table of change records: names and ranges of
+-- unsigned integer columns. A table grown since the last look is
+-- looked up again.
+local function binlog_table_info(stream, schema, name, width)
+    local key = schema .. '.' .. name
+    local info = stream.tables[key]
+    if info ~= nil and width <= #info.names then
+        return info
+    end
+    local results = stream.meta_conn:execute(
+        'SELECT COLUMN_NAME AS name, COLUMN_TYPE AS column_type, ' ..
+        'DATA_TYPE AS data_type FROM information_schema.COLUMNS ' ..
+        'WHERE TABLE_SCHEMA = ? AND TABLE_NAME = ? ' ..
+        'ORDER BY ORDINAL_POSITION', schema, name)
+    info = {names = {}, unsigned = {}}
+    for i, column in ipairs(results[1]) do
+        info.names[i] = column.name
+        if column.column_type:find('unsigned') then
+            info.unsigned[i] = UNSIGNED_RANGES[column.data_type] or
+                               column.data_type == 'bigint' or nil
+        end
+    end
+    stream.tables[key] = info
+    return info
+end
+
+local function binlog_fix_unsigned(row, unsigned)
+    for i, range in pairs(unsigned) do
+        local value = row[i]
+        if range == true then
+            if type(value) == 'cdata' and value < 0 then
+                row[i] = ffi.cast('uint64_t', value)
+            end
+        elseif type(value) == 'number' and value < 0 then
+            row[i] = value + range
+        end
+    end
+end
+
+-- Give change records names of columns and fix values of unsigned
+-- columns.
+local function binlog_describe(stream, records)
+    for _, record in ipairs(records) do
+        local row = record.new or record.old
+        local info = binlog_table_info(stream, record.schema, record.table,
+                                       #row)
+        record.columns = info.names
+        if next(info.unsigned) ~= nil then
+            for _, image in pairs({record.old, record.new}) do
+                binlog_fix_unsigned(image, info.unsigned)
+            end
+        end
+    end
+end
+
+local function binlog_key(index, row)
+    local key = {}
+    for i, part in ipairs(index.parts) do
+        key[i] = row[part.fieldno]
+    end
+    return key
+end
+
+local function binlog_same_key(a, b)
+    for i = 1, #a do
+        if a[i] ~= b[i] then
+            return false
+        end
+    end
+    return true
+end
+
+-- Apply a change record to a space: rows are replaced and deleted
+-- by the primary key.
+local function binlog_apply(space, record)
+    local index = space.index[0]
+    if record.old ~= nil then
+        local key = binlog_key(index, record.old)
+        if record.new == nil or
+           not binlog_same_key(key, binlog_key(index, record.new)) then
+            space:delete(key)
+        end
+    end
+    if record.new ~= nil then
+        space:replace(record.new)
+    end
+end
+
+local function binlog_save_position(stream, position)
+    if stream.checkpoint_space ~= nil then
+        box.space[stream.checkpoint_space]:replace({
+            stream.name, position.file, position.position,
+            position.gtid or box.NULL,
+        })
+    end
+end
+
+-- Deliver a batch of change records: apply records of mapped tables
+-- and pass the rest to the callback. Changes of spaces and the
+-- position are committed at once.
+local function binlog_deliver(stream, records, position)
+    binlog_describe(stream, records)
+    local rest = records
+    if stream.spaces ~= nil then
+        rest = {}
+        box.atomic(function()
+            for _, record in ipairs(records) do
+                local space = stream.spaces[record.schema .. '.' ..
+                                            record.table]
+                if space ~= nil then
+                    binlog_apply(box.space[space], record)
+                else
+                    table.insert(rest, record)
+                end
+            end
+            if stream.on_changes == nil then
+                binlog_save_position(stream, position)
+            end
+        end)
+    end
+    if stream.on_changes ~= nil then
+        stream.on_changes(rest, position)
+        if stream.checkpoint_space ~= nil then
+            box.atomic(binlog_save_position, stream, position)
+        end
+    end
+    stream.records = stream.records + #records
+    stream.batches = stream.batches + 1
+end
+
+-- The position to start a stream with: the given one, the saved one
+-- or the end of binlog of the server.
+local function binlog_start_position(stream, conn)
+    if stream.position ~= nil then
+        return stream.position
+    end
+    if stream.checkpoint_space ~= nil then
+        local tuple = box.space[stream.checkpoint_space]:get(stream.name)
+        if tuple ~= nil then
+            return {file = tuple[2], position = tuple[3],
+                    gtid = tuple[4] ~= box.NULL and tuple[4] or nil}
+        end
+    end
+    local ok, results = pcall(conn.execute, conn, 'SHOW BINARY LOG STATUS')
+    if not ok then
+        results = conn:execute('SHOW MASTER STATUS')
+    end
+    local row = first_row(results)
+    if row == nil then
+        error('Binary logging is disabled on the server')
+    end
+    return {file = row.File, position = tonumber(row.Position)}
+end
+
+-- Stream changes of one connection to the server until it fails.
+local function binlog_session(stream)
+    local conn = connect(stream.conn_opts)
+    stream.conn = conn
+    local position = binlog_start_position(stream, conn)
+    -- Events come with checksums the server is configured to write.
+    conn:execute('SET @master_binlog_checksum = @@global.binlog_checksum')
+    conn:execute(('SET @master_heartbeat_period = %d'):format(
+        stream.heartbeat * 1e9))
+    local file = position.file
+    if stream.use_gtid and position.gtid ~= nil then
+        -- Resume from the GTID of a MariaDB server.
+        conn:execute('SET @slave_connect_state = ?', position.gtid)
+        file = ''
+    end
+    local status, binlog = conn.conn:binlog_open(stream.server_id, file,
+                                                 position.position,
+                                                 stream.filter)
+    if status ~= 0 then
+        error(binlog)
+    end
+    stream.binlog = binlog
+    while stream.running do
+        local status, records, new_position =
+            binlog:fetch(stream.batch_size)
+        if status ~= 0 then
+            error(records)
+        end
+        new_position.gtid = new_position.gtid or position.gtid
+        binlog_deliver(stream, records, new_position)
+        position = new_position
+        stream.position = position
+    end
+end
+
+local function binlog_session_end(stream)
+    if stream.binlog ~= nil then
+        stream.binlog:close()
+        stream.binlog = nil
+    end
+    if stream.conn ~= nil then
+        pcall(stream.conn.close, stream.conn)
+        stream.conn = nil
+    end
+    -- Tables may change while the stream is down.
+    stream.tables = {}
+end
+
+local function binlog_loop(stream)
+    while stream.running do
+        local ok, err = pcall(binlog_session, stream)
+        binlog_session_end(stream)
+        if not stream.running then
+            break
+        end
+        stream.errors = stream.errors + 1
+        stream.last_error = tostring(err)
+        log.error('mysql binlog stream %s: %s', stream.name, err)
+        if not pcall(fiber.sleep, stream.reconnect_delay) then
+            break
+        end
+    end
+    stream.running = false
+end
+
+-- Stream changes of tables of a server to a callback or spaces.
+local function binlog_stream(opts)
+    opts = opts or {}
+    if type(opts.server_id) ~= 'number' then
+        error('server_id of the replica must be a number')
+    end
+    if opts.on_changes == nil and opts.spaces == nil then
+        error('on_changes or spaces must be given')
+    end
+    local filter
+    if opts.tables ~= nil then
+        filter = {}
+        for _, name in ipairs(opts.tables) do
+            filter[name] = true
+        end
+    elseif opts.on_changes == nil then
+        filter = {}
+        for name in pairs(opts.spaces) do
+            filter[name] = true
+        end
+    end
+    local conn_opts = table.copy(opts)
+    conn_opts.db = nil
+    local stream = setmetatable({
+        name = opts.name or 'binlog',
+        server_id = opts.server_id,
+        conn_opts = conn_opts,
+        meta_conn = connect({host = opts.host, port = opts.port,
+                             user = opts.user, password = opts.password}),
+        on_changes = opts.on_changes,
+        spaces = opts.spaces,
+        filter = filter,
+        checkpoint_space = opts.checkpoint_space,
+        position = opts.position,
+        use_gtid = opts.use_gtid,
+        batch_size = opts.batch_size or BINLOG_BATCH_SIZE,
+        heartbeat = opts.heartbeat or BINLOG_HEARTBEAT,
+        reconnect_delay = opts.reconnect_delay or BINLOG_RECONNECT_DELAY,
+        tables = {},
+        running = true,
+        -- Statistics.
+        records = 0,
+        batches = 0,
+        errors = 0,
+    }, binlog_stream_mt)
+    stream.fiber = fiber.new(binlog_loop, stream)
+    return stream
+end
+
+binlog_stream_mt = {
+    __index = {
+        -- The position after the last delivered batch.
+        position = function(self)
+            return self.position
+        end,
+        stats = function(self)
+            return {
+                running = self.running,
+                records = self.records,
+                batches = self.batches,
+                errors = self.errors,
+                last_error = self.last_error,
+                position = self.position,
+            }
+        end,
+        stop = function(self)
+            if not self.running then
+                return false
+            end
+            self.running = false
+            if self.fiber:status() ~= 'dead' and
+               self.fiber ~= fiber.self() then
+                self.fiber:cancel()
+            end
+            self.meta_conn:close()
+            return true
+        end,
+    }
+}
+
 return {
     connect = connect;
     pool_create = pool_create;
+    cluster_create = cluster_create;
+    binlog_stream = binlog_stream;
+    multi_pool = multi_pool_create;
+    stats = stats;
+    metrics_collector = metrics_collector;
+    profiler_start = profiler_start;
+    profiler_stop = profiler_stop;
+    slow_log = slow_log;
 }
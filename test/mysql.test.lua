@@ -9,6 +9,8 @@ local tap = require('tap')
 local fiber = require('fiber')
 local fio = require('fio')
 local ffi = require('ffi')
+local buffer = require('buffer')
+local msgpack = require('msgpack')
 
 local host, port, user, password, db = string.match(os.getenv('MYSQL') or '',
     "([^:]*):([^:]*):([^:]*):([^:]*):([^:]*)")
@@ -21,6 +23,10 @@ local p, err = mysql.pool_create({ host = host, port = port, user = user,
     password = password, db = db, size = 2 })
 if p == nil then error(err) end
 
+-- Spaces of the tests loading rows into Tarantool. Nothing is written to
+-- the directory without WAL and snapshots.
+box.cfg({memtx_dir = fio.tempdir(), wal_mode = 'none', log = '/dev/null'})
+
 local function test_old_api(t, conn)
     t:plan(16)
     -- Add an extension to 'tap' module
@@ -735,8 +741,1088 @@ local function test_conn_from_pool_gc_yield(test)
     test:is(pool_is_usable, false, 'Pool is not usable')
 end
 
+local function test_stmt_cache(test)
+    test:plan(7)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db, stmt_cache_size = 2})
+    if conn == nil then error(err) end
+
+    local res = conn:execute('SELECT ? AS val', 1)
+    test:is_deeply(res, {{{val = 1}}}, 'the first execution')
+    res = conn:execute('SELECT ? AS val', 2)
+    test:is_deeply(res, {{{val = 2}}}, 'a cached statement with new params')
+    conn:execute('SELECT ? AS a', 1)
+    conn:execute('SELECT ? AS b', 1)
+
+    local stats = conn:stmt_cache_stats()
+    test:is_deeply({stats.size, stats.capacity}, {2, 2}, 'cache size')
+    test:is_deeply({tonumber(stats.hits), tonumber(stats.misses),
+                    tonumber(stats.evictions)}, {1, 3, 1}, 'cache counters')
+
+    local ok = pcall(conn.execute, conn, 'SELECT ? FROM unknown_table', 1)
+    test:ok(not ok, 'an error is raised')
+    test:is(conn:stmt_cache_stats().size, 2, 'failed statement is not cached')
+
+    conn:reset(user, password, db)
+    res = conn:execute('SELECT ? AS val', 3)
+    test:is_deeply({res, conn:stmt_cache_stats().size}, {{{{val = 3}}}, 1},
+                   'the cache is flushed on reset')
+    conn:close()
+end
+
+local function test_prepared_statement(test)
+    test:plan(9)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db})
+    if conn == nil then error(err) end
+
+    conn:execute('CREATE TEMPORARY TABLE _stmt_test (a INT, b VARCHAR(10))')
+    local stmt = conn:prepare('INSERT INTO _stmt_test VALUES (?, ?)')
+    test:ok(stmt ~= nil, 'prepare')
+    test:is_deeply({stmt:execute(1, 'a')}, {{}, true}, 'execute')
+
+    local rows = {}
+    for i = 2, 5 do
+        table.insert(rows, {i, i % 2 == 0 and tostring(i) or nil})
+    end
+    table.insert(rows, {6, 6})
+    test:is_deeply({stmt:execute_many(rows, {batch_size = 2})}, {5, true},
+                   'execute_many')
+    test:is_deeply(conn:execute('SELECT * FROM _stmt_test ORDER BY a'),
+                   {{{a = 1, b = 'a'}, {a = 2, b = '2'}, {a = 3},
+                     {a = 4, b = '4'}, {a = 5}, {a = 6, b = '6'}}},
+                   'rows are inserted')
+    stmt:execute_many({{7LL, 'x'}, {8ULL, 10LL}, {box.NULL, 11ULL}})
+    test:is_deeply(conn:execute('SELECT * FROM _stmt_test WHERE a > 6 ' ..
+                                'OR a IS NULL ORDER BY a'),
+                   {{{b = '11'}, {a = 7, b = 'x'}, {a = 8, b = '10'}}},
+                   'execute_many binds 64-bit integers')
+    local ok, err = pcall(stmt.execute_many, stmt, {{9, 'y'}, 10})
+    test:ok(not ok and tostring(err):find('a row must be a table'),
+            'a row which is not a table is an error')
+
+    local select_stmt = conn:prepare('SELECT b FROM _stmt_test WHERE a = ?')
+    test:is_deeply(select_stmt:execute(4), {{{b = '4'}}}, 'select')
+
+    conn:reset(user, password, db)
+    ok = pcall(select_stmt.execute, select_stmt, 4)
+    test:ok(not ok, 'a statement is invalidated by reset')
+
+    stmt:close()
+    ok = pcall(stmt.execute, stmt, 1, 'a')
+    test:ok(not ok, 'a closed statement is not usable')
+    conn:close()
+end
+
+local function test_cursor(test)
+    test:plan(8)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db})
+    if conn == nil then error(err) end
+
+    conn:execute('CREATE TEMPORARY TABLE _cursor_test (a INT, b VARCHAR(10))')
+    local rows = {}
+    for i = 1, 10 do
+        table.insert(rows, {i, tostring(i)})
+    end
+    conn:prepare('INSERT INTO _cursor_test VALUES (?, ?)'):execute_many(rows)
+
+    local cursor = conn:cursor('SELECT a, b FROM _cursor_test ORDER BY a')
+    test:is_deeply(cursor:metadata(), {{name = 'a', type = 'long'},
+                                       {name = 'b', type = 'var_string'}},
+                   'metadata')
+    local sizes = {}
+    for chunk in cursor:chunks(4) do
+        table.insert(sizes, #chunk)
+    end
+    test:is_deeply(sizes, {4, 4, 2}, 'chunks')
+    test:is_deeply(conn:execute('SELECT 1 AS x'), {{{x = 1}}},
+                   'the connection is released when rows are read out')
+
+    cursor = conn:cursor('SELECT a FROM _cursor_test WHERE a > ? ORDER BY a',
+                         7)
+    local values = {}
+    for row in cursor:rows(2) do
+        table.insert(values, row.a)
+    end
+    test:is_deeply(values, {8, 9, 10}, 'server side cursor')
+    test:is(cursor:fetch(), nil, 'a read out cursor returns nil')
+
+    cursor = conn:cursor('SELECT a FROM _cursor_test ORDER BY a')
+    test:is_deeply(cursor:fetch(1), {{a = 1}}, 'fetch')
+    cursor:close()
+    test:is_deeply(conn:execute('SELECT 2 AS x'), {{{x = 2}}},
+                   'unread rows are skipped on close')
+
+    -- A forgotten cursor releases the connection on collection.
+    conn:cursor('SELECT a FROM _cursor_test')
+    collectgarbage('collect')
+    collectgarbage('collect')
+    test:is_deeply(conn:execute('SELECT 3 AS x'), {{{x = 3}}},
+                   'a collected cursor releases the connection')
+    conn:close()
+end
+
+local function test_decode_budget(test)
+    test:plan(2)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db, decode_budget_rows = 10,
+        decode_budget_time = 0})
+    if conn == nil then error(err) end
+
+    local done = false
+    local ticks = 0
+    fiber.create(function()
+        while not done do
+            ticks = ticks + 1
+            fiber.yield()
+        end
+    end)
+    local rows = conn:execute('WITH RECURSIVE s(n) AS (SELECT 1 UNION ALL ' ..
+                              'SELECT n + 1 FROM s WHERE n < 1000) ' ..
+                              'SELECT n FROM s')
+    done = true
+    test:is(#rows[1], 1000, 'all rows are decoded')
+    test:ok(ticks >= 100, 'other fibers run during decoding')
+    conn:close()
+end
+
+local function test_lazy_result(test)
+    test:plan(8)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db, result_format = 'lazy'})
+    if conn == nil then error(err) end
+
+    local sql = "SELECT 1 AS a, 'x' AS b, NULL AS c UNION ALL " ..
+                "SELECT 2, 'yy', 3"
+    local result = conn:execute(sql)[1]
+    test:is(#result, 2, 'count of rows')
+    test:is(#result[1], 3, 'count of columns')
+    test:is(result[2].b, 'yy', 'a value by column name')
+    test:is(result[2][3], 3, 'a value by column number')
+    test:is(result[1].c, nil, 'NULL value')
+    test:is(result[3], nil, 'a missing row')
+    test:is_deeply(json.decode(json.encode(result)),
+                   {{a = 1, b = 'x'}, {a = 2, b = 'yy', c = 3}},
+                   'serialization')
+    result = conn:execute('SELECT ? AS a', 42)[1]
+    test:is(result[1].a, 42, 'a prepared statement result')
+    conn:close()
+end
+
+local function test_columnar_result(test)
+    test:plan(8)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db, result_format = 'columnar'})
+    if conn == nil then error(err) end
+
+    local sql = "SELECT 1 AS a, 'x' AS b, 0.5e0 AS c UNION ALL " ..
+                "SELECT 2, NULL, NULL UNION ALL SELECT -3, 'z', 2.5e0"
+    local result = conn:execute(sql)[1]
+    test:is(result.count, 3, 'count of rows')
+    local a = result.columns.a
+    test:is_deeply({tonumber(a[1]), tonumber(a[2]), tonumber(a[3])},
+                   {1, 2, -3}, 'an integer column')
+    test:is(type(a), 'cdata', 'an integer column is an FFI array')
+    test:is_deeply(result.columns.b, {'x', nil, 'z'}, 'a string column')
+    local c = result.columns.c
+    test:is_deeply({c[1], c[3]}, {0.5, 2.5}, 'a double column')
+    test:is(bit.band(result.nulls.c[0], 4), 4, 'a NULL value is marked')
+    test:is(result.metadata[1].name, 'a', 'metadata')
+
+    local rows = {}
+    for row in conn:cursor(sql):rows(2) do
+        table.insert(rows, {tonumber(row.a), row.b, row.c})
+    end
+    test:is_deeply(rows, {{1, 'x', 0.5}, {2}, {-3, 'z', 2.5}},
+                   'cursor:rows() turns columns into rows')
+    conn:close()
+end
+
+local function test_execute_msgpack(test)
+    test:plan(4)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db})
+    if conn == nil then error(err) end
+
+    local ibuf = buffer.ibuf()
+    local sql = "SELECT 1 AS a, 'x' AS b, NULL AS c, -1.5e0 AS d; " ..
+                "SELECT 300 AS a"
+    local size = conn:execute_msgpack(ibuf, sql)
+    test:is(size, ibuf:size(), 'size of results')
+    local results = msgpack.decode(ibuf.rpos, size)
+    test:is_deeply(results, {{{a = 1, b = 'x', d = -1.5}}, {{a = 300}}},
+                   'results')
+    ibuf:reset()
+
+    size = conn:execute_msgpack(ibuf, 'SELECT ? AS a', 'y')
+    test:is_deeply(msgpack.decode(ibuf.rpos, size), {{{a = 'y'}}},
+                   'results of a statement with parameters')
+    ibuf:reset()
+
+    local ok = pcall(conn.execute_msgpack, conn, ibuf, 'SELECT bad syntax')
+    test:ok(not ok and ibuf:size() == 0, 'nothing is written on error')
+    conn:close()
+end
+
+local function test_load_into(test)
+    test:plan(9)
+
+    local space = box.schema.space.create('load_into_test')
+    space:create_index('pk', {parts = {{1, 'unsigned'}}})
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db})
+    if conn == nil then error(err) end
+
+    local sql = "SELECT 1 AS id, 'a' AS s, 1.5e0 AS d, NULL AS n UNION " ..
+                "SELECT 2, 'b', 2.5e0, NULL UNION SELECT 3, 'c', 3.5e0, NULL"
+    local count = conn:load_into(space, {sql = sql, batch_size = 2})
+    test:is(count, 3, 'count of loaded rows')
+    test:is_deeply(space:select({}, {iterator = 'ALL'}):map(box.tuple.totable),
+                   {{1, 'a', 1.5, box.NULL}, {2, 'b', 2.5, box.NULL},
+                    {3, 'c', 3.5, box.NULL}}, 'loaded tuples')
+
+    space:truncate()
+    count = conn:load_into(space.id, {
+        sql = 'SELECT ? AS s, ? AS id',
+        fields = {'id', 1},
+        types = {'integer'},
+    }, 'x', '7')
+    test:is(count, 1, 'count of loaded rows with mapped fields')
+    test:is_deeply(space:get(7):totable(), {7, 'x'}, 'fields are mapped')
+
+    local ok = pcall(conn.load_into, conn, space,
+                     {sql = 'SELECT 1 AS id', fields = {'bad'}})
+    test:ok(not ok, 'unknown column')
+    local err
+    ok, err = pcall(conn.load_into, conn, space,
+                    {sql = 'SELECT 1 AS id', fields = {true}})
+    test:ok(not ok and tostring(err):find('Unknown column'),
+            'a field which is neither a name nor a number')
+    ok, err = pcall(conn.load_into, conn, space,
+                    {sql = "SELECT 1 AS id, 'abc' AS d",
+                     types = {'integer', 'number'}})
+    test:ok(not ok and tostring(err):find("field 2 does not fit type " ..
+                                          "'number'"),
+            'a value which is not a number')
+    ok, err = pcall(conn.load_into, conn, space,
+                    {sql = "SELECT '18446744073709551616' AS id",
+                     types = {'integer'}})
+    test:ok(not ok and tostring(err):find("field 1 does not fit type " ..
+                                          "'integer'"),
+            'an integer out of range')
+    test:is(conn:execute('SELECT 1 AS a')[1][1].a, 1,
+            'connection is usable after an error')
+
+    conn:close()
+    space:drop()
+end
+
+local function test_reset_strategy(test)
+    test:plan(7)
+
+    local ok = pcall(mysql.pool_create, {host = host, port = port,
+        user = user, password = password, db = db, reset_strategy = 'bad'})
+    test:ok(not ok, 'unknown reset strategy')
+
+    local function resets(conn)
+        local status = conn:execute("SHOW GLOBAL STATUS LIKE " ..
+                                    "'Com_reset_connection'")
+        return tonumber(status[1][1].Value)
+    end
+
+    local pool = mysql.pool_create({host = host, port = port, user = user,
+        password = password, db = db, size = 1, reset_strategy = 'tracked'})
+    local conn = pool:get()
+    local before = resets(conn)
+    pool:put(conn)
+    conn = pool:get()
+    test:is(resets(conn), before, 'clean session is not reset')
+
+    conn:execute('SET @reset_strategy = 1')
+    pool:put(conn)
+    conn = pool:get()
+    test:is(conn:execute('SELECT @reset_strategy AS v')[1][1].v, nil,
+            'changed session is reset')
+    test:is(resets(conn), before + 1, 'session is reset once')
+
+    -- The change is reported at the end of the result set.
+    conn:execute('SELECT @reset_strategy := 2 AS v')
+    pool:put(conn)
+    conn = pool:get()
+    test:is(conn:execute('SELECT @reset_strategy AS v')[1][1].v, nil,
+            'a change reported after rows is tracked')
+    pool:put(conn)
+    pool:close()
+
+    pool = mysql.pool_create({host = host, port = port, user = user,
+        password = password, db = db, size = 1,
+        reset_strategy = 'reset_connection'})
+    conn = pool:get()
+    conn:execute('SET @reset_strategy = 1')
+    pool:put(conn)
+    conn = pool:get()
+    test:is(conn:execute('SELECT @reset_strategy AS v')[1][1].v, nil,
+            'session is reset by reset_connection')
+    conn:execute('USE information_schema')
+    pool:put(conn)
+    conn = pool:get()
+    test:is(conn:execute('SELECT DATABASE() AS db')[1][1].db, db,
+            'the database is restored by reset_connection')
+    pool:put(conn)
+    pool:close()
+end
+
+local function test_elastic_pool(test)
+    test:plan(6)
+
+    local ok = pcall(mysql.pool_create, {host = host, port = port,
+        user = user, password = password, db = db, min_size = 2,
+        max_size = 1})
+    test:ok(not ok, 'min_size greater than max_size')
+
+    local pool = mysql.pool_create({host = host, port = port, user = user,
+        password = password, db = db, min_size = 1, max_size = 3,
+        idle_timeout = 0.2, health_check_interval = 0.1})
+    test:is(pool:stats().live, 1, 'min_size connections are established')
+
+    -- Wait for the background fiber of the pool to do its work.
+    local function wait_for(cond)
+        local deadline = fiber.clock() + 5
+        while not cond() and fiber.clock() < deadline do
+            fiber.sleep(0.01)
+        end
+        return cond()
+    end
+
+    local conns = {}
+    for i = 1, 3 do
+        conns[i] = pool:get()
+    end
+    test:is(pool:stats().live, 3, 'connections are established on demand')
+    for i = 1, 3 do
+        pool:put(conns[i])
+    end
+    test:ok(wait_for(function() return pool:stats().live == 1 end),
+            'idle connections are closed')
+
+    local conn = pool:get()
+    local id = conn:execute('SELECT CONNECTION_ID() AS id')[1][1].id
+    pool:put(conn)
+    local connects = pool:stats().connects
+    local killer = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db})
+    killer:execute('KILL ' .. id)
+    killer:close()
+    test:ok(wait_for(function()
+        local stats = pool:stats()
+        return stats.connects > connects and stats.live == 1
+    end), 'broken connection is replaced')
+    conn = pool:get()
+    test:isnt(conn:execute('SELECT CONNECTION_ID() AS id')[1][1].id, id,
+              'a new connection is used')
+    pool:put(conn)
+    pool:close()
+end
+
+local function test_pool_admission(test)
+    test:plan(5)
+
+    local pool = mysql.pool_create({host = host, port = port, user = user,
+        password = password, db = db, size = 1, max_waiters = 2})
+    local conn = pool:get()
+
+    local order = {}
+    local done = fiber.channel(2)
+    local function waiter(name, priority)
+        local c = pool:get({priority = priority})
+        table.insert(order, name)
+        pool:put(c)
+        done:put(true)
+    end
+    fiber.create(waiter, 'low', 0)
+    fiber.create(waiter, 'high', 10)
+    fiber.yield()
+    test:is(pool:stats().waiters, 2, 'waiters are counted')
+
+    local ok = pcall(pool.get, pool, {timeout = 1})
+    test:ok(not ok, 'a waiter beyond max_waiters is rejected')
+    test:is(pool:stats().rejected, 1, 'rejected calls are counted')
+
+    pool:put(conn)
+    done:get()
+    done:get()
+    test:is_deeply(order, {'high', 'low'}, 'waiters are served by priority')
+    test:ok(pool:stats().max_wait_time > 0, 'wait time is measured')
+    pool:close()
+end
+
+local function test_query_timeout(test)
+    test:plan(5)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db})
+    if conn == nil then error(err) end
+
+    local started = fiber.clock()
+    local ok, msg = pcall(conn.execute, conn,
+                          {sql = 'SELECT SLEEP(10)', timeout = 0.2})
+    test:ok(not ok and tostring(msg):find('Query timeout') ~= nil,
+            'query is cut by the timeout')
+    test:ok(fiber.clock() - started < 5, 'query is killed')
+    test:is(conn:execute('SELECT 1 AS a')[1][1].a, 1,
+            'connection is usable after the timeout')
+    test:is(conn:execute({sql = 'SELECT ? AS a', timeout = 5}, 2)[1][1].a, 2,
+            'query within the timeout')
+    ok = pcall(conn.execute, conn, {sql = 'SELECT 1', timeout = -1})
+    test:ok(not ok, 'negative timeout')
+    conn:close()
+end
+
+local function test_execute_coalesced(test)
+    test:plan(5)
+
+    local pool = mysql.pool_create({host = host, port = port, user = user,
+        password = password, db = db, size = 2, coalesce_window = 0.05})
+    local conn = pool:get()
+    conn:execute('DROP TABLE IF EXISTS coalesce_test')
+    conn:execute('CREATE TABLE coalesce_test (id INT PRIMARY KEY, ' ..
+                 'v VARCHAR(10))')
+    pool:put(conn)
+
+    local sql = 'INSERT INTO coalesce_test VALUES (?, ?)'
+    local results = {}
+    local done = fiber.channel(11)
+    for i = 1, 11 do
+        fiber.create(function()
+            -- The last row duplicates the first one.
+            local id = i <= 10 and i or 1
+            results[i] = {pcall(pool.execute_coalesced, pool, sql, id,
+                                i % 2 == 0 and 'even' or nil)}
+            done:put(true)
+        end)
+    end
+    for _ = 1, 11 do
+        done:get()
+    end
+    local failed = {}
+    local affected_rows = 0
+    for i = 1, 11 do
+        if not results[i][1] then
+            table.insert(failed, i)
+        else
+            affected_rows = affected_rows + results[i][2]
+        end
+    end
+    test:is_deeply(failed, {11}, 'only the failed row gets an error')
+    test:is(affected_rows, 10, 'each row gets its affected rows')
+
+    conn = pool:get()
+    local rows = conn:execute('SELECT COUNT(*) AS n, COUNT(v) AS v ' ..
+                              'FROM coalesce_test')[1][1]
+    test:is(rows.n, 10, 'rows are written')
+    test:is(rows.v, 5, 'NULL values are written')
+
+    -- A bulk write without failures derives results of each row.
+    conn:execute('CREATE TABLE coalesce_auto_test (id INT AUTO_INCREMENT ' ..
+                 'PRIMARY KEY, v INT)')
+    pool:put(conn)
+    sql = 'INSERT INTO coalesce_auto_test (v) VALUES (?)'
+    for i = 1, 3 do
+        fiber.create(function()
+            results[i] = {pool:execute_coalesced(sql, i)}
+            done:put(true)
+        end)
+    end
+    for _ = 1, 3 do
+        done:get()
+    end
+    conn = pool:get()
+    local ids = {}
+    for i = 1, 3 do
+        local id = conn:execute('SELECT id FROM coalesce_auto_test ' ..
+                                'WHERE v = ?', i)[1][1].id
+        table.insert(ids, {results[i][1], results[i][2] == id})
+    end
+    test:is_deeply(ids, {{1, true}, {1, true}, {1, true}},
+                   'bulk rows get their affected rows and insert ids')
+    conn:execute('DROP TABLE coalesce_auto_test')
+    conn:execute('DROP TABLE coalesce_test')
+    pool:put(conn)
+    pool:close()
+end
+
+local function test_execute_batch(test)
+    test:plan(11)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db})
+    if conn == nil then error(err) end
+
+    conn:execute('CREATE TEMPORARY TABLE batch_test (a INT, b VARCHAR(16))')
+    local results, errors = conn:execute_batch({
+        {'INSERT INTO batch_test VALUES (?, ?), (?, ?);', 1, "it's", 2,
+         box.NULL},
+        {"SELECT a, b, '?;' AS q FROM batch_test -- ?;\n ORDER BY a"},
+        {'SELECT ? AS n, ? AS f, ? + 1 AS i', 42, 0.5, 1e15},
+    })
+    test:is(errors, nil, 'no errors')
+    test:is(results[1], 2, 'affected rows')
+    test:is_deeply(results[2], {{a = 1, b = "it's", q = '?;'},
+                                {a = 2, q = '?;'}},
+                   'placeholders in quotes and comments are kept')
+    test:is_deeply(results[3], {{n = 42, f = '0.5', i = 1e15 + 1}},
+                   'numbers')
+
+    results = conn:execute_batch({
+        {'SELECT 1 AS a -- one'},
+        {'SELECT 2 AS a # two'},
+        {'SELECT 3 AS a'},
+    })
+    test:is_deeply(results, {{{a = 1}}, {{a = 2}}, {{a = 3}}},
+                   'a trailing comment does not swallow the next statement')
+
+    local ok, err = pcall(conn.execute_batch, conn, {
+        {'SELECT ? AS a, ? AS b', 1},
+    })
+    test:ok(not ok and err:find('Too few parameters') ~= nil,
+            'a missing parameter is an error')
+    ok, err = pcall(conn.execute_batch, conn, {
+        {'SELECT 1 AS a; SELECT 2 AS a'},
+    })
+    test:ok(not ok and err:find('single statement') ~= nil,
+            'several statements in one item are rejected')
+    ok, err = pcall(conn.execute_batch, conn, {
+        {'CALL batch_proc()'},
+    })
+    test:ok(not ok and err:find('CALL') ~= nil, 'CALL is rejected')
+
+    conn:execute("SET SESSION sql_mode = 'NO_BACKSLASH_ESCAPES'")
+    results = conn:execute_batch({
+        {"SELECT 'a\\' AS s, ? AS p", 1},
+    })
+    conn:execute("SET SESSION sql_mode = DEFAULT")
+    test:is_deeply(results[1], {{s = 'a\\', p = 1}},
+                   'a backslash does not escape with NO_BACKSLASH_ESCAPES')
+
+    results, errors = conn:execute_batch({
+        {'SELECT 1 AS a'},
+        {'SELECT bad syntax'},
+        {'SELECT 3 AS a'},
+    }, {stop_on_error = false})
+    test:ok(errors[2] ~= nil and errors[1] == nil and errors[3] == nil and
+            results[3][1].a == 3, 'the batch goes on after an error')
+
+    results, errors = conn:execute_batch({
+        {'SELECT bad syntax'},
+        {'SELECT 2 AS a'},
+    })
+    test:ok(errors[1] ~= nil and results[2] == nil,
+            'the batch stops on an error')
+    conn:close()
+end
+
+local function test_native_types(test)
+    test:plan(8)
+
+    local decimal = require('decimal')
+    local datetime = require('datetime')
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db, native_types = true})
+    if conn == nil then error(err) end
+
+    local sql = "SELECT CAST('12.50' AS DECIMAL(10, 2)) AS d, " ..
+                "CAST('2020-01-02' AS DATE) AS dt, " ..
+                "CAST('2020-01-02 03:04:05.25' AS DATETIME(2)) AS ts"
+    local rows = conn:execute(sql)
+    test:ok(decimal.is_decimal(rows[1][1].d) and
+            rows[1][1].d == decimal.new('12.50'), 'decimal')
+    test:ok(datetime.is_datetime(rows[1][1].dt) and
+            rows[1][1].dt == datetime.new({year = 2020, month = 1, day = 2}),
+            'date')
+    test:ok(rows[1][1].ts == datetime.new({year = 2020, month = 1, day = 2,
+            hour = 3, min = 4, sec = 5, nsec = 250000000}), 'datetime')
+
+    rows = conn:execute(sql .. ', ? AS n', 1)
+    test:ok(rows[1][1].ts == datetime.new({year = 2020, month = 1, day = 2,
+            hour = 3, min = 4, sec = 5, nsec = 250000000}) and
+            decimal.is_decimal(rows[1][1].d), 'binary results')
+
+    rows = conn:execute('SELECT ? + 0 AS big, ? AS n, ? AS d',
+                        9007199254740993ULL, 2^53, decimal.new('0.1'))
+    test:is(rows[1][1].big, 9007199254740993ULL, 'int64 parameter')
+    test:is(rows[1][1].n, 9007199254740992LL, 'integral number parameter')
+
+    rows = conn:execute('SELECT ? AS dt',
+                        datetime.new({year = 2021, month = 5, day = 6}))
+    test:is(rows[1][1].dt, '2021-05-06 00:00:00.000000',
+            'datetime parameter')
+
+    local ok, err = pcall(conn.execute, conn, 'SELECT ? AS t', {1})
+    test:ok(not ok and err:find('Unsupported type') ~= nil,
+            'a parameter of an unsupported type is an error')
+    conn:close()
+end
+
+local function test_long_values(test)
+    test:plan(4)
+
+    local conn, err = mysql.connect({host = host, port = port, user = user,
+        password = password, db = db})
+    if conn == nil then error(err) end
+
+    conn:execute('CREATE TEMPORARY TABLE long_test (id INT, v LONGTEXT)')
+    local long = string.rep('0123456789abcdef', 65536)
+    conn:execute('INSERT INTO long_test VALUES (?, ?), (?, ?), (?, ?)',
+                 1, 'short', 2, long, 3, long .. long)
+    local rows = conn:execute('SELECT v FROM long_test WHERE id > ? ' ..
+                              'ORDER BY id', 0)
+    test:is(rows[1][1].v, 'short', 'a short value')
+    test:is(rows[1][2].v, long, 'a long value is fetched by pieces')
+    test:is(rows[1][3].v, long .. long, 'a longer value grows the buffer')
+
+    rows = conn:execute('SELECT LENGTH(v) AS len FROM long_test WHERE id = ?',
+                        3)
+    test:is(rows[1][1].len, #long * 2, 'a long parameter is sent by chunks')
+    conn:close()
+end
+
+local function test_result_cache(test)
+    test:plan(11)
+
+    local pool = mysql.pool_create({host = host, port = port, user = user,
+        password = password, db = db, size = 2, cache = {ttl = 60}})
+    local conn = pool:get()
+    conn:execute('DROP TABLE IF EXISTS cache_test')
+    conn:execute('CREATE TABLE cache_test (id INT PRIMARY KEY, v INT)')
+    conn:execute('INSERT INTO cache_test VALUES (1, 10), (2, 20)')
+
+    -- Count of cache hits made by a function.
+    local function hits(fn)
+        local before = pool:stats().cache.hits
+        fn()
+        return pool:stats().cache.hits - before
+    end
+    local sql = 'SELECT v FROM cache_test WHERE id = ?'
+    local rows = conn:execute(sql, 1)
+    local other = pool:get()
+    test:is(hits(function() other:execute(sql, 1) end), 1,
+            'a result is shared by the pool')
+    test:is(hits(function() conn:execute(sql, 1LL) end), 1,
+            'an int64 argument gives the same key')
+    test:is(hits(function() conn:execute(sql, 2) end), 0,
+            'arguments are a part of the key')
+    conn:execute('USE information_schema')
+    test:ok(not pcall(conn.execute, conn, sql, 1),
+            'the current database is a part of the key')
+    conn:execute('USE ' .. db)
+    local now = 'SELECT NOW() AS t'
+    test:is(hits(function() conn:execute(now) conn:execute(now) end), 0,
+            'a volatile query is not cached')
+    rows[1][1].v = 0
+    test:is(conn:execute(sql, 1)[1][1].v, 10,
+            'a caller changing its results does not change the cache')
+
+    other:execute('UPDATE cache_test SET v = 11 WHERE id = ?', 1)
+    test:is(conn:execute(sql, 1)[1][1].v, 11, 'a write drops results')
+
+    conn:begin()
+    conn:execute('UPDATE cache_test SET v = 12 WHERE id = 1')
+    test:is(other:execute(sql, 1)[1][1].v, 11,
+            'an uncommitted change is not seen')
+    conn:commit()
+    test:is(other:execute(sql, 1)[1][1].v, 12,
+            'results are dropped again on commit')
+
+    test:is(hits(function()
+        conn:execute({sql = sql, cache = false}, 1)
+    end), 0, 'the cache is bypassed')
+
+    local stats = pool:stats().cache
+    test:ok(stats.hits >= 2 and stats.invalidations >= 2 and
+            stats.entries > 0 and stats.memory > 0, 'statistics')
+    conn:execute('DROP TABLE cache_test')
+    pool:put(other)
+    pool:put(conn)
+    pool:close()
+end
+
+-- Replicas are given as MYSQL_REPLICAS=host:port[,host:port...],
+-- the server itself plays a replica otherwise.
+local function test_cluster(test)
+    test:plan(10)
+
+    local replicas = {}
+    for replica_host, replica_port in
+        (os.getenv('MYSQL_REPLICAS') or ''):gmatch('([^:,]+):(%d+)') do
+        table.insert(replicas, {host = replica_host, port = replica_port})
+    end
+    if #replicas == 0 then
+        replicas = {{host = host, port = port}}
+    end
+    local cluster = mysql.cluster_create({host = host, port = port,
+        user = user, password = password, db = db, size = 2,
+        replicas = replicas, read_your_writes = true, check_interval = 3600})
+    local function granted()
+        local stats = cluster:stats()
+        return stats.primary.granted, stats.replicas[1].pool.granted
+    end
+
+    cluster:execute('DROP TABLE IF EXISTS cluster_test')
+    cluster:execute('CREATE TABLE cluster_test (id INT PRIMARY KEY)')
+    local primary, replica = granted()
+    cluster:execute('SELECT * FROM cluster_test')
+    local primary2, replica2 = granted()
+    test:ok(primary2 == primary and replica2 == replica + 1,
+            'a read goes to a replica')
+    cluster:execute({sql = 'SELECT * FROM cluster_test', mode = 'write'})
+    primary, replica = granted()
+    test:ok(primary == primary2 + 1 and replica == replica2,
+            'a hint routes a read to the primary')
+    cluster:execute('SELECT * FROM cluster_test FOR UPDATE')
+    primary2 = granted()
+    test:is(primary2, primary + 1, 'a locking read goes to the primary')
+    -- Sequences may be missing, only the routing is checked.
+    pcall(cluster.execute, cluster, 'SELECT NEXT VALUE FOR cluster_seq')
+    primary = granted()
+    test:is(primary, primary2 + 1, 'a sequence function goes to the primary')
+    local ok = pcall(cluster.execute, cluster,
+                     'SELECT no_such_column FROM cluster_test')
+    primary2 = granted()
+    test:ok(not ok and primary2 == primary,
+            'a statement error on a replica is not retried on the primary')
+
+    local conn = cluster:get()
+    conn:begin()
+    conn:execute('INSERT INTO cluster_test VALUES (1)')
+    test:is_deeply(conn:execute('SELECT id FROM cluster_test'), {{{id = 1}}},
+                   'a transaction is pinned to the primary')
+    conn:rollback()
+    test:is_deeply(conn:execute('SELECT id FROM cluster_test'), {{}},
+                   'rollback')
+    conn:execute('INSERT INTO cluster_test VALUES (2)')
+    test:is(type(conn:gtid()), 'string', 'GTIDs of a write are kept')
+    test:is_deeply(conn:execute('SELECT id FROM cluster_test'), {{{id = 2}}},
+                   'a read sees the write')
+    conn:close()
+    cluster:close()
+
+    cluster = mysql.cluster_create({host = host, port = port,
+        user = user, password = password, db = db, size = 1,
+        replicas = replicas, check_interval = 3600, cache = {ttl = 60}})
+    cluster:execute('SELECT id FROM cluster_test')
+    cluster:execute('SELECT id FROM cluster_test')
+    cluster:execute('DELETE FROM cluster_test')
+    local stats = cluster:stats().cache
+    test:ok(stats.hits == 1 and stats.invalidations == 1,
+            'a write to the primary drops results read from a replica')
+    cluster:execute('DROP TABLE cluster_test')
+    cluster:close()
+end
+
+local function test_binlog_stream(test)
+    test:plan(7)
+
+    conn:execute('DROP TABLE IF EXISTS binlog_test')
+    conn:execute('CREATE TABLE binlog_test (id INT UNSIGNED PRIMARY KEY, ' ..
+                 's VARCHAR(10), d DECIMAL(5, 2), t DATETIME(3))')
+    local ok, results = pcall(conn.execute, conn, 'SHOW BINARY LOG STATUS')
+    if not ok then
+        results = conn:execute('SHOW MASTER STATUS')
+    end
+    local position = {file = results[1][1].File,
+                      position = tonumber(results[1][1].Position)}
+    conn:execute("INSERT INTO binlog_test VALUES " ..
+                 "(1, 'a', 1.5, '2024-01-02 03:04:05.678'), " ..
+                 "(4294967295, NULL, -0.25, NULL)")
+    conn:execute("UPDATE binlog_test SET s = 'b' WHERE id = 1")
+    conn:execute('DELETE FROM binlog_test WHERE id = 4294967295')
+
+    local records = {}
+    local done = fiber.cond()
+    local stream = mysql.binlog_stream({host = host, port = port,
+        user = user, password = password, server_id = 4242,
+        position = position, tables = {db .. '.binlog_test'},
+        on_changes = function(batch)
+            for _, record in ipairs(batch) do
+                table.insert(records, record)
+            end
+            done:signal()
+        end})
+    while #records < 4 and done:wait(5) do end
+    stream:stop()
+    test:is(#records, 4, 'all changes are streamed')
+    test:is_deeply({records[1].op, records[1].table, records[1].columns},
+                   {'insert', 'binlog_test', {'id', 's', 'd', 't'}},
+                   'a record of an insert')
+    test:is_deeply(records[1].new, {1, 'a', '1.50', '2024-01-02 03:04:05.678'},
+                   'values are decoded')
+    test:is_deeply(records[2].new, {4294967295, nil, '-0.25'},
+                   'unsigned values are fixed')
+    test:is_deeply({records[3].op, records[3].old[2], records[3].new[2]},
+                   {'update', 'a', 'b'}, 'a record of an update')
+    test:is_deeply({records[4].op, records[4].old[1]},
+                   {'delete', 4294967295}, 'a record of a delete')
+
+    local space = box.schema.space.create('binlog_test')
+    space:create_index('pk', {parts = {{1, 'unsigned'}}})
+    local checkpoints = box.schema.space.create('binlog_checkpoints')
+    checkpoints:create_index('pk', {parts = {{1, 'string'}}})
+    stream = mysql.binlog_stream({host = host, port = port,
+        user = user, password = password, server_id = 4242,
+        position = position, spaces = {[db .. '.binlog_test'] = space.name},
+        checkpoint_space = checkpoints.name})
+    local deadline = fiber.clock() + 5
+    while stream:stats().records < 4 and fiber.clock() < deadline do
+        fiber.sleep(0.01)
+    end
+    stream:stop()
+    test:is_deeply(space:select({}, {iterator = 'ALL'}):map(box.tuple.totable),
+                   {{1, 'b', '1.50', '2024-01-02 03:04:05.678'}},
+                   'changes are applied to a space')
+
+    space:drop()
+    checkpoints:drop()
+    conn:execute('DROP TABLE binlog_test')
+end
+
+local function test_load_data(test)
+    local local_infile = conn:execute('SELECT @@GLOBAL.local_infile AS v')
+    if tonumber(local_infile[1][1].v) ~= 1 then
+        test:plan(1)
+        test:skip('local_infile is off on the server')
+        return
+    end
+    test:plan(7)
+
+    conn:execute('DROP TABLE IF EXISTS load_data_test')
+    conn:execute('CREATE TABLE load_data_test (id INT PRIMARY KEY, ' ..
+                 's VARCHAR(20), d DECIMAL(5, 2))')
+    local rows = {{1, 'a\tb\nc\\', 1.5}, {2, box.NULL, nil},
+                  {3, '', '2.25'}, {0, 0.1}}
+    local i = 0
+    local count = conn:load_data('load_data_test', {'id', 's', 'd'},
+                                 function()
+        i = i + 1
+        return rows[i]
+    end)
+    test:is(count, 4, 'count of loaded rows')
+    test:is_deeply(conn:execute('SELECT id, s, CAST(d AS CHAR) AS d ' ..
+                                'FROM load_data_test ORDER BY id'),
+                   {{{id = 0, s = '0.1'},
+                     {id = 1, s = 'a\tb\nc\\', d = '1.50'}, {id = 2},
+                     {id = 3, s = '', d = '2.25'}}},
+                   'special characters, numbers and NULL are loaded')
+
+    local sent = false
+    local ok, err = pcall(conn.load_data, conn, 'load_data_test', {'id'},
+                          function()
+        if sent then
+            return nil
+        end
+        sent = true
+        return {math.huge}
+    end)
+    test:ok(not ok and err:find('Can not represent') ~= nil,
+            'an infinite number is an error')
+
+    local space = box.schema.space.create('load_data_test')
+    space:create_index('pk')
+    for id = 4, 2003 do
+        space:insert({id, string.rep('x', 100)})
+    end
+    count = conn:load_data('load_data_test', {'id', 's'}, space)
+    test:is(count, 2000, 'tuples of a space are loaded in chunks')
+
+    count = conn:load_data('load_data_test', {'id'}, space.index.pk,
+                           {key = 4})
+    test:is(count, 0, 'a duplicate is skipped')
+    count = conn:load_data('load_data_test', {'id', 's'}, space.index.pk,
+                           {key = 4, on_duplicate = 'replace'})
+    test:is(count, 2, 'a duplicate is replaced')
+
+    ok = pcall(conn.execute, conn,
+               "LOAD DATA LOCAL INFILE '/etc/passwd' INTO TABLE " ..
+               "load_data_test")
+    test:ok(not ok, 'other local files are not sent')
+
+    space:drop()
+    conn:execute('DROP TABLE load_data_test')
+end
+
+local function test_multi_pool(test)
+    test:plan(10)
+
+    local p2 = mysql.pool_create({host = host, port = port, user = user,
+        password = password, db = db, size = 2})
+    conn:execute('DROP TABLE IF EXISTS multi_pool_test')
+    conn:execute('CREATE TABLE multi_pool_test (id INT PRIMARY KEY)')
+    conn:execute('INSERT INTO multi_pool_test VALUES (1), (3), (5)')
+    local function ids(rows)
+        local res = {}
+        for row in rows do
+            table.insert(res, row.id)
+        end
+        return res
+    end
+
+    local multi = mysql.multi_pool({p, p2}, {timeout = 10})
+    test:is_deeply(multi:execute_all('SELECT COUNT(*) AS c ' ..
+                                     'FROM multi_pool_test'),
+                   {{{{c = 3}}}, {{{c = 3}}}}, 'a query runs on every shard')
+    test:is_deeply(ids(multi:rows('SELECT id FROM multi_pool_test ' ..
+                                  'ORDER BY id', {chunk_size = 2})),
+                   {1, 3, 5, 1, 3, 5}, 'rows are concatenated')
+    test:is_deeply(ids(multi:rows('SELECT id FROM multi_pool_test ' ..
+                                  'ORDER BY id DESC',
+                                  {order_by = 'id', desc = true,
+                                   chunk_size = 2})),
+                   {5, 5, 3, 3, 1, 1}, 'rows are merged')
+    test:is_deeply(ids(multi:rows('SELECT id FROM multi_pool_test ' ..
+                                  'ORDER BY id', {order_by = 'id',
+                                                  limit = 3})),
+                   {1, 1, 3}, 'a limit ends the stream')
+    local ok, err = pcall(multi.rows, multi, 'SELECT id FROM ' ..
+                          'multi_pool_test LIMIT 1 FOR UPDATE', {limit = 3})
+    test:ok(not ok and err:find('Can not push LIMIT down') ~= nil,
+            'a limit is not pushed down to a statement with its own')
+    test:is_deeply(ids(multi:rows('SELECT id FROM multi_pool_test ' ..
+                                  '-- a comment', {limit = 2})),
+                   {1, 3}, 'a limit is pushed down after a comment')
+    test:is(p2:stats().free, 2, 'connections are put back')
+    local function abandon()
+        local rows = multi:rows('SELECT id FROM multi_pool_test',
+                                {chunk_size = 1})
+        rows()
+    end
+    abandon()
+    collectgarbage('collect')
+    collectgarbage('collect')
+    fiber.sleep(0.1)
+    test:is(p2:stats().free, 2, 'an abandoned stream puts connections back')
+
+    local down = {
+        get = function() error('shard is down', 0) end,
+        put = function() end,
+    }
+    multi = mysql.multi_pool({p, down})
+    ok, err = pcall(multi.execute_all, multi, 'SELECT 1 AS a')
+    test:ok(not ok and tostring(err):find('Shard 2: shard is down'),
+            'a failed shard fails the query')
+    multi = mysql.multi_pool({p, down}, {on_error = 'partial'})
+    local results, errors = multi:execute_all('SELECT 1 AS a')
+    test:is_deeply({results, errors}, {{{{{a = 1}}}}, {[2] = 'shard is down'}},
+                   'results of other shards are returned')
+
+    conn:execute('DROP TABLE multi_pool_test')
+    p2:close()
+end
+
+local function test_metrics(test)
+    test:plan(9)
+
+    local before = mysql.stats()
+    conn:execute('SELECT 1 AS a UNION ALL SELECT 2')
+    local after = mysql.stats()
+    test:is(after.queries - before.queries, 1, 'a query is counted')
+    test:is(after.rows - before.rows, 2, 'rows are counted')
+    test:is(after.query_time.count - before.query_time.count, 1,
+            'a query time is observed')
+    test:is(after.fetch_time.count - before.fetch_time.count, 1,
+            'a fetch time is observed once for a result set')
+    local buckets = after.query_time.buckets
+    test:is(buckets[#buckets].count, after.query_time.count,
+            'the last bucket counts all the queries')
+
+    local mp = mysql.pool_create({host = host, port = port, user = user,
+        password = password, db = db, size = 2, name = 'metrics_test'})
+    local sleeper = fiber.create(function(p)
+        local sleeper_conn = p:get()
+        sleeper_conn:execute('SELECT SLEEP(0.2)')
+        p:put(sleeper_conn)
+    end, mp)
+    sleeper:set_joinable(true)
+    fiber.sleep(0.1)
+    test:is(mysql.stats().in_flight, 1, 'a running query is in flight')
+    sleeper:join()
+    local c = mp:get()
+    test:is(mysql.stats().pools.metrics_test.busy, 1,
+            'a pool is reported by name')
+    c = nil -- luacheck: no unused
+    collectgarbage('collect')
+    collectgarbage('collect')
+    for _ = 1, 10 do
+        if mp:stats().gc_recovered > 0 then
+            break
+        end
+        fiber.yield()
+    end
+    local found
+    for _, obs in ipairs(mysql.metrics_collector():collect()) do
+        if obs.metric_name == 'mysql_pool_gc_recovered_total' and
+           obs.label_pairs.pool == 'metrics_test' then
+            found = obs.value
+        end
+    end
+    test:is(found, 1, 'a collected connection is exported')
+    mp:close()
+    test:is(mysql.stats().pools.metrics_test, nil,
+            'a closed pool is not reported')
+end
+
+local function test_profiler(test)
+    test:plan(7)
+
+    mysql.profiler_start({threshold = 0.1, size = 2})
+    conn:execute('SELECT 1 AS a')
+    test:is(#mysql.slow_log(), 0, 'a fast query is not logged')
+    conn:execute('SELECT SLEEP(0.2) AS a UNION ALL SELECT 1')
+    local log = mysql.slow_log()
+    test:is(#log, 1, 'a slow query is logged')
+    local entry = log[1]
+    test:is(entry.sql, 'SELECT SLEEP(0.2) AS a UNION ALL SELECT 1',
+            'the statement is logged')
+    test:ok(entry.io_read >= 0.1 and entry.decode < entry.io_read,
+            'the query is server-bound')
+    test:is_deeply({entry.rows, entry.result_count, #entry.results},
+                   {2, 1, 1}, 'result sets are logged')
+
+    local stmt = conn:prepare('SELECT SLEEP(?) AS a')
+    stmt:execute(0.15)
+    stmt:execute(0.15)
+    stmt:close()
+    mysql.profiler_stop()
+    conn:execute('SELECT SLEEP(0.15) AS a')
+    log = mysql.slow_log()
+    test:is_deeply({#log, log[1].sql, log[2].sql},
+                   {2, 'SELECT SLEEP(?) AS a', 'SELECT SLEEP(?) AS a'},
+                   'the log keeps the last entries')
+
+    local pool = mysql.pool_create({host = host, port = port, user = user,
+        password = password, db = db, size = 1, cache = {ttl = 60}})
+    local c = pool:get()
+    mysql.profiler_start({threshold = 0})
+    c:execute('SELECT 2 AS b')
+    c:execute('SELECT 2 AS b')
+    mysql.profiler_stop()
+    log = mysql.slow_log()
+    test:is_deeply({#log, log[1].rows, log[2].cached, log[2].rows},
+                   {2, 1, true, nil},
+                   'a cached result has no phases of the driver')
+    pool:put(c)
+    pool:close()
+end
+
 local test = tap.test('mysql connector')
-test:plan(12)
+test:plan(35)
 
 test:test('connection old api', test_old_api, conn)
 local pool_conn = p:get()
@@ -752,6 +1838,29 @@ test:test('ffi null printing', test_ffi_null_printing, p)
 test:test('test_block_fiber_inf', test_block_fiber_inf, p)
 test:test('test_put_to_wrong_pool', test_put_to_wrong_pool)
 test:test('test_conn_from_pool_gc_yield', test_conn_from_pool_gc_yield)
+test:test('prepared statement cache', test_stmt_cache)
+test:test('prepared statement', test_prepared_statement)
+test:test('cursor', test_cursor)
+test:test('decode budget', test_decode_budget)
+test:test('lazy result', test_lazy_result)
+test:test('columnar result', test_columnar_result)
+test:test('execute_msgpack', test_execute_msgpack)
+test:test('load_into', test_load_into)
+test:test('reset strategy', test_reset_strategy)
+test:test('elastic pool', test_elastic_pool)
+test:test('pool admission', test_pool_admission)
+test:test('query timeout', test_query_timeout)
+test:test('execute_coalesced', test_execute_coalesced)
+test:test('execute_batch', test_execute_batch)
+test:test('native types', test_native_types)
+test:test('long values', test_long_values)
+test:test('result cache', test_result_cache)
+test:test('cluster', test_cluster)
+test:test('binlog stream', test_binlog_stream)
+test:test('load_data', test_load_data)
+test:test('multi pool', test_multi_pool)
+test:test('metrics', test_metrics)
+test:test('profiler', test_profiler)
 p:close()
 
 os.exit(test:check() and 0 or 1)